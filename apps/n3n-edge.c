@@ -1163,7 +1163,7 @@ int main (int argc, char* argv[]) {
         }
         seek_answer = 1;
 
-        resolve_check(eee->resolve_parameter, false /* no intermediate resolution requirement at this point */, now);
+        resolve_check(eee->resolve_parameter, false /* no intermediate resolution requirement at this point */, now, NULL);
     }
 
     // allow a higher number of pings for first regular round of ping
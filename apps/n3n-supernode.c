@@ -563,6 +563,16 @@ int main (int argc, char * argv[]) {
         traceEvent(TRACE_NORMAL, "supernode is listening on UDP %u (main)", ntohs(sa->sin_port));
     }
 
+    int workers = sn_open_workers(&sss_node);
+    if(workers > 0) {
+        traceEvent(
+            TRACE_NORMAL,
+            "supernode is listening on UDP %u (%i workers)",
+            ntohs(sa->sin_port),
+            workers
+        );
+    }
+
 #ifdef N2N_HAVE_TCP
     sss_node.tcp_sock = open_socket(
         sss_node.conf.bind_address,
@@ -48,22 +48,30 @@ typedef struct aes_context_t {
     AES_KEY ecb_dec_key;                         /* one step ecb decryption key */
 } aes_context_t;
 
-#elif defined (__AES__) && defined (__SSE2__) // Intel's AES-NI ---------------------------------------------------
+#else // AES-NI or plain C, on x86 picked at run time -------------------------------------------------------------
 
+#if defined (__SSE2__) || defined (__x86_64__)
 #include <immintrin.h>
+#endif
 
-typedef struct aes_context_t {
-    __m128i rk_enc[15];
-    __m128i rk_dec[15];
-    int Nr;
-} aes_context_t;
-
-#else // plain C --------------------------------------------------------------------------------------------------
+// the functions of one build of the cipher, see aes.c
+struct aes_kernels;
 
 typedef struct aes_context_t {
-    uint32_t enc_rk[60];    // round keys for encryption
-    uint32_t dec_rk[60];    // round keys for decryption
+    union {
+#if defined (__SSE2__) || defined (__x86_64__)
+        struct {                // Intel's AES-NI
+            __m128i rk_enc[15];
+            __m128i rk_dec[15];
+        };
+#endif
+        struct {                // plain C
+            uint32_t enc_rk[60];    // round keys for encryption
+            uint32_t dec_rk[60];    // round keys for decryption
+        };
+    };
     int Nr;                 // number of rounds
+    const struct aes_kernels *kernels;
 } aes_context_t;
 
 #endif // ---------------------------------------------------------------------------------------------------------
@@ -79,6 +87,12 @@ int aes_ecb_decrypt (unsigned char *out, const unsigned char *in, aes_context_t
 
 int aes_init (const unsigned char *key, size_t key_size, aes_context_t **ctx);
 
+// same as aes_init() but using the named build of the kernels, e.g. "aesni" as shown in the metrics, or the best
+// one for the CPU if NULL -- fails if that one is not linked in or the CPU cannot run it; meant for the benchmarks
+int aes_init_variant (const unsigned char *key, size_t key_size, aes_context_t **ctx, const char *variant);
+
+int aes_variant_available (const char *variant);
+
 int aes_deinit (aes_context_t *ctx);
 
 
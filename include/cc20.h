@@ -30,6 +30,10 @@
 #define CC20_KEY_BYTES       (256/8)
 
 
+// the functions of one build of the cipher, see cc20.c
+struct cc20_kernels;
+
+
 #ifdef HAVE_LIBCRYPTO // openSSL 1.1 ----------------------------------------------------------------------------
 
 
@@ -49,6 +53,7 @@ typedef struct cc20_context_t {
 typedef struct cc20_context {
     uint32_t keystream32[16];
     uint8_t key[CC20_KEY_BYTES];
+    const struct cc20_kernels *kernels;
 } cc20_context_t;
 
 
@@ -59,6 +64,7 @@ typedef struct cc20_context {
     uint32_t keystream32[16];
     uint32_t state[16];
     uint8_t key[CC20_KEY_BYTES];
+    const struct cc20_kernels *kernels;
 } cc20_context_t;
 
 
@@ -70,6 +76,12 @@ int cc20_crypt (unsigned char *out, const unsigned char *in, size_t in_len,
 
 int cc20_init (const unsigned char *key, cc20_context_t **ctx);
 
+// same as cc20_init() but using the named build of the kernels, e.g. "ssse3" as shown in the metrics, or the best
+// one for the CPU if NULL -- fails if that one is not linked in or the CPU cannot run it; meant for the benchmarks
+int cc20_init_variant (const unsigned char *key, cc20_context_t **ctx, const char *variant);
+
+int cc20_variant_available (const char *variant);
+
 int cc20_deinit (cc20_context_t *ctx);
 
 
@@ -0,0 +1,40 @@
+/**
+ * Copyright (C) Hamish Coleman
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * ChaCha20-Poly1305 AEAD (RFC 8439), without additional data
+ */
+
+
+#ifndef CHACHAPOLY_H
+#define CHACHAPOLY_H
+
+
+#include <stddef.h>  // for size_t
+#include <stdint.h>  // for uint8_t
+
+
+#define CHACHAPOLY_KEY_BYTES   (256/8)
+#define CHACHAPOLY_NONCE_SIZE  12
+#define CHACHAPOLY_TAG_SIZE    16
+
+
+typedef struct chachapoly_context chachapoly_context_t;
+
+
+// Encrypt len bytes from in to out and write the authentication tag.  The
+// in and out buffers may be the same
+int chachapoly_encrypt (uint8_t *out, uint8_t *tag, const uint8_t *in, size_t len,
+                        const uint8_t *nonce, chachapoly_context_t *ctx);
+
+// Check the tag and decrypt len bytes from in to out.  The in and out buffers
+// may be the same.  Returns -1 if the tag does not match
+int chachapoly_decrypt (uint8_t *out, const uint8_t *in, size_t len, const uint8_t *tag,
+                        const uint8_t *nonce, chachapoly_context_t *ctx);
+
+int chachapoly_init (const uint8_t *key, chachapoly_context_t **ctx);
+
+int chachapoly_deinit (chachapoly_context_t *ctx);
+
+
+#endif // CHACHAPOLY_H
@@ -19,6 +19,9 @@
 #include "n2n_typedefs.h"
 #include "speck.h"          // for struct speck_context_t
 
+uint32_t packet_header_check_magic (const uint8_t packet[], uint16_t packet_len,
+                                    struct speck_context_t *ctx);
+
 int packet_header_decrypt (uint8_t packet[], uint16_t packet_len,
                            char *community_name,
                            struct speck_context_t *ctx,
@@ -30,6 +33,22 @@ int packet_header_encrypt (uint8_t packet[], uint16_t header_len, uint16_t packe
                            struct speck_context_t *ctx_iv,
                            uint64_t stamp);
 
+// batch versions of the above, with the headers of all the packets encrypted
+// side by side; result[] holds the outcome of packet_header_decrypt() for
+// each packet and the number of packets decrypted is returned
+int packet_header_decrypt_batch (uint8_t *packet[], const uint16_t packet_len[], int count,
+                                 char *community_name,
+                                 struct speck_context_t *ctx,
+                                 struct speck_context_t *ctx_iv,
+                                 uint64_t stamp[],
+                                 int result[]);
+
+int packet_header_encrypt_batch (uint8_t *packet[], const uint16_t header_len[], const uint16_t packet_len[],
+                                 int count,
+                                 struct speck_context_t *ctx,
+                                 struct speck_context_t *ctx_iv,
+                                 const uint64_t stamp[]);
+
 void packet_header_setup_key (const char *community_name,
                               struct speck_context_t **ctx_static,
                               struct speck_context_t **ctx_dynamic,
@@ -88,6 +88,7 @@ int n2n_transop_tf_init (const n2n_edge_conf_t *conf, n2n_trans_op_t *ttt);
 int n2n_transop_aes_init (const n2n_edge_conf_t *conf, n2n_trans_op_t *ttt);
 int n2n_transop_cc20_init (const n2n_edge_conf_t *conf, n2n_trans_op_t *ttt);
 int n2n_transop_speck_init (const n2n_edge_conf_t *conf, n2n_trans_op_t *ttt);
+int n2n_transop_chachapoly_init (const n2n_edge_conf_t *conf, n2n_trans_op_t *ttt);
 int n2n_transop_lzo_init (const n2n_edge_conf_t *conf, n2n_trans_op_t *ttt);
 #ifdef HAVE_LIBZSTD
 int n2n_transop_zstd_init (const n2n_edge_conf_t *conf, n2n_trans_op_t *ttt);
@@ -101,6 +102,10 @@ int tuntap_open (struct tuntap_dev *device, char *dev, uint8_t address_mode,
 int tuntap_read (struct tuntap_dev *tuntap, unsigned char *buf, int len);
 int tuntap_write (struct tuntap_dev *tuntap, unsigned char *buf, int len);
 void tuntap_close (struct tuntap_dev *tuntap);
+#ifdef __linux__
+int tuntap_open_queue (struct tuntap_dev *device);
+void tuntap_flush (struct tuntap_dev *tuntap);
+#endif
 void tuntap_get_address (struct tuntap_dev *tuntap);
 
 /* Utils */
@@ -137,6 +142,7 @@ int quick_edge_init (char *device_name, char *community_name,
 int comm_init (struct sn_community *comm, char *cmn);
 void sn_init (struct n3n_runtime_data *sss);
 void sn_term (struct n3n_runtime_data *sss);
+int sn_open_workers (struct n3n_runtime_data *sss);
 int assign_one_ip_subnet (struct n3n_runtime_data *sss, struct sn_community *comm);
 
 #endif /* _N2N_H_ */
@@ -38,6 +38,7 @@
                                              * and when we send out packets to query selection-relevant informations from supernodes. */
 #ifdef HAVE_BRIDGING_SUPPORT
 #define HOSTINFO_TIMEOUT                300 /* sec, how long after last seen will the hostinfo be deleted */
+#define HOSTINFO_MAX                   4096 /* how many hosts are remembered, beyond that the least recently seen is replaced */
 #endif
 #define NUMBER_SN_PINGS_INITIAL          15 /* number of supernodes to concurrently ping during bootstrap and immediately afterwards */
 #define NUMBER_SN_PINGS_REGULAR           5 /* number of supernodes to concurrently ping during regular edge operation */
@@ -155,6 +156,9 @@ enum n3n_event_topic {
 #define N2N_LOCAL_REG_COOKIE       0x01000000
 #define N2N_DESC_SIZE              16
 #define N2N_PKT_BUF_SIZE           2048
+#define N3N_RX_BATCH_SIZE          8    /* max datagrams read per socket wakeup */
+#define N3N_TX_BATCH_SIZE          16   /* max tap segments encrypted at once */
+#define N3N_PKTBUF_HEADROOM        64   /* space kept in front of a tap frame for the PDU header */
 #define N3N_SOCKBUF_SIZE           128  /* string representation of INET or INET6 sockets */
 #define N3N_PORTBUF_SIZE           8    /* string representation of a port 0 - 65535 */
 
@@ -56,6 +56,7 @@ extern "C" {
 #endif
 
 #include <stdio.h>
+#include <stddef.h>  // for size_t
 
 /* Compile regex string pattern to a regex_t-array. */
 re_t re_compile (const char* pattern);
@@ -69,6 +70,19 @@ int re_matchp (re_t pattern, const char* text, int* matchlenght);
 int  re_match (const char* pattern, const char* text, int* matchlenght);
 
 
+/* Compile regex string pattern and add it to a set, allocating the set if it is still NULL.
+   Returns -1 if the pattern could not be compiled. */
+int re_set_add (re_set_t* set, const char* pattern);
+
+
+/* Check if the whole of the first len chars of text (or up to its end) is matched by any pattern in the set.
+   Returns 1 on a match, otherwise 0, as for an empty text.  Not reentrant, the set holds the scratch space. */
+int re_set_matchp (re_set_t set, const char* text, size_t len);
+
+
+void re_set_free (re_set_t set);
+
+
 #ifdef __cplusplus
 }
 #endif
@@ -132,6 +132,9 @@ typedef struct tuntap_dev {
 #ifndef _WIN32
     int fd;
     devstr_t dev_name;
+    int queues;                         /* Linux: >1 opens a multi-queue TAP */
+    int offload;                        /* Linux: open with IFF_VNET_HDR */
+    struct n3n_vnet *vnet;              /* Linux: offload state for fd */
 #endif
     in_addr_t ip_addr;
     n2n_mac_t mac_addr;
@@ -332,16 +335,12 @@ typedef struct n2n_QUERY_PEER {
 
 typedef struct n2n_buf n2n_buf_t;
 
-#ifdef HAVE_BRIDGING_SUPPORT
-struct host_info {
-    time_t last_seen;
-    UT_hash_handle hh;     /* makes this structure hashable */
-    n2n_mac_t mac_addr;
-    n2n_mac_t edge_addr;
-};
-#endif
-
 struct n3n_runtime_data;
+struct n3n_bitmap;
+struct n3n_hosttable;
+struct sn_member;
+struct filter_classifier;
+struct filter_flow;
 
 /* *************************************************** */
 
@@ -358,10 +357,10 @@ struct network_traffic_filter {
     n2n_verdict (*filter_packet_from_tap)(network_traffic_filter_t* filter, struct n3n_runtime_data *eee, uint8_t *payload, uint16_t payload_size);
 
     filter_rule_t *rules;
+    struct filter_classifier *classifier;   /* the rules, compiled for the lookups */
 
-    filter_rule_pair_cache_t *connections_rule_cache;
-
-    uint32_t work_count_scene_last_clear;
+    struct filter_flow *flows;              /* the verdicts of recent flows */
+    uint32_t flow_hand;                     /* where the clock continues in a full probe window */
 
 };
 
@@ -374,6 +373,7 @@ typedef enum n2n_transform {
     N2N_TRANSFORM_ID_AES =      3,
     N2N_TRANSFORM_ID_CHACHA20 = 4,
     N2N_TRANSFORM_ID_SPECK =    5,
+    N2N_TRANSFORM_ID_CHACHAPOLY = 6,
 } n2n_transform_t;
 
 struct n2n_trans_op; /* Circular definition */
@@ -385,6 +385,21 @@ typedef int (*n2n_transform_f)(struct n2n_trans_op * arg,
                                const uint8_t * inbuf,
                                size_t in_len,
                                const n2n_mac_t peer_mac);
+
+/* One payload of a batch for n2n_transform_batch_f */
+struct n2n_trans_vec {
+    uint8_t *outbuf;
+    size_t out_len;
+    const uint8_t *inbuf;
+    size_t in_len;
+    int result;                       /* set to the output length, or -1 */
+};
+
+/* The payloads of a batch can be from or to different peers, so there is
+ * no peer_mac.  Returns the number of payloads that were transformed */
+typedef int (*n2n_transform_batch_f)(struct n2n_trans_op * arg,
+                                     struct n2n_trans_vec * vec,
+                                     int count);
 /** Holds the info associated with a data transform plugin.
  *
  *  When a packet arrives the transform ID is extracted. This defines the code
@@ -399,9 +414,16 @@ typedef struct n2n_trans_op {
     n2n_transdeinit_f deinit;         /* destructor function */
     n2n_transform_f fwd;              /* encode a payload */
     n2n_transform_f rev;              /* decode a payload */
+    n2n_transform_batch_f fwd_batch;  /* encode several payloads, optional */
+    n2n_transform_batch_f rev_batch;  /* decode several payloads, optional */
 
     n2n_transform_t transform_id;
     uint8_t no_encryption;            /* 1 if this transop does not perform encryption */
+
+    /* 1 if fwd and rev can work in place: fwd accepts inbuf == outbuf +
+     * preamble and rev accepts outbuf == inbuf + preamble */
+    uint8_t inplace;
+    uint8_t preamble;                 /* bytes written ahead of the payload */
 } n2n_trans_op_t;
 
 
@@ -456,6 +478,8 @@ typedef struct n2n_edge_conf {
     devstr_t tuntap_dev_name;
     struct n2n_ip_subnet tuntap_v4;
     uint8_t tuntap_ip_mode;                          /**< Interface IP address allocated mode, eg. DHCP. */
+    uint32_t tuntap_queues;                          /**< Number of TAP queues, each read by its own thread */
+    bool tuntap_offload;                             /**< Exchange GSO frames and partial checksums with the TAP */
 
     uint32_t test_benchmark_seconds;
     int test_output_format;
@@ -469,6 +493,7 @@ typedef struct n2n_edge_conf {
     struct peer_info *sn_edges;     // SN federation storage during configure
     n2n_ip_subnet_t sn_min_auto_ip_net;                        /* Address range of auto_ip service. */
     n2n_ip_subnet_t sn_max_auto_ip_net;                        /* Address range of auto_ip service. */
+    uint32_t sn_workers;                                       /* number of threads receiving on the main UDP port */
 } n2n_edge_conf_t;
 
 
@@ -482,6 +507,10 @@ struct n2n_edge_stats {
     uint32_t tx_multicast_drop;
     uint32_t rx_multicast_drop;
     uint32_t tx_tuntap_error;
+    uint32_t tx_payload;        /* Number of PACKET payloads encoded. */
+    uint32_t rx_payload;        /* Number of PACKET payloads decoded. */
+    uint32_t tx_payload_copy;   /* Payload bytes moved to another buffer while encoding. */
+    uint32_t rx_payload_copy;   /* Payload bytes moved to another buffer while decoding. */
     uint32_t sn_errors;         /* Number of errors encountered. */
     uint32_t sn_reg;            /* Number of REGISTER_SUPER requests received. */
     uint32_t sn_reg_nak;        /* Number of REGISTER_SUPER requests declined. */
@@ -490,6 +519,8 @@ struct n2n_edge_stats {
     uint32_t sn_drop;
 };
 
+struct n3n_tcpconn;
+
 typedef struct n2n_tcp_connection {
     int socket_fd;                                        /* file descriptor for tcp socket */
     socklen_t sock_len;                                   /* amount of actually used space (of the following) */
@@ -497,9 +528,7 @@ typedef struct n2n_tcp_connection {
         struct sockaddr sock;                             /* network order socket */
         struct sockaddr_storage sas;                      /* memory for it, can be longer than sockaddr */
     };
-    uint16_t expected;                                    /* number of bytes expected to be read */
-    uint16_t position;                                    /* current position in the buffer */
-    uint8_t buffer[N2N_PKT_BUF_SIZE + sizeof(uint16_t)];  /* buffer for data collected from tcp socket incl. prepended length */
+    struct n3n_tcpconn *tcp;                              /* packets being read from and queued for the stream */
 
     uint8_t inactive;                                     /* connection not be handled if set, already closed and to be deleted soon */
     UT_hash_handle hh; /* makes this structure hashable */
@@ -508,6 +537,16 @@ typedef struct n2n_tcp_connection {
 
 typedef struct slots slots_t;
 
+// A timer on the mainloop timer wheel.  The owner provides the storage and
+// sets func and data, the remaining fields belong to the mainloop
+struct n3n_timer {
+    struct n3n_timer *next;
+    struct n3n_timer **pprev;   // NULL while the timer is not pending
+    uint64_t expires;           // mainloop_now_ms() when the timer is due
+    void (*func)(struct n3n_timer *, time_t now);
+    void *data;
+};
+
 struct n3n_runtime_data {
     n2n_edge_conf_t conf;
 
@@ -521,10 +560,12 @@ struct n3n_runtime_data {
     bool multicast_joined_v6;                                            /**< 1 if the IPV6 group has been joined.*/
     int close_socket_counter;                                            /**< counter for close-event before re-opening */
     size_t sup_attempts;                                                 /**< Number of remaining attempts to this supernode. */
+    uint32_t dynamic_key_changes;                                        /**< Bumped whenever the dynamic header key changes */
     tuntap_dev device;                                                   /**< All about the TUNTAP device */
     n2n_trans_op_t transop;                                              /**< The transop to use when encoding */
     n2n_trans_op_t transop_lzo;                                          /**< The transop for LZO  compression */
     n2n_trans_op_t transop_zstd;                                         /**< The transop for ZSTD compression */
+    struct n3n_tapqueues             *tapqueues;                         /**< Optional threads reading extra TAP queues */
     uint64_t sn_selection_criterion_common_data;
 
     /* Sockets */
@@ -544,7 +585,7 @@ struct n3n_runtime_data {
     struct peer_info *               known_peers;                        /**< Edges we are connected to. */
     struct peer_info *               pending_peers;                      /**< Edges we have tried to register with. */
 #ifdef HAVE_BRIDGING_SUPPORT
-    struct host_info *               known_hosts;                        /**< hosts we know. */
+    struct n3n_hosttable *           known_hosts;                        /**< hosts we know. */
 #endif
 /* Timers */
     time_t last_register_req;                                            /**< Check if time to re-register with super*/
@@ -554,6 +595,8 @@ struct n3n_runtime_data {
     time_t last_sn_fwd;       /* Time when last message was forwarded. */
     time_t last_sn_reg;       /* Time when last REGISTER_SUPER was received. */
     time_t start_time;                                                   /**< For calculating uptime */
+    struct n3n_timer timer_sn_reg;                                       /**< Runs update_supernode_reg() when it is due */
+    struct n3n_timer timer_resolve;                                      /**< Runs the supernode name resolution checks */
 
 
 
@@ -569,10 +612,14 @@ struct n3n_runtime_data {
     uint32_t dynamic_key_time;                                /* UTC time of last dynamic key generation (second accuracy) */
     n2n_tcp_connection_t                   *tcp_connections;/* list of established TCP connections */
     struct sn_community                    *communities;
-    struct sn_community_regular_expression *rules;
+    struct re_set                          *rules;          /* allowed community name patterns, as one automaton */
     struct sn_community                    *federation;
     n2n_private_public_key_t private_key;                     /* private federation key derived from federation name */
     bool lock_communities;                                    /* If true, only loaded and matching communities can be used. */
+    struct n3n_bitmap                      *auto_subnets;   /* The auto ip sub-network slots that are taken */
+    n2n_ip_subnet_t                        *auto_subnets_fixed; /* The configured community networks, which can share slots */
+    uint32_t auto_subnets_fixed_count;
+    struct sn_workers                      *workers;        /* optional SO_REUSEPORT receive threads */
 };
 
 typedef struct node_supernode_association {
@@ -608,22 +655,24 @@ struct sn_community {
     struct speck_context_t *header_iv_ctx_dynamic;         /* Header IV encryption cipher context, REMOVE as soon as separate fields for checksum and replay protection available */
     uint8_t dynamic_key[N2N_AUTH_CHALLENGE_SIZE];                       /* dynamic key */
     struct                        peer_info *edges;       /* Link list of registered edges. */
+    struct                        peer_info *edges_by_ip; /* The registered edges, indexed by tunnel ip address */
     node_supernode_association_t  *assoc;                 /* list of other edges from this community and their supernodes */
     sn_user_t                     *allowed_users;         /* list of allowed users */
     int64_t number_enc_packets;                           /* Number of encrypted packets handled so far, required for sorting from time to time */
     n2n_ip_subnet_t auto_ip_net;                          /* Address range of auto ip address service. */
+    struct n3n_bitmap *auto_ip_hosts;                     /* The host ids in auto_ip_net that are taken */
+    struct sn_member *members;                            /* The edges, with their destinations resolved for broadcasts */
+    uint32_t members_count;
+    uint32_t members_size;
+    bool members_dirty;                                   /* An edge has joined, left or moved, so members needs to be rebuilt */
+    bool members_tcp;                                     /* Some of the members are on a tcp connection */
 
     UT_hash_handle hh;                                    /* makes this structure hashable */
 };
 
 /* Typedef'd pointer to get abstract datatype. */
 typedef struct regex_t* re_t;
-
-struct sn_community_regular_expression {
-    re_t rule;         /* compiles regular expression */
-
-    UT_hash_handle hh; /* makes this structure hashable */
-};
+typedef struct re_set* re_set_t;
 
 
 /* *************************************************** */
@@ -20,6 +20,7 @@ enum n3n_test_data {
     test_data_cc20,
     test_data_aes,
     test_data_tf,
+    test_data_chachapoly,
     test_data_pdu_v3,
     test_data_pdu_eth,
     test_data_tun2pdu,
@@ -43,5 +43,22 @@ int mainloop_runonce (struct n3n_runtime_data *);
 void mainloop_register_fd (int, enum fd_info_proto);
 void mainloop_unregister_fd (int);
 
+// Sample the monotonic clock, done once for each mainloop iteration
+void mainloop_clock_update ();
+
+// The monotonic clock in milliseconds, as of the last mainloop_clock_update()
+uint64_t mainloop_now_ms ();
+
+// (Re)schedule the timer to run delay_ms from now
+void mainloop_timer_add (struct n3n_timer *, uint32_t delay_ms);
+void mainloop_timer_del (struct n3n_timer *);
+
+// Returns the milliseconds until the next timer is due, or -1 if there are
+// no timers pending
+int mainloop_timer_next ();
+
+// Run the callbacks of all the timers that are due
+void mainloop_timer_run (time_t now);
+
 
 #endif
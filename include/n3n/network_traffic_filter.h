@@ -112,6 +112,9 @@ typedef struct filter_rule_key {
     uint8_t bool_tcp_configured;
     uint8_t bool_udp_configured;
     uint8_t bool_icmp_configured;
+    uint8_t bool_ipv6;          // the nets are src_net6 and dst_net6 instead
+    uint8_t src_net6[16];
+    uint8_t dst_net6[16];
 } filter_rule_key_t;
 
 typedef struct filter_rule {
@@ -145,20 +148,14 @@ typedef enum {
 typedef struct packet_address_proto_info {
     in_addr_t src_ip;
     in_addr_t dst_ip;
+    uint8_t src_ip6[16];        // only used when bool_ipv6 is set
+    uint8_t dst_ip6[16];
     uint16_t src_port;
     uint16_t dst_port;
     filter_packet_proto proto;
+    uint32_t bool_ipv6;
 }packet_address_proto_info_t;
 
-typedef struct filter_rule_pair_cache {
-    packet_address_proto_info_t key;
-
-    uint32_t active_count;
-    uint8_t bool_allow_traffic;
-
-    UT_hash_handle hh;                 /* makes this structure hashable */
-} filter_rule_pair_cache_t;
-
 struct network_traffic_filter;
 typedef struct network_traffic_filter network_traffic_filter_t;
 
@@ -169,6 +166,7 @@ void destroy_network_traffic_filter (network_traffic_filter_t* filter);
 void network_traffic_filter_add_rule (network_traffic_filter_t* filter, filter_rule_t* rules);
 
 //rule_str format: src_ip/len:[b_port,e_port],dst_ip/len:[s_port,e_port],TCP+/-,UDP+/-,ICMP+/-
+//IPv6 nets are written in brackets, like [2001:db8::]/32
 uint8_t process_traffic_filter_rule_str (const char* rule_str, filter_rule_t* rule_struct);
 
 #endif //N3N_NETWORK_TRAFFIC_FILTER_H
@@ -24,7 +24,14 @@
 
 #include <stdint.h>   // for uint64_t, uint32_t
 
+// Not thread-safe: uses the shared generator, unless the calling thread
+// has its own
 uint64_t n3n_rand (void);
+
+// Give the calling thread its own generator, seeded from the shared one.
+// Call it while holding the lock that protects the shared generator
+void n3n_rand_thread_init (void);
+
 int memrnd (uint8_t *address, size_t len);
 
 // Only use when attempting to make a reproducible test case
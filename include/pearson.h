@@ -27,6 +27,9 @@ void pearson_hash_128 (uint8_t *out, const uint8_t *in, size_t len);
 
 uint64_t pearson_hash_64 (const uint8_t *in, size_t len);
 
+// the 64 bit hashes of count inputs at once, each the same as pearson_hash_64() would give
+void pearson_hash_64_multi (uint64_t out[], const uint8_t *in[], const size_t len[], int count);
+
 uint32_t pearson_hash_32 (const uint8_t *in, size_t len);
 
 uint16_t pearson_hash_16 (const uint8_t *in, size_t len);
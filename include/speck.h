@@ -36,88 +36,56 @@
 #define SPECK_KEY_BYTES       (256/8)
 
 
-#if defined (__AVX512F__) // AVX512 support -----------------------------------------------------------------------
+#if defined (__SSE2__) || defined (__x86_64__) // SSE, AVX2, AVX512 -----------------------------------------------
 
 
 #include <immintrin.h>
-#include <string.h>    /* memcpy() */
-
-#define u512 __m512i
 
 #define SPECK_ALIGNED_CTX       64
 
-typedef struct {
-    u512 rk[34];
-    u64 key[34];
-    u32 keysize;
-} speck_context_t;
-
-
-#elif defined (__AVX2__) // AVX2 support --------------------------------------------------------------------------
-
-
-#include <immintrin.h>
-
-#define u256 __m256i
-
-#define SPECK_ALIGNED_CTX       32
-
-typedef struct {
-    u256 rk[34];
-    u64 key[34];
-    u32 keysize;
-} speck_context_t;
-
-
-#elif defined (__SSE2__) // SSE support ---------------------------------------------------------------------------
-
-
-#include <immintrin.h>
-
-#define u128 __m128i
-
-#define SPECK_ALIGNED_CTX       16
-#define SPECK_CTX_BYVAL          1
-
-typedef struct {
-    u128 rk[34];
-    u64 key[34];
-    u32 keysize;
-} speck_context_t;
-
 
 #elif defined (__ARM_NEON) && defined (SPECK_ARM_NEON)      // NEON support ---------------------------------------
 
 
 #include <arm_neon.h>
 
-#define u128 uint64x2_t
-
-typedef struct {
-    u128 rk[34];
-    u64 key[34];
-    u32 keysize;
-} speck_context_t;
 
+#endif // ---------------------------------------------------------------------------------------------------------
 
-#else // plain C --------------------------------------------------------------------------------------------------
 
+// the functions of one build of the cipher, see speck.c
+struct speck_kernels;
 
+// the vector round keys are laid out for the kernels picked at speck_init() time -- on x86, those can be any of
+// the SSE, AVX2 or AVX512 builds, so there is room for the widest
 typedef struct {
+#if defined (SPECK_ALIGNED_CTX)
+    union {
+        __m512i rk512[34];
+        __m256i rk256[34];
+        __m128i rk128[34];
+    };
+#elif defined (__ARM_NEON) && defined (SPECK_ARM_NEON)
+    uint64x2_t rk[34];
+#endif
     u64 key[34];
     u32 keysize;
+    const struct speck_kernels *kernels;
 } speck_context_t;
 
 
-#endif // ---------------------------------------------------------------------------------------------------------
-
-
 int speck_ctr (unsigned char *out, const unsigned char *in, unsigned long long inlen,
                const unsigned char *n,
                speck_context_t *ctx);
 
 int speck_init (speck_context_t **ctx, const unsigned char *k, int keysize);
 
+// same as speck_init() but using the named build of the kernels, e.g. "avx2" as shown in the metrics, or the best
+// one for the CPU if NULL -- fails if that one is not linked in or the CPU cannot run it; meant for the benchmarks
+int speck_init_variant (speck_context_t **ctx, const unsigned char *k, int keysize, const char *variant);
+
+int speck_variant_available (const char *variant);
+
 int speck_deinit (speck_context_t *ctx);
 
 
@@ -136,4 +104,21 @@ int speck_128_decrypt (unsigned char *inout, speck_context_t *ctx);
 int speck_128_encrypt (unsigned char *inout, speck_context_t *ctx);
 
 
+// ----------------------------------------------------------------------------------------------------------------
+// ----------------------------------------------------------------------------------------------------------------
+
+
+// multi-buffer versions of the above -- count independent inputs, each with its own nonce, processed side by side
+// in the vector lanes; meant for many short inputs like the headers of a batch of packets
+// the output must not overlap any of the nonces
+
+
+int speck_ctr_multi (unsigned char *out[], const unsigned char *in[], const unsigned int inlen[],
+                     const unsigned char *n[], int count, speck_context_t *ctx);
+
+int speck_128_decrypt_multi (unsigned char *inout[], int count, speck_context_t *ctx);
+
+int speck_128_encrypt_multi (unsigned char *inout[], int count, speck_context_t *ctx);
+
+
 #endif // SPECK_H
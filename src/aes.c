@@ -25,9 +25,20 @@
 #include <stdlib.h>  // for calloc, free
 #include <string.h>  // for memcpy, size_t
 #include "aes.h"     // for AES_BLOCK_SIZE, aes_context_t, AES128_KEY_BYTES
+#include "cpu.h"     // for n3n_cpu_kernel_select, n3n_cpu_kernel_find
 #include "portable_endian.h"  // for be32toh, htobe32
 
 
+// without openssl, this file is built once as the baseline which also carries the public API, and on x86_64 once
+// more for each of the variants in aes_*.c which only provide their kernels -- see speck.c for the same
+
+
+#if !defined (AES_KERNELS)
+#define AES_KERNELS aes_kernels_base
+#define AES_PUBLIC_API
+#endif
+
+
 #ifdef HAVE_LIBCRYPTO // openSSL 1.1 ---------------------------------------------------------------------
 
 #include <openssl/err.h>    // for ERR_print_errors
@@ -177,6 +188,9 @@ int aes_init (const unsigned char *key, size_t key_size, aes_context_t **ctx) {
 #elif defined (__AES__) && defined (__SSE2__) // Intel's AES-NI ---------------------------------------------------
 
 
+#define AES_VARIANT_NAME "aesni"
+
+
 // inspired by https://gist.github.com/acapola/d5b940da024080dfaf5f
 // furthered by the help of Sebastian Ramacher's implementation found at
 // https://chromium.googlesource.com/external/github.com/dlitz/pycrypto/+/junk/master/src/AESNI.c
@@ -372,10 +386,10 @@ static void aes_internal_decrypt (aes_context_t *ctx, const uint8_t ct[16], uint
 }
 
 
-// public API
+// the kernels, called through the public API further down
 
 
-int aes_ecb_decrypt (unsigned char *out, const unsigned char *in, aes_context_t *ctx) {
+static int internal_ecb_decrypt (unsigned char *out, const unsigned char *in, aes_context_t *ctx) {
 
     aes_internal_decrypt(ctx, in, out);
 
@@ -384,7 +398,7 @@ int aes_ecb_decrypt (unsigned char *out, const unsigned char *in, aes_context_t
 
 
 // not used
-int aes_ecb_encrypt (unsigned char *out, const unsigned char *in, aes_context_t *ctx) {
+static int internal_ecb_encrypt (unsigned char *out, const unsigned char *in, aes_context_t *ctx) {
 
     aes_internal_encrypt(ctx, in, out);
 
@@ -392,8 +406,8 @@ int aes_ecb_encrypt (unsigned char *out, const unsigned char *in, aes_context_t
 }
 
 
-int aes_cbc_encrypt (unsigned char *out, const unsigned char *in, size_t in_len,
-                     const unsigned char *iv, aes_context_t *ctx) {
+static int internal_cbc_encrypt (unsigned char *out, const unsigned char *in, size_t in_len,
+                                 const unsigned char *iv, aes_context_t *ctx) {
 
     int n;                       /* number of blocks */
     int ret = (int)in_len & 15;  /* remainder        */
@@ -435,8 +449,8 @@ int aes_cbc_encrypt (unsigned char *out, const unsigned char *in, size_t in_len,
 }
 
 
-int aes_cbc_decrypt (unsigned char *out, const unsigned char *in, size_t in_len,
-                     const unsigned char *iv, aes_context_t *ctx) {
+static int internal_cbc_decrypt (unsigned char *out, const unsigned char *in, size_t in_len,
+                                 const unsigned char *iv, aes_context_t *ctx) {
 
     int n;                       /* number of blocks */
     int ret = (int)in_len & 15;  /* remainder        */
@@ -586,31 +600,9 @@ int aes_cbc_decrypt (unsigned char *out, const unsigned char *in, size_t in_len,
 }
 
 
-int aes_init (const unsigned char *key, size_t key_size, aes_context_t **ctx) {
+static int internal_key_setup (aes_context_t *ctx, const unsigned char *key, size_t key_size) {
 
-    // allocate context...
-    *ctx = (aes_context_t*) calloc(1, sizeof(aes_context_t));
-    if(!(*ctx))
-        return -1;
-    // ...and fill her up:
-
-    // initialize data structures
-
-    // check key size and make key size (given in bytes) dependant settings
-    switch(key_size) {
-        case AES128_KEY_BYTES:    // 128 bit key size
-            break;
-        case AES192_KEY_BYTES:    // 192 bit key size
-            break;
-        case AES256_KEY_BYTES:    // 256 bit key size
-            break;
-        default:
-            traceEvent(TRACE_ERROR, "aes_init invalid key size %u\n", key_size);
-            return -1;
-    }
-
-    // key materiel handling
-    aes_internal_key_setup( *ctx, key, 8 * key_size);
+    aes_internal_key_setup(ctx, key, 8 * key_size);
 
     return 0;
 }
@@ -619,6 +611,9 @@ int aes_init (const unsigned char *key, size_t key_size, aes_context_t **ctx) {
 #else // plain C --------------------------------------------------------------------------
 
 
+#define AES_VARIANT_NAME "c"
+
+
 // rijndael-alg-fst.c version 3.0 (December 2000)
 // optimised ANSI C code for the Rijndael cipher (now AES)
 // original authors: Vincent Rijmen <vincent.rijmen@esat.kuleuven.ac.be>
@@ -1227,10 +1222,10 @@ static void aes_internal_decrypt (const uint32_t rk[] /*4*(Nr + 1)*/, int Nr, co
 }
 
 
-// public API
+// the kernels, called through the public API further down
 
 
-int aes_ecb_decrypt (unsigned char *out, const unsigned char *in, aes_context_t *ctx) {
+static int internal_ecb_decrypt (unsigned char *out, const unsigned char *in, aes_context_t *ctx) {
 
     aes_internal_decrypt(ctx->dec_rk, ctx->Nr, in, out);
 
@@ -1239,7 +1234,7 @@ int aes_ecb_decrypt (unsigned char *out, const unsigned char *in, aes_context_t
 
 
 // not used
-int aes_ecb_encrypt (unsigned char *out, const unsigned char *in, aes_context_t *ctx) {
+static int internal_ecb_encrypt (unsigned char *out, const unsigned char *in, aes_context_t *ctx) {
 
     aes_internal_encrypt(ctx->enc_rk, ctx->Nr, in, out);
 
@@ -1251,8 +1246,8 @@ int aes_ecb_encrypt (unsigned char *out, const unsigned char *in, aes_context_t
     *(uint32_t*)&(target)[8] = *(uint32_t*)&(target)[8] ^ *(uint32_t*)&(source)[8]; *(uint32_t*)&(target)[12] = *(uint32_t*)&(target)[12] ^ *(uint32_t*)&(source)[12];
 
 
-int aes_cbc_encrypt (unsigned char *out, const unsigned char *in, size_t in_len,
-                     const unsigned char *iv, aes_context_t *ctx) {
+static int internal_cbc_encrypt (unsigned char *out, const unsigned char *in, size_t in_len,
+                                 const unsigned char *iv, aes_context_t *ctx) {
 
     uint8_t tmp[AES_BLOCK_SIZE];
     size_t i;
@@ -1271,8 +1266,8 @@ int aes_cbc_encrypt (unsigned char *out, const unsigned char *in, size_t in_len,
 }
 
 
-int aes_cbc_decrypt (unsigned char *out, const unsigned char *in, size_t in_len,
-                     const unsigned char *iv, aes_context_t *ctx) {
+static int internal_cbc_decrypt (unsigned char *out, const unsigned char *in, size_t in_len,
+                                 const unsigned char *iv, aes_context_t *ctx) {
 
     uint8_t tmp[AES_BLOCK_SIZE];
     uint8_t old[AES_BLOCK_SIZE];
@@ -1293,8 +1288,136 @@ int aes_cbc_decrypt (unsigned char *out, const unsigned char *in, size_t in_len,
 }
 
 
+static int internal_key_setup (aes_context_t *ctx, const unsigned char *key, size_t key_size) {
+
+    ctx->Nr = aes_internal_key_setup_enc(ctx->enc_rk /*[4*(Nr + 1)]*/, key, 8 * key_size);
+    aes_internal_key_setup_dec(ctx->dec_rk /*[4*(Nr + 1)]*/, key, 8 * key_size);
+
+    return 0;
+}
+
+
+#endif // openSSL 1.1, AES-NI, plain C ----------------------------------------------------------------------------
+
+
+#ifndef HAVE_LIBCRYPTO
+
+
+struct aes_kernels {
+    int (*ecb_decrypt) (unsigned char *out, const unsigned char *in, aes_context_t *ctx);
+    int (*ecb_encrypt) (unsigned char *out, const unsigned char *in, aes_context_t *ctx);
+    int (*cbc_encrypt) (unsigned char *out, const unsigned char *in, size_t in_len,
+                        const unsigned char *iv, aes_context_t *ctx);
+    int (*cbc_decrypt) (unsigned char *out, const unsigned char *in, size_t in_len,
+                        const unsigned char *iv, aes_context_t *ctx);
+    int (*key_setup) (aes_context_t *ctx, const unsigned char *key, size_t key_size);
+};
+
+
+const struct aes_kernels AES_KERNELS = {
+    .ecb_decrypt = internal_ecb_decrypt,
+    .ecb_encrypt = internal_ecb_encrypt,
+    .cbc_encrypt = internal_cbc_encrypt,
+    .cbc_decrypt = internal_cbc_decrypt,
+    .key_setup = internal_key_setup,
+};
+
+
+#endif
+
+
+#if defined (AES_PUBLIC_API)
+
+
+#ifdef HAVE_LIBCRYPTO
+
+
+int aes_init_variant (const unsigned char *key, size_t key_size, aes_context_t **ctx, const char *variant) {
+
+    // openssl makes its own choice
+    if(variant) {
+        *ctx = NULL;
+        return -1;
+    }
+
+    return aes_init(key, key_size, ctx);
+}
+
+
+int aes_variant_available (const char *variant) {
+
+    return 0;
+}
+
+
+#else
+
+
+#if defined (N3N_CPU_DISPATCH)
+extern const struct aes_kernels aes_kernels_aesni;
+#endif
+
+static const struct n3n_cpu_variant aes_variants[] = {
+#if defined (N3N_CPU_DISPATCH)
+    { .name = "aesni", .feature = n3n_cpu_aes, .kernels = &aes_kernels_aesni },
+#endif
+    { .name = AES_VARIANT_NAME, .feature = n3n_cpu_baseline, .kernels = &aes_kernels_base },
+};
+
+static struct n3n_cpu_kernel aes_kernel = {
+    .name = "aes",
+    .variants = aes_variants,
+    .nr_variants = sizeof(aes_variants) / sizeof(aes_variants[0]),
+};
+
+
+int aes_ecb_decrypt (unsigned char *out, const unsigned char *in, aes_context_t *ctx) {
+
+    return ctx->kernels->ecb_decrypt(out, in, ctx);
+}
+
+
+// not used
+int aes_ecb_encrypt (unsigned char *out, const unsigned char *in, aes_context_t *ctx) {
+
+    return ctx->kernels->ecb_encrypt(out, in, ctx);
+}
+
+
+int aes_cbc_encrypt (unsigned char *out, const unsigned char *in, size_t in_len,
+                     const unsigned char *iv, aes_context_t *ctx) {
+
+    return ctx->kernels->cbc_encrypt(out, in, in_len, iv, ctx);
+}
+
+
+int aes_cbc_decrypt (unsigned char *out, const unsigned char *in, size_t in_len,
+                     const unsigned char *iv, aes_context_t *ctx) {
+
+    return ctx->kernels->cbc_decrypt(out, in, in_len, iv, ctx);
+}
+
+
 int aes_init (const unsigned char *key, size_t key_size, aes_context_t **ctx) {
 
+    return aes_init_variant(key, key_size, ctx, NULL);
+}
+
+
+int aes_init_variant (const unsigned char *key, size_t key_size, aes_context_t **ctx, const char *variant) {
+
+    const struct aes_kernels *kernels;
+
+    if(variant) {
+        kernels = n3n_cpu_kernel_find(&aes_kernel, variant);
+    } else {
+        kernels = n3n_cpu_kernel_select(&aes_kernel);
+    }
+    if(!kernels) {
+        *ctx = NULL;
+        return -1;
+    }
+
     // allocate context...
     *ctx = (aes_context_t*) calloc(1, sizeof(aes_context_t));
     if(!(*ctx))
@@ -1317,13 +1440,18 @@ int aes_init (const unsigned char *key, size_t key_size, aes_context_t **ctx) {
     }
 
     // key materiel handling
-    (*ctx)->Nr = aes_internal_key_setup_enc((*ctx)->enc_rk /*[4*(Nr + 1)]*/, key, 8 * key_size);
-    aes_internal_key_setup_dec((*ctx)->dec_rk /*[4*(Nr + 1)]*/, key, 8 * key_size);
-    return 0;
+    (*ctx)->kernels = kernels;
+    return kernels->key_setup(*ctx, key, key_size);
 }
 
 
-#endif // openSSL 1.1, AES-NI, plain C ----------------------------------------------------------------------------
+int aes_variant_available (const char *variant) {
+
+    return n3n_cpu_kernel_find(&aes_kernel, variant) != NULL;
+}
+
+
+#endif
 
 
 int aes_deinit (aes_context_t *ctx) {
@@ -1332,3 +1460,14 @@ int aes_deinit (aes_context_t *ctx) {
 
     return 0;
 }
+
+
+void n3n_initfuncs_aes () {
+
+#ifndef HAVE_LIBCRYPTO
+    n3n_cpu_kernel_register(&aes_kernel);
+#endif
+}
+
+
+#endif // AES_PUBLIC_API
@@ -0,0 +1,9 @@
+/**
+ * Copyright (C) Hamish Coleman
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * The aes kernels built for AES-NI, see aes.c
+ */
+
+#define AES_KERNELS aes_kernels_aesni
+#include "aes.c"
@@ -462,6 +462,77 @@ static const uint8_t _test_data_tf[] = {
     0x02,0x60,0x3b,0x6a,0x06,0x8a,0x0c,0x1e,
 };
 
+static const uint8_t _test_data_chachapoly[] = {
+    0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
+    0x00,0x00,0x00,0x00,0x78,0xd6,0xee,0x91,
+    0x97,0x56,0xa1,0x09,0x8d,0x33,0x53,0x4d,
+    0x9a,0x2d,0x66,0xe0,0x0a,0x30,0x9f,0x39,
+    0x0a,0x82,0x75,0xae,0x14,0x59,0x44,0xb8,
+    0xfb,0x2d,0x11,0x40,0xc4,0x60,0x01,0x9c,
+    0xef,0xac,0x32,0xf0,0xba,0x4f,0xc8,0xe9,
+    0x36,0x11,0xde,0xc0,0x1f,0xdf,0x3b,0x88,
+    0x8b,0x56,0xcd,0x4f,0x02,0xa4,0xa6,0xab,
+    0xcd,0x83,0x46,0xa0,0xe9,0xff,0x78,0x34,
+    0x01,0xa8,0x14,0xa4,0xc1,0xcf,0xa3,0x28,
+    0x5d,0xb0,0x06,0xca,0xd4,0x15,0xba,0x37,
+    0xb7,0x33,0x9b,0xf0,0x71,0x3b,0xea,0xc7,
+    0xe5,0x86,0x58,0xf0,0x4f,0xe6,0xcf,0x47,
+    0x69,0x8f,0x16,0xb5,0x2a,0xa4,0x36,0x5d,
+    0x43,0x72,0xd6,0x87,0x94,0xf7,0x9f,0xb6,
+    0x00,0x1c,0xb0,0xad,0x23,0xf5,0x4f,0xeb,
+    0xc3,0x8f,0x3e,0x20,0x9b,0x7c,0x81,0x2f,
+    0x04,0xee,0xcd,0x42,0xe2,0x2c,0x2c,0xc1,
+    0x75,0xea,0xff,0x31,0x0d,0x1b,0xf3,0x45,
+    0x38,0x67,0x76,0x01,0xad,0x02,0xbe,0x9f,
+    0xc2,0xbb,0x57,0xf6,0x8f,0x3f,0x55,0xc7,
+    0x81,0x46,0x7d,0x1f,0xd0,0x2c,0xb2,0x46,
+    0x02,0x30,0xe6,0x5f,0xe9,0x36,0x43,0x01,
+    0xaf,0xac,0xfb,0x26,0x30,0x42,0x77,0xbf,
+    0x20,0xf0,0x52,0x92,0x34,0x54,0xeb,0x26,
+    0x79,0xf3,0xba,0xfd,0xab,0x4c,0x2a,0x09,
+    0x7e,0x33,0xcb,0x89,0x0c,0x96,0xb4,0x87,
+    0xa1,0x45,0x2c,0xed,0x03,0xe7,0xe9,0x6f,
+    0xa2,0xfb,0x26,0xb2,0x93,0x87,0xa6,0xd0,
+    0xee,0xa6,0xf1,0x32,0x5c,0x62,0xef,0xe2,
+    0x3f,0x3b,0xac,0xe3,0x73,0x9a,0x62,0xa9,
+    0xf0,0x77,0xb5,0xc9,0xc3,0xa7,0xf8,0xae,
+    0x10,0xb4,0xe1,0xd8,0x22,0x18,0x67,0xd8,
+    0xb0,0xa3,0xb9,0xa5,0x34,0x1d,0xe8,0xb1,
+    0xc1,0xb9,0x2d,0xbc,0x73,0xb2,0xa1,0x70,
+    0xa7,0x0e,0x79,0x57,0x5e,0xc0,0xed,0xb1,
+    0xcc,0x24,0xa0,0xb5,0x1b,0x28,0x68,0xb8,
+    0x94,0x0d,0x81,0xb4,0xad,0xd7,0xc0,0x0b,
+    0x88,0x31,0xed,0x87,0x37,0x82,0xc9,0xf4,
+    0xbb,0x7e,0xb1,0x61,0x30,0x68,0xa1,0x82,
+    0x18,0x98,0x45,0xcf,0xfb,0x06,0x4d,0x53,
+    0x07,0x76,0xc5,0x06,0x34,0x8f,0x46,0x5b,
+    0xb7,0x9d,0x9d,0x4f,0xe8,0xd5,0x5a,0x38,
+    0x99,0x71,0xf4,0x74,0x83,0x71,0xf8,0x9e,
+    0xd7,0xc8,0xe9,0x80,0x25,0x49,0x6f,0xad,
+    0x71,0x53,0xa5,0xd7,0x22,0x16,0x20,0x15,
+    0x8f,0x88,0xdc,0x50,0xa0,0xb9,0xd7,0x86,
+    0xff,0x6f,0xc0,0x05,0xad,0xac,0xaa,0xaa,
+    0x9d,0x9e,0xb3,0x15,0x4a,0x62,0x8a,0x2e,
+    0xef,0x1d,0xb8,0x89,0xb6,0xa1,0x62,0xd9,
+    0xad,0x23,0x67,0x62,0xd3,0xa0,0x6e,0x04,
+    0xd6,0x1e,0xd2,0xa7,0xf7,0x87,0xff,0x27,
+    0x10,0xbf,0x5a,0x55,0x10,0xff,0xaa,0xd3,
+    0xa6,0x62,0x5c,0x10,0x22,0x7b,0xde,0x2b,
+    0xd3,0xb2,0x73,0x52,0x8f,0x49,0xce,0xe4,
+    0xf9,0xa9,0x8a,0x8a,0x8c,0xb9,0x64,0xfa,
+    0x9c,0xb0,0x93,0x3f,0xd7,0xef,0x3d,0xaf,
+    0x5f,0x23,0xb2,0x7c,0x86,0x10,0x55,0xa4,
+    0x65,0xd5,0x09,0x39,0xc3,0x6b,0xc3,0xca,
+    0x85,0xbf,0x8a,0x44,0x52,0x2c,0x81,0x41,
+    0xe7,0x79,0xd2,0x82,0xe5,0xb4,0x08,0x33,
+    0xc3,0x77,0x31,0xf0,0x0d,0x42,0xba,0x1b,
+    0x50,0xfb,0xc9,0xa4,0x7d,0x0d,0xf0,0x6d,
+    0x04,0xa3,0xf8,0xcc,0xac,0xee,0xf5,0x7d,
+    0x54,0x48,0xe6,0xb2,0x61,0x37,0xe1,0x5f,
+    0x49,0x0b,0x71,0xe3,0x18,0xd2,0xa1,0x6c,
+    0x78,0xdd,0x75,0x52,
+};
+
 static const uint8_t _test_data_pdu_v3[] = {
     0x03,0x01,0x00,0x43,0x74,0x65,0x73,0x74,
     0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
@@ -592,6 +663,10 @@ const struct test_data benchmark_test_data[] = {
         .size = sizeof(_test_data_tf),
         .data = &_test_data_tf,
     },
+    [test_data_chachapoly] = {
+        .size = sizeof(_test_data_chachapoly),
+        .data = &_test_data_chachapoly,
+    },
     [test_data_pdu_v3] = {
         .size = sizeof(_test_data_pdu_v3),
         .data = &_test_data_pdu_v3,
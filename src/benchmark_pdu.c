@@ -40,6 +40,7 @@ static void *bench_setup (void *const _ctx) {
     ctx->eee.pending_peers = NULL;
     ctx->eee.known_peers = NULL;
     ctx->eee.network_traffic_filter = NULL;
+    ctx->eee.device.vnet = NULL;
 
     n2n_transop_null_init(&ctx->eee.conf, &ctx->eee.transop);
 
@@ -0,0 +1,118 @@
+/**
+ * Copyright (C) Hamish Coleman
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * An allocation bitmap, for handing out the free numbers in a range
+ */
+
+#include <stdlib.h>     // for malloc, free, abort
+#include <string.h>     // for memset
+
+#include "bitmap.h"
+
+static uint32_t bitmap_words (const struct n3n_bitmap *bitmap) {
+    return (bitmap->bits + 63) / 64;
+}
+
+static uint32_t bitmap_full_words (const struct n3n_bitmap *bitmap) {
+    return (bitmap_words(bitmap) + 63) / 64;
+}
+
+void n3n_bitmap_init (struct n3n_bitmap *bitmap, uint32_t bits) {
+    bitmap->bits = bits;
+    bitmap->used = malloc(bitmap_words(bitmap) * sizeof(uint64_t));
+    bitmap->full = malloc(bitmap_full_words(bitmap) * sizeof(uint64_t));
+    if(!bitmap->used || !bitmap->full) {
+        abort();
+    }
+    n3n_bitmap_reset(bitmap);
+}
+
+void n3n_bitmap_free (struct n3n_bitmap *bitmap) {
+    free(bitmap->used);
+    free(bitmap->full);
+    bitmap->used = NULL;
+    bitmap->full = NULL;
+    bitmap->bits = 0;
+}
+
+void n3n_bitmap_reset (struct n3n_bitmap *bitmap) {
+    uint32_t words = bitmap_words(bitmap);
+    uint32_t full_words = bitmap_full_words(bitmap);
+
+    memset(bitmap->used, 0, words * sizeof(uint64_t));
+    memset(bitmap->full, 0, full_words * sizeof(uint64_t));
+
+    // The bits past the end of the range are never free
+    for(uint32_t bit = bitmap->bits; bit < words * 64; bit++) {
+        n3n_bitmap_set(bitmap, bit);
+    }
+    for(uint32_t word = words; word < full_words * 64; word++) {
+        bitmap->full[word / 64] |= (uint64_t)1 << (word % 64);
+    }
+}
+
+void n3n_bitmap_set (struct n3n_bitmap *bitmap, uint32_t bit) {
+    uint32_t word = bit / 64;
+
+    bitmap->used[word] |= (uint64_t)1 << (bit % 64);
+    if(bitmap->used[word] == UINT64_MAX) {
+        bitmap->full[word / 64] |= (uint64_t)1 << (word % 64);
+    }
+}
+
+void n3n_bitmap_clear (struct n3n_bitmap *bitmap, uint32_t bit) {
+    uint32_t word = bit / 64;
+
+    bitmap->used[word] &= ~((uint64_t)1 << (bit % 64));
+    bitmap->full[word / 64] &= ~((uint64_t)1 << (word % 64));
+}
+
+bool n3n_bitmap_find_down (const struct n3n_bitmap *bitmap, uint32_t start, uint32_t *found) {
+    int64_t word = start / 64;
+    uint64_t free_bits = ~bitmap->used[word];
+
+    // Only the bits up to and including start
+    free_bits &= UINT64_MAX >> (63 - (start % 64));
+
+    while(!free_bits) {
+        word--;
+        if(word < 0) {
+            return false;
+        }
+        if(bitmap->full[word / 64] == UINT64_MAX) {
+            // Skip the whole group of full words
+            word &= ~63;
+            continue;
+        }
+        free_bits = ~bitmap->used[word];
+    }
+
+    *found = word * 64 + 63 - __builtin_clzll(free_bits);
+    return true;
+}
+
+bool n3n_bitmap_find_up (const struct n3n_bitmap *bitmap, uint32_t start, uint32_t *found) {
+    uint32_t words = bitmap_words(bitmap);
+    uint32_t word = start / 64;
+    uint64_t free_bits = ~bitmap->used[word];
+
+    // Only the bits after start
+    free_bits &= (start % 64 == 63) ? 0 : (UINT64_MAX << (start % 64 + 1));
+
+    while(!free_bits) {
+        word++;
+        if(word >= words) {
+            return false;
+        }
+        if(bitmap->full[word / 64] == UINT64_MAX) {
+            // Skip the whole group of full words
+            word |= 63;
+            continue;
+        }
+        free_bits = ~bitmap->used[word];
+    }
+
+    *found = word * 64 + __builtin_ctzll(free_bits);
+    return true;
+}
@@ -0,0 +1,42 @@
+/**
+ * Copyright (C) Hamish Coleman
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * Private interface to an allocation bitmap, for handing out the free
+ * numbers in a range
+ */
+
+#ifndef _BITMAP_H
+#define _BITMAP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Each bit records a used number.  A second level has a bit for each word
+// of the first that is completely used, so that the searches can skip over
+// the busy parts of a large range.
+struct n3n_bitmap {
+    uint64_t *used;
+    uint64_t *full;
+    uint32_t bits;      // Numbers from 0 to bits-1 can be handed out
+};
+
+// Allocate the bitmap for the given number of bits, with them all free
+void n3n_bitmap_init (struct n3n_bitmap *, uint32_t bits);
+void n3n_bitmap_free (struct n3n_bitmap *);
+
+// Mark all the numbers as free again
+void n3n_bitmap_reset (struct n3n_bitmap *);
+
+void n3n_bitmap_set (struct n3n_bitmap *, uint32_t bit);
+void n3n_bitmap_clear (struct n3n_bitmap *, uint32_t bit);
+
+// Find the free number closest to start, at or below it.  Returns false
+// if there is none
+bool n3n_bitmap_find_down (const struct n3n_bitmap *, uint32_t start, uint32_t *found);
+
+// Find the free number closest to start, above it.  Returns false if there
+// is none
+bool n3n_bitmap_find_up (const struct n3n_bitmap *, uint32_t start, uint32_t *found);
+
+#endif
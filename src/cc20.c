@@ -25,9 +25,20 @@
 
 #include "cc20.h"
 #include "config.h"  // HAVE_LIBCRYPTO
+#include "cpu.h"     // for n3n_cpu_kernel_select, n3n_cpu_kernel_find
 #include "portable_endian.h"  // for htole32
 
 
+// without openssl, this file is built once as the baseline which also carries the public API, and on x86_64 once
+// more for each of the variants in cc20_*.c which only provide their kernels -- see speck.c for the same
+
+
+#if !defined (CC20_KERNELS)
+#define CC20_KERNELS cc20_kernels_base
+#define CC20_PUBLIC_API
+#endif
+
+
 #ifdef HAVE_LIBCRYPTO // openSSL 1.1 ---------------------------------------------------------------------
 
 
@@ -96,6 +107,13 @@ int cc20_crypt (unsigned char *out, const unsigned char *in, size_t in_len,
 #include <xmmintrin.h>  // for _MM_SHUFFLE
 
 
+#if defined (__SSSE3__)
+#define CC20_VARIANT_NAME "ssse3"
+#else
+#define CC20_VARIANT_NAME "sse2"
+#endif
+
+
 #define SL  _mm_slli_epi32
 #define SR  _mm_srli_epi32
 #define XOR _mm_xor_si128
@@ -153,8 +171,8 @@ int cc20_crypt (unsigned char *out, const unsigned char *in, size_t in_len,
     I += 16; O += 16                                                   \
 
 
-int cc20_crypt (unsigned char *out, const unsigned char *in, size_t in_len,
-                const unsigned char *iv, cc20_context_t *ctx) {
+static int internal_cc20_crypt (unsigned char *out, const unsigned char *in, size_t in_len,
+                                const unsigned char *iv, cc20_context_t *ctx) {
 
     __m128i a, b, c, d, k0, k1, k2, k3, k4, k5, k6, k7;
 
@@ -260,6 +278,9 @@ int cc20_crypt (unsigned char *out, const unsigned char *in, size_t in_len,
 // taken (and modified) from https://github.com/Ginurx/chacha20-c (public domain)
 
 
+#define CC20_VARIANT_NAME "c"
+
+
 static void cc20_init_block (cc20_context_t *ctx, const uint8_t nonce[]) {
 
     const uint8_t *magic_constant = (uint8_t*)"expand 32-byte k";
@@ -352,8 +373,8 @@ static void cc20_init_context (cc20_context_t *ctx, const uint8_t *nonce) {
 }
 
 
-int cc20_crypt (unsigned char *out, const unsigned char *in, size_t in_len,
-                const unsigned char *iv, cc20_context_t *ctx) {
+static int internal_cc20_crypt (unsigned char *out, const unsigned char *in, size_t in_len,
+                                const unsigned char *iv, cc20_context_t *ctx) {
 
     uint8_t   *keystream8 = (uint8_t*)ctx->keystream32;
     uint32_t * in_p       = (uint32_t*)in;
@@ -403,8 +424,83 @@ int cc20_crypt (unsigned char *out, const unsigned char *in, size_t in_len,
 #endif // openSSL 1.1, plain C ------------------------------------------------------------------------------------
 
 
+#ifndef HAVE_LIBCRYPTO
+
+
+struct cc20_kernels {
+    int (*crypt) (unsigned char *out, const unsigned char *in, size_t in_len,
+                  const unsigned char *iv, cc20_context_t *ctx);
+};
+
+
+const struct cc20_kernels CC20_KERNELS = {
+    .crypt = internal_cc20_crypt,
+};
+
+
+#endif
+
+
+#if defined (CC20_PUBLIC_API)
+
+
+#ifndef HAVE_LIBCRYPTO
+
+#if defined (N3N_CPU_DISPATCH)
+extern const struct cc20_kernels cc20_kernels_ssse3;
+#endif
+
+static const struct n3n_cpu_variant cc20_variants[] = {
+#if defined (N3N_CPU_DISPATCH)
+    { .name = "ssse3", .feature = n3n_cpu_ssse3, .kernels = &cc20_kernels_ssse3 },
+#endif
+    { .name = CC20_VARIANT_NAME, .feature = n3n_cpu_baseline, .kernels = &cc20_kernels_base },
+};
+
+static struct n3n_cpu_kernel cc20_kernel = {
+    .name = "cc20",
+    .variants = cc20_variants,
+    .nr_variants = sizeof(cc20_variants) / sizeof(cc20_variants[0]),
+};
+
+
+int cc20_crypt (unsigned char *out, const unsigned char *in, size_t in_len,
+                const unsigned char *iv, cc20_context_t *ctx) {
+
+    return ctx->kernels->crypt(out, in, in_len, iv, ctx);
+}
+
+#endif
+
+
 int cc20_init (const unsigned char *key, cc20_context_t **ctx) {
 
+    return cc20_init_variant(key, ctx, NULL);
+}
+
+
+int cc20_init_variant (const unsigned char *key, cc20_context_t **ctx, const char *variant) {
+
+#ifdef HAVE_LIBCRYPTO
+    // openssl makes its own choice
+    if(variant) {
+        *ctx = NULL;
+        return -1;
+    }
+#else
+    const struct cc20_kernels *kernels;
+
+    if(variant) {
+        kernels = n3n_cpu_kernel_find(&cc20_kernel, variant);
+    } else {
+        kernels = n3n_cpu_kernel_select(&cc20_kernel);
+    }
+    if(!kernels) {
+        *ctx = NULL;
+        return -1;
+    }
+#endif
+
     // allocate context...
     *ctx = (cc20_context_t*)calloc(1, sizeof(cc20_context_t));
     if(!(*ctx))
@@ -417,6 +513,8 @@ int cc20_init (const unsigned char *key, cc20_context_t **ctx) {
     }
 
     (*ctx)->cipher = EVP_chacha20();
+#else
+    (*ctx)->kernels = kernels;
 #endif
     memcpy((*ctx)->key, key, CC20_KEY_BYTES);
 
@@ -424,6 +522,16 @@ int cc20_init (const unsigned char *key, cc20_context_t **ctx) {
 }
 
 
+int cc20_variant_available (const char *variant) {
+
+#ifdef HAVE_LIBCRYPTO
+    return 0;
+#else
+    return n3n_cpu_kernel_find(&cc20_kernel, variant) != NULL;
+#endif
+}
+
+
 int cc20_deinit (cc20_context_t *ctx) {
 
 #ifdef HAVE_LIBCRYPTO
@@ -432,3 +540,14 @@ int cc20_deinit (cc20_context_t *ctx) {
     free(ctx);
     return 0;
 }
+
+
+void n3n_initfuncs_cc20 () {
+
+#ifndef HAVE_LIBCRYPTO
+    n3n_cpu_kernel_register(&cc20_kernel);
+#endif
+}
+
+
+#endif // CC20_PUBLIC_API
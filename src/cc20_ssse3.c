@@ -0,0 +1,9 @@
+/**
+ * Copyright (C) Hamish Coleman
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * The chacha20 kernels built for SSSE3, see cc20.c
+ */
+
+#define CC20_KERNELS cc20_kernels_ssse3
+#include "cc20.c"
@@ -0,0 +1,391 @@
+/**
+ * Copyright (C) Hamish Coleman
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * ChaCha20-Poly1305 AEAD (RFC 8439), without additional data.
+ *
+ * With openSSL, the EVP contexts are set up with the key once and only get a
+ * new nonce for each packet.  Otherwise the keystream comes from our own
+ * ChaCha20 and is combined with the 32 bit Poly1305 below.
+ */
+
+
+#include <n3n/logging.h> // for traceEvent
+#include <stdlib.h>     // for calloc, free, size_t
+#include <string.h>     // for memcpy, memset
+
+#include "chachapoly.h"
+#include "config.h"     // HAVE_LIBCRYPTO
+
+
+#ifdef HAVE_LIBCRYPTO // openSSL 1.1 ---------------------------------------------------------------------
+
+
+#include <openssl/err.h>
+#include <openssl/evp.h>
+
+
+struct chachapoly_context {
+    EVP_CIPHER_CTX      *enc;                   /* keyed once, reused for every packet */
+    EVP_CIPHER_CTX      *dec;
+};
+
+
+// get any erorr message out of openssl
+// taken from https://en.wikibooks.org/wiki/OpenSSL/Error_handling
+static char *openssl_err_as_string (void) {
+
+    BIO *bio = BIO_new(BIO_s_mem());
+    ERR_print_errors(bio);
+    char *buf = NULL;
+    size_t len = BIO_get_mem_data(bio, &buf);
+    char *ret = (char *)calloc(1, 1 + len);
+
+    if(ret)
+        memcpy(ret, buf, len);
+
+    BIO_free(bio);
+
+    return ret;
+}
+
+
+int chachapoly_encrypt (uint8_t *out, uint8_t *tag, const uint8_t *in, size_t len,
+                        const uint8_t *nonce, chachapoly_context_t *ctx) {
+
+    int out_len;
+
+    if(1 != EVP_EncryptInit_ex(ctx->enc, NULL, NULL, NULL, nonce)
+       || 1 != EVP_EncryptUpdate(ctx->enc, out, &out_len, in, len)
+       || 1 != EVP_EncryptFinal_ex(ctx->enc, out + out_len, &out_len)
+       || 1 != EVP_CIPHER_CTX_ctrl(ctx->enc, EVP_CTRL_AEAD_GET_TAG, CHACHAPOLY_TAG_SIZE, tag)) {
+        traceEvent(TRACE_ERROR, "chachapoly_encrypt openssl encryption: %s",
+                   openssl_err_as_string());
+        return -1;
+    }
+
+    return 0;
+}
+
+
+int chachapoly_decrypt (uint8_t *out, const uint8_t *in, size_t len, const uint8_t *tag,
+                        const uint8_t *nonce, chachapoly_context_t *ctx) {
+
+    int out_len;
+
+    if(1 != EVP_DecryptInit_ex(ctx->dec, NULL, NULL, NULL, nonce)
+       || 1 != EVP_CIPHER_CTX_ctrl(ctx->dec, EVP_CTRL_AEAD_SET_TAG, CHACHAPOLY_TAG_SIZE, (void *)tag)
+       || 1 != EVP_DecryptUpdate(ctx->dec, out, &out_len, in, len)) {
+        traceEvent(TRACE_ERROR, "chachapoly_decrypt openssl decryption: %s",
+                   openssl_err_as_string());
+        return -1;
+    }
+
+    // a tag mismatch is an expected failure, so is not logged here
+    if(1 != EVP_DecryptFinal_ex(ctx->dec, out + out_len, &out_len)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+int chachapoly_init (const uint8_t *key, chachapoly_context_t **ctx) {
+
+    *ctx = (chachapoly_context_t*)calloc(1, sizeof(chachapoly_context_t));
+    if(!(*ctx))
+        return -1;
+
+    if(!((*ctx)->enc = EVP_CIPHER_CTX_new())
+       || !((*ctx)->dec = EVP_CIPHER_CTX_new())) {
+        traceEvent(TRACE_ERROR, "chachapoly_init openssl's evp_* context creation failed: %s",
+                   openssl_err_as_string());
+        return -1;
+    }
+
+    if(1 != EVP_EncryptInit_ex((*ctx)->enc, EVP_chacha20_poly1305(), NULL, key, NULL)
+       || 1 != EVP_DecryptInit_ex((*ctx)->dec, EVP_chacha20_poly1305(), NULL, key, NULL)) {
+        traceEvent(TRACE_ERROR, "chachapoly_init openssl key setup: %s",
+                   openssl_err_as_string());
+        return -1;
+    }
+
+    return 0;
+}
+
+
+int chachapoly_deinit (chachapoly_context_t *ctx) {
+
+    if(ctx->enc) EVP_CIPHER_CTX_free(ctx->enc);
+    if(ctx->dec) EVP_CIPHER_CTX_free(ctx->dec);
+    free(ctx);
+
+    return 0;
+}
+
+
+#else // plain C --------------------------------------------------------------------------------------------------
+
+
+#include "cc20.h"               // for cc20_crypt, CC20_IV_SIZE
+#include "portable_endian.h"    // for le32toh, htole32
+
+
+struct chachapoly_context {
+    cc20_context_t      *cc20;
+};
+
+
+// Poly1305 with 26 bit limbs, after the public domain poly1305-donna
+
+
+typedef struct poly1305_state {
+    uint32_t r[5];
+    uint32_t h[5];
+    uint32_t pad[4];
+} poly1305_state_t;
+
+
+static inline uint32_t load32 (const uint8_t *p) {
+
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return le32toh(v);
+}
+
+
+static inline void store32 (uint8_t *p, uint32_t v) {
+
+    v = htole32(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+
+static void poly1305_init (poly1305_state_t *st, const uint8_t *key) {
+
+    // r &= 0xffffffc0ffffffc0ffffffc0fffffff
+    st->r[0] = (load32(&key[ 0])     ) & 0x3ffffff;
+    st->r[1] = (load32(&key[ 3]) >> 2) & 0x3ffff03;
+    st->r[2] = (load32(&key[ 6]) >> 4) & 0x3ffc0ff;
+    st->r[3] = (load32(&key[ 9]) >> 6) & 0x3f03fff;
+    st->r[4] = (load32(&key[12]) >> 8) & 0x00fffff;
+
+    memset(st->h, 0, sizeof(st->h));
+
+    st->pad[0] = load32(&key[16]);
+    st->pad[1] = load32(&key[20]);
+    st->pad[2] = load32(&key[24]);
+    st->pad[3] = load32(&key[28]);
+}
+
+
+// Absorb whole 16 byte blocks, a shorter tail must be zero padded by the
+// caller, as the AEAD construction requires anyway
+static void poly1305_blocks (poly1305_state_t *st, const uint8_t *m, size_t bytes) {
+
+    const uint32_t hibit = 1UL << 24;
+    const uint32_t r0 = st->r[0], r1 = st->r[1], r2 = st->r[2], r3 = st->r[3], r4 = st->r[4];
+    const uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+    uint32_t h0 = st->h[0], h1 = st->h[1], h2 = st->h[2], h3 = st->h[3], h4 = st->h[4];
+    uint64_t d0, d1, d2, d3, d4;
+    uint32_t c;
+
+    while(bytes >= 16) {
+        // h += m[i]
+        h0 += (load32(m +  0)     ) & 0x3ffffff;
+        h1 += (load32(m +  3) >> 2) & 0x3ffffff;
+        h2 += (load32(m +  6) >> 4) & 0x3ffffff;
+        h3 += (load32(m +  9) >> 6) & 0x3ffffff;
+        h4 += (load32(m + 12) >> 8) | hibit;
+
+        // h *= r
+        d0 = ((uint64_t)h0 * r0) + ((uint64_t)h1 * s4) + ((uint64_t)h2 * s3) + ((uint64_t)h3 * s2) + ((uint64_t)h4 * s1);
+        d1 = ((uint64_t)h0 * r1) + ((uint64_t)h1 * r0) + ((uint64_t)h2 * s4) + ((uint64_t)h3 * s3) + ((uint64_t)h4 * s2);
+        d2 = ((uint64_t)h0 * r2) + ((uint64_t)h1 * r1) + ((uint64_t)h2 * r0) + ((uint64_t)h3 * s4) + ((uint64_t)h4 * s3);
+        d3 = ((uint64_t)h0 * r3) + ((uint64_t)h1 * r2) + ((uint64_t)h2 * r1) + ((uint64_t)h3 * r0) + ((uint64_t)h4 * s4);
+        d4 = ((uint64_t)h0 * r4) + ((uint64_t)h1 * r3) + ((uint64_t)h2 * r2) + ((uint64_t)h3 * r1) + ((uint64_t)h4 * r0);
+
+        // (partial) h %= p
+        c = (uint32_t)(d0 >> 26); h0 = (uint32_t)d0 & 0x3ffffff;
+        d1 += c; c = (uint32_t)(d1 >> 26); h1 = (uint32_t)d1 & 0x3ffffff;
+        d2 += c; c = (uint32_t)(d2 >> 26); h2 = (uint32_t)d2 & 0x3ffffff;
+        d3 += c; c = (uint32_t)(d3 >> 26); h3 = (uint32_t)d3 & 0x3ffffff;
+        d4 += c; c = (uint32_t)(d4 >> 26); h4 = (uint32_t)d4 & 0x3ffffff;
+        h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+        h1 += c;
+
+        m += 16;
+        bytes -= 16;
+    }
+
+    st->h[0] = h0;
+    st->h[1] = h1;
+    st->h[2] = h2;
+    st->h[3] = h3;
+    st->h[4] = h4;
+}
+
+
+// Absorb data as the AEAD does: whole blocks, then the tail zero padded
+static void poly1305_padded (poly1305_state_t *st, const uint8_t *m, size_t bytes) {
+
+    size_t whole = bytes & ~(size_t)15;
+    uint8_t block[16] = {0};
+
+    poly1305_blocks(st, m, whole);
+    if(bytes > whole) {
+        memcpy(block, m + whole, bytes - whole);
+        poly1305_blocks(st, block, sizeof(block));
+    }
+}
+
+
+static void poly1305_finish (poly1305_state_t *st, uint8_t *mac) {
+
+    uint32_t h0 = st->h[0], h1 = st->h[1], h2 = st->h[2], h3 = st->h[3], h4 = st->h[4];
+    uint32_t g0, g1, g2, g3, g4;
+    uint32_t c, mask;
+    uint64_t f;
+
+    // fully carry h
+    c = h1 >> 26; h1 &= 0x3ffffff;
+    h2 += c; c = h2 >> 26; h2 &= 0x3ffffff;
+    h3 += c; c = h3 >> 26; h3 &= 0x3ffffff;
+    h4 += c; c = h4 >> 26; h4 &= 0x3ffffff;
+    h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+    h1 += c;
+
+    // compute h + -p
+    g0 = h0 + 5; c = g0 >> 26; g0 &= 0x3ffffff;
+    g1 = h1 + c; c = g1 >> 26; g1 &= 0x3ffffff;
+    g2 = h2 + c; c = g2 >> 26; g2 &= 0x3ffffff;
+    g3 = h3 + c; c = g3 >> 26; g3 &= 0x3ffffff;
+    g4 = h4 + c - (1UL << 26);
+
+    // select h if h < p, or h + -p if h >= p
+    mask = (g4 >> 31) - 1;
+    g0 &= mask;
+    g1 &= mask;
+    g2 &= mask;
+    g3 &= mask;
+    g4 &= mask;
+    mask = ~mask;
+    h0 = (h0 & mask) | g0;
+    h1 = (h1 & mask) | g1;
+    h2 = (h2 & mask) | g2;
+    h3 = (h3 & mask) | g3;
+    h4 = (h4 & mask) | g4;
+
+    // h = h % (2^128)
+    h0 = ((h0      ) | (h1 << 26));
+    h1 = ((h1 >>  6) | (h2 << 20));
+    h2 = ((h2 >> 12) | (h3 << 14));
+    h3 = ((h3 >> 18) | (h4 <<  8));
+
+    // mac = (h + pad) % (2^128)
+    f = (uint64_t)h0 + st->pad[0]; h0 = (uint32_t)f;
+    f = (uint64_t)h1 + st->pad[1] + (f >> 32); h1 = (uint32_t)f;
+    f = (uint64_t)h2 + st->pad[2] + (f >> 32); h2 = (uint32_t)f;
+    f = (uint64_t)h3 + st->pad[3] + (f >> 32); h3 = (uint32_t)f;
+
+    store32(&mac[ 0], h0);
+    store32(&mac[ 4], h1);
+    store32(&mac[ 8], h2);
+    store32(&mac[12], h3);
+}
+
+
+// The tag over the ciphertext, keyed from the first keystream block
+static void chachapoly_tag (uint8_t *tag, const uint8_t *cipher, size_t len,
+                            uint8_t *iv, chachapoly_context_t *ctx) {
+
+    static const uint8_t zero[32] = {0};
+    uint8_t poly_key[32];
+    uint8_t lengths[16];
+    poly1305_state_t st;
+
+    memset(iv, 0, 4);
+    cc20_crypt(poly_key, zero, sizeof(poly_key), iv, ctx->cc20);
+    poly1305_init(&st, poly_key);
+
+    poly1305_padded(&st, cipher, len);
+
+    // no additional data, so only the cipher text length is non zero
+    memset(lengths, 0, sizeof(lengths));
+    store32(&lengths[ 8], (uint32_t)len);
+    store32(&lengths[12], (uint32_t)((uint64_t)len >> 32));
+    poly1305_blocks(&st, lengths, sizeof(lengths));
+
+    poly1305_finish(&st, tag);
+}
+
+
+// The ChaCha20 iv is a little endian 32 bit block counter and the nonce
+static void chachapoly_iv (uint8_t *iv, const uint8_t *nonce) {
+
+    memcpy(&iv[4], nonce, CHACHAPOLY_NONCE_SIZE);
+}
+
+
+int chachapoly_encrypt (uint8_t *out, uint8_t *tag, const uint8_t *in, size_t len,
+                        const uint8_t *nonce, chachapoly_context_t *ctx) {
+
+    uint8_t iv[CC20_IV_SIZE];
+
+    chachapoly_iv(iv, nonce);
+
+    // the payload starts at block 1, block 0 is for the poly1305 key
+    store32(iv, 1);
+    cc20_crypt(out, in, len, iv, ctx->cc20);
+
+    chachapoly_tag(tag, out, len, iv, ctx);
+
+    return 0;
+}
+
+
+int chachapoly_decrypt (uint8_t *out, const uint8_t *in, size_t len, const uint8_t *tag,
+                        const uint8_t *nonce, chachapoly_context_t *ctx) {
+
+    uint8_t iv[CC20_IV_SIZE];
+    uint8_t expected[CHACHAPOLY_TAG_SIZE];
+    uint8_t diff = 0;
+    int i;
+
+    chachapoly_iv(iv, nonce);
+    chachapoly_tag(expected, in, len, iv, ctx);
+
+    // constant time compare
+    for(i = 0; i < CHACHAPOLY_TAG_SIZE; i++)
+        diff |= expected[i] ^ tag[i];
+    if(diff)
+        return -1;
+
+    store32(iv, 1);
+    cc20_crypt(out, in, len, iv, ctx->cc20);
+
+    return 0;
+}
+
+
+int chachapoly_init (const uint8_t *key, chachapoly_context_t **ctx) {
+
+    *ctx = (chachapoly_context_t*)calloc(1, sizeof(chachapoly_context_t));
+    if(!(*ctx))
+        return -1;
+
+    return cc20_init(key, &(*ctx)->cc20);
+}
+
+
+int chachapoly_deinit (chachapoly_context_t *ctx) {
+
+    if(ctx->cc20) cc20_deinit(ctx->cc20);
+    free(ctx);
+
+    return 0;
+}
+
+
+#endif // openSSL 1.1, plain C ------------------------------------------------------------------------------------
@@ -41,7 +41,7 @@ static struct n3n_conf_option section_community[] = {
         .desc = "The name of the cipher to use",
         .help = "Choose from any of the registered ciphers for payload "
                 "encryption (requires a key). "
-                "(eg: Twofish, AES, ChaCha20, Speck).",
+                "(eg: Twofish, AES, ChaCha20, ChaCha20-Poly1305, Speck).",
     },
     {
         .name = "compression",
@@ -261,6 +261,7 @@ static struct n3n_conf_option section_filter[] = {
         .desc = "Add a new traffic filter rule",
         .help = "Each rule config option adds a new rule. "
                 "rule_str format: `src_ip/len:[b_port,e_port],dst_ip/len:[s_port,e_port],TCP+/-,UDP+/-,ICMP+/-` "
+                "IPv6 addresses are written in brackets, like `[2001:db8::]/32`. "
                 "See the docs/advanced/TrafficRestrictions.md for more details",
     },
     {.name = NULL},
@@ -396,6 +397,17 @@ static struct n3n_conf_option section_supernode[] = {
                 "(max 19 letters, defaults to the build version).",
 
     },
+    {
+        .name = "workers",
+        .type = n3n_conf_uint32,
+        .offset = offsetof(n2n_edge_conf_t, sn_workers),
+        .desc = "Number of UDP receive threads",
+        .help = "When built with pthread support, the supernode can open "
+                "additional SO_REUSEPORT sockets on its main port, each one "
+                "read by its own thread.  Header decryption and community "
+                "matching then run in parallel, while the actual packet "
+                "handling stays serialised.  Defaults to 1 (no extra threads).",
+    },
     {.name = NULL},
 };
 
@@ -498,6 +510,27 @@ static struct n3n_conf_option section_tuntap[] = {
                 "that matches this name.  On other operating systems, it is "
                 "ignored.",
     },
+    {
+        .name = "offload",
+        .type = n3n_conf_bool,
+        .offset = offsetof(n2n_edge_conf_t, tuntap_offload),
+        .desc = "Use the TAP segmentation and checksum offloads",
+        .help = "(Linux only) Open the TAP device with a virtio header, so "
+                "that the kernel can hand over large TCP frames and leave "
+                "checksums unfinished.  The large frames are split before "
+                "being sent and consecutive received TCP segments are merged "
+                "again, reducing the number of TAP reads and writes.",
+    },
+    {
+        .name = "queues",
+        .type = n3n_conf_uint32,
+        .offset = offsetof(n2n_edge_conf_t, tuntap_queues),
+        .desc = "Number of TAP queues",
+        .help = "(Linux only, needs pthread support) Open the TAP device "
+                "in multi-queue mode, with each additional queue read by its "
+                "own thread.  This lets the packet encryption use more than "
+                "one CPU core.  Defaults to 1.",
+    },
     {.name = NULL},
 };
 
@@ -0,0 +1,115 @@
+/**
+ * Copyright (C) Hamish Coleman
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * Choose the build of each crypto kernel that suits the CPU.
+ *
+ * The kernels that have vector code are compiled more than once, with the
+ * instruction set extensions enabled for each variant, so that one binary
+ * can use the best code for the machine it lands on without needing a
+ * -march build for it.
+ */
+
+#include <n3n/metrics.h>
+#include <stdbool.h>
+#include <stddef.h>     // for NULL
+#include <stdint.h>
+#include <string.h>     // for strcmp
+
+#include "cpu.h"
+
+static struct n3n_cpu_kernel *registered_kernels;
+
+bool n3n_cpu_supports (enum n3n_cpu_feature feature) {
+    switch(feature) {
+        case n3n_cpu_baseline:
+            return true;
+#if defined (N3N_CPU_DISPATCH)
+        // The builtin also checks that the OS saves the wider registers
+        case n3n_cpu_ssse3:
+            return __builtin_cpu_supports("ssse3");
+        case n3n_cpu_aes:
+            return __builtin_cpu_supports("aes");
+        case n3n_cpu_avx2:
+            return __builtin_cpu_supports("avx2");
+        case n3n_cpu_avx512f:
+            return __builtin_cpu_supports("avx512f");
+#endif
+        default:
+            return false;
+    }
+}
+
+const void *n3n_cpu_kernel_select (struct n3n_cpu_kernel *kernel) {
+    if(kernel->selected) {
+        return kernel->selected->kernels;
+    }
+
+    // The baseline is last in the list and always supported
+    int i;
+    for(i = 0; i < kernel->nr_variants - 1; i++) {
+        if(n3n_cpu_supports(kernel->variants[i].feature)) {
+            break;
+        }
+    }
+    kernel->selected = &kernel->variants[i];
+    return kernel->selected->kernels;
+}
+
+const void *n3n_cpu_kernel_find (struct n3n_cpu_kernel *kernel, const char *variant) {
+    for(int i = 0; i < kernel->nr_variants; i++) {
+        if(strcmp(kernel->variants[i].name, variant)) {
+            continue;
+        }
+        if(!n3n_cpu_supports(kernel->variants[i].feature)) {
+            return NULL;
+        }
+        return kernel->variants[i].kernels;
+    }
+    return NULL;
+}
+
+void n3n_cpu_kernel_register (struct n3n_cpu_kernel *kernel) {
+    n3n_cpu_kernel_select(kernel);
+
+    kernel->next = registered_kernels;
+    registered_kernels = kernel;
+}
+
+// The value shown for each variant, 1 for the one in use
+static uint32_t metrics_selected[2] = { 0, 1 };
+
+static void metrics_callback (strbuf_t **reply, const struct n3n_metrics_module *module) {
+    struct n3n_cpu_kernel *kernel;
+    for(kernel = registered_kernels; kernel; kernel = kernel->next) {
+        for(int i = 0; i < kernel->nr_variants; i++) {
+            const struct n3n_cpu_variant *variant = &kernel->variants[i];
+            if(!n3n_cpu_supports(variant->feature)) {
+                continue;
+            }
+
+            n3n_metrics_render_u32tags(
+                reply,
+                module,
+                "selected",
+                (variant == kernel->selected) ? sizeof(uint32_t) : 0,
+                2,  // number of tag+val pairs
+                "kernel",
+                kernel->name,
+                "variant",
+                variant->name
+            );
+        }
+    }
+}
+
+static struct n3n_metrics_module metrics_module = {
+    .name = "cpu",
+    .data = &metrics_selected,
+    .cb = &metrics_callback,
+    .type = n3n_metrics_type_cb,
+};
+
+void n3n_initfuncs_cpu () {
+    n3n_metrics_register(&metrics_module);
+}
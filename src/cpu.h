@@ -0,0 +1,56 @@
+/**
+ * Copyright (C) Hamish Coleman
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * Private interface for choosing, at run time, which build of a crypto
+ * kernel suits the CPU we are running on
+ */
+
+#ifndef _CPU_H
+#define _CPU_H
+
+#include <stdbool.h>
+
+// The Makefile only builds the extra kernel variants for this target, so
+// this test must agree with the one there
+#if defined (__x86_64__)
+#define N3N_CPU_DISPATCH
+#endif
+
+enum n3n_cpu_feature {
+    n3n_cpu_baseline = 0,   // whatever the build was compiled for
+    n3n_cpu_ssse3,
+    n3n_cpu_aes,
+    n3n_cpu_avx2,
+    n3n_cpu_avx512f,
+};
+
+struct n3n_cpu_variant {
+    const char *name;               // eg "avx2", as shown in metrics and benchmarks
+    enum n3n_cpu_feature feature;   // what the CPU needs to run it
+    const void *kernels;            // the function table of this build
+};
+
+// One algorithm and the builds of it that are linked in
+struct n3n_cpu_kernel {
+    struct n3n_cpu_kernel *next;    // the cpu.c manages this
+    const char *name;               // eg "speck"
+    const struct n3n_cpu_variant *variants; // best first, the baseline last
+    const int nr_variants;
+    const struct n3n_cpu_variant *selected; // the best one the CPU can run
+};
+
+bool n3n_cpu_supports (enum n3n_cpu_feature feature);
+
+// Return the kernels of the best variant the CPU can run.  This is cheap
+// once the choice has been made, so can be used before the initfuncs
+const void *n3n_cpu_kernel_select (struct n3n_cpu_kernel *kernel);
+
+// Return the kernels of the named variant, or NULL when it is not linked in
+// or the CPU cannot run it
+const void *n3n_cpu_kernel_find (struct n3n_cpu_kernel *kernel, const char *variant);
+
+// Make the choice and show it in the metrics
+void n3n_cpu_kernel_register (struct n3n_cpu_kernel *kernel);
+
+#endif
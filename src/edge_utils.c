@@ -18,6 +18,10 @@
  *
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE                  // for recvmmsg
+#endif
+
 #ifdef _WIN32
 #include "win32/defs.h"
 #endif
@@ -49,6 +53,7 @@
 #include "config.h"                  // for HAVE_LIBZSTD
 #include "edge_utils.h"
 #include "header_encryption.h"       // for packet_header_encrypt, packet_he...
+#include "hosttable.h"               // for n3n_hosttable_find, n3n_hosttabl...
 #include "management.h"              // for mgmt_event_post
 #include "minmax.h"                  // for MIN, MAX
 #include "n2n.h"                     // for n3n_runtime_data, n2n_edge_...
@@ -59,7 +64,10 @@
 #include "resolve.h"                 // for resolve_create_thread, resolve_c...
 #include "sn_selection.h"            // for sn_selection_criterion_common_da...
 #include "speck.h"                   // for speck_128_decrypt, speck_128_enc...
+#include "tapqueue.h"                // for n3n_tapqueue_start, n3n_tapqueue...
+#include "txqueue.h"                 // for n3n_txqueue_sendto
 #include "uthash.h"                  // for UT_hash_handle, HASH_COUNT, HASH...
+#include "vnethdr.h"                 // for n3n_vnet_read, n3n_vnet_segment
 #include "n2n_define.h"
 #include "n2n_typedefs.h"
 
@@ -171,6 +179,36 @@ static struct n3n_metrics_items_llu32 edge_utils_metrics_items2 = {
     },
 };
 
+static struct n3n_metrics_items_llu32 edge_utils_metrics_items3 = {
+    .name = "payload",
+    .desc = "PACKET payloads handled and the payload bytes copied between buffers",
+    .name1 = "direction",
+    .name2 = "event",
+    .items = {
+        {
+            .val1 = "tx",
+            .val2 = "packets",
+            .offset = offsetof(struct n2n_edge_stats, tx_payload),
+        },
+        {
+            .val1 = "tx",
+            .val2 = "copied_bytes",
+            .offset = offsetof(struct n2n_edge_stats, tx_payload_copy),
+        },
+        {
+            .val1 = "rx",
+            .val2 = "packets",
+            .offset = offsetof(struct n2n_edge_stats, rx_payload),
+        },
+        {
+            .val1 = "rx",
+            .val2 = "copied_bytes",
+            .offset = offsetof(struct n2n_edge_stats, rx_payload_copy),
+        },
+        { },
+    },
+};
+
 static struct n3n_metrics_module edge_metrics_module1 = {
     .name = "edge",
     .items_uint32 = edge_utils_metrics_items1,
@@ -183,6 +221,12 @@ static struct n3n_metrics_module edge_metrics_module2 = {
     .type = n3n_metrics_type_llu32,
 };
 
+static struct n3n_metrics_module edge_metrics_module3 = {
+    .name = "edge",
+    .items_llu32 = &edge_utils_metrics_items3,
+    .type = n3n_metrics_type_llu32,
+};
+
 /* addr should be in network order. Things are so much simpler that way. */
 char* intoa (uint32_t /* host order */ addr, char* buf, uint16_t buf_len) {
 
@@ -633,13 +677,65 @@ void supernode_disconnect (struct n3n_runtime_data *eee) {
 
 /* ************************************** */
 
+/** Set up the transops used to encode and decode packets.
+ *
+ *    Anything encoding packets in parallel needs its own set of these.
+ */
+int edge_init_transops (const n2n_edge_conf_t *conf,
+                        n2n_trans_op_t *transop,
+                        n2n_trans_op_t *transop_lzo,
+                        n2n_trans_op_t *transop_zstd) {
+    int rc;
+
+    // always initialize compression transforms so we can at least decompress
+    rc = n2n_transop_lzo_init(conf, transop_lzo);
+    if(rc) return rc; /* error message is printed in lzo_init */
+#ifdef HAVE_LIBZSTD
+    rc = n2n_transop_zstd_init(conf, transop_zstd);
+    if(rc) return rc; /* error message is printed in zstd_init */
+#endif
+
+    /* Set active transop */
+    switch(conf->transop_id) {
+        case N2N_TRANSFORM_ID_TWOFISH:
+            rc = n2n_transop_tf_init(conf, transop);
+            break;
+
+        case N2N_TRANSFORM_ID_AES:
+            rc = n2n_transop_aes_init(conf, transop);
+            break;
+
+        case N2N_TRANSFORM_ID_CHACHA20:
+            rc = n2n_transop_cc20_init(conf, transop);
+            break;
+
+        case N2N_TRANSFORM_ID_SPECK:
+            rc = n2n_transop_speck_init(conf, transop);
+            break;
+
+        case N2N_TRANSFORM_ID_CHACHAPOLY:
+            rc = n2n_transop_chachapoly_init(conf, transop);
+            break;
+
+        default:
+            rc = n2n_transop_null_init(conf, transop);
+    }
+
+    if((rc < 0) || (transop->fwd == NULL) || (transop->transform_id != conf->transop_id)) {
+        traceEvent(TRACE_ERROR, "transop init failed");
+        return -1;
+    }
+
+    return 0;
+}
+
+
 /** Initialise an edge to defaults.
  *
  *    This also initialises the NULL transform operation opstruct.
  */
 struct n3n_runtime_data* edge_init (const n2n_edge_conf_t *conf, int *rv) {
 
-    n2n_transform_t transop_id = conf->transop_id;
     struct n3n_runtime_data *eee = calloc(1, sizeof(struct n3n_runtime_data));
     int rc = -1;
     uint8_t tmp_key[N2N_AUTH_CHALLENGE_SIZE];
@@ -662,6 +758,8 @@ struct n3n_runtime_data* edge_init (const n2n_edge_conf_t *conf, int *rv) {
             conf->sessionname
         );
     }
+    eee->device.queues = eee->conf.tuntap_queues;
+    eee->device.offload = eee->conf.tuntap_offload;
 #endif
 
     // Show the user what has been configured
@@ -677,54 +775,37 @@ struct n3n_runtime_data* edge_init (const n2n_edge_conf_t *conf, int *rv) {
     }
 
     // Statically calculate how many packet buffers we need:
-    // - one for resolver, one for rx, one for tx, one spare
+    // - one for resolver, one batch for rx, one for tx, one spare
+    // - one batch of tx segments split from a GSO frame
+    // - the datagrams held by the transmit queue
     // (We might need more for multi-peer buffered TCP connections, or for
     // multi-queue / multi-thread
-    n3n_pktbuf_initialise(eee->conf.mtu, 4);
+    n3n_pktbuf_initialise(
+        eee->conf.mtu + N3N_PKTBUF_HEADROOM,
+        3 + N3N_RX_BATCH_SIZE + N3N_TX_BATCH_SIZE + N3N_TXQUEUE_SIZE
+    );
 
     eee->curr_sn = eee->supernodes;
     eee->start_time = time(NULL);
 
     eee->known_peers        = NULL;
     eee->pending_peers    = NULL;
+#ifdef HAVE_BRIDGING_SUPPORT
+    if(eee->conf.allow_routing) {
+        eee->known_hosts = n3n_hosttable_malloc(HOSTINFO_MAX);
+    }
+#endif
     reset_sup_attempts(eee);
 
     sn_selection_criterion_common_data_default(eee);
 
-    // always initialize compression transforms so we can at least decompress
-    rc = n2n_transop_lzo_init(&eee->conf, &eee->transop_lzo);
-    if(rc) goto edge_init_error; /* error message is printed in lzo_init */
-#ifdef HAVE_LIBZSTD
-    rc = n2n_transop_zstd_init(&eee->conf, &eee->transop_zstd);
-    if(rc) goto edge_init_error; /* error message is printed in zstd_init */
-#endif
-
-    /* Set active transop */
-    switch(transop_id) {
-        case N2N_TRANSFORM_ID_TWOFISH:
-            rc = n2n_transop_tf_init(&eee->conf, &eee->transop);
-            break;
-
-        case N2N_TRANSFORM_ID_AES:
-            rc = n2n_transop_aes_init(&eee->conf, &eee->transop);
-            break;
-
-        case N2N_TRANSFORM_ID_CHACHA20:
-            rc = n2n_transop_cc20_init(&eee->conf, &eee->transop);
-            break;
-
-        case N2N_TRANSFORM_ID_SPECK:
-            rc = n2n_transop_speck_init(&eee->conf, &eee->transop);
-            break;
-
-        default:
-            rc = n2n_transop_null_init(&eee->conf, &eee->transop);
-    }
-
-    if((rc < 0) || (eee->transop.fwd == NULL) || (eee->transop.transform_id != transop_id)) {
-        traceEvent(TRACE_ERROR, "transop init failed");
-        goto edge_init_error;
-    }
+    rc = edge_init_transops(
+        &eee->conf,
+        &eee->transop,
+        &eee->transop_lzo,
+        &eee->transop_zstd
+    );
+    if(rc) goto edge_init_error;
 
     // set the key schedule (context) for header encryption if enabled
     if(conf->header_encryption == HEADER_ENCRYPTION_ENABLED) {
@@ -760,9 +841,10 @@ struct n3n_runtime_data* edge_init (const n2n_edge_conf_t *conf, int *rv) {
         // random part of token (challenge) will be generated and filled in at each REGISTER_SUPER
         eee->conf.auth.token_size = N2N_AUTH_PW_TOKEN_SIZE;
         // make sure that only stream ciphers are being used
-        if((transop_id != N2N_TRANSFORM_ID_CHACHA20)
-           && (transop_id != N2N_TRANSFORM_ID_SPECK)) {
-            traceEvent(TRACE_ERROR, "user-password authentication requires ChaCha20 or SPECK to be used.");
+        if((conf->transop_id != N2N_TRANSFORM_ID_CHACHA20)
+           && (conf->transop_id != N2N_TRANSFORM_ID_SPECK)
+           && (conf->transop_id != N2N_TRANSFORM_ID_CHACHAPOLY)) {
+            traceEvent(TRACE_ERROR, "user-password authentication requires ChaCha20, ChaCha20-Poly1305 or SPECK to be used.");
             goto edge_init_error;
         }
     }
@@ -945,7 +1027,7 @@ static void register_with_new_peer (struct n3n_runtime_data *eee,
     } else{
         scan->sock = *peer;
     }
-    scan->last_seen = time(NULL);
+    peer_info_seen(&eee->pending_peers, scan, time(NULL));
     if(dev_addr != NULL) {
         memcpy(&(scan->dev_addr), dev_addr, sizeof(n2n_ip_subnet_t));
     }
@@ -1072,7 +1154,7 @@ static void peer_set_p2p_confirmed (struct n3n_runtime_data * eee,
         traceEvent(TRACE_DEBUG, "known peers list size=%u",
                    HASH_COUNT(eee->known_peers));
 
-        scan->last_seen = now;
+        peer_info_seen(&eee->known_peers, scan, now);
     } else
         traceEvent(TRACE_DEBUG, "failed to find sender in pending_peers");
 }
@@ -1142,10 +1224,13 @@ static int handle_remote_auth (struct n3n_runtime_data *eee, struct peer_info *p
             memxor(tmp_token + N2N_PRIVATE_PUBLIC_KEY_SIZE, eee->conf.auth.token + N2N_PRIVATE_PUBLIC_KEY_SIZE, N2N_AUTH_CHALLENGE_SIZE);
             // un-XOR the shared secret
             memxor(tmp_token + N2N_PRIVATE_PUBLIC_KEY_SIZE, *(eee->conf.shared_secret), N2N_AUTH_CHALLENGE_SIZE);
-            // setup for use as dynamic key
+            // setup for use as dynamic key, once the queued packets are
+            // done with the old one
+            n3n_txqueue_encrypt_headers();
             packet_header_change_dynamic_key(tmp_token + N2N_PRIVATE_PUBLIC_KEY_SIZE,
                                              &(eee->conf.header_encryption_ctx_dynamic),
                                              &(eee->conf.header_iv_ctx_dynamic));
+            eee->dynamic_key_changes++;
             break;
         default:
             break;
@@ -1231,19 +1316,28 @@ static void check_known_peer_sock_change (struct n3n_runtime_data *eee,
             /* Don't worry about what the supernode reports, it could be seeing a different socket. */
         }
     } else
-        scan->last_seen = when;
+        peer_info_seen(&eee->known_peers, scan, when);
 }
 
 /* ************************************** */
 
-/** Send a datagram to a socket file descriptor */
-static void sendto_fd (struct n3n_runtime_data *eee, const void *buf,
-                       size_t len, struct sockaddr *dest, socklen_t dest_len) {
+/** Send a datagram to a socket file descriptor, encrypting its header
+ *  on the way if header is not NULL
+ *
+ *  If frame is not NULL, buf lies in it and the send may keep a reference
+ *  to it instead of copying the datagram */
+static void sendto_fd (struct n3n_runtime_data *eee, void *buf,
+                       size_t len, const struct n3n_txqueue_header *header,
+                       struct n3n_pktbuf *frame,
+                       struct sockaddr *dest, socklen_t dest_len) {
 
     ssize_t sent = 0;
 
-    sent = sendto(eee->sock, buf, len, 0 /*flags*/,
-                  dest, dest_len);
+    if(header) {
+        sent = n3n_txqueue_sendto_header(eee->sock, buf, len, header, frame, dest, dest_len);
+    } else {
+        sent = n3n_txqueue_sendto(eee->sock, buf, len, frame, dest, dest_len);
+    }
 
     if(sent != -1) {
         // sendto success
@@ -1280,16 +1374,17 @@ static void sendto_fd (struct n3n_runtime_data *eee, const void *buf,
                sockaddr_to_str(sockbuf, sizeof(sockbuf), dest),
                errno, errstr);
 
-    /*
-     * TODO: metrics for errors
-     */
+    eee->stats.sn_errors++;
     return;
 }
 
 
-/** Send a datagram to a socket defined by a n3n_sock_t */
-static void sendto_sock (struct n3n_runtime_data *eee, const void * buf,
-                         size_t len, const n3n_sock_t * dest) {
+/** Send a datagram to a socket defined by a n3n_sock_t, encrypting its
+ *  header on the way if header is not NULL, see sendto_fd() for frame */
+static void sendto_sock (struct n3n_runtime_data *eee, void * buf,
+                         size_t len, const struct n3n_txqueue_header *header,
+                         struct n3n_pktbuf *frame,
+                         const n3n_sock_t * dest) {
 
     // provides enough space for all protocol families per which it varies
     struct sockaddr_storage peer_addr_storage = {0};
@@ -1313,6 +1408,9 @@ static void sendto_sock (struct n3n_runtime_data *eee, const void * buf,
 
     // if the connection is tcp, i.e. not the regular sock...
     if(eee->conf.connect_tcp) {
+        if(header) {
+            packet_header_encrypt(buf, header->len, len, header->ctx, header->ctx_iv, header->stamp);
+        }
         mainloop_send_v3tcp(eee->sock, buf, len);
         /*
          * TODO: metrics for errors
@@ -1333,7 +1431,7 @@ static void sendto_sock (struct n3n_runtime_data *eee, const void * buf,
     // This is a hack.  It was needed to successfully progress the test suite
     // with the new IPv6 code, but I suspect it breaks things.
     if(dest->family == AF_INET) {
-        sendto_fd(eee, buf, len, (struct sockaddr *) &peer_addr_storage, peer_addr_len);
+        sendto_fd(eee, buf, len, header, frame, (struct sockaddr *) &peer_addr_storage, peer_addr_len);
         return;
     }
 
@@ -1345,7 +1443,7 @@ static void sendto_sock (struct n3n_runtime_data *eee, const void * buf,
         return;
     }
 
-    sendto_fd(eee, buf, len, (struct sockaddr *) &dest_addr, peer_addr_len);
+    sendto_fd(eee, buf, len, header, frame, (struct sockaddr *) &dest_addr, peer_addr_len);
 }
 
 
@@ -1440,7 +1538,7 @@ void send_query_peer (struct n3n_runtime_data * eee,
                                   time_stamp());
         }
 
-        sendto_sock(eee, pktbuf, idx, &(eee->curr_sn->sock));
+        sendto_sock(eee, pktbuf, idx, NULL, NULL, &(eee->curr_sn->sock));
 
     } else {
         traceEvent(TRACE_DEBUG, "send PING to supernodes");
@@ -1479,7 +1577,7 @@ void send_query_peer (struct n3n_runtime_data * eee,
                 break;
             }
             traceEvent(TRACE_DEBUG, "send PING to this peer");
-            sendto_sock(eee, pktbuf, idx, &(peer->sock));
+            sendto_sock(eee, pktbuf, idx, NULL, NULL, &(peer->sock));
         }
     }
 }
@@ -1540,7 +1638,7 @@ void send_register_super (struct n3n_runtime_data *eee) {
         }
     }
 
-    sendto_sock(eee, pktbuf, idx, &(eee->curr_sn->sock));
+    sendto_sock(eee, pktbuf, idx, NULL, NULL, &(eee->curr_sn->sock));
 }
 
 
@@ -1576,7 +1674,7 @@ static void send_unregister_super (struct n3n_runtime_data *eee) {
                               eee->conf.header_encryption_ctx_dynamic, eee->conf.header_iv_ctx_dynamic,
                               time_stamp());
 
-    sendto_sock(eee, pktbuf, idx, &(eee->curr_sn->sock));
+    sendto_sock(eee, pktbuf, idx, NULL, NULL, &(eee->curr_sn->sock));
 
 }
 
@@ -1682,7 +1780,7 @@ static void send_register (struct n3n_runtime_data * eee,
                               eee->conf.header_encryption_ctx_dynamic, eee->conf.header_iv_ctx_dynamic,
                               time_stamp());
 
-    sendto_sock(eee, pktbuf, idx, remote_peer);
+    sendto_sock(eee, pktbuf, idx, NULL, NULL, remote_peer);
 }
 
 /* ************************************** */
@@ -1723,7 +1821,7 @@ static void send_register_ack (struct n3n_runtime_data * eee,
                               eee->conf.header_encryption_ctx_dynamic, eee->conf.header_iv_ctx_dynamic,
                               time_stamp());
 
-    sendto_sock(eee, pktbuf, idx, remote_peer);
+    sendto_sock(eee, pktbuf, idx, NULL, NULL, remote_peer);
 }
 
 /* ************************************** */
@@ -1885,6 +1983,32 @@ void update_supernode_reg (struct n3n_runtime_data * eee, time_t now) {
 
 /* ************************************** */
 
+// Arm the registration timer for the next time update_supernode_reg() will
+// have something to do
+static void edge_sn_reg_schedule (struct n3n_runtime_data *eee, time_t now) {
+    time_t due;
+
+    if(!eee->timer_sn_reg.func) {
+        // Still bootstrapping, run_edge_loop() will start the timer
+        return;
+    }
+
+    if(eee->sn_wait == 2) {
+        due = now;
+    } else if(eee->sn_wait) {
+        due = eee->last_register_req + (eee->conf.register_interval / 10) + 1;
+    } else {
+        due = eee->last_register_req + eee->conf.register_interval;
+    }
+
+    // Guard against the wall clock having been stepped
+    time_t delay = MAX(0, MIN(due - now, eee->conf.register_interval));
+
+    mainloop_timer_add(&eee->timer_sn_reg, delay * 1000);
+}
+
+/* ************************************** */
+
 /** A PACKET has arrived containing an encapsulated ethernet datagram - usually
  *    encrypted. */
 static int handle_PACKET (struct n3n_runtime_data * eee,
@@ -1892,7 +2016,8 @@ static int handle_PACKET (struct n3n_runtime_data * eee,
                           const n2n_PACKET_t * pkt,
                           const n3n_sock_t * orig_sender,
                           uint8_t * payload,
-                          size_t psize) {
+                          size_t psize,
+                          const ssize_t *decoded) {
 
     ssize_t data_sent_len;
     uint8_t *                 eth_payload = NULL;
@@ -1941,12 +2066,33 @@ static int handle_PACKET (struct n3n_runtime_data * eee,
     }
 
     uint8_t is_multicast;
-    // decrypt
-    eth_payload = decode_buf;
-    eth_size = eee->transop.rev(&eee->transop,
-                                eth_payload, N2N_PKT_BUF_SIZE,
-                                payload, psize, pkt->srcMac);
+    // decrypt, where the payload lies if the transform allows it
+    if(decoded) {
+        // Already decrypted in place along with the rest of its batch
+        eth_payload = payload + eee->transop.preamble;
+        eth_size = *decoded;
+    } else if(eee->transop.inplace && (psize >= eee->transop.preamble)) {
+        eth_payload = payload + eee->transop.preamble;
+        eth_size = eee->transop.rev(&eee->transop,
+                                    eth_payload, psize - eee->transop.preamble,
+                                    payload, psize, pkt->srcMac);
+    } else {
+        eth_payload = decode_buf;
+        eth_size = eee->transop.rev(&eee->transop,
+                                    eth_payload, N2N_PKT_BUF_SIZE,
+                                    payload, psize, pkt->srcMac);
+        if((ssize_t)eth_size > 0) {
+            eee->stats.rx_payload_copy += eth_size;
+        }
+    }
+    if((ssize_t)eth_size <= 0) {
+        // Not decodable, for example it failed an integrity check
+        traceEvent(TRACE_DEBUG, "dropping undecodable payload from %s",
+                   macaddr_str(mac_buf, pkt->srcMac));
+        return -1;
+    }
     ++(eee->transop.rx_cnt); /* stats */
+    eee->stats.rx_payload++;
 
     /* decompress if necessary */
     size_t deflate_len;
@@ -1958,14 +2104,14 @@ static int handle_PACKET (struct n3n_runtime_data * eee,
         case N2N_COMPRESSION_ID_LZO:
             deflate_len = eee->transop_lzo.rev(&eee->transop_lzo,
                                                deflate_buf, N2N_PKT_BUF_SIZE,
-                                               decode_buf, eth_size, pkt->srcMac);
+                                               eth_payload, eth_size, pkt->srcMac);
             break;
 
 #ifdef HAVE_LIBZSTD
         case N2N_COMPRESSION_ID_ZSTD:
             deflate_len = eee->transop_zstd.rev(&eee->transop_zstd,
                                                 deflate_buf, N2N_PKT_BUF_SIZE,
-                                                decode_buf, eth_size, pkt->srcMac);
+                                                eth_payload, eth_size, pkt->srcMac);
             break;
 #endif
         default:
@@ -2025,18 +2171,7 @@ static int handle_PACKET (struct n3n_runtime_data * eee,
 
 #ifdef HAVE_BRIDGING_SUPPORT
     if((eee->conf.allow_routing) && (!is_multi_broadcast(eh->shost))) {
-        struct host_info *host = NULL;
-
-        HASH_FIND(hh, eee->known_hosts, eh->shost, sizeof(n2n_mac_t), host);
-        if(host == NULL) {
-            host = calloc(1, sizeof(struct host_info));
-            // TODO: alloc() on the packet path can cause bad latency
-
-            memcpy(host->mac_addr, eh->shost, sizeof(n2n_mac_t));
-            HASH_ADD(hh, eee->known_hosts, mac_addr, sizeof(n2n_mac_t), host);
-        }
-        memcpy(host->edge_addr, pkt->srcMac, sizeof(n2n_mac_t));
-        host->last_seen = now;
+        n3n_hosttable_seen(eee->known_hosts, eh->shost, pkt->srcMac, now);
     }
 #endif
 
@@ -2194,11 +2329,13 @@ static int find_peer_destination (struct n3n_runtime_data * eee,
 /* ***************************************************** */
 
 /** Send an ecapsulated ethernet PACKET to a destination edge or broadcast MAC
- *    address. */
+ *    address.  See sendto_fd() for header and frame */
 static int send_packet (struct n3n_runtime_data * eee,
                         n2n_mac_t dstMac,
-                        const uint8_t * pktbuf,
-                        size_t pktlen) {
+                        uint8_t * pktbuf,
+                        size_t pktlen,
+                        const struct n3n_txqueue_header *header,
+                        struct n3n_pktbuf *frame) {
 
     int is_p2p;
     /*ssize_t s; */
@@ -2223,41 +2360,36 @@ static int send_packet (struct n3n_runtime_data * eee,
 
         // if no supernode around, foward the broadcast to all known peers
         if(eee->sn_wait) {
+            // the same buffer is sent to each, so encrypt it only once
+            if(header) {
+                packet_header_encrypt(pktbuf, header->len, pktlen, header->ctx, header->ctx_iv, header->stamp);
+            }
             HASH_ITER(hh, eee->known_peers, peer, tmp_peer) {
-                sendto_sock(eee, pktbuf, pktlen, &peer->sock);
+                sendto_sock(eee, pktbuf, pktlen, NULL, frame, &peer->sock);
             }
             return 0;
         }
         // fall through otherwise
     }
 
-    sendto_sock(eee, pktbuf, pktlen, &destination);
+    sendto_sock(eee, pktbuf, pktlen, header, frame, &destination);
 
     return 0;
 }
 
 /* ************************************** */
 
-/** A layer-2 packet was received at the tunnel and needs to be sent via UDP. */
-/** Encode an ethernet frame into an n3n PDU.
+/** Decide where an ethernet frame from the tunnel should be sent.
  *
- * Returns the number of bytes written to pktbuf, or 0 if the packet was
- * discarded by policy (e.g. routing rules).  out_destMac receives the n3n
- * destination MAC that should be used to route the PDU.
+ * Returns false if the packet is discarded by policy (e.g. routing rules).
+ * out_destMac receives the n3n destination MAC that should be used to route
+ * the PDU.
  */
-size_t edge_encode_packet (struct n3n_runtime_data *eee,
-                           uint8_t *tap_pkt, size_t len,
-                           uint8_t *pktbuf, size_t pktbuf_size,
+bool edge_tap_destination (struct n3n_runtime_data *eee,
+                           const uint8_t *tap_pkt,
                            n2n_mac_t out_destMac) {
 
     ipstr_t ip_buf;
-    n2n_common_t cmn;
-    n2n_PACKET_t pkt;
-    uint8_t *enc_src = tap_pkt;
-    size_t enc_len = len;
-    uint8_t compression_buf[N2N_PKT_BUF_SIZE];
-    size_t idx = 0;
-    n2n_transform_t tx_transop_idx = eee->transop.transform_id;
     ether_hdr_t eh;
 
     /* tap_pkt is not aligned so we have to copy to aligned memory */
@@ -2274,7 +2406,7 @@ size_t edge_encode_packet (struct n3n_runtime_data *eee,
                 /* This is a packet that needs to be routed */
                 traceEvent(TRACE_INFO, "discarding routed packet destined to [%s]",
                            intoa(ntohl(*src), ip_buf, sizeof(ip_buf)));
-                return 0;
+                return false;
             } else {
                 /* This packet is originated by us */
                 /* traceEvent(TRACE_INFO, "Sending non-routed packet"); */
@@ -2282,44 +2414,80 @@ size_t edge_encode_packet (struct n3n_runtime_data *eee,
         }
     }
 
-    /* Optionally compress then apply transforms, eg encryption. */
-
-    /* Once processed, send to destination in PACKET */
-
     memcpy(out_destMac, eh.dhost, N2N_MAC_SIZE);
 #ifdef HAVE_BRIDGING_SUPPORT
     /* find the destMac behind which edge, and change dest to this edge */
     if((eee->conf.allow_routing) && (!is_multi_broadcast(out_destMac))) {
-        struct host_info *host = NULL;
-        HASH_FIND(hh, eee->known_hosts, out_destMac, sizeof(n2n_mac_t), host);
+        struct host_info *host = n3n_hosttable_find(eee->known_hosts, out_destMac);
         if(host) {
             memcpy(out_destMac, host->edge_addr, N2N_MAC_SIZE);
         }
     }
 #endif
 
-    cmn.ttl = N2N_DEFAULT_TTL;
-    cmn.pc = MSG_TYPE_PACKET;
-    cmn.flags = 0; /* no options, not from supernode, no socket */
-    memcpy(cmn.community, eee->conf.community_name, N2N_COMMUNITY_SIZE);
+    return true;
+}
+
+
+/** Fill out the PACKET header fields for a frame read from the TAP interface */
+static void edge_init_PACKET (struct n3n_runtime_data *eee,
+                              n2n_trans_op_t *transop,
+                              const n2n_mac_t destMac,
+                              n2n_common_t *cmn,
+                              n2n_PACKET_t *pkt) {
+
+    cmn->ttl = N2N_DEFAULT_TTL;
+    cmn->pc = MSG_TYPE_PACKET;
+    cmn->flags = 0; /* no options, not from supernode, no socket */
+    memcpy(cmn->community, eee->conf.community_name, N2N_COMMUNITY_SIZE);
+
+    memcpy(pkt->srcMac, eee->device.mac_addr, N2N_MAC_SIZE);
+    memcpy(pkt->dstMac, destMac, N2N_MAC_SIZE);
+
+    pkt->transform = transop->transform_id;
+    pkt->compression = N2N_COMPRESSION_ID_NONE;
+}
+
+
+/** Compress and transform an ethernet frame into the payload of a PACKET.
+ *
+ * This only reads the edge configuration and the given transops, so it can
+ * run without holding the edge lock.  Returns the number of bytes written to
+ * pktbuf, with the length of the PACKET header stored in out_header_len.
+ */
+size_t edge_encode_payload (struct n3n_runtime_data *eee,
+                            n2n_trans_op_t *transop,
+                            n2n_trans_op_t *transop_lzo,
+                            n2n_trans_op_t *transop_zstd,
+                            uint8_t *tap_pkt, size_t len,
+                            const n2n_mac_t destMac,
+                            uint8_t *pktbuf, size_t pktbuf_size,
+                            uint16_t *out_header_len) {
+
+    n2n_common_t cmn;
+    n2n_PACKET_t pkt;
+    uint8_t *enc_src = tap_pkt;
+    size_t enc_len = len;
+    uint8_t compression_buf[N2N_PKT_BUF_SIZE];
+    size_t idx = 0;
+    n2n_transform_t tx_transop_idx = transop->transform_id;
 
-    memcpy(pkt.srcMac, eee->device.mac_addr, N2N_MAC_SIZE);
-    memcpy(pkt.dstMac, out_destMac, N2N_MAC_SIZE);
+    /* Optionally compress then apply transforms, eg encryption. */
 
-    pkt.transform = tx_transop_idx;
+    /* Once processed, send to destination in PACKET */
 
     // compression needs to be tried before encode_PACKET is called for compression indication gets encoded there
-    pkt.compression = N2N_COMPRESSION_ID_NONE;
+    edge_init_PACKET(eee, transop, destMac, &cmn, &pkt);
 
     if(eee->conf.compression) {
         int32_t compression_len;
 
         switch(eee->conf.compression) {
             case N2N_COMPRESSION_ID_LZO:
-                compression_len = eee->transop_lzo.fwd(&eee->transop_lzo,
-                                                       compression_buf, sizeof(compression_buf),
-                                                       tap_pkt, len,
-                                                       pkt.dstMac);
+                compression_len = transop_lzo->fwd(transop_lzo,
+                                                   compression_buf, sizeof(compression_buf),
+                                                   tap_pkt, len,
+                                                   pkt.dstMac);
 
                 if((compression_len > 0) && (compression_len < len)) {
                     pkt.compression = N2N_COMPRESSION_ID_LZO;
@@ -2328,10 +2496,10 @@ size_t edge_encode_packet (struct n3n_runtime_data *eee,
 
 #ifdef HAVE_LIBZSTD
             case N2N_COMPRESSION_ID_ZSTD:
-                compression_len = eee->transop_zstd.fwd(&eee->transop_zstd,
-                                                        compression_buf, sizeof(compression_buf),
-                                                        tap_pkt, len,
-                                                        pkt.dstMac);
+                compression_len = transop_zstd->fwd(transop_zstd,
+                                                    compression_buf, sizeof(compression_buf),
+                                                    tap_pkt, len,
+                                                    pkt.dstMac);
 
                 if((compression_len > 0) && (compression_len < len)) {
                     pkt.compression = N2N_COMPRESSION_ID_ZSTD;
@@ -2355,20 +2523,152 @@ size_t edge_encode_packet (struct n3n_runtime_data *eee,
     idx = 0;
     encode_PACKET(pktbuf, &idx, &cmn, &pkt);
 
-    uint16_t headerIdx = idx;
+    *out_header_len = idx;
 
-    idx += eee->transop.fwd(&eee->transop,
-                            pktbuf + idx, pktbuf_size - idx,
-                            enc_src, enc_len, pkt.dstMac);
+    idx += transop->fwd(transop,
+                        pktbuf + idx, pktbuf_size - idx,
+                        enc_src, enc_len, pkt.dstMac);
 
     traceEvent(TRACE_DEBUG, "encode PACKET of %u bytes, %u bytes data, %u bytes overhead, transform %u",
                (u_int)idx, (u_int)len, (u_int)(idx - len), tx_transop_idx);
 
-    if(eee->conf.header_encryption == HEADER_ENCRYPTION_ENABLED)
+    return idx;
+}
+
+
+/** Start encoding the ethernet frame held in a pktbuf into a PACKET, in place.
+ *
+ * The PACKET header is encoded into header, the preamble is prepended into
+ * the headroom and vec is filled in for the transform to work on the frame
+ * where it lies.  Returns false, leaving the frame untouched, if the
+ * transform or the compression settings need a separate output buffer.
+ */
+static bool edge_encode_inplace_start (struct n3n_runtime_data *eee,
+                                       struct n3n_pktbuf *frame,
+                                       const n2n_mac_t destMac,
+                                       uint8_t *header,
+                                       size_t *header_len,
+                                       struct n2n_trans_vec *vec) {
+
+    n2n_trans_op_t *transop = &eee->transop;
+    n2n_common_t cmn;
+    n2n_PACKET_t pkt;
+
+    if(!transop->inplace) {
+        return false;
+    }
+    if(eee->conf.compression != N2N_COMPRESSION_ID_NONE) {
+        return false;
+    }
+
+    *header_len = 0;
+    edge_init_PACKET(eee, transop, destMac, &cmn, &pkt);
+    encode_PACKET(header, header_len, &cmn, &pkt);
+
+    if(n3n_pktbuf_getheadroom(frame) < *header_len + transop->preamble) {
+        return false;
+    }
+
+    vec->inbuf = n3n_pktbuf_getbufptr(frame);
+    vec->in_len = n3n_pktbuf_getbufsize(frame);
+
+    n3n_pktbuf_prepend(frame, transop->preamble);
+    vec->outbuf = n3n_pktbuf_getbufptr(frame);
+    vec->out_len = n3n_pktbuf_getbufsize(frame) + n3n_pktbuf_getbufavail(frame);
+
+    return true;
+}
+
+/** Finish encoding a PACKET in place, once the transform has been run
+ *
+ * Returns the length of the PACKET header, or -1 if the transform failed.
+ */
+static int edge_encode_inplace_finish (struct n3n_pktbuf *frame,
+                                       const uint8_t *header,
+                                       size_t header_len,
+                                       int enc_len) {
+
+    if(enc_len < 0) {
+        return -1;
+    }
+    frame->offset_end = frame->offset_start + enc_len;
+
+    n3n_pktbuf_prepend(frame, header_len);
+    memcpy(n3n_pktbuf_getbufptr(frame), header, header_len);
+
+    traceEvent(TRACE_DEBUG, "encode PACKET of %u bytes in place, %u bytes encoded data",
+               (u_int)n3n_pktbuf_getbufsize(frame), (u_int)enc_len);
+
+    return header_len;
+}
+
+/** Encode the ethernet frame held in a pktbuf into a PACKET, in place.
+ *
+ * The transform works on the frame where it lies and the PACKET header is
+ * prepended into the headroom, so no payload bytes are copied.  Returns the
+ * length of the PACKET header, zero if the transform or the compression
+ * settings need a separate output buffer (leaving the frame untouched), or
+ * -1 if the transform failed.
+ */
+static int edge_encode_inplace (struct n3n_runtime_data *eee,
+                                struct n3n_pktbuf *frame,
+                                const n2n_mac_t destMac) {
+
+    n2n_trans_op_t *transop = &eee->transop;
+    uint8_t header[N3N_PKTBUF_HEADROOM];
+    size_t header_len;
+    struct n2n_trans_vec vec;
+
+    if(!edge_encode_inplace_start(eee, frame, destMac, header, &header_len, &vec)) {
+        return 0;
+    }
+
+    int enc_len = transop->fwd(
+        transop,
+        vec.outbuf,
+        vec.out_len,
+        vec.inbuf,
+        vec.in_len,
+        destMac
+    );
+
+    return edge_encode_inplace_finish(frame, header, header_len, enc_len);
+}
+
+
+/** Apply the header encryption to an encoded PACKET
+ *
+ * copied is the number of payload bytes that had to be moved to a separate
+ * buffer while encoding, for the stats
+ *
+ * If deferred is not NULL, the header encryption is only described in it,
+ * so that the send can do it along with that of other packets.  Returns the
+ * header encryption still to be done, or NULL if there is none.
+ */
+static const struct n3n_txqueue_header *edge_encode_header (struct n3n_runtime_data *eee,
+                                                            uint8_t *pktbuf,
+                                                            uint16_t headerIdx,
+                                                            size_t idx,
+                                                            size_t copied,
+                                                            struct n3n_txqueue_header *deferred) {
+
+    struct n3n_txqueue_header header;
+
+    if(eee->conf.header_encryption == HEADER_ENCRYPTION_ENABLED) {
         // in case of user-password auth, also encrypt the iv of payload assuming ChaCha20 and SPECK having the same iv size
-        packet_header_encrypt(pktbuf, headerIdx + (NULL != eee->conf.shared_secret) * MIN(idx - headerIdx, N2N_SPECK_IVEC_SIZE), idx,
-                              eee->conf.header_encryption_ctx_dynamic, eee->conf.header_iv_ctx_dynamic,
-                              time_stamp());
+        header.len = headerIdx + (NULL != eee->conf.shared_secret) * MIN(idx - headerIdx, N2N_SPECK_IVEC_SIZE);
+        header.ctx = eee->conf.header_encryption_ctx_dynamic;
+        header.ctx_iv = eee->conf.header_iv_ctx_dynamic;
+        header.stamp = time_stamp();
+
+        if(deferred) {
+            *deferred = header;
+        } else {
+            packet_header_encrypt(pktbuf, header.len, idx, header.ctx, header.ctx_iv, header.stamp);
+        }
+    } else {
+        deferred = NULL;
+    }
 
 #ifdef MTU_ASSERT_VALUE
     {
@@ -2380,6 +2680,46 @@ size_t edge_encode_packet (struct n3n_runtime_data *eee,
 #endif
 
     eee->transop.tx_cnt++; /* stats */
+    eee->stats.tx_payload++;
+    eee->stats.tx_payload_copy += copied;
+
+    return deferred;
+}
+
+
+/** A layer-2 packet was received at the tunnel and needs to be sent via UDP. */
+/** Encode an ethernet frame into an n3n PDU.
+ *
+ * Returns the number of bytes written to pktbuf, or 0 if the packet was
+ * discarded by policy (e.g. routing rules).  out_destMac receives the n3n
+ * destination MAC that should be used to route the PDU.
+ */
+size_t edge_encode_packet (struct n3n_runtime_data *eee,
+                           uint8_t *tap_pkt, size_t len,
+                           uint8_t *pktbuf, size_t pktbuf_size,
+                           n2n_mac_t out_destMac) {
+
+    uint16_t headerIdx;
+    size_t idx;
+
+    if(!edge_tap_destination(eee, tap_pkt, out_destMac)) {
+        return 0;
+    }
+
+    idx = edge_encode_payload(
+        eee,
+        &eee->transop,
+        &eee->transop_lzo,
+        &eee->transop_zstd,
+        tap_pkt,
+        len,
+        out_destMac,
+        pktbuf,
+        pktbuf_size,
+        &headerIdx
+    );
+
+    edge_encode_header(eee, pktbuf, headerIdx, idx, idx - headerIdx, NULL);
 
     return idx;
 }
@@ -2392,58 +2732,391 @@ void edge_send_packet2net (struct n3n_runtime_data * eee,
 
     size_t idx = edge_encode_packet(eee, tap_pkt, len, pktbuf, sizeof(pktbuf), destMac);
     if(idx) {
-        send_packet(eee, destMac, pktbuf, idx); /* to peer or supernode */
+        send_packet(eee, destMac, pktbuf, idx, NULL, NULL); /* to peer or supernode */
     }
 }
 
-/* ************************************** */
+/** Send a PACKET prepared by edge_encode_payload() from outside the mainloop */
+void edge_send_encoded (struct n3n_runtime_data *eee,
+                        n2n_mac_t destMac,
+                        uint8_t *pktbuf,
+                        uint16_t headerIdx,
+                        size_t idx) {
 
-/** Read a single packet from the TAP interface, process it and write out the
- *    corresponding packet to the cooked socket.
+    struct n3n_txqueue_header deferred;
+    const struct n3n_txqueue_header *header;
+
+    header = edge_encode_header(eee, pktbuf, headerIdx, idx, idx - headerIdx, &deferred);
+    send_packet(eee, destMac, pktbuf, idx, header, NULL); /* to peer or supernode */
+}
+
+/** Encode an ethernet frame into a separate buffer and send it, for the
+ * transforms that cannot work in place
  */
-void edge_read_from_tap (struct n3n_runtime_data * eee) {
+static void edge_send_copied (struct n3n_runtime_data *eee,
+                              n2n_mac_t destMac,
+                              uint8_t *eth_pkt,
+                              size_t len) {
 
-    /* tun -> remote */
-    uint8_t eth_pkt[N2N_PKT_BUF_SIZE];
-    macstr_t mac_buf;
-    ssize_t len;
+    uint8_t pktbuf[N2N_PKT_BUF_SIZE];
+    uint16_t payloadIdx;
+    size_t idx = edge_encode_payload(
+        eee,
+        &eee->transop,
+        &eee->transop_lzo,
+        &eee->transop_zstd,
+        eth_pkt,
+        len,
+        destMac,
+        pktbuf,
+        sizeof(pktbuf),
+        &payloadIdx
+    );
+    edge_send_encoded(eee, destMac, pktbuf, payloadIdx, idx);
+}
 
-    len = tuntap_read( &(eee->device), eth_pkt, N2N_PKT_BUF_SIZE );
-    if((len <= 0) || (len > N2N_PKT_BUF_SIZE)) {
-        // TODO:
-        // - how often does this actually happen
-        // - why does it happen
-        // - can we just remove this special case?
-        traceEvent(
-            TRACE_WARNING,
-            "read()=%d [%d/%s]",
-            len,
-            errno,
-            strerror(errno)
-        );
-        traceEvent(TRACE_WARNING, "TAP I/O operation aborted, restart later.");
-        eee->stats.tx_tuntap_error++;
+/** Send the ethernet frame held in a pktbuf, encoding it in place if possible
+ *
+ * reused is true when the caller builds the next frame in the same pktbuf,
+ * in which case the send has to copy the PACKET rather than hold on to it.
+ */
+static void edge_send_pktbuf2net (struct n3n_runtime_data *eee,
+                                  struct n3n_pktbuf *frame,
+                                  bool reused) {
 
-        sleep(3);
+    n2n_mac_t destMac;
+    uint8_t *eth_pkt = n3n_pktbuf_getbufptr(frame);
+    size_t len = n3n_pktbuf_getbufsize(frame);
+
+    if(!edge_tap_destination(eee, eth_pkt, destMac)) {
+        return;
+    }
+
+    int headerIdx = edge_encode_inplace(eee, frame, destMac);
+    if(headerIdx < 0) {
+        return;
+    }
+    if(headerIdx > 0) {
+        uint8_t *pktbuf = n3n_pktbuf_getbufptr(frame);
+        size_t idx = n3n_pktbuf_getbufsize(frame);
+
+        struct n3n_txqueue_header deferred;
+        const struct n3n_txqueue_header *header;
+
+        header = edge_encode_header(eee, pktbuf, headerIdx, idx, 0, &deferred);
+        send_packet(eee, destMac, pktbuf, idx, header, reused ? NULL : frame); /* to peer or supernode */
+        return;
+    }
+
+    edge_send_copied(eee, destMac, eth_pkt, len);
+}
+
+#ifdef __linux__
+/** Send a batch of ethernet frames held in pktbufs, encoding them in place
+ *
+ * The transform is run over all the frames at once, if it can do that.  The
+ * caller still holds its references to the frames and frees them after.
+ */
+static void edge_send_pktbufs2net (struct n3n_runtime_data *eee,
+                                   struct n3n_pktbuf **frames,
+                                   int count) {
+
+    n2n_trans_op_t *transop = &eee->transop;
+    struct n2n_trans_vec vec[N3N_TX_BATCH_SIZE];
+    struct n3n_pktbuf *batch[N3N_TX_BATCH_SIZE];
+    n2n_mac_t destMac[N3N_TX_BATCH_SIZE];
+    uint8_t header[N3N_TX_BATCH_SIZE][N3N_PKTBUF_HEADROOM];
+    size_t header_len[N3N_TX_BATCH_SIZE];
+    int nr = 0;
+
+    if(!transop->fwd_batch) {
+        for(int i = 0; i < count; i++) {
+            edge_send_pktbuf2net(eee, frames[i], false);
+        }
+        return;
+    }
+
+    for(int i = 0; i < count; i++) {
+        struct n3n_pktbuf *frame = frames[i];
+        uint8_t *eth_pkt = n3n_pktbuf_getbufptr(frame);
+        size_t len = n3n_pktbuf_getbufsize(frame);
+
+        if(!edge_tap_destination(eee, eth_pkt, destMac[nr])) {
+            continue;
+        }
+        if(!edge_encode_inplace_start(eee, frame, destMac[nr], header[nr], &header_len[nr], &vec[nr])) {
+            edge_send_copied(eee, destMac[nr], eth_pkt, len);
+            continue;
+        }
+        batch[nr++] = frame;
+    }
+
+    if(!nr) {
+        return;
+    }
+
+    transop->fwd_batch(transop, vec, nr);
+
+    for(int i = 0; i < nr; i++) {
+        struct n3n_pktbuf *frame = batch[i];
+
+        int headerIdx = edge_encode_inplace_finish(frame, header[i], header_len[i], vec[i].result);
+        if(headerIdx < 0) {
+            continue;
+        }
+
+        uint8_t *pktbuf = n3n_pktbuf_getbufptr(frame);
+        size_t idx = n3n_pktbuf_getbufsize(frame);
+
+        struct n3n_txqueue_header deferred;
+        const struct n3n_txqueue_header *hdr;
+
+        hdr = edge_encode_header(eee, pktbuf, headerIdx, idx, 0, &deferred);
+        send_packet(eee, destMac[i], pktbuf, idx, hdr, frame); /* to peer or supernode */
+    }
+}
+#endif
+
+/* ************************************** */
+
+/** Recover from a failed read of the TAP interface by reopening it */
+static void edge_tap_read_error (struct n3n_runtime_data *eee, ssize_t len) {
+
+    // TODO:
+    // - how often does this actually happen
+    // - why does it happen
+    // - can we just remove this special case?
+    traceEvent(
+        TRACE_WARNING,
+        "read()=%d [%d/%s]",
+        len,
+        errno,
+        strerror(errno)
+    );
+    traceEvent(TRACE_WARNING, "TAP I/O operation aborted, restart later.");
+    eee->stats.tx_tuntap_error++;
+
+    sleep(3);
 #ifndef _WIN32
-        mainloop_unregister_fd(eee->device.fd);
+    mainloop_unregister_fd(eee->device.fd);
 #endif
-        tuntap_close(&(eee->device));
-        tuntap_open(&(eee->device),
-                    eee->conf.tuntap_dev_name,
-                    eee->conf.tuntap_ip_mode,
-                    eee->conf.tuntap_v4,
-                    eee->conf.device_mac,
-                    eee->conf.mtu,
-                    eee->conf.metric
-        );
+    tuntap_close(&(eee->device));
+    tuntap_open(&(eee->device),
+                eee->conf.tuntap_dev_name,
+                eee->conf.tuntap_ip_mode,
+                eee->conf.tuntap_v4,
+                eee->conf.device_mac,
+                eee->conf.mtu,
+                eee->conf.metric
+    );
 #ifndef _WIN32
-        mainloop_register_fd(eee->device.fd, fd_info_proto_tuntap);
+    mainloop_register_fd(eee->device.fd, fd_info_proto_tuntap);
 #endif
+}
+
+#ifdef __linux__
+struct tap_segment_ctx {
+    struct n3n_runtime_data *eee;
+    uint8_t *seg_buf;           // where to build a segment without a pktbuf
+    struct n3n_pktbuf *frame;   // holds the segment being built, if not NULL
+    struct n3n_pktbuf *batch[N3N_TX_BATCH_SIZE];   // segments not yet sent
+    int count;
+};
+
+/** Send the segments collected so far */
+static void edge_tap_segment_flush (struct tap_segment_ctx *ctx) {
+    edge_send_pktbufs2net(ctx->eee, ctx->batch, ctx->count);
+
+    for(int i = 0; i < ctx->count; i++) {
+        n3n_pktbuf_free(ctx->batch[i]);
+    }
+    ctx->count = 0;
+}
+
+/** Find where to build the next segment, in a fresh pktbuf if there is one */
+static uint8_t *edge_tap_segment_next (struct tap_segment_ctx *ctx) {
+    ctx->frame = n3n_pktbuf_alloc(N2N_PKT_BUF_SIZE);
+    if(!ctx->frame && ctx->count) {
+        // The pool may only be short of the buffers we are holding
+        edge_tap_segment_flush(ctx);
+        ctx->frame = n3n_pktbuf_alloc(N2N_PKT_BUF_SIZE);
+    }
+    if(!ctx->frame) {
+        return ctx->seg_buf;
+    }
+
+    ctx->frame->owner = n3n_pktbuf_owner_tx_tap;
+    n3n_pktbuf_reserve(ctx->frame, N3N_PKTBUF_HEADROOM);
+    return n3n_pktbuf_getbufptr(ctx->frame);
+}
+
+/** Collect one frame split from a GSO frame read from the TAP interface
+ *
+ * The segments are sent in batches, so that the transform can encrypt
+ * them all at once.
+ */
+static uint8_t *edge_tap_segment (void *arg, uint8_t *seg, size_t len) {
+    struct tap_segment_ctx *ctx = arg;
+    struct n3n_runtime_data *eee = ctx->eee;
+
+    if(!edge_tap_frame_wanted(eee, seg, len)) {
+        return seg;
+    }
+
+    if(!ctx->frame) {
+        // Keep the segments in order
+        if(ctx->count) {
+            edge_tap_segment_flush(ctx);
+        }
+        edge_send_packet2net(eee, seg, len);
+        return edge_tap_segment_next(ctx);
+    }
+
+    n3n_pktbuf_append(ctx->frame, len, NULL);
+    ctx->batch[ctx->count++] = ctx->frame;
+    ctx->frame = NULL;
+
+    if(ctx->count == N3N_TX_BATCH_SIZE) {
+        edge_tap_segment_flush(ctx);
+    }
+    return edge_tap_segment_next(ctx);
+}
+
+/** Read a frame from a TAP interface opened with the offloads enabled */
+static void edge_read_from_tap_vnet (struct n3n_runtime_data *eee) {
+    uint8_t eth_buf[N2N_PKT_BUF_SIZE];
+    uint8_t seg_buf[N2N_PKT_BUF_SIZE];
+    uint8_t *eth_pkt = eth_buf;
+    uint8_t *seg_pkt = seg_buf;
+    size_t eth_size = sizeof(eth_buf);
+    size_t seg_size = sizeof(seg_buf);
+    struct n3n_pktbuf *frame;
+    struct tap_segment_ctx ctx = {
+        .eee = eee,
+        .seg_buf = seg_buf,
+    };
+
+    frame = n3n_pktbuf_alloc(N2N_PKT_BUF_SIZE);
+    if(frame) {
+        frame->owner = n3n_pktbuf_owner_tx_tap;
+        n3n_pktbuf_reserve(frame, N3N_PKTBUF_HEADROOM);
+        eth_pkt = n3n_pktbuf_getbufptr(frame);
+        eth_size = n3n_pktbuf_getbufavail(frame);
+    }
+
+    ssize_t len = n3n_vnet_read(eee->device.vnet, eee->device.fd, eth_pkt, eth_size);
+    if(len <= 0) {
+        if(frame) {
+            n3n_pktbuf_free(frame);
+        }
+        edge_tap_read_error(eee, len);
+        return;
+    }
+
+    // Build the segments of a GSO frame in pktbufs of their own, if there
+    // are any.  Each may end up in either, so must fit both
+    seg_pkt = edge_tap_segment_next(&ctx);
+    if(ctx.frame) {
+        seg_size = MIN(seg_size, n3n_pktbuf_getbufavail(ctx.frame));
+    }
+
+    int nr = n3n_vnet_segment(
+        eee->device.vnet,
+        eth_pkt,
+        len,
+        seg_pkt,
+        seg_size,
+        edge_tap_segment,
+        &ctx
+    );
+
+    if(nr == 0 && edge_tap_frame_wanted(eee, eth_pkt, len)) {
+        if(frame) {
+            n3n_pktbuf_append(frame, len, NULL);
+            edge_send_pktbuf2net(eee, frame, false);
+        } else {
+            edge_send_packet2net(eee, eth_pkt, len);
+        }
+    }
+
+    if(ctx.count) {
+        edge_tap_segment_flush(&ctx);
+    }
+    if(ctx.frame) {
+        n3n_pktbuf_free(ctx.frame);
+    }
+    if(frame) {
+        n3n_pktbuf_free(frame);
+    }
+}
+#endif
+
+/** Read a single packet from the TAP interface, process it and write out the
+ *    corresponding packet to the cooked socket.
+ */
+void edge_read_from_tap (struct n3n_runtime_data * eee) {
+
+    /* tun -> remote */
+    uint8_t eth_buf[N2N_PKT_BUF_SIZE];
+    uint8_t *eth_pkt = eth_buf;
+    ssize_t eth_size = sizeof(eth_buf);
+    struct n3n_pktbuf *frame = NULL;
+    ssize_t len;
+
+#ifdef __linux__
+    if(eee->device.vnet) {
+        edge_read_from_tap_vnet(eee);
+        return;
+    }
+#endif
+
+#ifndef _WIN32
+    // Read the frame behind some headroom, so that it can be turned into a
+    // PACKET without copying it.  (The windows tap reader runs on its own
+    // thread, so cannot use the pool)
+    frame = n3n_pktbuf_alloc(N2N_PKT_BUF_SIZE);
+    if(frame) {
+        frame->owner = n3n_pktbuf_owner_tx_tap;
+        n3n_pktbuf_reserve(frame, N3N_PKTBUF_HEADROOM);
+        eth_pkt = n3n_pktbuf_getbufptr(frame);
+        eth_size = n3n_pktbuf_getbufavail(frame);
+    }
+#endif
+
+    len = tuntap_read( &(eee->device), eth_pkt, eth_size );
+    if((len <= 0) || (len > N2N_PKT_BUF_SIZE)) {
+        if(frame) {
+            n3n_pktbuf_free(frame);
+        }
+        edge_tap_read_error(eee, len);
         return;
+    }
 
+    if(!frame) {
+        if(edge_tap_frame_wanted(eee, eth_pkt, len)) {
+            edge_send_packet2net(eee, eth_pkt, len);
+        }
+        return;
     }
 
+    n3n_pktbuf_append(frame, len, NULL);
+    if(edge_tap_frame_wanted(eee, eth_pkt, len)) {
+        edge_send_pktbuf2net(eee, frame, false);
+    }
+    n3n_pktbuf_free(frame);
+}
+
+
+/** Check the policy for a frame read from the TAP interface
+ *
+ * Returns false if the frame should be dropped
+ */
+bool edge_tap_frame_wanted (struct n3n_runtime_data *eee,
+                            uint8_t *eth_pkt,
+                            size_t len) {
+
+    macstr_t mac_buf;
+
     const uint8_t * mac = eth_pkt;
     traceEvent(TRACE_DEBUG, "Rx TAP packet (%4d) for %s",
                (signed int)len, macaddr_str(mac_buf, mac));
@@ -2453,37 +3126,45 @@ void edge_read_from_tap (struct n3n_runtime_data * eee) {
         is_ethMulticast(eth_pkt, len))) {
         traceEvent(TRACE_INFO, "dropping Tx multicast");
         eee->stats.tx_multicast_drop++;
-        return;
+        return false;
     }
 
     if(!eee->last_sup) {
         // drop packets before first registration with supernode
         traceEvent(TRACE_DEBUG, "DROP packet before first registration with supernode");
-        return;
+        return false;
     }
 
     if(eee->network_traffic_filter) {
         if(eee->network_traffic_filter->filter_packet_from_tap(eee->network_traffic_filter, eee, eth_pkt,
                                                                len) == N2N_DROP) {
             traceEvent(TRACE_DEBUG, "filtered packet of size %u", (unsigned int)len);
-            return;
+            return false;
         }
     }
 
-    edge_send_packet2net(eee, eth_pkt, len);
+    return true;
 }
 
 
 /* ************************************** */
 
 
-/** handle a datagram from the main UDP socket to the internet. */
-void process_pdu (struct n3n_runtime_data *eee,
-                  const struct sockaddr *sender_sock,
-                  const SOCKET in_sock,
-                  uint8_t *udp_buf,
-                  size_t udp_size,
-                  time_t now
+/** handle a datagram from the main UDP socket to the internet.
+ *
+ * If decrypted_stamp is not NULL, the header has already been decrypted
+ * with the dynamic key, giving that time stamp.  If decoded is not NULL, the
+ * payload of the PACKET has already been decrypted in place, giving that
+ * length.
+ */
+static void process_pdu_stamped (struct n3n_runtime_data *eee,
+                                 const struct sockaddr *sender_sock,
+                                 const SOCKET in_sock,
+                                 uint8_t *udp_buf,
+                                 size_t udp_size,
+                                 const uint64_t *decrypted_stamp,
+                                 const ssize_t *decoded,
+                                 time_t now
 ) {
 
     n2n_common_t cmn;          /* common fields in the packet header */
@@ -2533,7 +3214,10 @@ void process_pdu (struct n3n_runtime_data *eee,
     if(eee->conf.header_encryption == HEADER_ENCRYPTION_ENABLED) {
         // match with static (1) or dynamic (2) ctx?
         // check dynamic first as it is identical to static in normal header encryption mode
-        if(packet_header_decrypt(udp_buf, udp_size,
+        if(decrypted_stamp) {
+            stamp = *decrypted_stamp;
+            header_enc = 2;
+        } else if(packet_header_decrypt(udp_buf, udp_size,
                                  (char *)eee->conf.community_name,
                                  eee->conf.header_encryption_ctx_dynamic, eee->conf.header_iv_ctx_dynamic,
                                  &stamp)) {
@@ -2668,7 +3352,7 @@ void process_pdu (struct n3n_runtime_data *eee,
                                            from_supernode ? N2N_FORWARDED_REG_COOKIE : N2N_REGULAR_REG_COOKIE,
                                            NULL, NULL, orig_sender);
 
-            handle_PACKET(eee, from_supernode, &pkt, orig_sender, udp_buf + idx, udp_size - idx);
+            handle_PACKET(eee, from_supernode, &pkt, orig_sender, udp_buf + idx, udp_size - idx, decoded);
             break;
         }
 
@@ -3057,6 +3741,7 @@ void process_pdu (struct n3n_runtime_data *eee,
             traceEvent(TRACE_INFO, "Rx RE_REGISTER_SUPER");
 
             eee->sn_wait = 2; /* immediately */
+            edge_sn_reg_schedule(eee, now);
 
             break;
         }
@@ -3068,6 +3753,17 @@ void process_pdu (struct n3n_runtime_data *eee,
     } /* switch(msg_type) */
 }
 
+/** handle a datagram from the main UDP socket to the internet. */
+void process_pdu (struct n3n_runtime_data *eee,
+                  const struct sockaddr *sender_sock,
+                  const SOCKET in_sock,
+                  uint8_t *udp_buf,
+                  size_t udp_size,
+                  time_t now
+) {
+    process_pdu_stamped(eee, sender_sock, in_sock, udp_buf, udp_size, NULL, NULL, now);
+}
+
 
 /* ************************************** */
 
@@ -3128,6 +3824,199 @@ void edge_read_proto3_udp (struct n3n_runtime_data *eee,
     return;
 }
 
+#ifdef __linux__
+/** Decrypt the payloads of a batch of received PACKETs all at once
+ *
+ * Only the PACKETs for our community, with a header we could already
+ * decrypt, that use our transform in place are taken: their decoded length
+ * is left in decoded[] and they are marked in taken[].  Everything else is
+ * left for handle_PACKET() to decrypt one by one.
+ */
+static void edge_decode_batch (struct n3n_runtime_data *eee,
+                               uint8_t **packet,
+                               const uint16_t *packet_len,
+                               const int *decrypted,
+                               int count,
+                               ssize_t *decoded,
+                               bool *taken) {
+
+    n2n_trans_op_t *transop = &eee->transop;
+    struct n2n_trans_vec vec[N3N_RX_BATCH_SIZE];
+    int index[N3N_RX_BATCH_SIZE];
+    int nr = 0;
+
+    for(int i = 0; i < count; i++) {
+        taken[i] = false;
+    }
+    if(!transop->rev_batch || !transop->inplace) {
+        return;
+    }
+
+    for(int i = 0; i < count; i++) {
+        n2n_common_t cmn;
+        n2n_PACKET_t pkt;
+        size_t rem = packet_len[i];
+        size_t idx = 0;
+
+        if((eee->conf.header_encryption == HEADER_ENCRYPTION_ENABLED) && !decrypted[i]) {
+            continue;
+        }
+        if(decode_common(&cmn, packet[i], &rem, &idx) < 0) {
+            continue;
+        }
+        if(cmn.pc != MSG_TYPE_PACKET) {
+            continue;
+        }
+        if(memcmp(cmn.community, eee->conf.community_name, N2N_COMMUNITY_SIZE)) {
+            continue;
+        }
+        if(decode_PACKET(&pkt, &cmn, packet[i], &rem, &idx) < 0) {
+            continue;
+        }
+        if(pkt.transform != eee->conf.transop_id) {
+            continue;
+        }
+
+        size_t psize = packet_len[i] - idx;
+        if(psize < transop->preamble) {
+            continue;
+        }
+
+        vec[nr].outbuf = packet[i] + idx + transop->preamble;
+        vec[nr].out_len = psize - transop->preamble;
+        vec[nr].inbuf = packet[i] + idx;
+        vec[nr].in_len = psize;
+        index[nr] = i;
+        nr++;
+    }
+
+    if(!nr) {
+        return;
+    }
+
+    transop->rev_batch(transop, vec, nr);
+
+    for(int j = 0; j < nr; j++) {
+        decoded[index[j]] = vec[j].result;
+        taken[index[j]] = true;
+    }
+}
+
+int edge_read_proto3_udp_batch (struct n3n_runtime_data *eee,
+                                SOCKET sock,
+                                struct n3n_pktbuf **pktbufs,
+                                int count,
+                                time_t now) {
+    struct sockaddr_storage sas[N3N_RX_BATCH_SIZE];
+    struct iovec iov[N3N_RX_BATCH_SIZE];
+    struct mmsghdr msgs[N3N_RX_BATCH_SIZE];
+
+    if(count > N3N_RX_BATCH_SIZE) {
+        count = N3N_RX_BATCH_SIZE;
+    }
+
+    memset(msgs, 0, sizeof(msgs));
+    for(int i = 0; i < count; i++) {
+        iov[i].iov_base = n3n_pktbuf_getbufptr(pktbufs[i]);
+        iov[i].iov_len = n3n_pktbuf_getbufavail(pktbufs[i]);
+        msgs[i].msg_hdr.msg_name = &sas[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(sas[i]);
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    // The socket was reported as readable, so we only take what is already
+    // queued and never block waiting to fill the batch
+    int nr = recvmmsg(sock, msgs, count, MSG_DONTWAIT, NULL);
+
+    if(nr < 0) {
+        if(errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        }
+
+        /* The fd is no good now. Maybe we lost our interface. */
+        traceEvent(TRACE_ERROR, "recvmmsg() failed %d errno %d (%s)", nr, errno, strerror(errno));
+        *eee->keep_running = false;
+        return 0;
+    }
+
+    uint8_t *packet[N3N_RX_BATCH_SIZE];
+    uint16_t packet_len[N3N_RX_BATCH_SIZE];
+    uint64_t stamp[N3N_RX_BATCH_SIZE];
+    int decrypted[N3N_RX_BATCH_SIZE];
+
+    for(int i = 0; i < nr; i++) {
+        struct n3n_pktbuf *pktbuf = pktbufs[i];
+        pktbuf->offset_end = pktbuf->offset_start + msgs[i].msg_len;
+
+        packet[i] = n3n_pktbuf_getbufptr(pktbuf);
+        packet_len[i] = n3n_pktbuf_getbufsize(pktbuf);
+        decrypted[i] = 0;
+    }
+
+    // Try the dynamic key on all the headers at once.  Any that it does
+    // not fit are left to process_pdu_stamped() to try both keys on, as it
+    // would for a single datagram
+    if(eee->conf.header_encryption == HEADER_ENCRYPTION_ENABLED) {
+        packet_header_decrypt_batch(packet, packet_len, nr,
+                                    (char *)eee->conf.community_name,
+                                    eee->conf.header_encryption_ctx_dynamic,
+                                    eee->conf.header_iv_ctx_dynamic,
+                                    stamp, decrypted);
+    }
+
+    ssize_t decoded[N3N_RX_BATCH_SIZE];
+    bool taken[N3N_RX_BATCH_SIZE];
+
+    edge_decode_batch(eee, packet, packet_len, decrypted, nr, decoded, taken);
+
+    uint32_t key_changes = eee->dynamic_key_changes;
+
+    for(int i = 0; i < nr; i++) {
+        if(msgs[i].msg_len == 0) {
+            /* For UDP bread of zero just means no data (unlike TCP). */
+            continue;
+        }
+
+        if(decrypted[i] && (eee->dynamic_key_changes != key_changes)) {
+            // An earlier packet of the batch changed the dynamic key.  This
+            // one only fits the old key, so would not have been accepted on
+            // its own either
+            traceEvent(TRACE_DEBUG, "dropped packet encrypted with the previous dynamic key");
+            continue;
+        }
+
+        process_pdu_stamped(
+            eee,
+            (struct sockaddr *)&sas[i],
+            sock,
+            packet[i],
+            packet_len[i],
+            decrypted[i] ? &stamp[i] : NULL,
+            taken[i] ? &decoded[i] : NULL,
+            now
+        );
+
+        if(!(*eee->keep_running)) {
+            // Something in this packet asked us to stop
+            return i + 1;
+        }
+    }
+
+    return nr;
+}
+#else
+int edge_read_proto3_udp_batch (struct n3n_runtime_data *eee,
+                                SOCKET sock,
+                                struct n3n_pktbuf **pktbufs,
+                                int count,
+                                time_t now) {
+    // No batched receive API available, so just read one datagram
+    edge_read_proto3_udp(eee, sock, pktbufs[0], now);
+    return 1;
+}
+#endif
+
 void edge_read_proto3_tcp (struct n3n_runtime_data *eee,
                            SOCKET sock,
                            uint8_t *pktbuf,
@@ -3144,12 +4033,14 @@ void edge_read_proto3_tcp (struct n3n_runtime_data *eee,
 #endif
         supernode_disconnect(eee);
         eee->sn_wait = 1;
+        edge_sn_reg_schedule(eee, now);
         return;
     }
 
     if(pktbuf_len > N2N_PKT_BUF_SIZE + 2) {
         supernode_disconnect(eee);
         eee->sn_wait = 1;
+        edge_sn_reg_schedule(eee, now);
         traceEvent(TRACE_DEBUG, "too many bytes expected");
         return;
     }
@@ -3186,8 +4077,8 @@ static void print_edge_stats (const struct n3n_runtime_data *eee) {
     );
     traceEvent(
         TRACE_INFO,
-        "  bridge known hosts: %i",
-        HASH_COUNT(eee->known_hosts)
+        "  bridge known hosts: %u",
+        eee->known_hosts ? eee->known_hosts->count : 0
     );
     traceEvent(
         TRACE_INFO,
@@ -3211,15 +4102,140 @@ static void print_edge_stats (const struct n3n_runtime_data *eee) {
 /* ************************************** */
 
 
+/* ************************************** */
+
+// The periodic duties of the edge, each run from its own mainloop timer
+
+static void edge_timer_sn_reg (struct n3n_timer *timer, time_t now) {
+    struct n3n_runtime_data *eee = timer->data;
+
+    update_supernode_reg(eee, now);
+    edge_sn_reg_schedule(eee, now);
+
+    if(eee->resolution_request) {
+        // Dont wait for the next regular check
+        mainloop_timer_add(&eee->timer_resolve, 0);
+    }
+}
+
+static void edge_timer_purge (struct n3n_timer *timer, time_t now) {
+    struct n3n_runtime_data *eee = timer->data;
+    size_t numPurged = 0;
+    time_t last_purge = 0; // The timer sets the pace
+
+    // keep, i.e. do not purge, the known peers while no supernode supernode connection
+    if(!eee->sn_wait)
+        numPurged = purge_expired_nodes(&eee->known_peers,
+                                        eee->sock, NULL,
+                                        &last_purge,
+                                        PURGE_REGISTRATION_FREQUENCY, REGISTRATION_TIMEOUT);
+    last_purge = 0;
+    numPurged += purge_expired_nodes(&eee->pending_peers,
+                                     eee->sock, NULL,
+                                     &last_purge,
+                                     PURGE_REGISTRATION_FREQUENCY, REGISTRATION_TIMEOUT);
+
+    if(numPurged > 0) {
+        traceEvent(
+            TRACE_INFO,
+            "%u peers removed. now: pending=%u, operational=%u",
+            numPurged,
+            HASH_COUNT(eee->pending_peers),
+            HASH_COUNT(eee->known_peers)
+        );
+    }
+
+    mainloop_timer_add(timer, PURGE_REGISTRATION_FREQUENCY * 1000);
+}
+
+#ifdef HAVE_BRIDGING_SUPPORT
+static void edge_timer_purge_hosts (struct n3n_timer *timer, time_t now) {
+    struct n3n_runtime_data *eee = timer->data;
+
+    n3n_hosttable_purge(eee->known_hosts, now - HOSTINFO_TIMEOUT);
+
+    mainloop_timer_add(timer, SWEEP_TIME * 1000);
+}
+#endif
+
+static void edge_timer_iface_check (struct n3n_timer *timer, time_t now) {
+    struct n3n_runtime_data *eee = timer->data;
+
+    // TODO:
+    // - a static ip address mode
+    // - a notifier so we dont need to poll for changes
+    // - ipv6 support
+    // - multi-homing support
+    traceEvent(TRACE_INFO, "re-checking dynamic IP address");
+    tuntap_get_address(&(eee->device));
+
+    mainloop_timer_add(timer, IFACE_UPDATE_INTERVAL * 1000);
+}
+
+static void edge_timer_sort_supernodes (struct n3n_timer *timer, time_t now) {
+    struct n3n_runtime_data *eee = timer->data;
+
+    sort_supernodes(eee, now);
+
+    // A change of supernode also restarts the registration
+    edge_sn_reg_schedule(eee, now);
+
+    mainloop_timer_add(timer, (SWEEP_TIME + 1) * 1000);
+}
+
+static void edge_timer_resolve (struct n3n_timer *timer, time_t now) {
+    struct n3n_runtime_data *eee = timer->data;
+
+    eee->resolution_request = resolve_check(
+        eee->resolve_parameter,
+        eee->resolution_request,
+        now,
+        NULL
+    );
+
+    if(eee->resolution_request) {
+        // This currently gets signaled in update_supernode_reg when a
+        // supernode is not responding
+        //
+        // TODO: update this once we have the new async resolving
+        if(resolve_hostnames_str_to_peer_info(
+               RESOLVE_LIST_SUPERNODE,
+               &eee->supernodes)) {
+            traceEvent(
+                TRACE_WARNING,
+                "resolve_hostnames_str_to_peer_info returned errors"
+            );
+        } else {
+            // No errors, so clear the request
+            eee->resolution_request = false;
+        }
+    }
+
+    // resolve_check() keeps its own, longer, interval between the checks
+    // of the resolver thread results
+    mainloop_timer_add(timer, N2N_RESOLVE_CHECK_INTERVAL / 10 * 1000);
+}
+
 int run_edge_loop (struct n3n_runtime_data *eee) {
 
-    size_t numPurged;
-    time_t lastIfaceCheck = 0;
-    time_t last_purge_known = 0;
-    time_t last_purge_pending = 0;
+    struct n3n_timer timer_purge = {
+        .func = edge_timer_purge,
+        .data = eee,
+    };
 #ifdef HAVE_BRIDGING_SUPPORT
-    time_t last_purge_host = 0;
+    struct n3n_timer timer_purge_hosts = {
+        .func = edge_timer_purge_hosts,
+        .data = eee,
+    };
 #endif
+    struct n3n_timer timer_iface_check = {
+        .func = edge_timer_iface_check,
+        .data = eee,
+    };
+    struct n3n_timer timer_sort_supernodes = {
+        .func = edge_timer_sort_supernodes,
+        .data = eee,
+    };
 
 #ifdef _WIN32
     struct tunread_arg arg;
@@ -3228,111 +4244,55 @@ int run_edge_loop (struct n3n_runtime_data *eee) {
 #endif
 
     *eee->keep_running = true;
-    update_supernode_reg(eee, time(NULL));
+
+    eee->timer_sn_reg.func = edge_timer_sn_reg;
+    eee->timer_sn_reg.data = eee;
+    eee->timer_resolve.func = edge_timer_resolve;
+    eee->timer_resolve.data = eee;
+
+    mainloop_clock_update();
+    edge_timer_sn_reg(&eee->timer_sn_reg, time(NULL));
+    mainloop_timer_add(&timer_purge, 0);
+#ifdef HAVE_BRIDGING_SUPPORT
+    if(eee->conf.allow_routing) {
+        mainloop_timer_add(&timer_purge_hosts, SWEEP_TIME * 1000);
+    }
+#endif
+    if(eee->conf.tuntap_ip_mode == TUNTAP_IP_MODE_DHCP) {
+        mainloop_timer_add(&timer_iface_check, 0);
+    }
+    mainloop_timer_add(&timer_sort_supernodes, 0);
+    mainloop_timer_add(&eee->timer_resolve, 0);
 
     edge_metrics_module1.data = &eee->stats;
     edge_metrics_module2.data = &eee->stats;
+    edge_metrics_module3.data = &eee->stats;
     n3n_metrics_register(&edge_metrics_module1);
     n3n_metrics_register(&edge_metrics_module2);
+    n3n_metrics_register(&edge_metrics_module3);
+
+    n3n_tapqueue_start(eee);
 
     /* Main loop
      *
-     * select() is used to wait for input on either the TAP fd or the UDP/TCP
-     * socket. When input is present the data is read and processed by either
-     * readFromIPSocket() or edge_read_from_tap()
+     * The mainloop waits for input on the TAP fd or the UDP/TCP sockets and
+     * for the next timer to be due, then handles whichever is ready
      */
 
     while(*eee->keep_running) {
         mainloop_runonce(eee);
+    } /* while */
 
-        // TODO:
-        // - migrate all the following regular actions into the
-        // mainloop_runonce() function
-
-        time_t now = time(NULL);
-
-        // If anything we recieved caused us to stop..
-        if(!(*eee->keep_running))
-            break;
-
-        // finished processing select data
-        update_supernode_reg(eee, now);
-
-        numPurged = 0;
-        // keep, i.e. do not purge, the known peers while no supernode supernode connection
-        if(!eee->sn_wait)
-            numPurged = purge_expired_nodes(&eee->known_peers,
-                                            eee->sock, NULL,
-                                            &last_purge_known,
-                                            PURGE_REGISTRATION_FREQUENCY, REGISTRATION_TIMEOUT);
-        numPurged += purge_expired_nodes(&eee->pending_peers,
-                                         eee->sock, NULL,
-                                         &last_purge_pending,
-                                         PURGE_REGISTRATION_FREQUENCY, REGISTRATION_TIMEOUT);
-
-        if(numPurged > 0) {
-            traceEvent(
-                TRACE_INFO,
-                "%u peers removed. now: pending=%u, operational=%u",
-                numPurged,
-                HASH_COUNT(eee->pending_peers),
-                HASH_COUNT(eee->known_peers)
-            );
-        }
-
+    mainloop_timer_del(&timer_purge);
 #ifdef HAVE_BRIDGING_SUPPORT
-        if((eee->conf.allow_routing) && (now > last_purge_host + SWEEP_TIME)) {
-            struct host_info *host, *host_tmp;
-            HASH_ITER(hh, eee->known_hosts, host, host_tmp) {
-                if(now > host->last_seen + HOSTINFO_TIMEOUT) {
-                    HASH_DEL(eee->known_hosts, host);
-                    free(host);
-                }
-            }
-            last_purge_host = now;
-        }
+    mainloop_timer_del(&timer_purge_hosts);
 #endif
+    mainloop_timer_del(&timer_iface_check);
+    mainloop_timer_del(&timer_sort_supernodes);
+    mainloop_timer_del(&eee->timer_sn_reg);
+    mainloop_timer_del(&eee->timer_resolve);
 
-        // TODO:
-        // - a static ip address mode
-        // - a notifier so we dont need to poll for changes
-        // - ipv6 support
-        // - multi-homing support
-        if((eee->conf.tuntap_ip_mode == TUNTAP_IP_MODE_DHCP) &&
-           ((now - lastIfaceCheck) > IFACE_UPDATE_INTERVAL)) {
-            traceEvent(TRACE_INFO, "re-checking dynamic IP address");
-            tuntap_get_address(&(eee->device));
-            lastIfaceCheck = now;
-        }
-
-        sort_supernodes(eee, now);
-
-        eee->resolution_request = resolve_check(
-            eee->resolve_parameter,
-            eee->resolution_request,
-            now
-        );
-
-        if(eee->resolution_request) {
-            // This currently gets signaled in update_supernode_reg when a
-            // supernode is not responding
-            //
-            // TODO: update this once we have the new async resolving
-            if(resolve_hostnames_str_to_peer_info(
-                   RESOLVE_LIST_SUPERNODE,
-                   &eee->supernodes)) {
-                traceEvent(
-                    TRACE_WARNING,
-                    "resolve_hostnames_str_to_peer_info returned errors"
-                );
-            } else {
-                // No errors, so clear the request
-                eee->resolution_request = false;
-            }
-        }
-
-
-    } /* while */
+    n3n_tapqueue_stop(eee);
 
     send_unregister_super(eee);
 
@@ -3429,13 +4389,7 @@ void edge_term (struct n3n_runtime_data * eee) {
     clear_peer_list(&eee->supernodes);
 
 #ifdef HAVE_BRIDGING_SUPPORT
-    if(eee->conf.allow_routing) {
-        struct host_info *host, *host_tmp;
-        HASH_ITER(hh, eee->known_hosts, host, host_tmp) {
-            HASH_DEL(eee->known_hosts, host);
-            free(host);
-        }
-    }
+    n3n_hosttable_free(eee->known_hosts);
 #endif
 
     eee->transop.deinit(&eee->transop);
@@ -3621,6 +4575,7 @@ void edge_init_conf_defaults (n2n_edge_conf_t *conf, char *sessionname) {
     conf->tuntap_dev_name[0] = '\0';
 
     conf->tuntap_ip_mode = TUNTAP_IP_MODE_SN_ASSIGN;
+    conf->tuntap_queues = 1;
     conf->tuntap_v4.net_bitlen = N2N_EDGE_DEFAULT_V4MASKLEN;
 
     /* reserve possible last char as null terminator. */
@@ -6,19 +6,60 @@
 #ifndef _EDGE_UTILS_H_
 #define _EDGE_UTILS_H_
 
+#include <n3n/ethernet.h>   // for n2n_mac_t
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #include "pktbuf.h"     // for n3n_pktbuf
 
 // Forward declare so that this header can stay small
 struct n3n_runtime_data;
+struct n2n_edge_conf;
+struct n2n_trans_op;
+
+int edge_init_transops (const struct n2n_edge_conf *conf,
+                        struct n2n_trans_op *transop,
+                        struct n2n_trans_op *transop_lzo,
+                        struct n2n_trans_op *transop_zstd);
 
 void edge_read_from_tap (struct n3n_runtime_data *eee);
 
+// The steps of edge_read_from_tap(), split up so that a tap reader running
+// outside the mainloop can do the encoding with its own transops while only
+// holding the edge lock for the policy checks and the send
+bool edge_tap_frame_wanted (struct n3n_runtime_data *eee,
+                            uint8_t *eth_pkt,
+                            size_t len);
+bool edge_tap_destination (struct n3n_runtime_data *eee,
+                           const uint8_t *tap_pkt,
+                           n2n_mac_t out_destMac);
+size_t edge_encode_payload (struct n3n_runtime_data *eee,
+                            struct n2n_trans_op *transop,
+                            struct n2n_trans_op *transop_lzo,
+                            struct n2n_trans_op *transop_zstd,
+                            uint8_t *tap_pkt, size_t len,
+                            const n2n_mac_t destMac,
+                            uint8_t *pktbuf, size_t pktbuf_size,
+                            uint16_t *out_header_len);
+void edge_send_encoded (struct n3n_runtime_data *eee,
+                        n2n_mac_t destMac,
+                        uint8_t *pktbuf,
+                        uint16_t headerIdx,
+                        size_t idx);
+
 void edge_read_proto3_udp (struct n3n_runtime_data *eee,
                            SOCKET sock,
                            struct n3n_pktbuf *pktbuf,
                            time_t now);
+
+// Read up to count datagrams into the pktbufs and process them all,
+// returning the number of datagrams read
+int edge_read_proto3_udp_batch (struct n3n_runtime_data *eee,
+                                SOCKET sock,
+                                struct n3n_pktbuf **pktbufs,
+                                int count,
+                                time_t now);
 void edge_read_proto3_tcp (struct n3n_runtime_data *eee,
                            SOCKET sock,
                            uint8_t *pktbuf,
@@ -19,10 +19,13 @@
  */
 
 
+#include <n3n/benchmark.h>
 #include <n3n/logging.h>        // for traceEvent
 #include <n3n/random.h>         // for n3n_rand
 #include <stdint.h>             // for uint32_t, uint8_t, uint64_t, uint16_t
-#include <string.h>             // for memcpy
+#include <stdio.h>              // for printf
+#include <stdlib.h>             // for calloc, free, abort
+#include <string.h>             // for memcpy, memcmp, strncpy
 #include "header_encryption.h"  // for packet_header_change_dynamic_key, pac...
 #include "n2n_define.h"         // for N2N_COMMUNITY_SIZE
 #include "n2n_typedefs.h"       // for N2N_AUTH_CHALLENGE_SIZE
@@ -36,27 +39,80 @@ struct speck_context_t;
 
 #define HASH_FIND_COMMUNITY(head, name, out) HASH_FIND_STR(head, name, out)
 
+// most packets handed to the multi-buffer speck in one go
+#define HEADER_ENCRYPTION_BATCH 32
 
-int packet_header_decrypt (uint8_t packet[], uint16_t packet_len,
-                           char *community_name,
-                           struct speck_context_t *ctx,
-                           struct speck_context_t *ctx_iv,
-                           uint64_t *stamp) {
+
+uint32_t packet_header_check_magic (const uint8_t packet[], uint16_t packet_len,
+                                    struct speck_context_t *ctx) {
 
     // try community name as possible key and check for magic bytes "n2__"
     uint32_t magic = 0x6E320000;
     uint32_t test_magic;
-    uint32_t checksum_high = 0;
 
     // check for magic
-    // so, as a first step, decrypt last 4 bytes from where originally the community name would be
+    // so, decrypt last 4 bytes from where originally the community name would be
     speck_ctr((uint8_t*)&test_magic, &packet[16], 4, packet, (speck_context_t*)ctx);
     test_magic = be32toh(test_magic);
 
     //extract header length (lower 2 bytes)
     uint32_t header_len = test_magic - magic;
 
-    if(header_len <= packet_len) {
+    if(header_len > packet_len) {
+        return 0;
+    }
+    return header_len;
+}
+
+
+// once the IV has been decrypted, extract the time stamp and restore the
+// original packet order, returning the checksum that came with the packet
+static uint32_t packet_header_decrypt_restore (uint8_t packet[],
+                                               char *community_name,
+                                               uint64_t *stamp) {
+
+    uint32_t checksum_high = 0;
+
+    // extract the required data
+    *stamp = be64toh(*(uint64_t*)&packet[4]);
+    checksum_high = be32toh(*(uint32_t*)packet);
+
+    // restore original packet order before calculating checksum
+    memcpy(&packet[0], &packet[20], 4);
+    memcpy(&packet[4], community_name, N2N_COMMUNITY_SIZE);
+
+    return checksum_high;
+}
+
+
+// compare with the checksum of the restored packet
+static int packet_header_decrypt_verify (uint64_t checksum, uint32_t checksum_high,
+                                         uint64_t *stamp) {
+
+    if((checksum >> 32) != checksum_high) {
+        traceEvent(TRACE_DEBUG, "packet_header_decrypt dropped a packet with invalid checksum.");
+
+        // unsuccessful
+        return 0;
+    }
+
+    *stamp = *stamp ^ (checksum << 32);
+
+    // successful
+    return 1;
+}
+
+
+int packet_header_decrypt (uint8_t packet[], uint16_t packet_len,
+                           char *community_name,
+                           struct speck_context_t *ctx,
+                           struct speck_context_t *ctx_iv,
+                           uint64_t *stamp) {
+
+    // as a first step, check the magic bytes
+    uint32_t header_len = packet_header_check_magic(packet, packet_len, ctx);
+
+    if(header_len) {
         // decrypt the complete header
         speck_ctr(&packet[16], &packet[16], header_len - 16, packet, (speck_context_t*)ctx);
 
@@ -65,26 +121,10 @@ int packet_header_decrypt (uint8_t packet[], uint16_t packet_len,
         // use speck block cipher step (1 block == 128 bit == 16 bytes)
         speck_128_decrypt(packet, (speck_context_t*)ctx_iv);
 
-        // extract the required data
-        *stamp = be64toh(*(uint64_t*)&packet[4]);
-        checksum_high = be32toh(*(uint32_t*)packet);
-
-        // restore original packet order before calculating checksum
-        memcpy(&packet[0], &packet[20], 4);
-        memcpy(&packet[4], community_name, N2N_COMMUNITY_SIZE);
+        uint32_t checksum_high = packet_header_decrypt_restore(packet, community_name, stamp);
         uint64_t checksum = pearson_hash_64(packet, packet_len);
 
-        if((checksum >> 32) != checksum_high) {
-            traceEvent(TRACE_DEBUG, "packet_header_decrypt dropped a packet with invalid checksum.");
-
-            // unsuccessful
-            return 0;
-        }
-
-        *stamp = *stamp ^ (checksum << 32);
-
-        // successful
-        return 1;
+        return packet_header_decrypt_verify(checksum, checksum_high, stamp);
     } else {
 
         // unsuccessful
@@ -93,14 +133,32 @@ int packet_header_decrypt (uint8_t packet[], uint16_t packet_len,
 }
 
 
+// the first step of encryption, forming the pre-IV
+static void packet_header_encrypt_pre_iv (uint8_t packet[], uint64_t checksum,
+                                          uint64_t stamp) {
+
+    uint32_t *p32 = (uint32_t*)packet;
+    uint64_t *p64 = (uint64_t*)packet;
+
+    // re-order packet
+    p32[5] = p32[0];
+
+    // add time stamp, checksum, and random to form the pre-IV
+    p64[0] = htobe64(checksum);
+
+    p32[1] = p32[1] ^ htobe32((uint32_t)(stamp >> 32));
+    p32[2] = htobe32((uint32_t)stamp);
+
+    p32[3] = n3n_rand();
+}
+
+
 int packet_header_encrypt (uint8_t packet[], uint16_t header_len, uint16_t packet_len,
                            struct speck_context_t *ctx,
                            struct speck_context_t *ctx_iv,
                            uint64_t stamp) {
 
     uint32_t *p32 = (uint32_t*)packet;
-    uint64_t *p64 = (uint64_t*)packet;
-    uint64_t checksum = 0;
     uint32_t magic = 0x6E320000; /* == ASCII "n2__" */
     magic += header_len;
 
@@ -110,18 +168,7 @@ int packet_header_encrypt (uint8_t packet[], uint16_t header_len, uint16_t packe
     }
     // we trust in the caller assuring header_len <= packet_len
 
-    checksum = pearson_hash_64(packet, packet_len);
-
-    // re-order packet
-    p32[5] = p32[0];
-
-    // add time stamp, checksum, and random to form the pre-IV
-    p64[0] = htobe64(checksum);
-
-    p32[1] = p32[1] ^ htobe32((uint32_t)(stamp >> 32));
-    p32[2] = htobe32((uint32_t)stamp);
-
-    p32[3] = n3n_rand();
+    packet_header_encrypt_pre_iv(packet, pearson_hash_64(packet, packet_len), stamp);
 
     // encrypt this pre-IV to IV
     speck_128_encrypt(packet, (speck_context_t*)ctx_iv);
@@ -136,6 +183,136 @@ int packet_header_encrypt (uint8_t packet[], uint16_t header_len, uint16_t packe
 }
 
 
+int packet_header_decrypt_batch (uint8_t *packet[], const uint16_t packet_len[], int count,
+                                 char *community_name,
+                                 struct speck_context_t *ctx,
+                                 struct speck_context_t *ctx_iv,
+                                 uint64_t stamp[],
+                                 int result[]) {
+
+    uint8_t magic[HEADER_ENCRYPTION_BATCH][4];
+    unsigned char *out[HEADER_ENCRYPTION_BATCH];
+    const unsigned char *in[HEADER_ENCRYPTION_BATCH];
+    const unsigned char *nonce[HEADER_ENCRYPTION_BATCH];
+    unsigned int len[HEADER_ENCRYPTION_BATCH];
+    int idx[HEADER_ENCRYPTION_BATCH];
+    uint32_t checksum_high[HEADER_ENCRYPTION_BATCH];
+    uint64_t checksum[HEADER_ENCRYPTION_BATCH];
+    size_t checksum_len[HEADER_ENCRYPTION_BATCH];
+    int done, i, n, valid, decrypted = 0;
+
+    for(done = 0; done < count; done += n) {
+        n = count - done;
+        if(n > HEADER_ENCRYPTION_BATCH) {
+            n = HEADER_ENCRYPTION_BATCH;
+        }
+
+        // check the magic bytes of all the packets at once, as in packet_header_check_magic()
+        for(i = 0; i < n; i++) {
+            out[i] = magic[i];
+            in[i] = &packet[done + i][16];
+            nonce[i] = packet[done + i];
+            len[i] = (packet_len[done + i] >= 20) ? 4 : 0;
+        }
+        speck_ctr_multi(out, in, len, nonce, n, (speck_context_t*)ctx);
+
+        // then decrypt the complete headers of the packets that passed
+        valid = 0;
+        for(i = 0; i < n; i++) {
+            uint32_t header_len = be32toh(*(uint32_t*)magic[i]) - 0x6E320000;
+
+            result[done + i] = 0;
+            if(!len[i] || (header_len > packet_len[done + i]) || (header_len < 20)) {
+                continue;
+            }
+            out[valid] = &packet[done + i][16];
+            in[valid] = &packet[done + i][16];
+            nonce[valid] = packet[done + i];
+            len[valid] = header_len - 16;
+            idx[valid] = done + i;
+            valid++;
+        }
+        speck_ctr_multi(out, in, len, nonce, valid, (speck_context_t*)ctx);
+
+        for(i = 0; i < valid; i++) {
+            out[i] = packet[idx[i]];
+        }
+        speck_128_decrypt_multi(out, valid, (speck_context_t*)ctx_iv);
+
+        for(i = 0; i < valid; i++) {
+            checksum_high[i] = packet_header_decrypt_restore(packet[idx[i]], community_name, &stamp[idx[i]]);
+            in[i] = packet[idx[i]];
+            checksum_len[i] = packet_len[idx[i]];
+        }
+        pearson_hash_64_multi(checksum, (const uint8_t **)in, checksum_len, valid);
+
+        for(i = 0; i < valid; i++) {
+            result[idx[i]] = packet_header_decrypt_verify(checksum[i], checksum_high[i], &stamp[idx[i]]);
+            decrypted += result[idx[i]];
+        }
+    }
+
+    return decrypted;
+}
+
+
+int packet_header_encrypt_batch (uint8_t *packet[], const uint16_t header_len[], const uint16_t packet_len[],
+                                 int count,
+                                 struct speck_context_t *ctx,
+                                 struct speck_context_t *ctx_iv,
+                                 const uint64_t stamp[]) {
+
+    unsigned char *out[HEADER_ENCRYPTION_BATCH];
+    const unsigned char *in[HEADER_ENCRYPTION_BATCH];
+    const unsigned char *nonce[HEADER_ENCRYPTION_BATCH];
+    unsigned int len[HEADER_ENCRYPTION_BATCH];
+    uint64_t checksum[HEADER_ENCRYPTION_BATCH];
+    size_t checksum_len[HEADER_ENCRYPTION_BATCH];
+    int done, i, n;
+
+    for(i = 0; i < count; i++) {
+        if(packet_len[i] < 24) {
+            traceEvent(TRACE_DEBUG, "packet_header_encrypt_batch dropped a batch with a packet too short to be valid.");
+            return -1;
+        }
+    }
+    // we trust in the caller assuring header_len <= packet_len
+
+    for(done = 0; done < count; done += n) {
+        n = count - done;
+        if(n > HEADER_ENCRYPTION_BATCH) {
+            n = HEADER_ENCRYPTION_BATCH;
+        }
+
+        for(i = 0; i < n; i++) {
+            in[i] = packet[done + i];
+            checksum_len[i] = packet_len[done + i];
+        }
+        pearson_hash_64_multi(checksum, (const uint8_t **)in, checksum_len, n);
+
+        for(i = 0; i < n; i++) {
+            packet_header_encrypt_pre_iv(packet[done + i], checksum[i], stamp[done + i]);
+            out[i] = packet[done + i];
+        }
+
+        // encrypt the pre-IVs to IVs
+        speck_128_encrypt_multi(out, n, (speck_context_t*)ctx_iv);
+
+        // place IV plus magic in packets and encrypt, starting from magic
+        for(i = 0; i < n; i++) {
+            ((uint32_t*)packet[done + i])[4] = htobe32(0x6E320000 + header_len[done + i]);
+            out[i] = &packet[done + i][16];
+            in[i] = &packet[done + i][16];
+            nonce[i] = packet[done + i];
+            len[i] = header_len[done + i] - 16;
+        }
+        speck_ctr_multi(out, in, len, nonce, n, (speck_context_t*)ctx);
+    }
+
+    return 0;
+}
+
+
 void packet_header_setup_key (const char *community_name,
                               struct speck_context_t **ctx_static,
                               struct speck_context_t **ctx_dynamic,
@@ -182,3 +359,187 @@ void packet_header_change_dynamic_key (uint8_t *key_dynamic,
     pearson_hash_128(key, key, sizeof(key));
     speck_init((speck_context_t**)ctx_iv_dynamic, key, 128);
 }
+
+
+// Round trip the headers of a batch of packets of mixed sizes, either one
+// packet at a time or all at once
+#define BENCH_PACKETS       16
+#define BENCH_PACKET_SIZE   128
+
+struct bench_header {
+    struct speck_context_t *ctx;
+    struct speck_context_t *ctx_iv;
+    char community_name[N2N_COMMUNITY_SIZE];
+    uint8_t plain[BENCH_PACKETS][BENCH_PACKET_SIZE];
+    uint8_t packet[BENCH_PACKETS][BENCH_PACKET_SIZE];
+    uint8_t *ptr[BENCH_PACKETS];
+    uint16_t header_len[BENCH_PACKETS];
+    uint16_t packet_len[BENCH_PACKETS];
+    uint64_t stamp[BENCH_PACKETS];
+    uint64_t stamp_out[BENCH_PACKETS];
+    int result[BENCH_PACKETS];
+    ssize_t bytes;
+};
+
+static void *bench_setup (void *const ctx) {
+    struct bench_header *bench = calloc(1, sizeof(*bench));
+    struct speck_context_t *ctx_dynamic, *ctx_iv_dynamic;
+    int i, j;
+
+    if(!bench) {
+        abort();
+    }
+
+    strncpy(bench->community_name, "bench", sizeof(bench->community_name));
+    packet_header_setup_key(bench->community_name, &bench->ctx, &ctx_dynamic,
+                            &bench->ctx_iv, &ctx_iv_dynamic);
+    speck_deinit((speck_context_t*)ctx_dynamic);
+    speck_deinit((speck_context_t*)ctx_iv_dynamic);
+
+    for(i = 0; i < BENCH_PACKETS; i++) {
+        // a common header followed by a varying amount of packet specific
+        // header and payload
+        bench->header_len[i] = 24 + (i * 7) % 40;
+        bench->packet_len[i] = bench->header_len[i] + (i * 13) % 64;
+        bench->stamp[i] = 0x0123456789abcdefULL + i;
+        for(j = 0; j < BENCH_PACKET_SIZE; j++) {
+            bench->plain[i][j] = i * 31 + j;
+        }
+        memcpy(&bench->plain[i][4], bench->community_name, N2N_COMMUNITY_SIZE);
+        bench->ptr[i] = bench->packet[i];
+        bench->bytes += bench->packet_len[i];
+    }
+
+    return bench;
+}
+
+static void bench_teardown (void *const ctx) {
+    struct bench_header *bench = ctx;
+
+    speck_deinit((speck_context_t*)bench->ctx);
+    speck_deinit((speck_context_t*)bench->ctx_iv);
+    free(bench);
+}
+
+static const ssize_t bench_single_run (
+    void *const ctx,
+    const void *data_in,
+    const ssize_t data_in_size,
+    ssize_t *const bytes_in
+) {
+    struct bench_header *bench = ctx;
+    int i;
+
+    memcpy(bench->packet, bench->plain, sizeof(bench->packet));
+    for(i = 0; i < BENCH_PACKETS; i++) {
+        packet_header_encrypt(bench->packet[i], bench->header_len[i], bench->packet_len[i],
+                              bench->ctx, bench->ctx_iv, bench->stamp[i]);
+    }
+    for(i = 0; i < BENCH_PACKETS; i++) {
+        bench->result[i] = packet_header_decrypt(bench->packet[i], bench->packet_len[i],
+                                                 bench->community_name,
+                                                 bench->ctx, bench->ctx_iv, &bench->stamp_out[i]);
+    }
+
+    *bytes_in = bench->bytes;
+    return bench->bytes;
+}
+
+static const ssize_t bench_batch_run (
+    void *const ctx,
+    const void *data_in,
+    const ssize_t data_in_size,
+    ssize_t *const bytes_in
+) {
+    struct bench_header *bench = ctx;
+
+    memcpy(bench->packet, bench->plain, sizeof(bench->packet));
+    packet_header_encrypt_batch(bench->ptr, bench->header_len, bench->packet_len, BENCH_PACKETS,
+                                bench->ctx, bench->ctx_iv, bench->stamp);
+    packet_header_decrypt_batch(bench->ptr, bench->packet_len, BENCH_PACKETS,
+                                bench->community_name,
+                                bench->ctx, bench->ctx_iv, bench->stamp_out, bench->result);
+
+    *bytes_in = bench->bytes;
+    return bench->bytes;
+}
+
+static int bench_compare (struct bench_header *bench, const char *what, int level) {
+    int i, errors = 0;
+
+    for(i = 0; i < BENCH_PACKETS; i++) {
+        if(!bench->result[i]
+           || (bench->stamp_out[i] != bench->stamp[i])
+           || memcmp(bench->packet[i], bench->plain[i], bench->packet_len[i])) {
+            errors++;
+        }
+    }
+    if(level) {
+        printf("%s: %d of %d packets wrong\n", what, errors, BENCH_PACKETS);
+    }
+    return errors;
+}
+
+// Each direction of the batch must interwork with the single packet one
+static int bench_check (void *const ctx, const int level) {
+    struct bench_header *bench = ctx;
+    int i, errors = 0;
+
+    memcpy(bench->packet, bench->plain, sizeof(bench->packet));
+    packet_header_encrypt_batch(bench->ptr, bench->header_len, bench->packet_len, BENCH_PACKETS,
+                                bench->ctx, bench->ctx_iv, bench->stamp);
+    for(i = 0; i < BENCH_PACKETS; i++) {
+        bench->result[i] = packet_header_decrypt(bench->packet[i], bench->packet_len[i],
+                                                 bench->community_name,
+                                                 bench->ctx, bench->ctx_iv, &bench->stamp_out[i]);
+    }
+    errors += bench_compare(bench, "encrypt_batch", level);
+
+    memcpy(bench->packet, bench->plain, sizeof(bench->packet));
+    for(i = 0; i < BENCH_PACKETS; i++) {
+        packet_header_encrypt(bench->packet[i], bench->header_len[i], bench->packet_len[i],
+                              bench->ctx, bench->ctx_iv, bench->stamp[i]);
+    }
+    // a damaged packet must fail without upsetting the others
+    bench->packet[3][bench->packet_len[3] - 1] ^= 1;
+    packet_header_decrypt_batch(bench->ptr, bench->packet_len, BENCH_PACKETS,
+                                bench->community_name,
+                                bench->ctx, bench->ctx_iv, bench->stamp_out, bench->result);
+    if(bench->result[3]) {
+        errors++;
+    }
+    bench->result[3] = 1;
+    bench->stamp_out[3] = bench->stamp[3];
+    memcpy(bench->packet[3], bench->plain[3], bench->packet_len[3]);
+    errors += bench_compare(bench, "decrypt_batch", level);
+
+    return errors;
+}
+
+static struct bench_item bench_single = {
+    .name = "header_encryption",
+    .ctx_size = 0,
+    .setup = bench_setup,
+    .run = bench_single_run,
+    .check = bench_check,
+    .teardown = bench_teardown,
+    .data_in = test_data_none,
+    .data_out = test_data_none,
+};
+
+static struct bench_item bench_batch = {
+    .name = "header_encryption",
+    .variant = "batch",
+    .ctx_size = 0,
+    .setup = bench_setup,
+    .run = bench_batch_run,
+    .check = bench_check,
+    .teardown = bench_teardown,
+    .data_in = test_data_none,
+    .data_out = test_data_none,
+};
+
+void n3n_initfuncs_header_encryption () {
+    n3n_benchmark_register(&bench_batch);
+    n3n_benchmark_register(&bench_single);
+}
@@ -0,0 +1,225 @@
+/**
+ * Copyright (C) Hamish Coleman
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * A fixed size table of the hosts seen behind the bridging edges, which
+ * needs no allocations once it has been created
+ */
+
+#include <n3n/metrics.h>
+#include <stddef.h>             // for offsetof
+#include <stdlib.h>             // for calloc, free, abort
+#include <string.h>             // for memcmp, memcpy
+
+#include "hosttable.h"
+
+static struct metrics {
+    uint32_t size;          // hosts the table can hold
+    uint32_t used;          // hosts currently in the table
+    uint32_t insert;        // a new host was added
+    uint32_t evict;         // the oldest host was forgotten to make room
+    uint32_t expire;        // a host was purged after its timeout
+} metrics;
+
+static struct n3n_metrics_items_llu32 metrics_items = {
+    .name = "count",
+    .desc = "Track the occupancy of the bridged hosts table",
+    .name1 = "event",
+    .items = {
+        {
+            .val1 = "size",
+            .offset = offsetof(struct metrics, size),
+        },
+        {
+            .val1 = "used",
+            .offset = offsetof(struct metrics, used),
+        },
+        {
+            .val1 = "insert",
+            .offset = offsetof(struct metrics, insert),
+        },
+        {
+            .val1 = "evict",
+            .offset = offsetof(struct metrics, evict),
+        },
+        {
+            .val1 = "expire",
+            .offset = offsetof(struct metrics, expire),
+        },
+        { },
+    },
+};
+
+static struct n3n_metrics_module metrics_module = {
+    .name = "hosttable",
+    .data = &metrics,
+    .items_llu32 = &metrics_items,
+    .type = n3n_metrics_type_llu32,
+};
+
+struct n3n_hosttable *n3n_hosttable_malloc (uint32_t size) {
+    struct n3n_hosttable *table;
+    uint32_t i;
+
+    table = calloc(1, sizeof(*table));
+    if(!table) {
+        abort();
+    }
+
+    // At least twice as many buckets as entries keeps the chains short
+    table->bucket_bits = 1;
+    while((1U << table->bucket_bits) < 2 * size) {
+        table->bucket_bits++;
+    }
+
+    table->slab = calloc(size, sizeof(struct host_info));
+    table->bucket = calloc(1U << table->bucket_bits, sizeof(struct host_info *));
+    if(!table->slab || !table->bucket) {
+        abort();
+    }
+    table->size = size;
+
+    for(i = 0; i + 1 < size; i++) {
+        table->slab[i].next = &table->slab[i + 1];
+    }
+    table->free = size ? table->slab : NULL;
+
+    metrics.size = size;
+    metrics.used = 0;
+    return table;
+}
+
+void n3n_hosttable_free (struct n3n_hosttable *table) {
+    if(!table) {
+        return;
+    }
+    free(table->slab);
+    free(table->bucket);
+    free(table);
+    metrics.used = 0;
+}
+
+static inline struct host_info **hosttable_bucket (struct n3n_hosttable *table,
+                                                   const n2n_mac_t mac) {
+    uint64_t key = 0;
+
+    memcpy(&key, mac, sizeof(n2n_mac_t));
+    key *= 0x9e3779b97f4a7c15ULL;
+    return &table->bucket[key >> (64 - table->bucket_bits)];
+}
+
+struct host_info *n3n_hosttable_find (struct n3n_hosttable *table, const n2n_mac_t mac) {
+    struct host_info *host = *hosttable_bucket(table, mac);
+
+    while(host) {
+        if(!memcmp(host->mac_addr, mac, sizeof(n2n_mac_t))) {
+            return host;
+        }
+        host = host->chain;
+    }
+    return NULL;
+}
+
+static void hosttable_unlink (struct n3n_hosttable *table, struct host_info *host) {
+    if(host->prev) {
+        host->prev->next = host->next;
+    } else {
+        table->oldest = host->next;
+    }
+    if(host->next) {
+        host->next->prev = host->prev;
+    } else {
+        table->newest = host->prev;
+    }
+}
+
+static void hosttable_append (struct n3n_hosttable *table, struct host_info *host) {
+    host->prev = table->newest;
+    host->next = NULL;
+    if(table->newest) {
+        table->newest->next = host;
+    } else {
+        table->oldest = host;
+    }
+    table->newest = host;
+}
+
+/** Take the host out of the table, returning its entry to the free list */
+static void hosttable_remove (struct n3n_hosttable *table, struct host_info *host) {
+    struct host_info **scan = hosttable_bucket(table, host->mac_addr);
+
+    while(*scan != host) {
+        scan = &(*scan)->chain;
+    }
+    *scan = host->chain;
+
+    hosttable_unlink(table, host);
+    host->next = table->free;
+    table->free = host;
+    table->count--;
+    metrics.used = table->count;
+}
+
+void n3n_hosttable_seen (struct n3n_hosttable *table,
+                         const n2n_mac_t mac,
+                         const n2n_mac_t edge,
+                         time_t now) {
+    struct host_info **bucket;
+    struct host_info *host = n3n_hosttable_find(table, mac);
+
+    if(host) {
+        memcpy(host->edge_addr, edge, sizeof(n2n_mac_t));
+        if(host->last_seen == now) {
+            // Seen already this second, so it is already in the right place
+            return;
+        }
+        host->last_seen = now;
+        if(host != table->newest) {
+            hosttable_unlink(table, host);
+            hosttable_append(table, host);
+        }
+        return;
+    }
+
+    if(!table->free) {
+        if(!table->oldest) {
+            // A table without any entries
+            return;
+        }
+        hosttable_remove(table, table->oldest);
+        metrics.evict++;
+    }
+
+    host = table->free;
+    table->free = host->next;
+
+    memcpy(host->mac_addr, mac, sizeof(n2n_mac_t));
+    memcpy(host->edge_addr, edge, sizeof(n2n_mac_t));
+    host->last_seen = now;
+
+    bucket = hosttable_bucket(table, mac);
+    host->chain = *bucket;
+    *bucket = host;
+    hosttable_append(table, host);
+
+    table->count++;
+    metrics.used = table->count;
+    metrics.insert++;
+}
+
+uint32_t n3n_hosttable_purge (struct n3n_hosttable *table, time_t before) {
+    uint32_t count = 0;
+
+    // The list is in last_seen order, so stop at the first host still alive
+    while(table->oldest && (table->oldest->last_seen < before)) {
+        hosttable_remove(table, table->oldest);
+        count++;
+    }
+
+    metrics.expire += count;
+    return count;
+}
+
+void n3n_initfuncs_hosttable () {
+    n3n_metrics_register(&metrics_module);
+}
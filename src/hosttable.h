@@ -0,0 +1,54 @@
+/**
+ * Copyright (C) Hamish Coleman
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * Private interface to the table of hosts seen behind the bridging edges
+ */
+
+#ifndef _HOSTTABLE_H
+#define _HOSTTABLE_H
+
+#include <n3n/ethernet.h>   // for n2n_mac_t
+#include <stdint.h>
+#include <time.h>           // for time_t
+
+// Where a host was last seen.  The entries live in one slab allocated with
+// the table, and are linked both into a hash chain and into a list kept in
+// last_seen order, so that the oldest host is always at the head.
+struct host_info {
+    n2n_mac_t mac_addr;         // The host
+    n2n_mac_t edge_addr;        // The edge it is behind
+    time_t last_seen;
+    struct host_info *chain;    // Next entry in the same hash bucket
+    struct host_info *prev;     // Seen before this one
+    struct host_info *next;     // Seen after this one, or the next free entry
+};
+
+struct n3n_hosttable {
+    struct host_info *slab;
+    struct host_info **bucket;
+    struct host_info *oldest;
+    struct host_info *newest;
+    struct host_info *free;
+    uint32_t size;
+    uint32_t count;
+    uint8_t bucket_bits;
+};
+
+// The table never holds more than size hosts, when it is full the least
+// recently seen host is forgotten to make room for a new one
+struct n3n_hosttable *n3n_hosttable_malloc (uint32_t size);
+void n3n_hosttable_free (struct n3n_hosttable *);
+
+struct host_info *n3n_hosttable_find (struct n3n_hosttable *, const n2n_mac_t);
+
+// Record that the host was seen behind the edge, adding it if needed
+void n3n_hosttable_seen (struct n3n_hosttable *,
+                         const n2n_mac_t host,
+                         const n2n_mac_t edge,
+                         time_t now);
+
+// Forget the hosts not seen since before, returning how many were removed
+uint32_t n3n_hosttable_purge (struct n3n_hosttable *, time_t before);
+
+#endif
@@ -6,18 +6,30 @@
  */
 
 // prototype any internal (non-public) initfuncs (always sorted!)
+void n3n_initfuncs_aes ();
 void n3n_initfuncs_benchmark ();
 void n3n_initfuncs_benchmark_pdu ();
+void n3n_initfuncs_cc20 ();
 void n3n_initfuncs_conffile_defs ();
+void n3n_initfuncs_cpu ();
 void n3n_initfuncs_curve25519 ();
+void n3n_initfuncs_header_encryption ();
+void n3n_initfuncs_hosttable ();
 void n3n_initfuncs_mainloop ();
 void n3n_initfuncs_metrics ();
+void n3n_initfuncs_network_traffic_filter ();
 void n3n_initfuncs_pearson ();
 void n3n_initfuncs_peer_info ();
 void n3n_initfuncs_pktbuf ();
 void n3n_initfuncs_random ();
 void n3n_initfuncs_resolve ();
+void n3n_initfuncs_sn_utils ();
+void n3n_initfuncs_speck ();
+void n3n_initfuncs_tapqueue ();
+void n3n_initfuncs_tcpconn ();
 void n3n_initfuncs_transform ();
+void n3n_initfuncs_txqueue ();
+void n3n_initfuncs_vnethdr ();
 void n3n_initfuncs_win32 ();
 
 void n3n_deinitfuncs_config ();
@@ -37,18 +49,30 @@ void n3n_initfuncs () {
 #endif
 
     // (sorted list)
+    n3n_initfuncs_aes();
     n3n_initfuncs_benchmark();
     n3n_initfuncs_benchmark_pdu();
+    n3n_initfuncs_cc20();
     n3n_initfuncs_conffile_defs();
+    n3n_initfuncs_cpu();
     n3n_initfuncs_curve25519();
+    n3n_initfuncs_header_encryption();
+    n3n_initfuncs_hosttable();
     n3n_initfuncs_mainloop();
     n3n_initfuncs_metrics();
+    n3n_initfuncs_network_traffic_filter();
     n3n_initfuncs_pearson();
     n3n_initfuncs_peer_info();
     n3n_initfuncs_pktbuf();
     n3n_initfuncs_random();
     n3n_initfuncs_resolve();
+    n3n_initfuncs_sn_utils();
+    n3n_initfuncs_speck();
+    n3n_initfuncs_tapqueue();
+    n3n_initfuncs_tcpconn();
     n3n_initfuncs_transform();
+    n3n_initfuncs_txqueue();
+    n3n_initfuncs_vnethdr();
 }
 
 void n3n_deinitfuncs () {
@@ -7,6 +7,7 @@
 #include <assert.h>
 #include <connslot/connslot.h>  // for slots_fdset
 #include <errno.h>              // for errno
+#include <limits.h>             // for INT_MAX
 #include <n2n_typedefs.h>       // for n3n_runtime_data
 #include <n3n/edge.h>           // for edge_read_proto3_udp
 #include <n3n/logging.h>        // for traceEvent
@@ -15,12 +16,17 @@
 #include <n3n/logging.h>        // for traceEvent
 #include <stddef.h>
 #include <stdint.h>
+#include <time.h>               // for clock_gettime, time
 
 #ifndef _WIN32
 #include <sys/select.h>         // for select, FD_ZERO,
 #include <unistd.h>             // for close
 #endif
 
+#ifdef __linux__
+#include <sys/epoll.h>          // for epoll_create1, epoll_ctl, epoll_wait
+#endif
+
 #ifdef DEBUG_MALLOC
 #ifdef __GLIBC__
 #include <malloc.h>             // for mallinfo2, malloc_info
@@ -30,8 +36,12 @@
 #include "edge_utils.h"         // for edge_read_from_tap
 #include "management.h"         // for readFromMgmtSocket
 #include "minmax.h"             // for min, max
+#include "n2n.h"                // for tuntap_flush
+#include "tapqueue.h"           // for n3n_tapqueue_lock, n3n_tapqueue_unlock
+#include "tcpconn.h"            // for n3n_tcpconn_read, n3n_tcpconn_send
 #include "pktbuf.h"
 #include "portable_endian.h"    // for htobe16
+#include "txqueue.h"            // for n3n_txqueue_begin, n3n_txqueue_end
 
 #ifndef _WIN32
 // Another wonderful gift from the world of POSIX compliance is not worth much
@@ -44,7 +54,14 @@ static struct metrics {
     uint32_t unregister_fd; // mainloop_unregister_fd() is called
     uint32_t connlist_alloc;
     uint32_t connlist_free;
-    uint32_t send_queue_fail;   // Attempted to send v3tcp but buffer in use
+    uint32_t send_queue_fail;   // Attempted to send v3tcp but the queue was full
+    uint32_t v3udp_batch;       // A batch of v3udp datagrams was read
+    uint32_t v3udp_pkts;        // Total datagrams read in all v3udp batches
+    uint32_t poller_events;     // Ready events dispatched from the poller
+    uint32_t poller_error;      // The poller could not update a registration
+    uint32_t timer_add;         // A timer was scheduled
+    uint32_t timer_run;         // A timer callback was run
+    uint32_t timer_cascade;     // A timer moved down a level of the wheel
 } metrics;
 
 static struct n3n_metrics_items_llu32 metrics_items = {
@@ -76,6 +93,34 @@ static struct n3n_metrics_items_llu32 metrics_items = {
             .val1 = "send_queue_fail",
             .offset = offsetof(struct metrics, send_queue_fail),
         },
+        {
+            .val1 = "v3udp_batch",
+            .offset = offsetof(struct metrics, v3udp_batch),
+        },
+        {
+            .val1 = "v3udp_pkts",
+            .offset = offsetof(struct metrics, v3udp_pkts),
+        },
+        {
+            .val1 = "poller_events",
+            .offset = offsetof(struct metrics, poller_events),
+        },
+        {
+            .val1 = "poller_error",
+            .offset = offsetof(struct metrics, poller_error),
+        },
+        {
+            .val1 = "timer_add",
+            .offset = offsetof(struct metrics, timer_add),
+        },
+        {
+            .val1 = "timer_run",
+            .offset = offsetof(struct metrics, timer_run),
+        },
+        {
+            .val1 = "timer_cascade",
+            .offset = offsetof(struct metrics, timer_cascade),
+        },
         { },
     },
 };
@@ -89,13 +134,32 @@ static char *proto_str[] = {
     [fd_info_proto_http] = "http",
 };
 
+#define POLLER_READ     0x1
+#define POLLER_WRITE    0x2
+
 struct fd_info {
     int fd;                     // The file descriptor for this connection
     int stats_reads;            // The number of ready to read events
     enum fd_info_proto proto;   // What protocol to use on a read event
     int8_t connnr;              // which connlist[] is being used as buffer
+    uint8_t events;             // POLLER_* events registered with the poller
 };
 
+// The poller hides the mechanism used to wait for filehandles to be ready.
+// Filehandles are registered with the poller as they are added to the fdlist
+// and it is told about any change in their wanted events, so that pollers
+// with persistent registrations only need to handle the ready filehandles.
+struct poller {
+    const char *name;
+    void (*add)(int slot);      // optional, called after a slot is allocated
+    void (*update)(int slot);   // optional, called when slot events change
+    void (*del)(int slot);      // optional, called before a slot is freed
+    int (*wait)(int timeout_ms);
+    void (*dispatch)(const time_t now, struct n3n_runtime_data *eee);
+};
+
+static struct poller *poller;
+
 // A static array of known file descriptors will not scale once full TCP
 // connection support is added, but will work for now
 #define MAX_HANDLES 16
@@ -107,6 +171,10 @@ static int fdlist_next_search;
 static struct conn connlist[MAX_CONN];
 static int connlist_next_search;
 
+// The v3tcp packet buffers, for the same numbered fdlist slot.  Allocated
+// the first time a slot is used for v3tcp and then kept for reuse
+static struct n3n_tcpconn *tcplist[MAX_HANDLES];
+
 static void metrics_callback (strbuf_t **reply, const struct n3n_metrics_module *module) {
     int slot = 0;
     char buf[16];
@@ -221,6 +289,13 @@ static void connlist_deinit () {
         free(connlist[conn].reply_header);
         conn++;
     }
+
+    int slot = 0;
+    while(slot < MAX_HANDLES) {
+        n3n_tcpconn_free(tcplist[slot]);
+        tcplist[slot] = NULL;
+        slot++;
+    }
 }
 
 static int connlist_alloc (enum conn_proto proto) {
@@ -258,11 +333,60 @@ static void fdlist_zero () {
         fdlist[slot].connnr = -1;
         fdlist[slot].fd = -1;
         fdlist[slot].proto = fd_info_proto_unknown;
+        fdlist[slot].events = 0;
         slot++;
     }
     fdlist_next_search = 0;
 }
 
+// Calculate which events we want to be woken for on this slot
+static uint8_t fdlist_want_events (int slot) {
+    if(fdlist[slot].proto == fd_info_proto_v3tcp) {
+        if(n3n_tcpconn_pending(tcplist[slot])) {
+            return POLLER_READ | POLLER_WRITE;
+        }
+        return POLLER_READ;
+    }
+
+    if(fdlist[slot].connnr == -1) {
+        return POLLER_READ;
+    }
+
+    struct conn *conn = &connlist[fdlist[slot].connnr];
+    uint8_t events = 0;
+
+    if(conn->reply_sendpos == 0) {
+        // Only select for reading if we have finished previous write
+        // FIXME:
+        // this check assumes that the conn_write() that kicks off
+        // a sending event will have made at least some progress
+        events |= POLLER_READ;
+    }
+
+    if(conn_iswriter(conn)) {
+        events |= POLLER_WRITE;
+    }
+
+    return events;
+}
+
+// Tell the poller if the wanted events for this slot have changed
+static void fdlist_sync_events (int slot) {
+    if(fdlist[slot].fd == -1) {
+        return;
+    }
+
+    uint8_t events = fdlist_want_events(slot);
+    if(events == fdlist[slot].events) {
+        return;
+    }
+
+    fdlist[slot].events = events;
+    if(poller->update) {
+        poller->update(slot);
+    }
+}
+
 static int fdlist_allocslot (int fd, enum fd_info_proto proto) {
     int slot = fdlist_next_search % MAX_HANDLES;
     int count = MAX_HANDLES;
@@ -272,15 +396,18 @@ static int fdlist_allocslot (int fd, enum fd_info_proto proto) {
             fdlist[slot].fd = fd;
             fdlist[slot].proto = proto;
             fdlist[slot].stats_reads = 0;
+            fdlist[slot].connnr = -1;
 
             if(proto == fd_info_proto_v3tcp) {
-                int connnr = connlist_alloc(CONN_PROTO_BE16LEN);
-                assert(connnr != -1);
+                if(!tcplist[slot]) {
+                    tcplist[slot] = n3n_tcpconn_malloc();
+                }
+                n3n_tcpconn_reset(tcplist[slot]);
+            }
 
-                fdlist[slot].connnr = connnr;
-                conn_accept(&connlist[connnr], fd, CONN_PROTO_BE16LEN);
-            } else {
-                fdlist[slot].connnr = -1;
+            fdlist[slot].events = fdlist_want_events(slot);
+            if(poller->add) {
+                poller->add(slot);
             }
 
             fdlist_next_search = slot + 1;
@@ -308,12 +435,20 @@ static void fdlist_freefd (int fd) {
             continue;
         }
         metrics.unregister_fd++;
+        if(poller->del) {
+            poller->del(slot);
+        }
         if(fdlist[slot].connnr != -1) {
             connlist_free(fdlist[slot].connnr);
             fdlist[slot].connnr = -1;
         }
+        if(tcplist[slot]) {
+            // Any packet being handled from the buffers stays valid
+            n3n_tcpconn_reset(tcplist[slot]);
+        }
         fdlist[slot].fd = -1;
         fdlist[slot].proto = fd_info_proto_unknown;
+        fdlist[slot].events = 0;
         fdlist_next_search = slot;
         return;
     }
@@ -334,26 +469,12 @@ static int fdlist_fd_set (fd_set *rd, fd_set *wr) {
         // TODO:
         // - if no empty conn, dont FD_SET on proto TCP listen
 
-        if(fdlist[slot].connnr == -1) {
+        if(fdlist[slot].events & POLLER_READ) {
             FD_SET(fdlist[slot].fd, rd);
             max_sock = MAX(max_sock, fdlist[slot].fd);
-        } else {
-            if(connlist[fdlist[slot].connnr].reply_sendpos == 0) {
-                // Only select for reading if we have finished previous write
-                // FIXME:
-                // this check assumes that the conn_write() that kicks off
-                // a sending event will have made at least some progress
-                FD_SET(fdlist[slot].fd, rd);
-                max_sock = MAX(max_sock, fdlist[slot].fd);
-            }
-        }
-
-        if(fdlist[slot].connnr == -1) {
-            slot++;
-            continue;
         }
 
-        if(conn_iswriter(&connlist[fdlist[slot].connnr])) {
+        if(fdlist[slot].events & POLLER_WRITE) {
             FD_SET(fdlist[slot].fd, wr);
         }
 
@@ -362,7 +483,9 @@ static int fdlist_fd_set (fd_set *rd, fd_set *wr) {
     return max_sock;
 }
 
-static void handle_fd (const time_t now, const struct fd_info info, struct n3n_runtime_data *eee) {
+static void handle_fd (const time_t now, int slot, struct n3n_runtime_data *eee) {
+    const struct fd_info info = fdlist[slot];
+
     switch(info.proto) {
         case fd_info_proto_unknown:
             // should not happen!
@@ -405,88 +528,69 @@ static void handle_fd (const time_t now, const struct fd_info info, struct n3n_r
 
             fdlist[slotnr].connnr = connnr;
             conn_accept(&connlist[connnr], client, CONN_PROTO_HTTP);
+            fdlist_sync_events(slotnr);
 
             return;
         }
 
         case fd_info_proto_v3udp: {
-            struct n3n_pktbuf *pkt = n3n_pktbuf_alloc(N2N_PKT_BUF_SIZE);
-            if(!pkt) {
+            struct n3n_pktbuf *pkts[N3N_RX_BATCH_SIZE];
+            int nr_pkts = 0;
+
+            while(nr_pkts < N3N_RX_BATCH_SIZE) {
+                struct n3n_pktbuf *pkt = n3n_pktbuf_alloc(N2N_PKT_BUF_SIZE);
+                if(!pkt) {
+                    break;
+                }
+                pkt->owner = n3n_pktbuf_owner_rx_pdu;
+                pkts[nr_pkts++] = pkt;
+            }
+            if(!nr_pkts) {
                 abort();
             }
-            pkt->owner = n3n_pktbuf_owner_rx_pdu;
-            edge_read_proto3_udp(eee, info.fd, pkt, now);
-            n3n_pktbuf_free(pkt);
+
+            int nr_read = edge_read_proto3_udp_batch(
+                eee,
+                info.fd,
+                pkts,
+                nr_pkts,
+                now
+            );
+            metrics.v3udp_batch++;
+            metrics.v3udp_pkts += nr_read;
+
+            while(nr_pkts) {
+                n3n_pktbuf_free(pkts[--nr_pkts]);
+            }
             return;
         }
 
         case fd_info_proto_v3tcp: {
-            struct conn *conn = &connlist[info.connnr];
-            conn_read(conn, info.fd);
-
-            switch(conn->state) {
-                case CONN_EMPTY:
-                case CONN_READING:
-                    // These states dont require us to do anything
-                    // TODO:
-                    // - handle reading/sending simultaneous?
-                    return;
-
-                case CONN_ERROR:
-                case CONN_CLOSED:
-                    conn_close(conn, info.fd);
-                    sb_zero(conn->request);
-                    // Let the upper layer realise its connection is gone by
-                    // showing it a zero sized request
-
-                    // TODO: if the upper layer doesnt react properly by
-                    // unregistering the dead filehandle, we leak slots and
-                    // conns here
-
-                    edge_read_proto3_tcp(eee, -1, NULL, -1, now);
-                    return;
-
-                case CONN_READY: {
-                    int size = ntohs(*(uint16_t *)&conn->request->str);
-
-                    edge_read_proto3_tcp(
-                        eee,
-                        info.fd,
-                        (uint8_t *)&conn->request->str[2],
-                        size,
-                        now
-                    );
-
-                    if(sb_len(conn->request) == (size + 2)) {
-                        // We read exactly one packet
-                        // TODO: this crosses layers by reaching inside the
-                        // conn object
-                        sb_zero(conn->request);
-                        conn->state = CONN_EMPTY;
-                        return;
+            struct n3n_tcpconn *tcp = tcplist[slot];
+            uint8_t *pkt;
+            uint16_t size;
+            int rc = 0;
+
+            if(n3n_tcpconn_read(tcp, info.fd) >= 0) {
+                // Handle every whole packet that was read, stopping if the
+                // upper layer drops the connection
+                while(fdlist[slot].fd == info.fd) {
+                    rc = n3n_tcpconn_next(tcp, &pkt, &size);
+                    if(rc != 1) {
+                        break;
                     }
-
-                    // Our buffer contains data beyond the single packet
-
-                    // TODO: this crosses layers by reaching inside the
-                    // conn object
-                    int more = sb_len(conn->request) - (size + 2);
-                    traceEvent(TRACE_DEBUG, "packet has %i more bytes", more);
-                    memmove(
-                        conn->request->str,
-                        &conn->request->str[size + 2],
-                        more
-                    );
-                    conn->request->rd_pos = 0;
-                    conn->request->wr_pos = more;
-                    conn->state = CONN_READING;
-
-                    // FIXME: sometimes we will have an entire next packet in
-                    // the buffer, which means we should not wait for the FD
-                    // to be read ready again
+                    edge_read_proto3_tcp(eee, info.fd, pkt, size, now);
+                }
+                if(rc >= 0) {
                     return;
                 }
             }
+
+            if(fdlist[slot].fd == info.fd) {
+                // Let the upper layer realise its connection is gone by
+                // showing it a zero sized request
+                edge_read_proto3_tcp(eee, -1, NULL, -1, now);
+            }
             return;
         }
 
@@ -544,38 +648,84 @@ static void fdlist_closeidle (const time_t now) {
     }
 }
 
-static void fdlist_check_ready (fd_set *rd, fd_set *wr, const time_t now, struct n3n_runtime_data *eee) {
+// Handle the events that are ready for one slot
+static void fdlist_handle_slot (int slot, bool readable, bool writable, const time_t now, struct n3n_runtime_data *eee) {
+    int fd = fdlist[slot].fd;
+
+    if(readable) {
+        fdlist[slot].stats_reads++;
+        handle_fd(now, slot, eee);
+    }
+    if(writable) {
+        if(fdlist[slot].fd != fd) {
+            // The read handler has closed this slot
+            return;
+        }
+
+        if(fdlist[slot].proto == fd_info_proto_v3tcp) {
+            if(n3n_tcpconn_flush(tcplist[slot], fd) < 0) {
+                edge_read_proto3_tcp(eee, -1, NULL, -1, now);
+            }
+            fdlist_sync_events(slot);
+            return;
+        }
+
+        // We should not be listening on this socket if there is no
+        // connnr assigned, but paranoia..
+        if(fdlist[slot].connnr == -1) {
+            traceEvent(TRACE_DEBUG, "writer bad connnr");
+            return;
+        }
+
+        struct conn *conn = &connlist[fdlist[slot].connnr];
+
+        // TODO: track the stats on writes?
+        conn_write(conn, fd);
+
+        if(conn->reply_sendpos == 0) {
+            // Looks like we have finished a write, so we can clean up
+            sb_zero(conn->request);
+        }
+    }
+
+    fdlist_sync_events(slot);
+}
+
+/*
+ * The select() poller is available everywhere, but needs to rebuild the
+ * fd_set and scan the whole fdlist on every loop
+ */
+
+static fd_set select_rd;
+static fd_set select_wr;
+
+static int poller_select_wait (int timeout_ms) {
+    FD_ZERO(&select_rd);
+    FD_ZERO(&select_wr);
+    int maxfd = fdlist_fd_set(&select_rd, &select_wr);
+
+    struct timeval wait_time;
+    wait_time.tv_sec = timeout_ms / 1000;
+    wait_time.tv_usec = (timeout_ms % 1000) * 1000;
+
+    return select(maxfd + 1, &select_rd, &select_wr, NULL, &wait_time);
+}
+
+static void poller_select_dispatch (const time_t now, struct n3n_runtime_data *eee) {
     int slot = 0;
-    // A linear scan is not ideal, but until we support things other than
-    // select() it will need to suffice
+    // A linear scan is not ideal, but the select() API leaves no other choice
     while(slot < MAX_HANDLES) {
         int fd = fdlist[slot].fd;
         if(fd == -1) {
             slot++;
             continue;
         }
-        if(FD_ISSET(fd, rd)) {
-            fdlist[slot].stats_reads++;
-            handle_fd(now, fdlist[slot], eee);
-        }
-        if(FD_ISSET(fd, wr)) {
-            // We should not be listening on this socket if there is no
-            // connnr assigned, but paranoia..
-            if(fdlist[slot].connnr == -1) {
-                traceEvent(TRACE_DEBUG, "writer bad connnr");
-                slot++;
-                continue;
-            }
-
-            struct conn *conn = &connlist[fdlist[slot].connnr];
 
-            // TODO: track the stats on writes?
-            conn_write(conn, fd);
-
-            if(conn->reply_sendpos == 0) {
-                // Looks like we have finished a write, so we can clean up
-                sb_zero(conn->request);
-            }
+        bool readable = FD_ISSET(fd, &select_rd);
+        bool writable = FD_ISSET(fd, &select_wr);
+        if(readable || writable) {
+            metrics.poller_events++;
+            fdlist_handle_slot(slot, readable, writable, now, eee);
         }
 
         if(fdlist[slot].connnr != -1) {
@@ -590,6 +740,303 @@ static void fdlist_check_ready (fd_set *rd, fd_set *wr, const time_t now, struct
     }
 }
 
+static struct poller poller_select = {
+    .name = "select",
+    .wait = poller_select_wait,
+    .dispatch = poller_select_dispatch,
+};
+
+#ifdef __linux__
+/*
+ * The epoll poller keeps the registrations in the kernel, so each wakeup
+ * only needs to look at the filehandles that are actually ready
+ */
+
+static int epoll_fd = -1;
+static struct epoll_event epoll_events[MAX_HANDLES];
+static int epoll_nr_events;
+static time_t epoll_last_closeidle;
+
+static void poller_epoll_ctl (int op, int slot) {
+    struct epoll_event ev = {0};
+
+    if(fdlist[slot].events & POLLER_READ) {
+        ev.events |= EPOLLIN;
+    }
+    if(fdlist[slot].events & POLLER_WRITE) {
+        ev.events |= EPOLLOUT;
+    }
+
+    // Keep the fd with the slot number, so a stale event for a slot that
+    // has been reused in the same loop can be detected
+    ev.data.u64 = ((uint64_t)fdlist[slot].fd << 32) | slot;
+
+    if(epoll_ctl(epoll_fd, op, fdlist[slot].fd, &ev) == -1) {
+        if(op == EPOLL_CTL_ADD && errno == EEXIST) {
+            poller_epoll_ctl(EPOLL_CTL_MOD, slot);
+            return;
+        }
+        if(op == EPOLL_CTL_DEL && (errno == EBADF || errno == ENOENT)) {
+            // The fd was closed before it was unregistered, which has
+            // already removed it from the epoll set
+            return;
+        }
+        metrics.poller_error++;
+        traceEvent(
+            TRACE_WARNING,
+            "epoll_ctl(%i, fd=%i) errno=%i",
+            op,
+            fdlist[slot].fd,
+            errno
+        );
+    }
+}
+
+static void poller_epoll_add (int slot) {
+    poller_epoll_ctl(EPOLL_CTL_ADD, slot);
+}
+
+static void poller_epoll_update (int slot) {
+    poller_epoll_ctl(EPOLL_CTL_MOD, slot);
+}
+
+static void poller_epoll_del (int slot) {
+    poller_epoll_ctl(EPOLL_CTL_DEL, slot);
+}
+
+static int poller_epoll_wait (int timeout_ms) {
+    epoll_nr_events = epoll_wait(epoll_fd, epoll_events, MAX_HANDLES, timeout_ms);
+    return epoll_nr_events;
+}
+
+static void poller_epoll_dispatch (const time_t now, struct n3n_runtime_data *eee) {
+    for(int i = 0; i < epoll_nr_events; i++) {
+        int slot = epoll_events[i].data.u64 & 0xffffffff;
+        int fd = epoll_events[i].data.u64 >> 32;
+
+        if(fdlist[slot].fd != fd) {
+            // This slot was closed while handling an earlier event
+            continue;
+        }
+
+        uint32_t revents = epoll_events[i].events;
+        // Errors and hangups are found by the handler when it reads
+        bool readable = revents & (EPOLLIN | EPOLLERR | EPOLLHUP);
+        bool writable = revents & EPOLLOUT;
+
+        metrics.poller_events++;
+        fdlist_handle_slot(slot, readable, writable, now, eee);
+    }
+
+    // The idle timeout is measured in tens of seconds, so there is no need
+    // to check it on every single wakeup
+    if(now != epoll_last_closeidle) {
+        epoll_last_closeidle = now;
+        fdlist_closeidle(now);
+    }
+}
+
+static struct poller poller_epoll = {
+    .name = "epoll",
+    .add = poller_epoll_add,
+    .update = poller_epoll_update,
+    .del = poller_epoll_del,
+    .wait = poller_epoll_wait,
+    .dispatch = poller_epoll_dispatch,
+};
+
+static int poller_epoll_init () {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if(epoll_fd == -1) {
+        traceEvent(TRACE_WARNING, "epoll_create1 errno=%i, using select", errno);
+        return -1;
+    }
+    return 0;
+}
+
+static void poller_epoll_deinit () {
+    if(epoll_fd != -1) {
+        close(epoll_fd);
+        epoll_fd = -1;
+    }
+}
+#endif
+
+// The timer wheel has three levels of 64 slots.  The first level holds the
+// timers due in the next 64 ticks, one tick per slot, and each higher level
+// has slots covering 64 times the span of the level below it.  As the wheel
+// turns, the slots of the higher levels are cascaded down, so scheduling
+// and expiring a timer are both constant time operations.
+#define TIMER_TICK_MS       10
+#define TIMER_LEVEL_BITS    6
+#define TIMER_LEVEL_SLOTS   (1 << TIMER_LEVEL_BITS)
+#define TIMER_LEVEL_MASK    (TIMER_LEVEL_SLOTS - 1)
+#define TIMER_LEVELS        3
+
+static struct n3n_timer *timer_wheel[TIMER_LEVELS][TIMER_LEVEL_SLOTS];
+static uint64_t timer_tick;     // The next tick to be run
+static int timer_pending;       // Number of timers on the wheel
+static uint64_t clock_ms;       // The cached monotonic clock
+
+static uint64_t clock_sample () {
+#ifdef _WIN32
+    return GetTickCount64();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+void mainloop_clock_update () {
+    clock_ms = clock_sample();
+    if(!timer_pending) {
+        // Nothing can be missed, so avoid turning an empty wheel
+        timer_tick = clock_ms / TIMER_TICK_MS;
+    }
+}
+
+uint64_t mainloop_now_ms () {
+    return clock_ms;
+}
+
+static void timer_insert (struct n3n_timer *timer) {
+    // Round up, so a timer never runs early
+    uint64_t tick = (timer->expires + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    if(tick < timer_tick) {
+        tick = timer_tick;
+    }
+    uint64_t delta = tick - timer_tick;
+
+    struct n3n_timer **slot;
+    if(delta < TIMER_LEVEL_SLOTS) {
+        slot = &timer_wheel[0][tick & TIMER_LEVEL_MASK];
+    } else if(delta < (1 << (2 * TIMER_LEVEL_BITS))) {
+        slot = &timer_wheel[1][(tick >> TIMER_LEVEL_BITS) & TIMER_LEVEL_MASK];
+    } else {
+        if(delta >= (1 << (3 * TIMER_LEVEL_BITS))) {
+            // Beyond the end of the wheel, it will be placed again when
+            // this slot is cascaded
+            tick = timer_tick + (1 << (3 * TIMER_LEVEL_BITS)) - 1;
+        }
+        slot = &timer_wheel[2][(tick >> (2 * TIMER_LEVEL_BITS)) & TIMER_LEVEL_MASK];
+    }
+
+    timer->next = *slot;
+    if(timer->next) {
+        timer->next->pprev = &timer->next;
+    }
+    timer->pprev = slot;
+    *slot = timer;
+}
+
+static void timer_unlink (struct n3n_timer *timer) {
+    *timer->pprev = timer->next;
+    if(timer->next) {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer_pending--;
+}
+
+void mainloop_timer_add (struct n3n_timer *timer, uint32_t delay_ms) {
+    metrics.timer_add++;
+
+    if(timer->pprev) {
+        timer_unlink(timer);
+    }
+    if(!clock_ms) {
+        mainloop_clock_update();
+    }
+    timer->expires = clock_ms + delay_ms;
+    timer_insert(timer);
+    timer_pending++;
+}
+
+void mainloop_timer_del (struct n3n_timer *timer) {
+    if(timer->pprev) {
+        timer_unlink(timer);
+    }
+}
+
+static void timer_cascade (int level, int index) {
+    struct n3n_timer *list = timer_wheel[level][index];
+    timer_wheel[level][index] = NULL;
+
+    while(list) {
+        struct n3n_timer *timer = list;
+        list = timer->next;
+        timer_insert(timer);
+        metrics.timer_cascade++;
+    }
+}
+
+int mainloop_timer_next () {
+    if(!timer_pending) {
+        return -1;
+    }
+
+    uint64_t due = UINT64_MAX;
+    for(int i = 0; i < TIMER_LEVEL_SLOTS; i++) {
+        if(timer_wheel[0][(timer_tick + i) & TIMER_LEVEL_MASK]) {
+            due = timer_tick + i;
+            break;
+        }
+    }
+
+    // A timer in the higher levels can become due before the first level
+    // slot found above, but there are only ever a handful of timers, so
+    // just look at all of them
+    for(int level = 1; level < TIMER_LEVELS; level++) {
+        for(int i = 0; i < TIMER_LEVEL_SLOTS; i++) {
+            struct n3n_timer *timer;
+            for(timer = timer_wheel[level][i]; timer; timer = timer->next) {
+                uint64_t tick = (timer->expires + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+                due = MIN(due, tick);
+            }
+        }
+    }
+
+    uint64_t due_ms = MAX(due, timer_tick) * TIMER_TICK_MS;
+    if(due_ms <= clock_ms) {
+        return 0;
+    }
+    return MIN(due_ms - clock_ms, INT_MAX);
+}
+
+void mainloop_timer_run (time_t now) {
+    uint64_t target = clock_ms / TIMER_TICK_MS;
+
+    while(timer_pending && timer_tick <= target) {
+        int index = timer_tick & TIMER_LEVEL_MASK;
+
+        if(!index) {
+            int index1 = (timer_tick >> TIMER_LEVEL_BITS) & TIMER_LEVEL_MASK;
+            if(!index1) {
+                timer_cascade(2, (timer_tick >> (2 * TIMER_LEVEL_BITS)) & TIMER_LEVEL_MASK);
+            }
+            timer_cascade(1, index1);
+        }
+
+        // Move the wheel on first, so any timer added by a callback cannot
+        // land in the slot being emptied
+        timer_tick++;
+
+        struct n3n_timer **slot = &timer_wheel[0][index];
+        while(*slot) {
+            struct n3n_timer *timer = *slot;
+            timer_unlink(timer);
+            metrics.timer_run++;
+            timer->func(timer, now);
+        }
+    }
+
+    if(!timer_pending) {
+        timer_tick = target + 1;
+    }
+}
+
 #ifdef DEBUG_MALLOC
 #ifdef __GLIBC__
 static time_t last_mallinfo;
@@ -597,46 +1044,61 @@ static time_t last_mallinfo;
 #endif
 
 int mainloop_runonce (struct n3n_runtime_data *eee) {
-    fd_set rd;
-    fd_set wr;
-
     metrics.mainloop++;
 
-    FD_ZERO(&rd);
-    FD_ZERO(&wr);
-    int maxfd = fdlist_fd_set(&rd, &wr);
-
     // FIXME:
-    // unlock the windows tun reader thread before select() and lock it
-    // again after select().  It currently works by accident, but the
+    // the windows tun reader thread should use the same locking as the
+    // multi-queue tap threads.  It currently works by accident, but the
     // structures it manipulates are not thread-safe, so try to make it
     // work by /design/
 
-    struct timeval wait_time;
+    // Wake up for the next timer, but still check for idle connections
+    // every now and then.  The edge bootstrap runs without any timers and
+    // needs to be woken more often while it waits for the supernode
+    int max_timeout_ms;
     if(eee->sn_wait) {
-        wait_time.tv_sec = (SOCKET_TIMEOUT_INTERVAL_SECS / 10 + 1);
+        max_timeout_ms = (SOCKET_TIMEOUT_INTERVAL_SECS / 10 + 1) * 1000;
     } else {
-        wait_time.tv_sec = (SOCKET_TIMEOUT_INTERVAL_SECS);
+        max_timeout_ms = (SOCKET_TIMEOUT_INTERVAL_SECS) * 1000;
+    }
+
+    int timeout_ms = mainloop_timer_next();
+    if(timeout_ms < 0 || timeout_ms > max_timeout_ms) {
+        timeout_ms = max_timeout_ms;
     }
-    wait_time.tv_usec = 0;
 
-    int ready = select(maxfd + 1, &rd, &wr, NULL, &wait_time);
+    // Let any tap queue threads send while we are waiting
+    n3n_tapqueue_unlock(eee);
+    int ready = poller->wait(timeout_ms);
+    n3n_tapqueue_lock(eee);
 
     // One timestamp to use for this entire loop iteration
     time_t now = time(NULL);
+    mainloop_clock_update();
 
     if(ready == -1) {
-        traceEvent(TRACE_ERROR, "select errno=%i", errno);
+        traceEvent(TRACE_ERROR, "%s errno=%i", poller->name, errno);
         fdlist_closeidle(now);
         return -1;
     }
 
-    if(ready < 1) {
-        // Nothing ready
-        return ready;
+    // Collect the datagrams sent while handling the ready filehandles and
+    // the timers so they can be sent together
+    n3n_txqueue_begin(&eee->stats.sn_errors);
+    if(ready > 0) {
+        poller->dispatch(now, eee);
+    }
+
+    // If anything we recieved caused us to stop, leave the periodic work
+    if(*eee->keep_running) {
+        mainloop_timer_run(now);
     }
+    n3n_txqueue_end();
 
-    fdlist_check_ready(&rd, &wr, now, eee);
+#ifdef __linux__
+    // Write out any TCP segments that were being coalesced for the TAP
+    tuntap_flush(&eee->device);
+#endif
 
 #ifdef DEBUG_MALLOC
 #ifdef __GLIBC__
@@ -666,6 +1128,7 @@ int mainloop_runonce (struct n3n_runtime_data *eee) {
 
 void mainloop_dump (strbuf_t **buf) {
     int i;
+    sb_reprintf(buf, "poller: %s\n", poller->name);
     sb_reprintf(buf, "i : fd(read) pr connnr\n");
     for(i=0; i<MAX_HANDLES; i++) {
         sb_reprintf(
@@ -696,42 +1159,27 @@ bool mainloop_send_v3tcp (int fd, const void *buf, int bufsize) {
         }
         slot++;
     }
-    if(fdlist[slot].fd != fd) {
+    if((slot == MAX_HANDLES) || (fdlist[slot].fd != fd)) {
         // Couldnt find this fd
         return false;
     }
 
-    if(fdlist[slot].connnr == -1) {
-        // No buffer associated with this fd
+    if(fdlist[slot].proto != fd_info_proto_v3tcp) {
         return false;
     }
 
-    struct conn *conn = &connlist[fdlist[slot].connnr];
-
-    if(!conn->reply) {
-        conn->reply = sb_malloc(N2N_PKT_BUF_SIZE + 2, N2N_PKT_BUF_SIZE + 2);
-    } else {
-        if(sb_len(conn->reply)) {
-            // send buffer already in use
-            // TODO:
-            // - metrics!
-            return false;
-        }
-        sb_zero(conn->reply);
+    if((bufsize < 0) || (bufsize > N2N_PKT_BUF_SIZE)) {
+        return false;
     }
 
-    uint16_t pktsize16 = htobe16(bufsize);
-    sb_append(conn->reply, &pktsize16, sizeof(pktsize16));
-
-    // TODO:
-    // - avoid memcpy by using a global buffer pool and transferring ownership
-    sb_append(conn->reply, buf, bufsize);
-
-    // TODO:
-    // - check bufsize for N2N_PKT_BUF_SIZE overflow
+    // Queued behind anything the socket has not yet taken
+    ssize_t sent = n3n_tcpconn_send(tcplist[slot], fd, buf, bufsize);
+    if(sent == 0) {
+        metrics.send_queue_fail++;
+    }
 
-    conn_write(conn, fd);
-    return true;
+    fdlist_sync_events(slot);
+    return sent > 0;
 }
 
 void mainloop_register_fd (int fd, enum fd_info_proto proto) {
@@ -745,6 +1193,14 @@ void mainloop_unregister_fd (int fd) {
 void n3n_initfuncs_mainloop () {
     connlist_init();
     fdlist_zero();
+
+    poller = &poller_select;
+#ifdef __linux__
+    if(poller_epoll_init() == 0) {
+        poller = &poller_epoll;
+    }
+#endif
+
     n3n_metrics_register(&metrics_module_dynamic);
 #ifdef DEBUG_MALLOC
 #ifdef __GLIBC__
@@ -756,6 +1212,9 @@ void n3n_initfuncs_mainloop () {
 
 void n3n_deinitfuncs_mainloop () {
     connlist_deinit();
+#ifdef __linux__
+    poller_epoll_deinit();
+#endif
     // TODO: once the metrics framework supports it
     // n3n_metrics_unregister(&metrics_module_dynamic);
     // n3n_metrics_unregister(&metrics_module_static);
@@ -521,56 +521,63 @@ static uint64_t previously_issued_time_stamp = 0;
 uint64_t time_stamp (void) {
 
     struct timeval tod;
-    uint64_t micro_seconds;
+    uint64_t now, micro_seconds, previous;
     uint64_t co, mask_lo, mask_hi, hi_unchanged, counter, new_co;
 
     gettimeofday(&tod, NULL);
 
     // (roughly) calculate the microseconds since 1970, leftbound
-    micro_seconds = ((uint64_t)(tod.tv_sec) << 32) + ((uint64_t)tod.tv_usec << 12);
+    now = ((uint64_t)(tod.tv_sec) << 32) + ((uint64_t)tod.tv_usec << 12);
     // more exact but more costly due to the multiplication:
-    // micro_seconds = ((uint64_t)(tod.tv_sec) * 1000000ULL + tod.tv_usec) << 12;
-
-    // extract "counter only" flag (lowest bit)
-    co = (previously_issued_time_stamp << 63) >> 63;
-    // set mask accordingly
-    mask_lo   = -co;
-    mask_lo >>= 32;
-    // either 0x00000000FFFFFFFF (if co flag set) or 0x0000000000000000 (if co flag not set)
-
-    mask_lo  |= (~mask_lo) >> 52;
-    // either 0x00000000FFFFFFFF (unchanged)      or 0x0000000000000FFF (lowest 12 bit set)
-
-    mask_hi   = ~mask_lo;
-
-    hi_unchanged = ((previously_issued_time_stamp & mask_hi) == (micro_seconds & mask_hi));
-    // 0 if upper bits unchanged (compared to previous stamp), 1 otherwise
-
-    // read counter and shift right for flags
-    counter   = (previously_issued_time_stamp & mask_lo) >> 4;
-
-    counter  += hi_unchanged;
-    counter  &= -hi_unchanged;
-    // either counter++ if upper part of timestamp unchanged, 0 otherwise
-
-    // back to time stamp format
-    counter <<= 4;
-
-    // set new co flag if counter overflows while upper bits unchanged or if it was set before
-    new_co   = (((counter & mask_lo) == 0) & hi_unchanged) | co;
-
-    // in case co flag changed, masks need to be recalculated
-    mask_lo   = -new_co;
-    mask_lo >>= 32;
-    mask_lo  |= (~mask_lo) >> 52;
-    mask_hi   = ~mask_lo;
-
-    // assemble new timestamp
-    micro_seconds &= mask_hi;
-    micro_seconds |= counter;
-    micro_seconds |= new_co;
-
-    previously_issued_time_stamp = micro_seconds;
+    // now = ((uint64_t)(tod.tv_sec) * 1000000ULL + tod.tv_usec) << 12;
+
+    // the supernode workers issue stamps concurrently, so the previous one
+    // is only replaced if no other thread has issued one in the meantime
+    previous = __atomic_load_n(&previously_issued_time_stamp, __ATOMIC_RELAXED);
+    do {
+        micro_seconds = now;
+
+        // extract "counter only" flag (lowest bit)
+        co = (previous << 63) >> 63;
+        // set mask accordingly
+        mask_lo   = -co;
+        mask_lo >>= 32;
+        // either 0x00000000FFFFFFFF (if co flag set) or 0x0000000000000000 (if co flag not set)
+
+        mask_lo  |= (~mask_lo) >> 52;
+        // either 0x00000000FFFFFFFF (unchanged)      or 0x0000000000000FFF (lowest 12 bit set)
+
+        mask_hi   = ~mask_lo;
+
+        hi_unchanged = ((previous & mask_hi) == (micro_seconds & mask_hi));
+        // 0 if upper bits unchanged (compared to previous stamp), 1 otherwise
+
+        // read counter and shift right for flags
+        counter   = (previous & mask_lo) >> 4;
+
+        counter  += hi_unchanged;
+        counter  &= -hi_unchanged;
+        // either counter++ if upper part of timestamp unchanged, 0 otherwise
+
+        // back to time stamp format
+        counter <<= 4;
+
+        // set new co flag if counter overflows while upper bits unchanged or if it was set before
+        new_co   = (((counter & mask_lo) == 0) & hi_unchanged) | co;
+
+        // in case co flag changed, masks need to be recalculated
+        mask_lo   = -new_co;
+        mask_lo >>= 32;
+        mask_lo  |= (~mask_lo) >> 52;
+        mask_hi   = ~mask_lo;
+
+        // assemble new timestamp
+        micro_seconds &= mask_hi;
+        micro_seconds |= counter;
+        micro_seconds |= new_co;
+    } while(!__atomic_compare_exchange_n(
+                &previously_issued_time_stamp, &previous, micro_seconds, true,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED));
 
     return micro_seconds;
 }
@@ -49,6 +49,7 @@
  */
 
 
+#include <stdint.h>        // for uint64_t
 #include <stdio.h>         // for printf
 #include <stdlib.h>        // for calloc, free
 #include <string.h>        // for memcpy
@@ -74,6 +75,24 @@ typedef struct regex_t {
 
 
 
+/* A set of patterns, compiled into one automaton.  Each pattern item has a
+   position, in a bitmap holding all the positions of all the patterns, with
+   one more position after the last item of each pattern that marks a match.
+   A set bit in the state means the matching has got up to that item, so all
+   the patterns are stepped through the text together. */
+struct re_set {
+    int positions;      /* used positions                                  */
+    int words;          /* uint64_t words in each bitmap                   */
+    uint64_t* start;    /* positions active before any text                */
+    uint64_t* loop;     /* items that can repeat ('*' and '+')             */
+    uint64_t* optional; /* items that can be skipped ('*' and '?')         */
+    uint64_t* last;     /* positions that mark the end of a pattern        */
+    uint64_t* accept;   /* for each char, the items matching it            */
+    uint64_t* state;    /* scratch space for re_set_matchp()               */
+};
+
+
+
 /* Private function declarations: */
 static int matchpattern (regex_t* pattern, const char* text, int* matchlength);
 static int matchcharclass (char c, const char* str);
@@ -277,6 +296,202 @@ void re_print (regex_t* pattern) {
 
 
 
+int re_set_add (re_set_t* set_p, const char* pattern) {
+
+    re_t re_p;
+    re_set_t set = *set_p;
+    int items = 0;
+    int i, c, pos;
+
+    /* Compile first, the char classes are only valid until the next compile */
+    re_p = re_compile(pattern);
+    if(re_p == 0) {
+        return -1;
+    }
+    for(i = 0; re_p[i].type != UNUSED; ++i) {
+        if((re_p[i + 1].type == STAR) || (re_p[i + 1].type == PLUS) || (re_p[i + 1].type == QUESTIONMARK)) {
+            ++i;
+        }
+        ++items;
+    }
+
+    if(set == 0) {
+        set = (re_set_t)calloc(1, sizeof(struct re_set));
+        if(set == 0) {
+            free(re_p);
+            return -1;
+        }
+        *set_p = set;
+    }
+
+    /* Grow the bitmaps if the new positions do not fit */
+    if(set->positions + items + 1 > set->words * 64) {
+        int words = (set->positions + items + 1 + 63) / 64;
+        uint64_t* start    = (uint64_t*)calloc(words, sizeof(uint64_t));
+        uint64_t* loop     = (uint64_t*)calloc(words, sizeof(uint64_t));
+        uint64_t* optional = (uint64_t*)calloc(words, sizeof(uint64_t));
+        uint64_t* last     = (uint64_t*)calloc(words, sizeof(uint64_t));
+        uint64_t* accept   = (uint64_t*)calloc(256 * words, sizeof(uint64_t));
+        uint64_t* state    = (uint64_t*)calloc(2 * words, sizeof(uint64_t));
+
+        if(!start || !loop || !optional || !last || !accept || !state) {
+            free(start);
+            free(loop);
+            free(optional);
+            free(last);
+            free(accept);
+            free(state);
+            free(re_p);
+            return -1;
+        }
+        if(set->words) {
+            memcpy(start, set->start, set->words * sizeof(uint64_t));
+            memcpy(loop, set->loop, set->words * sizeof(uint64_t));
+            memcpy(optional, set->optional, set->words * sizeof(uint64_t));
+            memcpy(last, set->last, set->words * sizeof(uint64_t));
+            for(c = 0; c < 256; ++c) {
+                memcpy(&accept[c * words], &set->accept[c * set->words], set->words * sizeof(uint64_t));
+            }
+        }
+        free(set->start);
+        free(set->loop);
+        free(set->optional);
+        free(set->last);
+        free(set->accept);
+        free(set->state);
+        set->start    = start;
+        set->loop     = loop;
+        set->optional = optional;
+        set->last     = last;
+        set->accept   = accept;
+        set->state    = state;
+        set->words    = words;
+    }
+
+#define RE_SET_BIT(map, n) ((map)[(n) / 64] |= (uint64_t)1 << ((n) % 64))
+
+    pos = set->positions;
+    for(i = 0; re_p[i].type != UNUSED; ++i, ++pos) {
+        /* A stray quantifier never matches */
+        if((re_p[i].type != STAR) && (re_p[i].type != PLUS) && (re_p[i].type != QUESTIONMARK)) {
+            for(c = 1; c < 256; ++c) {
+                if(matchone(re_p[i], (char)c)) {
+                    RE_SET_BIT(&set->accept[c * set->words], pos);
+                }
+            }
+        }
+        switch(re_p[i + 1].type) {
+            case STAR:         RE_SET_BIT(set->loop, pos); RE_SET_BIT(set->optional, pos); ++i; break;
+            case PLUS:         RE_SET_BIT(set->loop, pos); ++i; break;
+            case QUESTIONMARK: RE_SET_BIT(set->optional, pos); ++i; break;
+            default: break;
+        }
+    }
+    RE_SET_BIT(set->last, pos);
+
+    /* The pattern starts at its first item, or any later one after items
+       that can be skipped */
+    for(pos = set->positions; pos <= set->positions + items; ++pos) {
+        RE_SET_BIT(set->start, pos);
+        if(!(set->optional[pos / 64] & ((uint64_t)1 << (pos % 64)))) {
+            break;
+        }
+    }
+    set->positions += items + 1;
+
+#undef RE_SET_BIT
+
+    free(re_p);
+
+    return 0;
+}
+
+int re_set_matchp (re_set_t set, const char* text, size_t len) {
+
+    uint64_t* state;
+    uint64_t* next;
+    uint64_t* accept;
+    uint64_t m, x, carry, any;
+    size_t i;
+    int w, changed;
+
+    if(set == 0) {
+        return 0;
+    }
+
+    /* Like re_matchp(), never match an empty text */
+    if((len == 0) || (text[0] == '\0')) {
+        return 0;
+    }
+
+    state = set->state;
+    next = &set->state[set->words];
+    memcpy(state, set->start, set->words * sizeof(uint64_t));
+
+    for(i = 0; (i < len) && (text[i] != '\0'); ++i) {
+        accept = &set->accept[(unsigned char)text[i] * set->words];
+
+        /* Step each item matching the char on to the next, or keep it
+           where it is for repeating items */
+        carry = 0;
+        any = 0;
+        for(w = 0; w < set->words; ++w) {
+            m = state[w] & accept[w];
+            next[w] = (m & set->loop[w]) | (m << 1) | carry;
+            carry = m >> 63;
+            any |= next[w];
+        }
+        if(!any) {
+            return 0;
+        }
+
+        /* Then on past any items that can be skipped */
+        do {
+            changed = 0;
+            carry = 0;
+            for(w = 0; w < set->words; ++w) {
+                x = next[w] & set->optional[w];
+                m = (x << 1) | carry;
+                carry = x >> 63;
+                if(m & ~next[w]) {
+                    next[w] |= m;
+                    changed = 1;
+                }
+            }
+        } while(changed);
+
+        /* swap */
+        accept = state;
+        state = next;
+        next = accept;
+    }
+
+    for(w = 0; w < set->words; ++w) {
+        if(state[w] & set->last[w]) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+void re_set_free (re_set_t set) {
+
+    if(set == 0) {
+        return;
+    }
+
+    free(set->start);
+    free(set->loop);
+    free(set->optional);
+    free(set->last);
+    free(set->accept);
+    free(set->state);
+    free(set);
+}
+
+
+
 /* Private functions: */
 static int matchdigit (char c) {
 
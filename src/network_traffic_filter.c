@@ -19,11 +19,14 @@
  */
 
 
+#include <n3n/benchmark.h>           // for bench_item
 #include <n3n/logging.h>             // for traceEvent
+#include <n3n/metrics.h>             // for n3n_metrics_register
 #include <n3n/network_traffic_filter.h>  // for create_network_traffic_filter
+#include <stddef.h>                  // for offsetof
 #include <stdint.h>                  // for uint8_t, uint16_t, uint32_t
 #include <stdio.h>                   // for sprintf
-#include <stdlib.h>                  // for free, malloc, atoi
+#include <stdlib.h>                  // for free, malloc, calloc, atoi, qsort
 #include <string.h>                  // for memcpy, strcpy, NULL, memset
 
 #include "uthash.h"                  // for UT_hash_handle, HASH_ITER, HASH_DEL
@@ -36,9 +39,10 @@
 #include <netinet/in.h>              // for in_addr, in_addr_t, ntohs, ntohl
 #endif
 
-// cache that hit less than 10 while 10000 package processed will be delete;
-#define CLEAR_CACHE_EVERY_X_COUNT 10000
-#define CLAER_CACHE_ACTIVE_COUNT  10
+// The flow table remembers the verdict of this many recent flows.  A new
+// flow replaces one of the flows in the few slots it may go into
+#define FILTER_FLOWS        4096    /* must be a power of two */
+#define FILTER_FLOW_PROBES  8
 
 /* for [-Wmissing-declarations] */
 const char* get_filter_packet_proto_name (filter_packet_proto proto);
@@ -76,15 +80,21 @@ const char* get_filter_packet_info_log_string (packet_address_proto_info_t* info
             return get_filter_packet_proto_name(info->proto);
         case FPP_TCP:
         case FPP_UDP: {
-            struct in_addr src, dst;
-
-            src.s_addr = info->src_ip;
-            dst.s_addr = info->dst_ip;
             const char* proto = get_filter_packet_proto_name(info->proto);
-            char src_ip[64] = {0};
-            char dst_ip[64] = {0};
-            strcpy(src_ip, inet_ntoa(src));
-            strcpy(dst_ip, inet_ntoa(dst));
+            char src_ip[INET6_ADDRSTRLEN + 2] = {0};
+            char dst_ip[INET6_ADDRSTRLEN + 2] = {0};
+
+            if(info->bool_ipv6) {
+                src_ip[0] = '[';
+                dst_ip[0] = '[';
+                inet_ntop(AF_INET6, info->src_ip6, src_ip + 1, INET6_ADDRSTRLEN);
+                inet_ntop(AF_INET6, info->dst_ip6, dst_ip + 1, INET6_ADDRSTRLEN);
+                strcat(src_ip, "]");
+                strcat(dst_ip, "]");
+            } else {
+                inet_ntop(AF_INET, &info->src_ip, src_ip, sizeof(src_ip));
+                inet_ntop(AF_INET, &info->dst_ip, dst_ip, sizeof(dst_ip));
+            }
             sprintf(buf, "%s\t%s:%d->%s:%d", proto, src_ip, info->src_port, dst_ip, info->dst_port);
             return buf;
         }
@@ -93,23 +103,134 @@ const char* get_filter_packet_info_log_string (packet_address_proto_info_t* info
     }
 }
 
+/** Fill in the ports of a TCP or UDP header, if the packet holds them */
+static void collect_packet_ports (packet_address_proto_info_t* out_info, const unsigned char *buffer, int size) {
+
+    // the ports are the first two fields of both headers
+    const struct n2n_udphdr *udp_hdr = (const struct n2n_udphdr*)buffer;
+
+    if(size < 4) {
+        return;
+    }
+    out_info->src_port = ntohs(udp_hdr->source);
+    out_info->dst_port = ntohs(udp_hdr->dest);
+}
+
+/** Walk the IPv6 header and its extension headers to the upper layer */
+static void collect_packet_info_ipv6 (packet_address_proto_info_t* out_info, const unsigned char *buffer, int size) {
+
+    uint8_t next_header;
+    int extensions;
+
+    // fixed header: version, class, flow (4), length (2), next header (1),
+    // hop limit (1), source (16), destination (16)
+    if(size < 40) {
+        return;
+    }
+    out_info->bool_ipv6 = 1;
+    next_header = buffer[6];
+    memcpy(out_info->src_ip6, &buffer[8], 16);
+    memcpy(out_info->dst_ip6, &buffer[24], 16);
+    buffer += 40;
+    size -= 40;
+
+    // Give up on chains longer than any sensible packet would use
+    for(extensions = 0; extensions < 8; extensions++) {
+        int length;
+
+        switch(next_header) {
+            case 0:     // hop-by-hop options
+            case 43:    // routing
+            case 60:    // destination options
+                if(size < 8) {
+                    return;
+                }
+                length = (buffer[1] + 1) * 8;
+                break;
+            case 44:    // fragment
+                if(size < 8) {
+                    return;
+                }
+                if((buffer[2] << 8 | buffer[3]) & 0xfff8) {
+                    // only the first fragment carries the upper layer header,
+                    // so the others are matched without ports
+                    switch(buffer[0]) {
+                        case 6:
+                            out_info->proto = FPP_TCP;
+                            break;
+                        case 17:
+                            out_info->proto = FPP_UDP;
+                            break;
+                        case 58:
+                            out_info->proto = FPP_ICMP;
+                            break;
+                    }
+                    return;
+                }
+                length = 8;
+                break;
+            case 51:    // authentication header
+                if(size < 8) {
+                    return;
+                }
+                length = (buffer[1] + 2) * 4;
+                break;
+            case 6:
+                out_info->proto = FPP_TCP;
+                collect_packet_ports(out_info, buffer, size);
+                return;
+            case 17:
+                out_info->proto = FPP_UDP;
+                collect_packet_ports(out_info, buffer, size);
+                return;
+            case 58:
+                out_info->proto = FPP_ICMP;
+                return;
+            default:
+                // ESP, no next header or anything unknown
+                return;
+        }
+
+        if(size <= length) {
+            return;
+        }
+        next_header = buffer[0];
+        buffer += length;
+        size -= length;
+    }
+}
+
 /* for [-Wmissing-declarations] */
 void collect_packet_info (packet_address_proto_info_t* out_info, unsigned char *buffer, int size);
 
 void collect_packet_info (packet_address_proto_info_t* out_info, unsigned char *buffer, int size) {
 
     ether_hdr_t *hdr_ether = (ether_hdr_t*)buffer;
-    uint16_t ether_type = ntohs(hdr_ether->type);
+    uint16_t ether_type;
     struct n2n_iphdr *hdr_ip = NULL;
-    struct n2n_tcphdr *hdr_tcp = NULL;
-    struct n2n_udphdr *udp_hdr = NULL;
 
     memset(out_info, 0, sizeof(packet_address_proto_info_t));
 
+    if(size < (int)sizeof(ether_hdr_t)) {
+        return;
+    }
+    ether_type = ntohs(hdr_ether->type);
+    buffer += sizeof(ether_hdr_t);
+    size -= sizeof(ether_hdr_t);
+
+    // Look past any 802.1Q and 802.1ad tags, the filter rules apply to all
+    // VLANs alike
+    while((ether_type == 0x8100) || (ether_type == 0x88a8)) {
+        if(size < 4) {
+            return;
+        }
+        ether_type = buffer[2] << 8 | buffer[3];
+        buffer += 4;
+        size -= 4;
+    }
+
     switch(ether_type) {
         case 0x0800: {
-            buffer += sizeof(ether_hdr_t);
-            size -= sizeof(ether_hdr_t);
             if(size <= 0) {
                 return;
             }
@@ -117,6 +238,9 @@ void collect_packet_info (packet_address_proto_info_t* out_info, unsigned char *
 
             switch(hdr_ip->version) {
                 case 4: {
+                    if(size < (int)sizeof(struct n2n_iphdr)) {
+                        return;
+                    }
                     out_info->src_ip = hdr_ip->saddr;
                     out_info->dst_ip = hdr_ip->daddr;
                     switch(hdr_ip->protocol) {
@@ -128,26 +252,12 @@ void collect_packet_info (packet_address_proto_info_t* out_info, unsigned char *
                             break;
                         case 0x06: {
                             out_info->proto = FPP_TCP;
-                            buffer += hdr_ip->ihl * 4;
-                            size -= hdr_ip->ihl * 4;
-                            if(size <= 0) {
-                                return;
-                            }
-                            hdr_tcp = (struct n2n_tcphdr*)buffer;
-                            out_info->src_port = ntohs(hdr_tcp->source);
-                            out_info->dst_port = ntohs(hdr_tcp->dest);
+                            collect_packet_ports(out_info, buffer + hdr_ip->ihl * 4, size - hdr_ip->ihl * 4);
                             break;
                         }
                         case 0x11: {
                             out_info->proto = FPP_UDP;
-                            buffer += hdr_ip->ihl * 4;
-                            size -= hdr_ip->ihl * 4;
-                            if(size <= 0) {
-                                return;
-                            }
-                            udp_hdr    = (struct n2n_udphdr*)buffer;
-                            out_info->src_port = ntohs(udp_hdr->source);
-                            out_info->dst_port = ntohs(udp_hdr->dest);
+                            collect_packet_ports(out_info, buffer + hdr_ip->ihl * 4, size - hdr_ip->ihl * 4);
                             break;
                         }
                         default:
@@ -155,11 +265,6 @@ void collect_packet_info (packet_address_proto_info_t* out_info, unsigned char *
                     };
                     break;
                 }
-                case 6: {
-                    // TODO: IPV6 Not Support
-                    out_info->proto = FPP_UNKNOWN;
-                    break;
-                }
                 default:
                     out_info->proto = FPP_UNKNOWN;
             }
@@ -169,7 +274,7 @@ void collect_packet_info (packet_address_proto_info_t* out_info, unsigned char *
             out_info->proto = FPP_ARP;
             break;
         case 0x86DD:
-            out_info->proto = FPP_UNKNOWN;
+            collect_packet_info_ipv6(out_info, buffer, size);
             break;
         default:
             traceEvent(TRACE_DEBUG, "collect_packet_info stumbled across the unknown ether type 0x%04X", ether_type);
@@ -183,14 +288,20 @@ const char* get_filter_rule_info_log_string (filter_rule_t* rule) {
 
     static char buf[1024] = {0};
     char* print_start = buf;
-    char src_net[64] = {0};
-    char dst_net[64] = {0};
-    struct in_addr src, dst;
-
-    src.s_addr = rule->key.src_net_cidr;
-    dst.s_addr = rule->key.dst_net_cidr;
-    strcpy(src_net, inet_ntoa(src));
-    strcpy(dst_net, inet_ntoa(dst));
+    char src_net[INET6_ADDRSTRLEN + 2] = {0};
+    char dst_net[INET6_ADDRSTRLEN + 2] = {0};
+
+    if(rule->key.bool_ipv6) {
+        src_net[0] = '[';
+        dst_net[0] = '[';
+        inet_ntop(AF_INET6, rule->key.src_net6, src_net + 1, INET6_ADDRSTRLEN);
+        inet_ntop(AF_INET6, rule->key.dst_net6, dst_net + 1, INET6_ADDRSTRLEN);
+        strcat(src_net, "]");
+        strcat(dst_net, "]");
+    } else {
+        inet_ntop(AF_INET, &rule->key.src_net_cidr, src_net, sizeof(src_net));
+        inet_ntop(AF_INET, &rule->key.dst_net_cidr, dst_net, sizeof(dst_net));
+    }
     print_start += sprintf(print_start, "%s/%d:[%d,%d],%s/%d:[%d,%d]",
                            src_net, rule->key.src_net_bit_len,
                            rule->key.src_port_range.start_port, rule->key.src_port_range.end_port,
@@ -237,10 +348,43 @@ uint8_t march_cidr_and_address (in_addr_t network, uint8_t net_bitlen, in_addr_t
 }
 
 /* for [-Wmissing-declarations] */
-uint8_t march_rule_and_cache_key (filter_rule_key_t *rule_key, packet_address_proto_info_t *pkt_addr_info);
+uint8_t march_cidr6_and_address (const uint8_t *network, uint8_t net_bitlen, const uint8_t *ip_addr);
+
+uint8_t march_cidr6_and_address (const uint8_t *network, uint8_t net_bitlen, const uint8_t *ip_addr) {
+
+    int bytes = net_bitlen / 8;
+    int bits = net_bitlen % 8;
+
+    if(net_bitlen > 128) {
+        return 0;
+    }
+    if(memcmp(network, ip_addr, bytes)) {
+        return 0;
+    }
+    if(bits && ((network[bytes] ^ ip_addr[bytes]) & (0xff00 >> bits))) {
+        return 0;
+    }
+    // like the IPv4 networks, one with host bits set never matches
+    for(int i = bytes; i < 16; i++) {
+        uint8_t host = (i == bytes) ? (0xff >> bits) : 0xff;
+        if(network[i] & host) {
+            return 0;
+        }
+    }
+
+    return net_bitlen + 1;
+}
+
+/* for [-Wmissing-declarations] */
+uint16_t march_rule_and_cache_key (filter_rule_key_t *rule_key, packet_address_proto_info_t *pkt_addr_info);
 
 // if ports march, compare cidr. if cidr ok, return sum of src&dst cidr net_bitlen. means always select larger net_bitlen record when multi record is marched.
-uint8_t march_rule_and_cache_key (filter_rule_key_t *rule_key, packet_address_proto_info_t *pkt_addr_info) {
+uint16_t march_rule_and_cache_key (filter_rule_key_t *rule_key, packet_address_proto_info_t *pkt_addr_info) {
+
+    // the rules only apply to their own address family
+    if(!rule_key->bool_ipv6 != !pkt_addr_info->bool_ipv6) {
+        return 0;
+    }
 
     // march failed if proto is not configured at the rule.
     switch(pkt_addr_info->proto) {
@@ -268,8 +412,15 @@ uint8_t march_rule_and_cache_key (filter_rule_key_t *rule_key, packet_address_pr
                                             && pkt_addr_info->src_port <= rule_key->src_port_range.end_port
                                             && rule_key->dst_port_range.start_port <= pkt_addr_info->dst_port
                                             && pkt_addr_info->dst_port <= rule_key->dst_port_range.end_port)) {
-        uint8_t march_src_score = march_cidr_and_address(rule_key->src_net_cidr, rule_key->src_net_bit_len, pkt_addr_info->src_ip);
-        uint8_t march_dst_score = march_cidr_and_address(rule_key->dst_net_cidr, rule_key->dst_net_bit_len, pkt_addr_info->dst_ip);
+        uint8_t march_src_score, march_dst_score;
+
+        if(rule_key->bool_ipv6) {
+            march_src_score = march_cidr6_and_address(rule_key->src_net6, rule_key->src_net_bit_len, pkt_addr_info->src_ip6);
+            march_dst_score = march_cidr6_and_address(rule_key->dst_net6, rule_key->dst_net_bit_len, pkt_addr_info->dst_ip6);
+        } else {
+            march_src_score = march_cidr_and_address(rule_key->src_net_cidr, rule_key->src_net_bit_len, pkt_addr_info->src_ip);
+            march_dst_score = march_cidr_and_address(rule_key->dst_net_cidr, rule_key->dst_net_bit_len, pkt_addr_info->dst_ip);
+        }
         if((march_src_score > 0) && (march_dst_score > 0)) {
             return march_src_score + march_dst_score;
         }
@@ -288,7 +439,7 @@ filter_rule_t* get_filter_rule (filter_rule_t **rules, packet_address_proto_info
 
     HASH_ITER(hh, *rules, item, tmp) {
         /* ... it is safe to delete and free s here */
-        uint8_t cur_march_score = march_rule_and_cache_key(&(item->key), pkt_addr_info);
+        uint16_t cur_march_score = march_rule_and_cache_key(&(item->key), pkt_addr_info);
         if(cur_march_score > march_score) {
             marched_rule = item;
             march_score = cur_march_score;
@@ -299,64 +450,544 @@ filter_rule_t* get_filter_rule (filter_rule_t **rules, packet_address_proto_info
 }
 
 
-/* for [-Wmissing-declarations] */
-void update_and_clear_cache_if_need (network_traffic_filter_t *filter);
-
-void update_and_clear_cache_if_need (network_traffic_filter_t *filter) {
-
-    if(++(filter->work_count_scene_last_clear) > CLEAR_CACHE_EVERY_X_COUNT) {
-        filter_rule_pair_cache_t *item = NULL, *tmp = NULL;
-        HASH_ITER(hh, filter->connections_rule_cache, item, tmp) {
-            /* ... it is safe to delete and free s here */
-            if(item->active_count < CLAER_CACHE_ACTIVE_COUNT) {
-                traceEvent(TRACE_DEBUG, "### DELETE filter cache %s", get_filter_packet_info_log_string(&item->key));
-                HASH_DEL(filter->connections_rule_cache, item);
-                free(item);
-            } else {
-                item->active_count = 0;
-            }
+
+// The rules, compiled into a classifier.  Each field of a packet is looked
+// up in a table of its own, giving the set of rules that match that field
+// as a bitmap.  The rules are numbered best match first, so the first bit
+// left after combining the sets is the rule get_filter_rule() would pick.
+//
+// The addresses and ports are split into the intervals between the rule
+// boundaries, every address in an interval is matched by the same rules.
+// The address intervals are found with a binary search, the ports with a
+// direct table.
+//
+// All values are kept as 128 bit numbers, an IPv4 address is its host order
+// value and an IPv6 address its two big endian halves.  The two families
+// share the intervals, the rules of the other family are masked out by the
+// protocol sets, which are kept per family.
+struct filter_value {
+    uint64_t hi;
+    uint64_t lo;
+};
+
+struct filter_intervals {
+    struct filter_value *start;     // first value of each interval, sorted
+    uint64_t *sets;                 // the matching rules of each interval
+    uint32_t count;
+};
+
+struct filter_classifier {
+    filter_rule_t **rule;           // in the order of their match score
+    uint32_t rules;
+    uint32_t words;                 // size of one set of rules
+    uint64_t *proto_sets;           // rules configured for TCP, UDP, ICMP,
+                                    // for IPv4 and then for IPv6
+    struct filter_intervals src_ip;
+    struct filter_intervals dst_ip;
+    struct filter_intervals src_port;
+    struct filter_intervals dst_port;
+    uint16_t *src_port_interval;    // interval of every port
+    uint16_t *dst_port_interval;
+};
+
+#define FILTER_PROTO_TCP    0
+#define FILTER_PROTO_UDP    1
+#define FILTER_PROTO_ICMP   2
+#define FILTER_PROTOS       3
+
+static inline int filter_value_cmp (struct filter_value x, struct filter_value y) {
+    if(x.hi != y.hi) {
+        return (x.hi > y.hi) - (x.hi < y.hi);
+    }
+    return (x.lo > y.lo) - (x.lo < y.lo);
+}
+
+static inline bool filter_value_is_max (struct filter_value x) {
+    return (x.hi == UINT64_MAX) && (x.lo == UINT64_MAX);
+}
+
+static inline struct filter_value filter_value_next (struct filter_value x) {
+    x.lo++;
+    if(!x.lo) {
+        x.hi++;
+    }
+    return x;
+}
+
+static inline struct filter_value filter_value_v4 (in_addr_t addr) {
+    struct filter_value value = { 0, ntohl(addr) };
+
+    return value;
+}
+
+static inline struct filter_value filter_value_v6 (const uint8_t *addr) {
+    struct filter_value value = { 0, 0 };
+    int i;
+
+    for(i = 0; i < 8; i++) {
+        value.hi = (value.hi << 8) | addr[i];
+        value.lo = (value.lo << 8) | addr[i + 8];
+    }
+    return value;
+}
+
+static int classifier_compare_value (const void *a, const void *b) {
+    return filter_value_cmp(*(const struct filter_value *)a, *(const struct filter_value *)b);
+}
+
+/** Find the interval containing value */
+static inline uint32_t classifier_interval_find (const struct filter_intervals *intervals, struct filter_value value) {
+    uint32_t lo = 0;
+    uint32_t hi = intervals->count;
+
+    // start[0] is always zero, so the answer is the last start <= value
+    while(hi - lo > 1) {
+        uint32_t mid = (lo + hi) / 2;
+        if(filter_value_cmp(intervals->start[mid], value) <= 0) {
+            lo = mid;
+        } else {
+            hi = mid;
         }
-        filter->work_count_scene_last_clear = 0;
     }
+    return lo;
 }
 
-/* for [-Wmissing-declarations] */
-filter_rule_pair_cache_t* get_or_create_filter_rule_cache (network_traffic_filter_t *filter, packet_address_proto_info_t *pkt_addr_info);
+/** Split the range of values at the first and last value of every rule */
+static void classifier_intervals_build (struct filter_intervals *intervals,
+                                        uint32_t rules,
+                                        uint32_t words,
+                                        const struct filter_value *first,
+                                        const struct filter_value *last) {
+    uint32_t i, n = 1;
+
+    intervals->start = malloc((2 * rules + 1) * sizeof(struct filter_value));
+    if(!intervals->start) {
+        abort();
+    }
+
+    intervals->start[0].hi = 0;
+    intervals->start[0].lo = 0;
+    for(i = 0; i < rules; i++) {
+        if(filter_value_cmp(first[i], last[i]) > 0) {
+            continue;
+        }
+        intervals->start[n++] = first[i];
+        if(!filter_value_is_max(last[i])) {
+            intervals->start[n++] = filter_value_next(last[i]);
+        }
+    }
 
-filter_rule_pair_cache_t* get_or_create_filter_rule_cache (network_traffic_filter_t *filter, packet_address_proto_info_t *pkt_addr_info) {
+    qsort(intervals->start, n, sizeof(struct filter_value), classifier_compare_value);
+    intervals->count = 0;
+    for(i = 0; i < n; i++) {
+        if(!intervals->count || filter_value_cmp(intervals->start[i], intervals->start[intervals->count - 1])) {
+            intervals->start[intervals->count++] = intervals->start[i];
+        }
+    }
 
-    filter_rule_pair_cache_t* rule_cache_find_result = 0;
-    HASH_FIND(hh, filter->connections_rule_cache, pkt_addr_info, sizeof(packet_address_proto_info_t), rule_cache_find_result);
-    if(!rule_cache_find_result) {
-        filter_rule_t* rule = get_filter_rule(&filter->rules, pkt_addr_info);
-        if(!rule) {
+    intervals->sets = calloc((size_t)intervals->count * words, sizeof(uint64_t));
+    if(!intervals->sets) {
+        abort();
+    }
+
+    for(i = 0; i < rules; i++) {
+        uint32_t from, to;
+
+        if(filter_value_cmp(first[i], last[i]) > 0) {
+            continue;
+        }
+        from = classifier_interval_find(intervals, first[i]);
+        to = filter_value_is_max(last[i]) ? intervals->count
+             : classifier_interval_find(intervals, filter_value_next(last[i]));
+        for(; from < to; from++) {
+            intervals->sets[(size_t)from * words + i / 64] |= 1ULL << (i % 64);
+        }
+    }
+}
+
+static void classifier_intervals_free (struct filter_intervals *intervals) {
+    free(intervals->start);
+    free(intervals->sets);
+}
+
+/** Expand the port intervals into a table giving the interval of each port */
+static uint16_t *classifier_port_table (const struct filter_intervals *intervals) {
+    uint16_t *table = malloc(65536 * sizeof(uint16_t));
+    uint32_t port, interval = 0;
+
+    if(!table) {
+        abort();
+    }
+    for(port = 0; port < 65536; port++) {
+        if((interval + 1 < intervals->count) && (intervals->start[interval + 1].lo == port)) {
+            interval++;
+        }
+        table[port] = interval;
+    }
+    return table;
+}
+
+/** Check the network of the rule, returning its first and last address */
+static bool classifier_rule_net (in_addr_t net, uint8_t bitlen, struct filter_value *first, struct filter_value *last) {
+    uint32_t mask;
+
+    if(bitlen > 32) {
+        return false;
+    }
+    mask = bitlen ? (~0U << (32 - bitlen)) : 0;
+    net = ntohl(net);
+    if(net & ~mask) {
+        // march_cidr_and_address() never matches a network with host bits
+        return false;
+    }
+    first->hi = last->hi = 0;
+    first->lo = net;
+    last->lo = net | ~mask;
+    return true;
+}
+
+/** The same for an IPv6 network */
+static bool classifier_rule_net6 (const uint8_t *net, uint8_t bitlen, struct filter_value *first, struct filter_value *last) {
+    struct filter_value value, mask;
+
+    if(bitlen > 128) {
+        return false;
+    }
+    mask.hi = (bitlen >= 64) ? UINT64_MAX : (bitlen ? (~0ULL << (64 - bitlen)) : 0);
+    mask.lo = (bitlen <= 64) ? 0 : ((bitlen == 128) ? UINT64_MAX : (~0ULL << (128 - bitlen)));
+    value = filter_value_v6(net);
+    if((value.hi & ~mask.hi) || (value.lo & ~mask.lo)) {
+        // march_cidr6_and_address() never matches a network with host bits
+        return false;
+    }
+    *first = value;
+    last->hi = value.hi | ~mask.hi;
+    last->lo = value.lo | ~mask.lo;
+    return true;
+}
+
+static bool classifier_rule_nets (const filter_rule_key_t *key,
+                                  struct filter_value *src_first, struct filter_value *src_last,
+                                  struct filter_value *dst_first, struct filter_value *dst_last) {
+    if(key->bool_ipv6) {
+        return classifier_rule_net6(key->src_net6, key->src_net_bit_len, src_first, src_last)
+               && classifier_rule_net6(key->dst_net6, key->dst_net_bit_len, dst_first, dst_last);
+    }
+    return classifier_rule_net(key->src_net_cidr, key->src_net_bit_len, src_first, src_last)
+           && classifier_rule_net(key->dst_net_cidr, key->dst_net_bit_len, dst_first, dst_last);
+}
+
+static int classifier_compare_score (const void *a, const void *b) {
+    const filter_rule_t *x = *(filter_rule_t *const *)a;
+    const filter_rule_t *y = *(filter_rule_t *const *)b;
+    int score_x = x->key.src_net_bit_len + x->key.dst_net_bit_len;
+    int score_y = y->key.src_net_bit_len + y->key.dst_net_bit_len;
+
+    return score_y - score_x;
+}
+
+static void classifier_free (struct filter_classifier *classifier) {
+    if(!classifier) {
+        return;
+    }
+    classifier_intervals_free(&classifier->src_ip);
+    classifier_intervals_free(&classifier->dst_ip);
+    classifier_intervals_free(&classifier->src_port);
+    classifier_intervals_free(&classifier->dst_port);
+    free(classifier->src_port_interval);
+    free(classifier->dst_port_interval);
+    free(classifier->proto_sets);
+    free(classifier->rule);
+    free(classifier);
+}
+
+static struct filter_classifier *classifier_build (filter_rule_t *rules) {
+    struct filter_classifier *classifier;
+    filter_rule_t *item, *tmp;
+    struct filter_value *first, *last, *dst_first, *dst_last;
+    uint32_t i, nr = 0;
+
+    classifier = calloc(1, sizeof(*classifier));
+    if(!classifier) {
+        abort();
+    }
+    classifier->rule = malloc((HASH_COUNT(rules) + 1) * sizeof(filter_rule_t *));
+    if(!classifier->rule) {
+        abort();
+    }
+
+    HASH_ITER(hh, rules, item, tmp) {
+        struct filter_value first_addr, last_addr;
+
+        if(!classifier_rule_nets(&item->key, &first_addr, &last_addr, &first_addr, &last_addr)) {
+            continue;
+        }
+        classifier->rule[nr++] = item;
+    }
+
+    // The hash list is in the order the rules were added, which decides
+    // between equal scores, so the sort has to be stable
+    for(i = 1; i < nr; i++) {
+        filter_rule_t *rule = classifier->rule[i];
+        uint32_t j = i;
+        while(j && (classifier_compare_score(&classifier->rule[j - 1], &rule) > 0)) {
+            classifier->rule[j] = classifier->rule[j - 1];
+            j--;
+        }
+        classifier->rule[j] = rule;
+    }
+
+    classifier->rules = nr;
+    classifier->words = (nr + 63) / 64;
+    if(!classifier->words) {
+        classifier->words = 1;
+    }
+
+    classifier->proto_sets = calloc(2 * FILTER_PROTOS * classifier->words, sizeof(uint64_t));
+    first = calloc(nr + 1, sizeof(struct filter_value));
+    last = calloc(nr + 1, sizeof(struct filter_value));
+    dst_first = calloc(nr + 1, sizeof(struct filter_value));
+    dst_last = calloc(nr + 1, sizeof(struct filter_value));
+    if(!classifier->proto_sets || !first || !last || !dst_first || !dst_last) {
+        abort();
+    }
+
+    for(i = 0; i < nr; i++) {
+        const filter_rule_key_t *key = &classifier->rule[i]->key;
+        uint64_t *sets = &classifier->proto_sets[(key->bool_ipv6 ? FILTER_PROTOS : 0) * classifier->words];
+        uint64_t bit = 1ULL << (i % 64);
+
+        if(key->bool_tcp_configured) {
+            sets[FILTER_PROTO_TCP * classifier->words + i / 64] |= bit;
+        }
+        if(key->bool_udp_configured) {
+            sets[FILTER_PROTO_UDP * classifier->words + i / 64] |= bit;
+        }
+        if(key->bool_icmp_configured) {
+            sets[FILTER_PROTO_ICMP * classifier->words + i / 64] |= bit;
+        }
+    }
+
+    for(i = 0; i < nr; i++) {
+        classifier_rule_nets(&classifier->rule[i]->key, &first[i], &last[i], &dst_first[i], &dst_last[i]);
+    }
+    classifier_intervals_build(&classifier->src_ip, nr, classifier->words, first, last);
+    classifier_intervals_build(&classifier->dst_ip, nr, classifier->words, dst_first, dst_last);
+
+    for(i = 0; i < nr; i++) {
+        first[i].hi = last[i].hi = 0;
+        first[i].lo = classifier->rule[i]->key.src_port_range.start_port;
+        last[i].lo = classifier->rule[i]->key.src_port_range.end_port;
+    }
+    classifier_intervals_build(&classifier->src_port, nr, classifier->words, first, last);
+    classifier->src_port_interval = classifier_port_table(&classifier->src_port);
+
+    for(i = 0; i < nr; i++) {
+        first[i].hi = last[i].hi = 0;
+        first[i].lo = classifier->rule[i]->key.dst_port_range.start_port;
+        last[i].lo = classifier->rule[i]->key.dst_port_range.end_port;
+    }
+    classifier_intervals_build(&classifier->dst_port, nr, classifier->words, first, last);
+    classifier->dst_port_interval = classifier_port_table(&classifier->dst_port);
+
+    free(first);
+    free(last);
+    free(dst_first);
+    free(dst_last);
+
+    return classifier;
+}
+
+/** Find the best matching rule, with the same result as get_filter_rule() */
+static filter_rule_t *classifier_lookup (const struct filter_classifier *classifier,
+                                         const packet_address_proto_info_t *pkt_addr_info) {
+    const uint64_t *proto, *src_ip, *dst_ip;
+    const uint64_t *src_port = NULL, *dst_port = NULL;
+    struct filter_value src, dst;
+    uint32_t words, w;
+
+    if(!classifier) {
+        return NULL;
+    }
+    words = classifier->words;
+    proto = &classifier->proto_sets[(pkt_addr_info->bool_ipv6 ? FILTER_PROTOS : 0) * words];
+
+    switch(pkt_addr_info->proto) {
+        case FPP_TCP:
+            proto += FILTER_PROTO_TCP * words;
+            break;
+        case FPP_UDP:
+            proto += FILTER_PROTO_UDP * words;
+            break;
+        case FPP_ICMP:
+            proto += FILTER_PROTO_ICMP * words;
+            break;
+        default:
             return NULL;
+    }
+
+    if(pkt_addr_info->bool_ipv6) {
+        src = filter_value_v6(pkt_addr_info->src_ip6);
+        dst = filter_value_v6(pkt_addr_info->dst_ip6);
+    } else {
+        src = filter_value_v4(pkt_addr_info->src_ip);
+        dst = filter_value_v4(pkt_addr_info->dst_ip);
+    }
+    src_ip = &classifier->src_ip.sets[(size_t)classifier_interval_find(&classifier->src_ip, src) * words];
+    dst_ip = &classifier->dst_ip.sets[(size_t)classifier_interval_find(&classifier->dst_ip, dst) * words];
+
+    // ports are ignored for ICMP
+    if(pkt_addr_info->proto != FPP_ICMP) {
+        src_port = &classifier->src_port.sets[(size_t)classifier->src_port_interval[pkt_addr_info->src_port] * words];
+        dst_port = &classifier->dst_port.sets[(size_t)classifier->dst_port_interval[pkt_addr_info->dst_port] * words];
+    }
+
+    for(w = 0; w < words; w++) {
+        uint64_t match = proto[w] & src_ip[w] & dst_ip[w];
+
+        if(src_port) {
+            match &= src_port[w] & dst_port[w];
+        }
+        if(match) {
+            return classifier->rule[w * 64 + __builtin_ctzll(match)];
+        }
+    }
+
+    return NULL;
+}
+
+// A slot of the flow table
+struct filter_flow {
+    packet_address_proto_info_t key;
+    uint8_t used;               // the slot holds a flow
+    uint8_t referenced;         // seen again since the clock last passed
+    uint8_t accept;             // the verdict
+};
+
+static struct metrics {
+    uint32_t hit;               // verdict found in the flow table
+    uint32_t miss;              // verdict looked up in the rules
+    uint32_t evict;             // a flow replaced an older one
+} metrics;
+
+static struct n3n_metrics_items_llu32 metrics_items = {
+    .name = "count",
+    .desc = "Track the flow table of the traffic filter",
+    .name1 = "event",
+    .items = {
+        {
+            .val1 = "hit",
+            .offset = offsetof(struct metrics, hit),
+        },
+        {
+            .val1 = "miss",
+            .offset = offsetof(struct metrics, miss),
+        },
+        {
+            .val1 = "evict",
+            .offset = offsetof(struct metrics, evict),
+        },
+        { },
+    },
+};
+
+static struct n3n_metrics_module metrics_module = {
+    .name = "filter",
+    .data = &metrics,
+    .items_llu32 = &metrics_items,
+    .type = n3n_metrics_type_llu32,
+};
+
+static inline uint32_t filter_flow_hash (const packet_address_proto_info_t *key) {
+    uint32_t hash;
+    uint32_t src = key->src_ip, dst = key->dst_ip;
+    int i;
+
+    if(key->bool_ipv6) {
+        for(i = 0; i < 16; i += 4) {
+            uint32_t word;
+            memcpy(&word, &key->src_ip6[i], sizeof(word));
+            src = (src ^ word) * 0x01000193;
+            memcpy(&word, &key->dst_ip6[i], sizeof(word));
+            dst = (dst ^ word) * 0x01000193;
+        }
+    }
+
+    hash = src * 0x9e3779b1;
+    hash ^= dst * 0x85ebca77;
+    hash ^= ((uint32_t)key->src_port << 16 | key->dst_port) * 0xc2b2ae3d;
+    hash ^= key->proto;
+    hash ^= hash >> 15;
+    hash *= 0x2c1b3c6d;
+    hash ^= hash >> 13;
+    return hash;
+}
+
+/** Decide if the flow is accepted, from the flow table when it is known */
+static bool filter_flow_accept (network_traffic_filter_t *filter, packet_address_proto_info_t *pkt_addr_info) {
+
+    uint32_t slot = filter_flow_hash(pkt_addr_info);
+    struct filter_flow *flow, *victim = NULL;
+    filter_rule_t *rule;
+    bool accept = true;
+    int i;
+
+    for(i = 0; i < FILTER_FLOW_PROBES; i++) {
+        flow = &filter->flows[(slot + i) & (FILTER_FLOWS - 1)];
+        if(!flow->used) {
+            if(!victim) {
+                victim = flow;
+            }
+            // flows are never removed one at a time, so this ends the search
+            break;
         }
+        if(!memcmp(&flow->key, pkt_addr_info, sizeof(flow->key))) {
+            flow->referenced = 1;
+            metrics.hit++;
+            return flow->accept;
+        }
+    }
+    metrics.miss++;
 
-        rule_cache_find_result = malloc(sizeof(filter_rule_pair_cache_t));
-        memset(rule_cache_find_result, 0, sizeof(filter_rule_pair_cache_t));
-        rule_cache_find_result->key = *pkt_addr_info;
-        switch(rule_cache_find_result->key.proto) {
+    // without a matching rule, the flow is accepted
+    rule = classifier_lookup(filter->classifier, pkt_addr_info);
+    if(rule) {
+        switch(pkt_addr_info->proto) {
             case FPP_ICMP:
-                rule_cache_find_result->bool_allow_traffic = rule->bool_accept_icmp;
+                accept = rule->bool_accept_icmp;
                 break;
             case FPP_UDP:
-                rule_cache_find_result->bool_allow_traffic = rule->bool_accept_udp;
+                accept = rule->bool_accept_udp;
                 break;
             case FPP_TCP:
-                rule_cache_find_result->bool_allow_traffic = rule->bool_accept_tcp;
+                accept = rule->bool_accept_tcp;
                 break;
             default:
-                traceEvent(TRACE_WARNING, "### Generate filter rule cache failed!");
-                return NULL;
+                break;
+        }
+    }
+
+    if(!victim) {
+        // All the slots are taken, so the clock hand sweeps over them,
+        // giving each flow seen again since its last pass a second chance
+        for(i = 0; i < FILTER_FLOW_PROBES; i++) {
+            flow = &filter->flows[(slot + filter->flow_hand) & (FILTER_FLOWS - 1)];
+            filter->flow_hand = (filter->flow_hand + 1) % FILTER_FLOW_PROBES;
+            if(!flow->referenced) {
+                break;
+            }
+            flow->referenced = 0;
         }
-        traceEvent(TRACE_DEBUG, "### ADD filter cache %s", get_filter_packet_info_log_string(&rule_cache_find_result->key));
-        HASH_ADD(hh, filter->connections_rule_cache, key, sizeof(packet_address_proto_info_t), rule_cache_find_result);
+        victim = flow;
+        metrics.evict++;
     }
-    ++(rule_cache_find_result->active_count);
-    update_and_clear_cache_if_need(filter);
 
-    return rule_cache_find_result;
+    victim->key = *pkt_addr_info;
+    victim->used = 1;
+    victim->referenced = 0;
+    victim->accept = accept;
+
+    return accept;
 }
 
 /* for [-Wmissing-declarations] */
@@ -364,12 +995,10 @@ n2n_verdict filter_packet_from_peer (network_traffic_filter_t *filter, struct n3
 
 n2n_verdict filter_packet_from_peer (network_traffic_filter_t *filter, struct n3n_runtime_data *eee, const n3n_sock_t *peer, uint8_t *payload, uint16_t payload_size) {
 
-    filter_rule_pair_cache_t *cur_pkt_rule = 0;
     packet_address_proto_info_t pkt_info;
 
     collect_packet_info(&pkt_info, payload, payload_size);
-    cur_pkt_rule = get_or_create_filter_rule_cache(filter, &pkt_info);
-    if(cur_pkt_rule && !cur_pkt_rule->bool_allow_traffic) {
+    if(!filter_flow_accept(filter, &pkt_info)) {
         traceEvent(TRACE_DEBUG, "### DROP %s", get_filter_packet_info_log_string(&pkt_info));
         return N2N_DROP;
     }
@@ -382,12 +1011,10 @@ n2n_verdict filter_packet_from_tap (network_traffic_filter_t *filter, struct n3n
 
 n2n_verdict filter_packet_from_tap (network_traffic_filter_t *filter, struct n3n_runtime_data *eee, uint8_t *payload, uint16_t payload_size) {
 
-    filter_rule_pair_cache_t *cur_pkt_rule = 0;
     packet_address_proto_info_t pkt_info;
 
     collect_packet_info(&pkt_info, payload, payload_size);
-    cur_pkt_rule = get_or_create_filter_rule_cache(filter, &pkt_info);
-    if(cur_pkt_rule && !cur_pkt_rule->bool_allow_traffic) {
+    if(!filter_flow_accept(filter, &pkt_info)) {
         traceEvent(TRACE_DEBUG, "### DROP %s", get_filter_packet_info_log_string(&pkt_info));
         return N2N_DROP;
     }
@@ -403,6 +1030,10 @@ network_traffic_filter_t *create_network_traffic_filter () {
     network_traffic_filter_t *filter = malloc(sizeof(network_traffic_filter_t));
 
     memset(filter, 0, sizeof(network_traffic_filter_t));
+    filter->flows = calloc(FILTER_FLOWS, sizeof(struct filter_flow));
+    if(!filter->flows) {
+        abort();
+    }
     filter->filter_packet_from_peer = filter_packet_from_peer;
     filter->filter_packet_from_tap = filter_packet_from_tap;
 
@@ -415,7 +1046,6 @@ void destroy_network_traffic_filter (network_traffic_filter_t *filter);
 void destroy_network_traffic_filter (network_traffic_filter_t *filter) {
 
     filter_rule_t *el = 0, *tmp = 0;
-    filter_rule_pair_cache_t* el1 = 0, * tmp1 = 0;
 
     if(!filter) {
         return;
@@ -428,13 +1058,8 @@ void destroy_network_traffic_filter (network_traffic_filter_t *filter) {
         }
     }
 
-    if(filter->connections_rule_cache) {
-        HASH_ITER(hh, filter->connections_rule_cache, el1, tmp1) {
-            HASH_DEL(filter->connections_rule_cache, el1);
-            free(el);
-        }
-    }
-
+    classifier_free(filter->classifier);
+    free(filter->flows);
     free(filter);
 }
 
@@ -451,6 +1076,12 @@ void network_traffic_filter_add_rule (network_traffic_filter_t* filter, filter_r
         HASH_ADD(hh, filter->rules, key, sizeof(filter_rule_key_t), new_rule);
         traceEvent(TRACE_NORMAL, "### ADD network traffic filter %s", get_filter_rule_info_log_string(new_rule));
     }
+
+    // Compile the whole rule set again, and forget the verdicts cached so
+    // far, as they might be decided by a different rule now
+    classifier_free(filter->classifier);
+    filter->classifier = classifier_build(filter->rules);
+    memset(filter->flows, 0, FILTER_FLOWS * sizeof(struct filter_flow));
 }
 
 /* for [-Wmissing-declarations] */
@@ -469,6 +1100,57 @@ in_addr_t get_int32_addr_from_ip_string (const char* begin, const char* next_pos
     return inet_addr(buf);
 }
 
+/* for [-Wmissing-declarations] */
+uint8_t process_traffic_filter_net (const char* begin, const char* next_pos_of_last_char, filter_rule_t *rule_struct, int is_src);
+
+// Store an IPv4 net, or an IPv6 one written in brackets, with the prefix
+// length of a single address as the default
+uint8_t process_traffic_filter_net (const char* begin, const char* next_pos_of_last_char, filter_rule_t *rule_struct, int is_src) {
+
+    char buf[INET6_ADDRSTRLEN] = {0};
+    uint8_t ipv6 = (*begin == '[');
+    uint8_t *net6 = is_src ? rule_struct->key.src_net6 : rule_struct->key.dst_net6;
+
+    if(is_src) {
+        rule_struct->key.bool_ipv6 = ipv6;
+    } else if(rule_struct->key.bool_ipv6 != ipv6) {
+        traceEvent(TRACE_WARNING, "process filter rule with a source and destination of different address families");
+        return 0;
+    }
+
+    if(!ipv6) {
+        if(is_src) {
+            rule_struct->key.src_net_cidr = get_int32_addr_from_ip_string(begin, next_pos_of_last_char);
+            rule_struct->key.src_net_bit_len = 32;
+        } else {
+            rule_struct->key.dst_net_cidr = get_int32_addr_from_ip_string(begin, next_pos_of_last_char);
+            rule_struct->key.dst_net_bit_len = 32;
+        }
+        return 1;
+    }
+
+    // skip the brackets
+    begin++;
+    next_pos_of_last_char--;
+    if((next_pos_of_last_char < begin) || (*next_pos_of_last_char != ']')
+       || ((next_pos_of_last_char - begin) >= (int)sizeof(buf))) {
+        traceEvent(TRACE_WARNING, "process filter rule with invalid IPv6 net");
+        return 0;
+    }
+    memcpy(buf, begin, next_pos_of_last_char - begin);
+    if(inet_pton(AF_INET6, buf, net6) != 1) {
+        traceEvent(TRACE_WARNING, "process filter rule with invalid IPv6 net %s", buf);
+        return 0;
+    }
+
+    if(is_src) {
+        rule_struct->key.src_net_bit_len = 128;
+    } else {
+        rule_struct->key.dst_net_bit_len = 128;
+    }
+    return 1;
+}
+
 /* for [-Wmissing-declarations] */
 int get_int32_from_number_string (const char* begin, const char* next_pos_of_last_char);
 
@@ -485,6 +1167,36 @@ int get_int32_from_number_string (const char* begin, const char* next_pos_of_las
     return atoi(buf);
 }
 
+/* for [-Wmissing-declarations] */
+uint8_t process_traffic_filter_bit_len (const char* begin, const char* next_pos_of_last_char, filter_rule_t *rule_struct, int is_src);
+
+// Store the prefix length of a net, which the net itself must already be
+// stored for, as the limit depends on its address family
+uint8_t process_traffic_filter_bit_len (const char* begin, const char* next_pos_of_last_char, filter_rule_t *rule_struct, int is_src) {
+
+    int max_bit_len = rule_struct->key.bool_ipv6 ? 128 : 32;
+    int bit_len;
+
+    // the range check needs the whole number, which is at most "128"
+    if((next_pos_of_last_char == begin) || ((next_pos_of_last_char - begin) > 3)) {
+        traceEvent(TRACE_WARNING, "process filter rule with an invalid prefix length");
+        return 0;
+    }
+
+    bit_len = get_int32_from_number_string(begin, next_pos_of_last_char);
+    if(bit_len > max_bit_len) {
+        traceEvent(TRACE_WARNING, "process filter rule with a prefix length beyond %d", max_bit_len);
+        return 0;
+    }
+
+    if(is_src) {
+        rule_struct->key.src_net_bit_len = bit_len;
+    } else {
+        rule_struct->key.dst_net_bit_len = bit_len;
+    }
+    return 1;
+}
+
 /* for [-Wmissing-declarations] */
 void process_traffic_filter_proto (const char* begin, const char* next_pos_of_last_char, filter_rule_t *rule_struct);
 
@@ -540,15 +1252,20 @@ uint8_t process_traffic_filter_rule_str (const char *rule_str, filter_rule_t *ru
             case FPS_SRC_NET: {
                 if((*cur_pos >= '0' && *cur_pos <= '9') || *cur_pos == '.') {
                     ; // Normal FPS_SRC_NET, next char
+                } else if(*cur_pos && (*stage_begin_pos == '[') && !memchr(stage_begin_pos, ']', cur_pos - stage_begin_pos)) {
+                    ; // Inside the brackets of an IPv6 FPS_SRC_NET, next char
                 } else if(*cur_pos == '/') {
                     // FPS_SRC_NET finish, next is FPS_SRC_NET_BIT_LEN
-                    rule_struct->key.src_net_cidr = get_int32_addr_from_ip_string(stage_begin_pos, cur_pos);
+                    if(!process_traffic_filter_net(stage_begin_pos, cur_pos, rule_struct, 1)) {
+                        return 0;
+                    }
                     stage_begin_pos = cur_pos + 1;
                     stage = FPS_SRC_NET_BIT_LEN;
                 } else if(*cur_pos == ':') {
                     // FPS_SRC_NET finish, ignore FPS_SRC_NET_BIT_LEN(default 32), next is one of FPS_SRC_PORT_RANGE/FPS_SRC_PORT_SINGLE
-                    rule_struct->key.src_net_cidr = get_int32_addr_from_ip_string(stage_begin_pos, cur_pos);
-                    rule_struct->key.src_net_bit_len = 32;
+                    if(!process_traffic_filter_net(stage_begin_pos, cur_pos, rule_struct, 1)) {
+                        return 0;
+                    }
                     stage_begin_pos = cur_pos + 1;
                     if(*(cur_pos + 1) == '[') {
                         stage = FPS_SRC_PORT_RANGE;
@@ -558,8 +1275,9 @@ uint8_t process_traffic_filter_rule_str (const char *rule_str, filter_rule_t *ru
                 } else if(*cur_pos == ',') {
                     // FPS_SRC_NET finish, ignore FPS_SRC_NET_BIT_LEN(default 32), ignore FPS_SRC_PORT(default all),
                     // next is FPS_DST_NET
-                    rule_struct->key.src_net_cidr = get_int32_addr_from_ip_string(stage_begin_pos, cur_pos);
-                    rule_struct->key.src_net_bit_len = 32;
+                    if(!process_traffic_filter_net(stage_begin_pos, cur_pos, rule_struct, 1)) {
+                        return 0;
+                    }
                     rule_struct->key.src_port_range.start_port = 0;
                     rule_struct->key.src_port_range.end_port = 65535;
                     stage_begin_pos = cur_pos + 1;
@@ -576,7 +1294,9 @@ uint8_t process_traffic_filter_rule_str (const char *rule_str, filter_rule_t *ru
                     ; // Normal FPS_SRC_NET_BIT_LEN, next char
                 } else if(*cur_pos == ':') {
                     // FPS_SRC_NET_BIT_LEN finish, next is one of FPS_SRC_PORT_RANGE/FPS_SRC_PORT_SINGLE
-                    rule_struct->key.src_net_bit_len = get_int32_from_number_string(stage_begin_pos, cur_pos);
+                    if(!process_traffic_filter_bit_len(stage_begin_pos, cur_pos, rule_struct, 1)) {
+                        return 0;
+                    }
                     stage_begin_pos = cur_pos + 1;
                     if(*(cur_pos + 1) == '[') {
                         stage = FPS_SRC_PORT_RANGE;
@@ -585,7 +1305,9 @@ uint8_t process_traffic_filter_rule_str (const char *rule_str, filter_rule_t *ru
                     }
                 } else if(*cur_pos == ',') {
                     // FPS_SRC_NET_BIT_LEN finish, ignore FPS_SRC_PORT(default all), next is FPS_DST_NET
-                    rule_struct->key.src_net_bit_len = get_int32_from_number_string(stage_begin_pos, cur_pos);;
+                    if(!process_traffic_filter_bit_len(stage_begin_pos, cur_pos, rule_struct, 1)) {
+                        return 0;
+                    }
                     rule_struct->key.src_port_range.start_port = 0;
                     rule_struct->key.src_port_range.end_port = 65535;
                     stage_begin_pos = cur_pos + 1;
@@ -658,15 +1380,20 @@ uint8_t process_traffic_filter_rule_str (const char *rule_str, filter_rule_t *ru
             case FPS_DST_NET: {
                 if((*cur_pos >= '0' && *cur_pos <= '9') || *cur_pos == '.') {
                     ; // Normal FPS_DST_NET, next char
+                } else if(*cur_pos && (*stage_begin_pos == '[') && !memchr(stage_begin_pos, ']', cur_pos - stage_begin_pos)) {
+                    ; // Inside the brackets of an IPv6 FPS_DST_NET, next char
                 } else if(*cur_pos == '/') {
                     // FPS_DST_NET finish, next is FPS_DST_NET_BIT_LEN
-                    rule_struct->key.dst_net_cidr = get_int32_addr_from_ip_string(stage_begin_pos, cur_pos);
+                    if(!process_traffic_filter_net(stage_begin_pos, cur_pos, rule_struct, 0)) {
+                        return 0;
+                    }
                     stage_begin_pos = cur_pos + 1;
                     stage = FPS_DST_NET_BIT_LEN;
                 } else if(*cur_pos == ':') {
                     // FPS_DST_NET finish, ignore FPS_DST_NET_BIT_LEN(default 32), next is one of FPS_DST_PORT_RANGE/FPS_DST_PORT_SINGLE
-                    rule_struct->key.dst_net_cidr = get_int32_addr_from_ip_string(stage_begin_pos, cur_pos);
-                    rule_struct->key.dst_net_bit_len = 32;
+                    if(!process_traffic_filter_net(stage_begin_pos, cur_pos, rule_struct, 0)) {
+                        return 0;
+                    }
                     stage_begin_pos = cur_pos + 1;
                     if(*(cur_pos + 1) == '[') {
                         stage = FPS_DST_PORT_RANGE;
@@ -676,8 +1403,9 @@ uint8_t process_traffic_filter_rule_str (const char *rule_str, filter_rule_t *ru
                 } else if((*cur_pos == ',') || (*cur_pos == 0)) {
                     // FPS_DST_NET finish, ignore FPS_DST_NET_BIT_LEN(default 32), ignore FPS_DST_PORT(default all),
                     // next is FPS_PROTO
-                    rule_struct->key.dst_net_cidr = get_int32_addr_from_ip_string(stage_begin_pos, cur_pos);
-                    rule_struct->key.dst_net_bit_len = 32;
+                    if(!process_traffic_filter_net(stage_begin_pos, cur_pos, rule_struct, 0)) {
+                        return 0;
+                    }
                     rule_struct->key.dst_port_range.start_port = 0;
                     rule_struct->key.dst_port_range.end_port = 65535;
                     stage_begin_pos = cur_pos + 1;
@@ -694,7 +1422,9 @@ uint8_t process_traffic_filter_rule_str (const char *rule_str, filter_rule_t *ru
                     ; // Normal FPS_DST_NET_BIT_LEN, next char
                 } else if(*cur_pos == ':') {
                     // FPS_DST_NET_BIT_LEN finish, next is one of FPS_DST_PORT_RANGE/FPS_DST_PORT_SINGLE
-                    rule_struct->key.dst_net_bit_len = get_int32_from_number_string(stage_begin_pos, cur_pos);
+                    if(!process_traffic_filter_bit_len(stage_begin_pos, cur_pos, rule_struct, 0)) {
+                        return 0;
+                    }
                     stage_begin_pos = cur_pos + 1;
                     if(*(cur_pos + 1) == '[') {
                         stage = FPS_DST_PORT_RANGE;
@@ -703,7 +1433,9 @@ uint8_t process_traffic_filter_rule_str (const char *rule_str, filter_rule_t *ru
                     }
                 } else if((*cur_pos == ',') || (*cur_pos == 0)) {
                     // FPS_DST_NET_BIT_LEN finish, ignore FPS_DST_PORT(default all), next is FPS_PROTO
-                    rule_struct->key.dst_net_bit_len = get_int32_from_number_string(stage_begin_pos, cur_pos);;
+                    if(!process_traffic_filter_bit_len(stage_begin_pos, cur_pos, rule_struct, 0)) {
+                        return 0;
+                    }
                     rule_struct->key.dst_port_range.start_port = 0;
                     rule_struct->key.dst_port_range.end_port = 65535;
                     stage_begin_pos = cur_pos + 1;
@@ -805,3 +1537,217 @@ uint8_t process_traffic_filter_rule_str (const char *rule_str, filter_rule_t *ru
 
     return 1;
 }
+
+
+/* *************************************************** */
+
+#define BENCH_RULES     512
+#define BENCH_PACKETS   1024
+
+struct bench_filter {
+    network_traffic_filter_t *filter;
+    packet_address_proto_info_t packet[BENCH_PACKETS];
+    uint32_t next;
+};
+
+static uint32_t bench_random (uint32_t *state) {
+    *state = *state * 1103515245 + 12345;
+    return *state >> 8;
+}
+
+// A synthetic rule set: mostly narrow rules below a few wide ones, as an
+// edge protecting a site would have, and packets that partly hit them
+// An address in 2001:db8::/32, with 18 bits from value after the prefix and
+// everything beyond bitlen cleared
+static void bench_addr6 (uint8_t *addr, uint32_t value, uint8_t bitlen) {
+    int i;
+
+    memset(addr, 0, 16);
+    addr[0] = 0x20;
+    addr[1] = 0x01;
+    addr[2] = 0x0d;
+    addr[3] = 0xb8;
+    addr[4] = (value >> 16) & 0x03;
+    addr[5] = value >> 8;
+    addr[6] = value;
+    for(i = 0; i < 16; i++) {
+        if(bitlen < 8 * (i + 1)) {
+            addr[i] &= (bitlen > 8 * i) ? (uint8_t)(0xff << (8 * (i + 1) - bitlen)) : 0;
+        }
+    }
+}
+
+static void *bench_setup (void *const ctx) {
+    struct bench_filter *bench = calloc(1, sizeof(*bench));
+    filter_rule_t *rules = NULL, *rule, *tmp;
+    uint32_t state = 1;
+    int i;
+
+    if(!bench) {
+        abort();
+    }
+
+    for(i = 0; i < BENCH_RULES; i++) {
+        static const uint8_t bitlens[] = { 0, 8, 16, 24, 24, 32, 32, 32 };
+        uint8_t src_bitlen = bitlens[bench_random(&state) % 8];
+        uint8_t dst_bitlen = bitlens[bench_random(&state) % 8];
+        uint32_t src = 0x0a000000 | (bench_random(&state) & 0x3ffff);
+        uint32_t dst = 0x0a000000 | (bench_random(&state) & 0x3ffff);
+        uint16_t port = bench_random(&state) % 2048;
+
+        rule = calloc(1, sizeof(*rule));
+        if(!rule) {
+            abort();
+        }
+        if(!(i % 4)) {
+            // One in four of the rules is for IPv6
+            static const uint8_t bitlens6[] = { 0, 32, 40, 48, 48, 56, 128, 128 };
+            src_bitlen = bitlens6[src_bitlen ? src_bitlen / 4 - 1 : 0];
+            dst_bitlen = bitlens6[dst_bitlen ? dst_bitlen / 4 - 1 : 0];
+            rule->key.bool_ipv6 = 1;
+            bench_addr6(rule->key.src_net6, src, src_bitlen);
+            bench_addr6(rule->key.dst_net6, dst, dst_bitlen);
+        } else {
+            rule->key.src_net_cidr = htonl(src_bitlen ? src & (~0U << (32 - src_bitlen)) : 0);
+            rule->key.dst_net_cidr = htonl(dst_bitlen ? dst & (~0U << (32 - dst_bitlen)) : 0);
+        }
+        rule->key.src_net_bit_len = src_bitlen;
+        rule->key.dst_net_bit_len = dst_bitlen;
+        rule->key.src_port_range.start_port = 0;
+        rule->key.src_port_range.end_port = 65535;
+        rule->key.dst_port_range.start_port = port;
+        rule->key.dst_port_range.end_port = port + bench_random(&state) % 64;
+        rule->key.bool_tcp_configured = bench_random(&state) & 1;
+        rule->key.bool_udp_configured = bench_random(&state) & 1;
+        rule->key.bool_icmp_configured = !(bench_random(&state) % 8);
+        rule->bool_accept_tcp = bench_random(&state) & 1;
+        rule->bool_accept_udp = bench_random(&state) & 1;
+        rule->bool_accept_icmp = bench_random(&state) & 1;
+        HASH_ADD(hh, rules, key, sizeof(filter_rule_key_t), rule);
+    }
+
+    // Without logging every one of the rules as it is added
+    int level = getTraceLevel();
+    setTraceLevel(TRACE_ERROR);
+    bench->filter = create_network_traffic_filter();
+    network_traffic_filter_add_rule(bench->filter, rules);
+    setTraceLevel(level);
+
+    HASH_ITER(hh, rules, rule, tmp) {
+        HASH_DEL(rules, rule);
+        free(rule);
+    }
+
+    for(i = 0; i < BENCH_PACKETS; i++) {
+        static const filter_packet_proto protos[] = { FPP_TCP, FPP_TCP, FPP_UDP, FPP_ICMP };
+        packet_address_proto_info_t *packet = &bench->packet[i];
+
+        if(!(i % 4)) {
+            packet->bool_ipv6 = 1;
+            bench_addr6(packet->src_ip6, bench_random(&state), 128);
+            bench_addr6(packet->dst_ip6, bench_random(&state), 128);
+        } else {
+            packet->src_ip = htonl(0x0a000000 | (bench_random(&state) & 0x3ffff));
+            packet->dst_ip = htonl(0x0a000000 | (bench_random(&state) & 0x3ffff));
+        }
+        packet->src_port = bench_random(&state);
+        packet->dst_port = bench_random(&state) % 2048;
+        packet->proto = protos[bench_random(&state) % 4];
+    }
+
+    return bench;
+}
+
+static void bench_teardown (void *const ctx) {
+    struct bench_filter *bench = ctx;
+
+    destroy_network_traffic_filter(bench->filter);
+    free(bench);
+}
+
+// Classify one packet, as on a flow cache miss
+static const ssize_t bench_classify_run (
+    void *const ctx,
+    const void *data_in,
+    const ssize_t data_in_size,
+    ssize_t *const bytes_in
+) {
+    struct bench_filter *bench = ctx;
+    packet_address_proto_info_t *packet = &bench->packet[bench->next++ % BENCH_PACKETS];
+
+    classifier_lookup(bench->filter->classifier, packet);
+
+    *bytes_in = sizeof(*packet);
+    return 0;
+}
+
+// The same, with the walk over every rule the classifier replaced
+static const ssize_t bench_linear_run (
+    void *const ctx,
+    const void *data_in,
+    const ssize_t data_in_size,
+    ssize_t *const bytes_in
+) {
+    struct bench_filter *bench = ctx;
+    packet_address_proto_info_t *packet = &bench->packet[bench->next++ % BENCH_PACKETS];
+
+    get_filter_rule(&bench->filter->rules, packet);
+
+    *bytes_in = sizeof(*packet);
+    return 0;
+}
+
+static int bench_check (void *const ctx, const int level) {
+    struct bench_filter *bench = ctx;
+    int matched = 0;
+    int result = 0;
+    int i;
+
+    for(i = 0; i < BENCH_PACKETS; i++) {
+        filter_rule_t *want = get_filter_rule(&bench->filter->rules, &bench->packet[i]);
+        filter_rule_t *got = classifier_lookup(bench->filter->classifier, &bench->packet[i]);
+
+        if(want != got) {
+            result++;
+        }
+        if(want) {
+            matched++;
+        }
+    }
+
+    if(level) {
+        printf("filter: rules=%u packets=%i matched=%i result=%i\n",
+               bench->filter->classifier->rules, BENCH_PACKETS, matched, result);
+    }
+    return result;
+}
+
+static struct bench_item bench_classify = {
+    .name = "filter_classify",
+    .ctx_size = 0,
+    .setup = bench_setup,
+    .run = bench_classify_run,
+    .check = bench_check,
+    .teardown = bench_teardown,
+    .data_in = test_data_none,
+    .data_out = test_data_none,
+};
+
+static struct bench_item bench_linear = {
+    .name = "filter_classify",
+    .variant = "linear",
+    .flags = BENCH_SKIP_CHECK,
+    .ctx_size = 0,
+    .setup = bench_setup,
+    .run = bench_linear_run,
+    .check = bench_check,
+    .teardown = bench_teardown,
+    .data_in = test_data_none,
+    .data_out = test_data_none,
+};
+
+void n3n_initfuncs_network_traffic_filter () {
+    n3n_metrics_register(&metrics_module);
+    n3n_benchmark_register(&bench_linear);
+    n3n_benchmark_register(&bench_classify);
+}
@@ -28,10 +28,21 @@
 // this is free and unencumbered software released into the public domain
 
 
+#include "cpu.h"               // for n3n_cpu_kernel_select, n3n_cpu_kernel_find
 #include "pearson.h"
 #include "portable_endian.h"  // for le64toh, htobe64
 
 
+// this file is built once as the baseline which also carries the public API, and on x86_64 once more as
+// pearson_avx2.c which only provides the kernel for the multi-buffer hash -- see speck.c for the same
+
+
+#if !defined (PEARSON_KERNELS)
+#define PEARSON_KERNELS pearson_kernels_base
+#define PEARSON_PUBLIC_API
+#endif
+
+
 // Christopher Wellons' triple32 from https://github.com/skeeto/hash-prospector
 // published under The Unlicense
 #define permute32(in) \
@@ -73,6 +84,9 @@
     permute64(hash ## part)
 
 
+#if defined (PEARSON_PUBLIC_API)
+
+
 void pearson_hash_256 (uint8_t *out, const uint8_t *in, size_t len) {
 
     uint64_t *current;
@@ -135,13 +149,12 @@ void pearson_hash_256 (uint8_t *out, const uint8_t *in, size_t len) {
 }
 
 
-void pearson_hash_128 (uint8_t *out, const uint8_t *in, size_t len) {
+// continue a 128 bit hash from hash1 and hash2, with len bytes of the input left
+static inline void pearson_hash_128_tail (uint8_t *out, uint64_t hash1, uint64_t hash2,
+                                          const uint8_t *in, size_t len, uint64_t org_len) {
 
     uint64_t *current;
     current = (uint64_t*)in;
-    uint64_t org_len = len;
-    uint64_t hash1 = 0;
-    uint64_t hash2 = 0;
 
     while(len > 7) {
         // digest words little endian first
@@ -181,12 +194,17 @@ void pearson_hash_128 (uint8_t *out, const uint8_t *in, size_t len) {
 }
 
 
-uint64_t pearson_hash_64 (const uint8_t *in, size_t len) {
+void pearson_hash_128 (uint8_t *out, const uint8_t *in, size_t len) {
+
+    pearson_hash_128_tail(out, 0, 0, in, len, len);
+}
+
+
+// continue a 64 bit hash from hash1, with len bytes of the input left
+static inline uint64_t pearson_hash_64_tail (uint64_t hash1, const uint8_t *in, size_t len, uint64_t org_len) {
 
     uint64_t *current;
     current = (uint64_t*)in;
-    uint64_t org_len = len;
-    uint64_t hash1 = 0;
 
     while(len > 7) {
         // digest words little endian first
@@ -215,6 +233,212 @@ uint64_t pearson_hash_64 (const uint8_t *in, size_t len) {
 }
 
 
+uint64_t pearson_hash_64 (const uint8_t *in, size_t len) {
+
+    return pearson_hash_64_tail(0, in, len, len);
+}
+
+
+#endif // PEARSON_PUBLIC_API
+
+
+// multi-buffer -- every input is a chain of its own, so several of them can be hashed side by side,
+// in the lanes of two AVX2 vectors or as interleaved scalar chains; all lanes move on together as
+// long as every input has a whole word left, the rest of each input is finished on its own
+
+#define PEARSON_LANES 8
+
+struct pearson_kernels {
+    void (*hash_64_lanes) (uint64_t hash[PEARSON_LANES], const uint8_t *in[PEARSON_LANES], size_t words);
+};
+
+
+#if defined (__AVX2__)
+
+#include <immintrin.h>
+
+// AVX2 has no 64 bit multiply, so build it from the 32 bit ones
+static inline __m256i pearson_mul64 (__m256i a, uint64_t c) {
+
+    __m256i lo = _mm256_mul_epu32(a, _mm256_set1_epi64x(c));
+    __m256i hi = _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), _mm256_set1_epi64x(c)),
+                                  _mm256_mul_epu32(a, _mm256_set1_epi64x(c >> 32)));
+
+    return _mm256_add_epi64(lo, _mm256_slli_epi64(hi, 32));
+}
+
+static inline __m256i pearson_round (__m256i hash, __m256i in) {
+
+    hash = _mm256_xor_si256(hash, in);
+    hash = _mm256_sub_epi64(hash, _mm256_set1_epi64x(1));
+    // permute64
+    hash = _mm256_xor_si256(hash, _mm256_srli_epi64(hash, 30));
+    hash = pearson_mul64(hash, 0xbf58476d1ce4e5b9);
+    hash = _mm256_xor_si256(hash, _mm256_srli_epi64(hash, 27));
+    hash = pearson_mul64(hash, 0x94d049bb133111eb);
+    hash = _mm256_xor_si256(hash, _mm256_srli_epi64(hash, 31));
+
+    return hash;
+}
+
+static void pearson_hash_64_lanes_avx2 (uint64_t hash[PEARSON_LANES], const uint8_t *in[PEARSON_LANES], size_t words) {
+
+    __m256i h0 = _mm256_setzero_si256();
+    __m256i h1 = _mm256_setzero_si256();
+    uint64_t word[PEARSON_LANES];
+    size_t i;
+    int l;
+
+    for(i = 0; i < words; i++) {
+        for(l = 0; l < PEARSON_LANES; l++)
+            memcpy(&word[l], in[l] + 8 * i, sizeof(word[l]));
+        h0 = pearson_round(h0, _mm256_loadu_si256((__m256i*)&word[0]));
+        h1 = pearson_round(h1, _mm256_loadu_si256((__m256i*)&word[4]));
+    }
+
+    _mm256_storeu_si256((__m256i*)&hash[0], h0);
+    _mm256_storeu_si256((__m256i*)&hash[4], h1);
+}
+
+#define PEARSON_VARIANT_NAME "avx2"
+
+#define pearson_hash_64_lanes pearson_hash_64_lanes_avx2
+
+#else // plain C
+
+// interleaving the chains hides the multiply latency
+static void pearson_hash_64_lanes_c (uint64_t hash[PEARSON_LANES], const uint8_t *in[PEARSON_LANES], size_t words) {
+
+    uint64_t word;
+    size_t i;
+    int l;
+
+    for(l = 0; l < PEARSON_LANES; l++)
+        hash[l] = 0;
+
+    for(i = 0; i < words; i++) {
+        for(l = 0; l < PEARSON_LANES; l++) {
+            memcpy(&word, in[l] + 8 * i, sizeof(word));
+            hash[l] ^= le64toh(word);
+            dec1(hash[l]);
+            permute64(hash[l]);
+        }
+    }
+}
+
+#define PEARSON_VARIANT_NAME "c"
+
+#define pearson_hash_64_lanes pearson_hash_64_lanes_c
+
+#endif // AVX2 vs. plain C
+
+
+const struct pearson_kernels PEARSON_KERNELS = {
+    .hash_64_lanes = pearson_hash_64_lanes,
+};
+
+
+#if defined (PEARSON_PUBLIC_API)
+
+
+static void pearson_hash_64_multi_kernels (const struct pearson_kernels *kernels,
+                                           uint64_t out[], const uint8_t *in[], const size_t len[], int count) {
+
+    uint64_t hash[PEARSON_LANES];
+    const uint8_t *lane_in[PEARSON_LANES];
+    size_t words;
+    int done, lanes, l;
+
+    for(done = 0; done < count; done += lanes) {
+        lanes = count - done;
+        if(lanes > PEARSON_LANES)
+            lanes = PEARSON_LANES;
+
+        // a short group fills its spare lanes with its first input
+        words = len[done] / 8;
+        for(l = 0; l < PEARSON_LANES; l++) {
+            lane_in[l] = in[done + ((l < lanes) ? l : 0)];
+            if((l < lanes) && (len[done + l] / 8 < words))
+                words = len[done + l] / 8;
+        }
+
+        kernels->hash_64_lanes(hash, lane_in, words);
+
+        for(l = 0; l < lanes; l++)
+            out[done + l] = pearson_hash_64_tail(hash[l], in[done + l] + 8 * words,
+                                                 len[done + l] - 8 * words, len[done + l]);
+    }
+}
+
+
+#if defined (N3N_CPU_DISPATCH)
+extern const struct pearson_kernels pearson_kernels_avx2;
+#endif
+
+static const struct n3n_cpu_variant pearson_variants[] = {
+#if defined (N3N_CPU_DISPATCH)
+    { .name = "avx2", .feature = n3n_cpu_avx2, .kernels = &pearson_kernels_avx2 },
+#endif
+    { .name = PEARSON_VARIANT_NAME, .feature = n3n_cpu_baseline, .kernels = &pearson_kernels_base },
+};
+
+static struct n3n_cpu_kernel pearson_kernel = {
+    .name = "pearson",
+    .variants = pearson_variants,
+    .nr_variants = sizeof(pearson_variants) / sizeof(pearson_variants[0]),
+};
+
+
+void pearson_hash_64_multi (uint64_t out[], const uint8_t *in[], const size_t len[], int count) {
+
+    pearson_hash_64_multi_kernels(n3n_cpu_kernel_select(&pearson_kernel), out, in, len, count);
+}
+
+
+#if defined (__SSE2__)
+
+#include <emmintrin.h>
+
+// the two chains of pearson_hash_128() in the lanes of one vector -- with the 64 bit multiply built
+// from the 32 bit ones, this is slower than the scalar code where both chains already run in parallel,
+// so it is only built for comparison in the benchmark and pearson_hash_128() stays scalar
+
+static inline __m128i pearson_mul64_sse2 (__m128i a, uint64_t c) {
+
+    __m128i lo = _mm_mul_epu32(a, _mm_set1_epi64x(c));
+    __m128i hi = _mm_add_epi64(_mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_set1_epi64x(c)),
+                               _mm_mul_epu32(a, _mm_set1_epi64x(c >> 32)));
+
+    return _mm_add_epi64(lo, _mm_slli_epi64(hi, 32));
+}
+
+static void pearson_hash_128_sse2 (uint8_t *out, const uint8_t *in, size_t len) {
+
+    // lane 0 is hash1 and takes one decrement, lane 1 is hash2 and takes two
+    __m128i dec = _mm_set_epi64x(2, 1);
+    __m128i hash = _mm_setzero_si128();
+    uint64_t word, h[2];
+    size_t i, words = len / 8;
+
+    for(i = 0; i < words; i++) {
+        memcpy(&word, in + 8 * i, sizeof(word));
+        hash = _mm_xor_si128(hash, _mm_set1_epi64x(le64toh(word)));
+        hash = _mm_sub_epi64(hash, dec);
+        // permute64
+        hash = _mm_xor_si128(hash, _mm_srli_epi64(hash, 30));
+        hash = pearson_mul64_sse2(hash, 0xbf58476d1ce4e5b9);
+        hash = _mm_xor_si128(hash, _mm_srli_epi64(hash, 27));
+        hash = pearson_mul64_sse2(hash, 0x94d049bb133111eb);
+        hash = _mm_xor_si128(hash, _mm_srli_epi64(hash, 31));
+    }
+
+    _mm_storeu_si128((__m128i*)h, hash);
+    pearson_hash_128_tail(out, h[0], h[1], in + 8 * words, len - 8 * words, len);
+}
+
+#endif // SSE2
+
+
 uint32_t pearson_hash_32 (const uint8_t *in, size_t len) {
 
     return pearson_hash_64(in, len);
@@ -338,6 +562,73 @@ static int bench_64_check (void *ctx, int level) {
     return 0;
 }
 
+// Inputs starting at successive bytes of the input, so all of different
+// lengths, and enough to fill one group of lanes and part of another
+#define BENCH_MULTI_INPUTS  12
+
+struct bench_multi {
+    const struct pearson_kernels *kernels;
+    const uint8_t *in[BENCH_MULTI_INPUTS];
+    size_t len[BENCH_MULTI_INPUTS];
+    uint64_t out[BENCH_MULTI_INPUTS];
+};
+
+// The builds of the kernel that can be picked at run time
+static void *bench_64_multi_setup_c (void *const ctx) {
+    struct bench_multi *multi = (struct bench_multi *)ctx;
+
+    multi->kernels = n3n_cpu_kernel_find(&pearson_kernel, "c");
+    return ctx;
+}
+
+static void *bench_64_multi_setup_avx2 (void *const ctx) {
+    struct bench_multi *multi = (struct bench_multi *)ctx;
+
+    multi->kernels = n3n_cpu_kernel_find(&pearson_kernel, "avx2");
+    return ctx;
+}
+
+static const ssize_t bench_64_multi_run (
+    void *ctx,
+    const void *data_in,
+    const ssize_t data_in_size,
+    ssize_t *bytes_in
+) {
+    struct bench_multi *multi = (struct bench_multi *)ctx;
+    int i;
+
+    *bytes_in = 0;
+    for(i = 0; i < BENCH_MULTI_INPUTS; i++) {
+        multi->in[i] = (const uint8_t *)data_in + i;
+        multi->len[i] = data_in_size - i;
+        *bytes_in += multi->len[i];
+    }
+
+    pearson_hash_64_multi_kernels(multi->kernels, multi->out, multi->in, multi->len, BENCH_MULTI_INPUTS);
+    return sizeof(multi->out);
+}
+
+static int bench_64_multi_check (void *ctx, int level) {
+    struct bench_multi *multi = (struct bench_multi *)ctx;
+    int i, errors = 0;
+
+    for(i = 0; i < BENCH_MULTI_INPUTS; i++) {
+        uint64_t expected = pearson_hash_64(multi->in[i], multi->len[i]);
+        if(level) {
+            printf("%s: output[%i] = 0x%" PRIx64 "\n", "pearson_hash_64_multi", i, multi->out[i]);
+        }
+        if(multi->out[i] != expected) {
+            // every lane has to match the single input hash
+            errors++;
+        }
+    }
+    if(level) {
+        printf("\n");
+    }
+
+    return errors;
+}
+
 static const ssize_t bench_128_run (
     void *ctx,
     const void *data_in,
@@ -352,6 +643,22 @@ static const ssize_t bench_128_run (
     return bytes[32];
 }
 
+#if defined (__SSE2__)
+static const ssize_t bench_128_sse2_run (
+    void *ctx,
+    const void *data_in,
+    const ssize_t data_in_size,
+    ssize_t *bytes_in
+) {
+    uint8_t *bytes = (uint8_t *)ctx;
+
+    pearson_hash_128_sse2(ctx, data_in, data_in_size);
+    *bytes_in = data_in_size;
+    bytes[32] = 16;
+    return bytes[32];
+}
+#endif
+
 static const ssize_t bench_256_run (
     void *ctx,
     const void *data_in,
@@ -399,9 +706,31 @@ static struct bench_item bench_64 = {
     .data_in = test_data_32x16,
 };
 
+// One for each build of the lanes kernel
+static struct bench_item bench_64_multi_variants[] = {
+    {
+        .name = "pearson_hash_64_multi",
+        .variant = "c",
+        .ctx_size = sizeof(struct bench_multi),
+        .setup = bench_64_multi_setup_c,
+        .run = bench_64_multi_run,
+        .check = bench_64_multi_check,
+        .data_in = test_data_32x16,
+    },
+    {
+        .name = "pearson_hash_64_multi",
+        .variant = "avx2",
+        .ctx_size = sizeof(struct bench_multi),
+        .setup = bench_64_multi_setup_avx2,
+        .run = bench_64_multi_run,
+        .check = bench_64_multi_check,
+        .data_in = test_data_32x16,
+    },
+};
+
 static struct bench_item bench_128 = {
     .name = "pearson_hash_128",
-    .flags = BENCH_SKIP_BENCH,
+    .variant = "c",
     // largest result size plus one for the length
     .ctx_size = 32 + 1,
     .run = bench_128_run,
@@ -410,6 +739,19 @@ static struct bench_item bench_128 = {
     .data_out = test_data_pearson_128,
 };
 
+#if defined (__SSE2__)
+static struct bench_item bench_128_sse2 = {
+    .name = "pearson_hash_128",
+    .variant = "sse2",
+    // largest result size plus one for the length
+    .ctx_size = 32 + 1,
+    .run = bench_128_sse2_run,
+    .get_output = bench_get_output,
+    .data_in = test_data_32x16,
+    .data_out = test_data_pearson_128,
+};
+#endif
+
 static struct bench_item bench_256 = {
     .name = "pearson_hash_256",
     .flags = BENCH_SKIP_BENCH,
@@ -422,9 +764,25 @@ static struct bench_item bench_256 = {
 };
 
 void n3n_initfuncs_pearson (void) {
+    n3n_cpu_kernel_register(&pearson_kernel);
+
     n3n_benchmark_register(&bench_16);
     n3n_benchmark_register(&bench_32);
     n3n_benchmark_register(&bench_64);
+
+    // Only the ones that are linked in and that this CPU can run
+    for(int i = 0; i < sizeof(bench_64_multi_variants) / sizeof(bench_64_multi_variants[0]); i++) {
+        if(n3n_cpu_kernel_find(&pearson_kernel, bench_64_multi_variants[i].variant)) {
+            n3n_benchmark_register(&bench_64_multi_variants[i]);
+        }
+    }
+
     n3n_benchmark_register(&bench_128);
+#if defined (__SSE2__)
+    n3n_benchmark_register(&bench_128_sse2);
+#endif
     n3n_benchmark_register(&bench_256);
 }
+
+
+#endif // PEARSON_PUBLIC_API
@@ -0,0 +1,9 @@
+/**
+ * Copyright (C) Hamish Coleman
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * The pearson multi-buffer kernel built for AVX2, see pearson.c
+ */
+
+#define PEARSON_KERNELS pearson_kernels_avx2
+#include "pearson.c"
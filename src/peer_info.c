@@ -16,6 +16,7 @@
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/time.h>   // for gettimeofday, timeval
 
 #ifndef _WIN32
 #include <sys/socket.h>
@@ -23,6 +24,7 @@
 
 #include "management.h" // for mgmt_event_post
 #include "peer_info.h"
+#include "tcpconn.h"    // for n3n_tcpconn_free
 #include "uthash.h"
 
 #ifndef _WIN32
@@ -35,8 +37,16 @@ static struct metrics {
     uint32_t alloc;     // peer_info_malloc() is called
     uint32_t free;      // peer_info_free() is called
     uint32_t hostname;  // n3n_peer_add_by_hostname() is called
+    uint32_t seen_move; // peer_info_seen() moved a peer to the end of its list
+    uint32_t purge;     // purge_peer_list() looked at a list
+    uint32_t purge_scan;    // peers looked at by purge_peer_list()
+    uint32_t purge_msec;    // total time spent in purge_peer_list()
 } metrics;
 
+// The purge time is added up in microseconds, as one purge usually takes
+// much less than a millisecond, and only shown in milliseconds
+static uint64_t purge_usec;
+
 static struct n3n_metrics_items_llu32 metrics_items = {
     .name = "count",
     .desc = "Track the events in the lifecycle of peer_info objects",
@@ -63,6 +73,26 @@ static struct n3n_metrics_items_llu32 metrics_items = {
             .val2 = "init",
             .offset = offsetof(struct metrics, init),
         },
+        {
+            .val1 = "fast",
+            .val2 = "seen_move",
+            .offset = offsetof(struct metrics, seen_move),
+        },
+        {
+            .val1 = "slow",
+            .val2 = "purge",
+            .offset = offsetof(struct metrics, purge),
+        },
+        {
+            .val1 = "slow",
+            .val2 = "purge_scan",
+            .offset = offsetof(struct metrics, purge_scan),
+        },
+        {
+            .val1 = "slow",
+            .val2 = "purge_msec",
+            .offset = offsetof(struct metrics, purge_msec),
+        },
         { },
     },
 };
@@ -109,6 +139,7 @@ struct peer_info* peer_info_malloc (const n2n_mac_t mac) {
 
 void peer_info_free (struct peer_info *p) {
     metrics.free++;
+    peer_info_ip_index_del(p);
     free(p->hostname);
     free(p);
 }
@@ -147,11 +178,14 @@ inline char *peer_info_get_hostname (struct peer_info *p) {
 size_t purge_peer_list (struct peer_info **peer_list,
                         SOCKET socket_not_to_close,
                         n2n_tcp_connection_t **tcp_connections,
-                        time_t purge_before) {
+                        time_t purge_before,
+                        peer_info_purged_f purged,
+                        void *data) {
 
     struct peer_info *scan, *tmp;
     n2n_tcp_connection_t *conn;
     size_t retval = 0;
+    struct timeval tv1, tv2;
 
     // If our table is small, dont bother purging it
     // TODO: should the table size be a config param?
@@ -159,32 +193,120 @@ size_t purge_peer_list (struct peer_info **peer_list,
         return retval;
     }
 
+    metrics.purge++;
+    gettimeofday(&tv1, NULL);
+
     HASH_ITER(hh, *peer_list, scan, tmp) {
+        metrics.purge_scan++;
+        if(!scan->purgeable) {
+            continue;
+        }
+
+        // The list is kept in last_seen order by peer_info_seen(), so
+        // everything from here on is still alive
+        if(scan->last_seen >= purge_before) {
+            break;
+        }
+
         // TODO: untangle the tcp_connections usage and use
         // peer_info_validate() as the core of this loop
-        if(scan->purgeable && scan->last_seen < purge_before) {
-            if((scan->socket_fd >=0) && (scan->socket_fd != socket_not_to_close)) {
-                if(tcp_connections) {
-                    HASH_FIND_INT(*tcp_connections, &scan->socket_fd, conn);
-                    if(conn) {
-                        HASH_DEL(*tcp_connections, conn);
-                        free(conn);
-                    }
-                    shutdown(scan->socket_fd, SHUT_RDWR);
-                    closesocket(scan->socket_fd);
+        if((scan->socket_fd >=0) && (scan->socket_fd != socket_not_to_close)) {
+            if(tcp_connections) {
+                HASH_FIND_INT(*tcp_connections, &scan->socket_fd, conn);
+                if(conn) {
+                    HASH_DEL(*tcp_connections, conn);
+                    n3n_tcpconn_free(conn->tcp);
+                    free(conn);
                 }
+                shutdown(scan->socket_fd, SHUT_RDWR);
+                closesocket(scan->socket_fd);
             }
-            HASH_DEL(*peer_list, scan);
-            mgmt_event_post(N3N_EVENT_PEER,N3N_EVENT_PEER_PURGE,scan);
-            /* FIXME: generates events for more than just p2p */
-            retval++;
-            peer_info_free(scan);
         }
+        HASH_DEL(*peer_list, scan);
+        peer_info_ip_index_del(scan);
+        if(purged) {
+            purged(scan, data);
+        }
+        mgmt_event_post(N3N_EVENT_PEER,N3N_EVENT_PEER_PURGE,scan);
+        /* FIXME: generates events for more than just p2p */
+        retval++;
+        peer_info_free(scan);
     }
 
+    gettimeofday(&tv2, NULL);
+    purge_usec += (tv2.tv_sec - tv1.tv_sec) * 1000000 + (tv2.tv_usec - tv1.tv_usec);
+    metrics.purge_msec = purge_usec / 1000;
+
     return retval;
 }
 
+/** Add the peer to the tunnel ip index, or move it after its address changed */
+void peer_info_ip_index_set (struct peer_info **ip_index, struct peer_info *peer) {
+    peer_info_ip_index_del(peer);
+
+    if(peer->dev_addr.net_addr == 0) {
+        // No address to find it by
+        return;
+    }
+
+    HASH_ADD(hh_ip, *ip_index, dev_addr.net_addr, sizeof(uint32_t), peer);
+    peer->ip_index = ip_index;
+}
+
+void peer_info_ip_index_del (struct peer_info *peer) {
+    if(!peer->ip_index) {
+        return;
+    }
+    HASH_DELETE(hh_ip, *peer->ip_index, peer);
+    peer->ip_index = NULL;
+}
+
+struct peer_info* peer_info_ip_index_find (struct peer_info *ip_index, uint32_t net_addr) {
+    struct peer_info *peer;
+
+    HASH_FIND(hh_ip, ip_index, &net_addr, sizeof(uint32_t), peer);
+    return peer;
+}
+
+static int peer_last_seen_cmp (struct peer_info *a, struct peer_info *b) {
+    return (a->last_seen > b->last_seen) - (a->last_seen < b->last_seen);
+}
+
+/** Record that the peer was seen, keeping the peer_list in last_seen order */
+void peer_info_seen (struct peer_info **peer_list, struct peer_info *peer, time_t now) {
+    if(peer->last_seen == now) {
+        // Seen already this second, so it is already in the right place
+        return;
+    }
+    peer->last_seen = now;
+
+    // The newest entry in the list, other than this peer
+    struct peer_info *newest = ELMT_FROM_HH((*peer_list)->hh.tbl, (*peer_list)->hh.tbl->tail);
+    if(newest == peer) {
+        newest = peer->hh.prev;
+    }
+
+    if(newest && newest->last_seen > now) {
+        // A time in the past, so the peer belongs somewhere in the middle.
+        // This is rare, so it is fine to walk the list to find the spot
+        HASH_DEL(*peer_list, peer);
+        HASH_ADD_INORDER(hh, *peer_list, mac_addr, sizeof(n2n_mac_t), peer, peer_last_seen_cmp);
+        metrics.seen_move++;
+        return;
+    }
+
+    if(!peer->hh.next) {
+        // Already the last entry
+        return;
+    }
+
+    // Re-adding the peer appends it to the list, behind everyone seen
+    // before it
+    HASH_DEL(*peer_list, peer);
+    HASH_ADD_PEER(*peer_list, peer);
+    metrics.seen_move++;
+}
+
 /** Purge all items from the peer_list and return the number of items that were removed. */
 size_t clear_peer_list (struct peer_info ** peer_list) {
 
@@ -217,7 +339,7 @@ size_t purge_expired_nodes (struct peer_info **peer_list,
 
     traceEvent(TRACE_DEBUG, "Purging old registrations");
 
-    num_reg = purge_peer_list(peer_list, socket_not_to_close, tcp_connections, now - timeout);
+    num_reg = purge_peer_list(peer_list, socket_not_to_close, tcp_connections, now - timeout, NULL, NULL);
 
     (*p_last_purge) = now;
     traceEvent(TRACE_DEBUG, "Remove %ld registrations", num_reg);
@@ -286,7 +408,7 @@ struct peer_info* add_sn_to_list_by_mac_or_sock (struct peer_info **sn_list, n3n
         if(!is_null_mac(mac)) {
             HASH_DEL(*sn_list, scan);
             memcpy(scan->mac_addr, mac, sizeof(n2n_mac_t));
-            HASH_ADD_PEER(*sn_list, scan);
+            HASH_ADD_INORDER(hh, *sn_list, mac_addr, sizeof(n2n_mac_t), scan, peer_last_seen_cmp);
         }
 
         peer = scan;
@@ -308,7 +430,8 @@ struct peer_info* add_sn_to_list_by_mac_or_sock (struct peer_info **sn_list, n3n
 
     peer->selection_criterion = sn_selection_criterion_default();
     memcpy(&(peer->sock), sock, sizeof(n3n_sock_t));
-    HASH_ADD_PEER(*sn_list, peer);
+    // Not seen yet, so this goes before everyone that has been
+    HASH_ADD_INORDER(hh, *sn_list, mac_addr, sizeof(n2n_mac_t), peer, peer_last_seen_cmp);
     *skip_add = SN_ADD_ADDED;
 
     return peer;
@@ -384,20 +507,29 @@ static int time_stamp_verify_and_update (uint64_t stamp, uint64_t *previous_stam
     }
 
     // if applicable: is it higher than previous time stamp (including allowed deviation of TIME_STAMP_JITTER)?
+    // the supernode workers can verify stamps of the same peer at once, so
+    // the previous one is only replaced if it has not changed meanwhile
     if(NULL != previous_stamp) {
-        diff = stamp - *previous_stamp;
-        if(allow_jitter) {
-            // 8 times higher jitter allowed for counter-only flagged timestamps ( ~ 1.25 sec with 160 ms default jitter)
-            diff += TIME_STAMP_JITTER << (co << 3);
-        }
+        uint64_t previous = __atomic_load_n(previous_stamp, __ATOMIC_RELAXED);
+        do {
+            diff = stamp - previous;
+            if(allow_jitter) {
+                // 8 times higher jitter allowed for counter-only flagged timestamps ( ~ 1.25 sec with 160 ms default jitter)
+                diff += TIME_STAMP_JITTER << (co << 3);
+            }
 
-        if(diff <= 0) {
-            traceEvent(TRACE_DEBUG, "time_stamp_verify_and_update found a timestamp too old compared to previous.");
-            return 0; // failure
-        }
-        // for not allowing to exploit the allowed TIME_STAMP_JITTER to "turn the clock backwards",
-        // set the higher of the values
-        *previous_stamp = (stamp > *previous_stamp ? stamp : *previous_stamp);
+            if(diff <= 0) {
+                traceEvent(TRACE_DEBUG, "time_stamp_verify_and_update found a timestamp too old compared to previous.");
+                return 0; // failure
+            }
+            // for not allowing to exploit the allowed TIME_STAMP_JITTER to "turn the clock backwards",
+            // set the higher of the values
+            if(stamp <= previous) {
+                break;
+            }
+        } while(!__atomic_compare_exchange_n(
+                    previous_stamp, &previous, stamp, true,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED));
     }
 
     return 1; // success
@@ -48,6 +48,8 @@ struct peer_info {
     n2n_version_t version;
 
     UT_hash_handle hh;     /* makes this structure hashable */
+    UT_hash_handle hh_ip;  /* optional second index, on the tunnel ip address */
+    struct peer_info **ip_index;    /* the tunnel ip index holding this peer, if any */
 };
 
 typedef struct peer_info peer_info_t;
@@ -60,10 +62,29 @@ struct peer_info* peer_info_validate (struct peer_info **, struct peer_info *);
 char *peer_info_get_hostname (struct peer_info *);
 
 /* Operations on peer_info lists. */
+
+// The lists are kept in the order that their peers were last seen, so that
+// purging the expired peers only has to look at the start of the list.
+// Any update to the last_seen of a peer in a purged list should be done
+// with peer_info_seen()
+void peer_info_seen (struct peer_info **peer_list, struct peer_info *peer, time_t now);
+
+// A peer list can have a second index on the tunnel ip address of its
+// peers.  Peers are removed from it when they are freed
+void peer_info_ip_index_set (struct peer_info **ip_index, struct peer_info *peer);
+void peer_info_ip_index_del (struct peer_info *peer);
+struct peer_info* peer_info_ip_index_find (struct peer_info *ip_index, uint32_t net_addr);
+
+// Called for each peer that purge_peer_list() removes, once it is out of
+// its list and ip index but before it is freed
+typedef void (*peer_info_purged_f)(struct peer_info *peer, void *data);
+
 size_t purge_peer_list (struct peer_info ** peer_list,
                         SOCKET socket_not_to_close,
                         n2n_tcp_connection_t **tcp_connections,
-                        time_t purge_before);
+                        time_t purge_before,
+                        peer_info_purged_f purged,
+                        void *data);
 
 size_t clear_peer_list (struct peer_info ** peer_list);
 
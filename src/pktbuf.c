@@ -5,16 +5,45 @@
  * Routines for handling a pool of packet-sized buffers
  */
 
+#include <n2n_define.h>         // for N2N_PKT_BUF_SIZE
+#include <n3n/benchmark.h>
 #include <n3n/metrics.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>              // for printf
 #include <stdlib.h>
 #include <string.h>
 
 #include "pktbuf.h"
 
-static struct metrics {
+struct metrics {
     uint32_t alloc;     // n3n_pktbuf_alloc() is called
     uint32_t free;      // n3n_pktbuf_free() is called
-} metrics;
+    uint32_t exhausted; // n3n_pktbuf_alloc() found no free buffer
+    uint32_t in_use;    // buffers currently allocated
+    uint32_t high_water;    // largest number of buffers ever allocated
+    uint32_t size;      // number of buffers in the pool
+};
+
+// The free buffers are kept on a lock-free stack.  The head holds the index
+// of the top buffer plus one (zero for an empty stack) in the low half and a
+// generation count in the high half, which is bumped on every change so that
+// a pop racing with a pop and push of the same buffer cannot succeed (ABA)
+#define FREE_INDEX(head) ((uint32_t)(head))
+#define FREE_HEAD(index, gen) (((uint64_t)(gen) << 32) | (uint32_t)(index))
+
+struct pool {
+    void *buf;
+    struct n3n_pktbuf *items;
+    uint32_t *next;             // the index+1 of the buffer below, per buffer
+    uint64_t free;              // head of the free stack
+    ssize_t item_size;
+    int item_count;
+    struct metrics metrics;
+};
+
+// The pool behind the n3n_pktbuf_*() functions
+static struct pool pool;
 
 static struct n3n_metrics_items_llu32 metrics_items = {
     .name = "count",
@@ -29,108 +58,206 @@ static struct n3n_metrics_items_llu32 metrics_items = {
             .val1 = "free",
             .offset = offsetof(struct metrics, free),
         },
+        {
+            .val1 = "exhausted",
+            .offset = offsetof(struct metrics, exhausted),
+        },
         { },
     },
 };
 
+static struct n3n_metrics_items_uint32 metrics_items_pool[] = {
+    {
+        .name = "in_use",
+        .offset = offsetof(struct metrics, in_use),
+    },
+    {
+        .name = "high_water",
+        .offset = offsetof(struct metrics, high_water),
+    },
+    {
+        .name = "size",
+        .offset = offsetof(struct metrics, size),
+    },
+    { },
+};
+
 static struct n3n_metrics_module metrics_module_static = {
     .name = "pktbuf",
-    .data = &metrics,
+    .data = &pool.metrics,
     .items_llu32 = &metrics_items,
     .type = n3n_metrics_type_llu32,
 };
 
-static void *pool_buf;
-static struct n3n_pktbuf *pool;
-static struct n3n_pktbuf *pool_item_next_search;
-static struct n3n_pktbuf *pool_item_max;
-static ssize_t pool_item_size;
-static int pool_item_count;
+static struct n3n_metrics_module metrics_module_pool = {
+    .name = "pktbuf",
+    .data = &pool.metrics,
+    .items_uint32 = metrics_items_pool,
+    .type = n3n_metrics_type_uint32,
+};
+
+static void pool_push (struct pool *pool, struct n3n_pktbuf *p) {
+    uint32_t index = (p - pool->items) + 1;
+    uint64_t head = __atomic_load_n(&pool->free, __ATOMIC_RELAXED);
+    uint64_t next;
 
-void n3n_pktbuf_initialise (ssize_t mtu, int count) {
-    if(pool) {
-        if(metrics.alloc != metrics.free) {
+    do {
+        __atomic_store_n(&pool->next[index - 1], FREE_INDEX(head), __ATOMIC_RELAXED);
+        next = FREE_HEAD(index, (head >> 32) + 1);
+    } while(!__atomic_compare_exchange_n(
+                &pool->free, &head, next, true,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static struct n3n_pktbuf *pool_pop (struct pool *pool) {
+    uint64_t head = __atomic_load_n(&pool->free, __ATOMIC_ACQUIRE);
+    uint64_t next;
+
+    do {
+        uint32_t index = FREE_INDEX(head);
+        if(!index) {
+            return NULL;
+        }
+        uint32_t below = __atomic_load_n(&pool->next[index - 1], __ATOMIC_RELAXED);
+        next = FREE_HEAD(below, (head >> 32) + 1);
+    } while(!__atomic_compare_exchange_n(
+                &pool->free, &head, next, true,
+                __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+    return &pool->items[FREE_INDEX(head) - 1];
+}
+
+static void pool_deinitialise (struct pool *pool) {
+    free(pool->items);
+    free(pool->buf);
+    free(pool->next);
+    pool->items = NULL;
+    pool->buf = NULL;
+    pool->next = NULL;
+    pool->free = 0;
+    pool->metrics.size = 0;
+}
+
+static void pool_initialise (struct pool *pool, ssize_t mtu, int count) {
+    if(pool->items) {
+        if(pool->metrics.in_use) {
             // Simplify logic by not allowing the pool shape to change while
             // there are any users
             return;
         }
-        free(pool);
-        free(pool_buf);
+        pool_deinitialise(pool);
     }
 
     // Round up to a multiple
     int item_size = (mtu + 2047) & ~0x7ff;
 
-    pool_buf = calloc(count, item_size);
-    if(!pool_buf) {
+    pool->buf = calloc(count, item_size);
+    if(!pool->buf) {
         abort();
     }
 
-    pool = calloc(count, sizeof(struct n3n_pktbuf));
-    if(!pool) {
+    pool->items = calloc(count, sizeof(struct n3n_pktbuf));
+    if(!pool->items) {
         abort();
     }
 
-    pool_item_size = item_size;
-    pool_item_count = count;
-    pool_item_next_search = pool;
-    pool_item_max = pool + (count - 1) * sizeof(struct n3n_pktbuf);
+    pool->next = calloc(count, sizeof(*pool->next));
+    if(!pool->next) {
+        abort();
+    }
+
+    pool->item_size = item_size;
+    pool->item_count = count;
+    pool->free = 0;
+    pool->metrics.size = count;
 
+    // Push in reverse, so the first allocations come from the start
     int i;
-    for(i=0; i < pool_item_count; i++) {
-        pool[i].buf = pool_buf + i * item_size;
-        pool[i].capacity = item_size;
-        pool[i].owner = n3n_pktbuf_owner_none;
-        n3n_pktbuf_zero(&pool[i]);
+    for(i=pool->item_count - 1; i >= 0; i--) {
+        pool->items[i].buf = pool->buf + i * item_size;
+        pool->items[i].capacity = item_size;
+        pool->items[i].owner = n3n_pktbuf_owner_none;
+        n3n_pktbuf_zero(&pool->items[i]);
+        pool_push(pool, &pool->items[i]);
     }
 }
 
-void n3n_pktbuf_deinitialise () {
-    free(pool);
-    free(pool_buf);
-}
-
-struct n3n_pktbuf *n3n_pktbuf_alloc (ssize_t size) {
-    // We only have one pool, so we can use a simple check
-    if(size > pool_item_size) {
+static struct n3n_pktbuf *pool_alloc (struct pool *pool, ssize_t size) {
+    // All the buffers in a pool are the same size, so a simple check will do
+    if(size > pool->item_size) {
         return NULL;
     }
 
-    struct n3n_pktbuf *p = pool_item_next_search;
-    int count = pool_item_count;
-
-    while(count) {
-        if(p > (struct n3n_pktbuf *)pool_item_max) {
-            p = pool;
-        }
+    struct n3n_pktbuf *p = pool_pop(pool);
+    if(!p) {
+        __atomic_add_fetch(&pool->metrics.exhausted, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
 
-        if(p->owner == n3n_pktbuf_owner_none) {
-            p->owner = n3n_pktbuf_owner_alloc;
-            n3n_pktbuf_zero(p);
+    p->owner = n3n_pktbuf_owner_alloc;
+    p->refs = 1;
+    n3n_pktbuf_zero(p);
 
-            pool_item_next_search = p + pool_item_size;
-            metrics.alloc++;
-            return p;
+    __atomic_add_fetch(&pool->metrics.alloc, 1, __ATOMIC_RELAXED);
+    uint32_t in_use = __atomic_add_fetch(&pool->metrics.in_use, 1, __ATOMIC_RELAXED);
+    uint32_t high_water = __atomic_load_n(&pool->metrics.high_water, __ATOMIC_RELAXED);
+    while(in_use > high_water) {
+        if(__atomic_compare_exchange_n(
+               &pool->metrics.high_water, &high_water, in_use, true,
+               __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            break;
         }
-
-        p += pool_item_size;
-        count--;
     }
-    return NULL;
+    return p;
 }
 
-void n3n_pktbuf_free (struct n3n_pktbuf *p) {
+static void pool_release (struct pool *pool, struct n3n_pktbuf *p) {
     // Confirm we are within the pool boundaries
-    if(p < (struct n3n_pktbuf *)pool) {
+    if(p < pool->items) {
         return;
     }
-    if(p > (struct n3n_pktbuf *)pool_item_max) {
+    if(p >= pool->items + pool->item_count) {
+        return;
+    }
+    if(p->owner == n3n_pktbuf_owner_none) {
+        // Already free, pushing it twice would corrupt the stack
+        return;
+    }
+    if(__atomic_sub_fetch(&p->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+        // Still held by someone else
         return;
     }
 
     p->owner = n3n_pktbuf_owner_none;
-    pool_item_next_search = p;
-    metrics.free++;
+    __atomic_add_fetch(&pool->metrics.free, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&pool->metrics.in_use, 1, __ATOMIC_RELAXED);
+    pool_push(pool, p);
+}
+
+void n3n_pktbuf_initialise (ssize_t mtu, int count) {
+    pool_initialise(&pool, mtu, count);
+}
+
+void n3n_pktbuf_deinitialise () {
+    pool_deinitialise(&pool);
+}
+
+struct n3n_pktbuf *n3n_pktbuf_alloc (ssize_t size) {
+    return pool_alloc(&pool, size);
+}
+
+void n3n_pktbuf_free (struct n3n_pktbuf *p) {
+    pool_release(&pool, p);
+}
+
+void n3n_pktbuf_ref (struct n3n_pktbuf *p) {
+    __atomic_add_fetch(&p->refs, 1, __ATOMIC_RELAXED);
+}
+
+int n3n_pktbuf_contains (struct n3n_pktbuf *p, const void *ptr, ssize_t size) {
+    const unsigned char *start = ptr;
+
+    return (start >= p->buf) && (size >= 0) && (start + size <= p->buf + p->capacity);
 }
 
 void n3n_pktbuf_zero (struct n3n_pktbuf *p) {
@@ -150,14 +277,30 @@ void *n3n_pktbuf_getbufptr (struct n3n_pktbuf *p) {
     return &p->buf[p->offset_start];
 }
 
-int n3n_pktbuf_prepend (struct n3n_pktbuf *p, ssize_t prepend) {
-    if(prepend < 0) {
+int n3n_pktbuf_reserve (struct n3n_pktbuf *p, ssize_t headroom) {
+    if(headroom < 0) {
         return -1;
     }
-    if(prepend > p->capacity) {
+    if(headroom > p->capacity) {
         return -1;
     }
-    p->offset_start = prepend;
+    p->offset_start = headroom;
+    p->offset_end = headroom;
+    return 1;
+}
+
+ssize_t n3n_pktbuf_getheadroom (struct n3n_pktbuf *p) {
+    return p->offset_start;
+}
+
+int n3n_pktbuf_prepend (struct n3n_pktbuf *p, ssize_t size) {
+    if(size < 0) {
+        return -1;
+    }
+    if(size > p->offset_start) {
+        return -1;
+    }
+    p->offset_start -= size;
     return 1;
 }
 
@@ -166,15 +309,133 @@ int n3n_pktbuf_append (struct n3n_pktbuf *p, ssize_t size, void *buf) {
     if(new_end > p->capacity) {
         return -1;
     }
+    if(buf) {
+        memcpy(&p->buf[p->offset_end], buf, size);
+    }
     p->offset_end = new_end;
-    memcpy(&p->buf[p->offset_end], buf, size);
     return 1;
 }
 
+#define BENCH_POOL_SIZE 16
+
+// The benchmarks use a pool of their own, so that running them does not
+// change the one that the edge or supernode is using
+static struct pool bench_pool;
+
+static void *bench_setup (void *const ctx) {
+    pool_initialise(&bench_pool, N2N_PKT_BUF_SIZE, BENCH_POOL_SIZE);
+    return ctx;
+}
+
+// Allocate and free a single buffer, the common packet path case
+static const ssize_t bench_alloc_run (
+    void *const ctx,
+    const void *data_in,
+    const ssize_t data_in_size,
+    ssize_t *const bytes_in
+) {
+    struct n3n_pktbuf *p = pool_alloc(&bench_pool, N2N_PKT_BUF_SIZE);
+    pool_release(&bench_pool, p);
+
+    // Report the buffer space handed out, to give a throughput figure
+    *bytes_in = N2N_PKT_BUF_SIZE;
+    return 0;
+}
+
+// Drain the whole pool and return it, in the opposite order
+static const ssize_t bench_drain_run (
+    void *const ctx,
+    const void *data_in,
+    const ssize_t data_in_size,
+    ssize_t *const bytes_in
+) {
+    struct n3n_pktbuf *p[BENCH_POOL_SIZE];
+    int nr = 0;
+
+    while(nr < BENCH_POOL_SIZE && (p[nr] = pool_alloc(&bench_pool, N2N_PKT_BUF_SIZE))) {
+        nr++;
+    }
+    *bytes_in = nr * N2N_PKT_BUF_SIZE;
+    while(nr) {
+        pool_release(&bench_pool, p[--nr]);
+    }
+
+    return 0;
+}
+
+static int bench_check (void *const ctx, const int level) {
+    struct metrics *metrics = &bench_pool.metrics;
+    struct n3n_pktbuf *p[BENCH_POOL_SIZE + 1];
+    uint32_t exhausted = metrics->exhausted;
+    int nr = 0;
+    int result = 0;
+
+    while(nr <= BENCH_POOL_SIZE && (p[nr] = pool_alloc(&bench_pool, N2N_PKT_BUF_SIZE))) {
+        nr++;
+    }
+
+    // Every buffer must come out exactly once, then the pool is empty
+    if(nr != bench_pool.item_count || metrics->exhausted != exhausted + 1) {
+        result++;
+    }
+    for(int i = 0; i < nr; i++) {
+        for(int j = i + 1; j < nr; j++) {
+            if(p[i] == p[j]) {
+                result++;
+            }
+        }
+    }
+    if(metrics->high_water < nr) {
+        result++;
+    }
+
+    while(nr) {
+        pool_release(&bench_pool, p[--nr]);
+    }
+
+    // A double free must not put the buffer on the free stack twice
+    p[0] = pool_alloc(&bench_pool, N2N_PKT_BUF_SIZE);
+    pool_release(&bench_pool, p[0]);
+    pool_release(&bench_pool, p[0]);
+    if(metrics->in_use != 0) {
+        result++;
+    }
+
+    if(level) {
+        printf("pktbuf: pool=%i high_water=%u result=%i\n",
+               bench_pool.item_count, metrics->high_water, result);
+    }
+    return result;
+}
+
+static struct bench_item bench_alloc = {
+    .name = "pktbuf_alloc",
+    .ctx_size = 0,
+    .setup = bench_setup,
+    .run = bench_alloc_run,
+    .check = bench_check,
+    .data_in = test_data_none,
+    .data_out = test_data_none,
+};
+
+static struct bench_item bench_drain = {
+    .name = "pktbuf_drain",
+    .flags = BENCH_SKIP_CHECK,
+    .ctx_size = 0,
+    .setup = bench_setup,
+    .run = bench_drain_run,
+    .data_in = test_data_none,
+    .data_out = test_data_none,
+};
+
 void n3n_initfuncs_pktbuf () {
     n3n_metrics_register(&metrics_module_static);
+    n3n_metrics_register(&metrics_module_pool);
+    n3n_benchmark_register(&bench_alloc);
+    n3n_benchmark_register(&bench_drain);
 }
 
 void n3n_deinitfuncs_pktbuf () {
     n3n_pktbuf_deinitialise();
+    pool_deinitialise(&bench_pool);
 }
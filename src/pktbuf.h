@@ -16,6 +16,7 @@ enum __attribute__((__packed__)) n3n_pktbuf_owner {
     n3n_pktbuf_owner_resolver_query,
     n3n_pktbuf_owner_resolver_result,
     n3n_pktbuf_owner_rx_pdu,
+    n3n_pktbuf_owner_tx_tap,
 };
 
 struct n3n_pktbuf {
@@ -23,6 +24,7 @@ struct n3n_pktbuf {
     short capacity;       // Total size of buf
     short offset_start;   // Offset to start of data
     short offset_end;     // Offset to end of data
+    short refs;           // n3n_pktbuf_free() calls until it is free again
     enum n3n_pktbuf_owner owner;    // What process and data owns this
 };
 
@@ -31,13 +33,27 @@ void n3n_pktbuf_initialise (ssize_t mtu, int count);
 struct n3n_pktbuf *n3n_pktbuf_alloc(ssize_t);
 void n3n_pktbuf_free (struct n3n_pktbuf *);
 
+// Take another reference, the buffer stays allocated until each holder has
+// called n3n_pktbuf_free()
+void n3n_pktbuf_ref (struct n3n_pktbuf *);
+
+// Is the memory at ptr inside the buffer
+int n3n_pktbuf_contains (struct n3n_pktbuf *, const void *ptr, ssize_t size);
+
 void n3n_pktbuf_zero (struct n3n_pktbuf *);
 
 ssize_t n3n_pktbuf_getbufsize (struct n3n_pktbuf *);
 ssize_t n3n_pktbuf_getbufavail (struct n3n_pktbuf *);
+ssize_t n3n_pktbuf_getheadroom (struct n3n_pktbuf *);
 void *n3n_pktbuf_getbufptr (struct n3n_pktbuf *);
 
+// Empty the buffer, leaving space in front of the data for later prepends
+int n3n_pktbuf_reserve(struct n3n_pktbuf *, ssize_t);
+
+// Grow the data at the front into the headroom, the caller fills it in
 int n3n_pktbuf_prepend(struct n3n_pktbuf *, ssize_t);
+
+// Grow the data at the end, copying from buf if it is not NULL
 int n3n_pktbuf_append(struct n3n_pktbuf *, ssize_t, void *);
 
 #endif
@@ -73,6 +73,12 @@ static rn_generator_state_t rn_current_state = {
     .b = 0xBF58476D1CE4E5B9
 };
 
+// a thread that runs outside of the lock protecting rn_current_state gets
+// its own generator, see n3n_rand_thread_init().  Until then, it uses the
+// shared one
+static __thread rn_generator_state_t rn_thread_state;
+static __thread rn_generator_state_t *rn_state;
+
 
 // used for mixing the initializing seed
 static uint64_t splitmix64 (splitmix64_state_t *state) {
@@ -123,18 +129,43 @@ static int n3n_srand (uint64_t seed) {
 // and thus is considered public domain
 uint64_t n3n_rand (void) {
 
-    uint64_t t       = rn_current_state.a;
-    uint64_t const s = rn_current_state.b;
+    rn_generator_state_t *state = rn_state;
+    if(!state) {
+        state = &rn_current_state;
+    }
+
+    uint64_t t       = state->a;
+    uint64_t const s = state->b;
 
-    rn_current_state.a = s;
+    state->a = s;
     t ^= t << 23;
     t ^= t >> 17;
     t ^= s ^ (s >> 26);
-    rn_current_state.b = t;
+    state->b = t;
 
     return t + s;
 }
 
+void n3n_rand_thread_init (void) {
+
+    uint8_t i;
+    // drawn from the shared generator, so no two threads start alike
+    splitmix64_state_t smstate = { n3n_rand() };
+
+    rn_thread_state.a = splitmix64(&smstate);
+    rn_thread_state.b = splitmix64(&smstate);
+
+    if((rn_thread_state.a == 0) && (rn_thread_state.b == 0)) {
+        rn_thread_state.a = n3n_rand() | 1;
+    }
+
+    rn_state = &rn_thread_state;
+
+    // stabilize in unlikely case of weak state with only a few bits set
+    for(i = 0; i < 32; i++)
+        n3n_rand();
+}
+
 #ifdef SYS_getrandom
 static uint64_t seed_getrandom () {
     int retries = RND_RETRIES;
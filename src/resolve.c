@@ -41,7 +41,6 @@ struct peer_info;
 #endif
 
 #define N2N_RESOLVE_INTERVAL            300 /* seconds until edge and supernode try to resolve supernode names again */
-#define N2N_RESOLVE_CHECK_INTERVAL       30 /* seconds until main loop checking in on changes from resolver thread */
 
 /**********************************************************/
 
@@ -366,7 +365,7 @@ void resolve_cancel_thread (n3n_resolve_parameter_t *param) {
 }
 
 
-bool resolve_check (n3n_resolve_parameter_t *param, bool requires_resolution, time_t now) {
+bool resolve_check (n3n_resolve_parameter_t *param, bool requires_resolution, time_t now, bool *renewed) {
 
     bool ret = requires_resolution; /* if trylock fails, it still requires resolution */
 
@@ -390,6 +389,9 @@ bool resolve_check (n3n_resolve_parameter_t *param, bool requires_resolution, ti
                 // unselectively copy all socks (even those with error code, that would be the old one because
                 // sockets do not get overwritten in case of error in resolve_thread) from list to supernode list
                 HASH_ITER(hh, param->list, entry, tmp_entry) {
+                    if(renewed && memcmp(entry->org_sock, &entry->sock, sizeof(n3n_sock_t))) {
+                        *renewed = true;
+                    }
                     memcpy(entry->org_sock, &entry->sock, sizeof(n3n_sock_t));
                     traceEvent(TRACE_INFO, "resolve_check renews ip address of supernode '%s' to %s",
                                entry->org_ip, sock_to_cstr(sock_buf, &(entry->sock)));
@@ -435,7 +437,7 @@ void resolve_cancel_thread (n3n_resolve_parameter_t *param) {
 }
 
 
-bool resolve_check (n3n_resolve_parameter_t *param, bool requires_resolution, time_t now) {
+bool resolve_check (n3n_resolve_parameter_t *param, bool requires_resolution, time_t now, bool *renewed) {
     return requires_resolution;
 }
 
@@ -20,6 +20,8 @@
 
 struct peer_info;
 
+#define N2N_RESOLVE_CHECK_INTERVAL       30 /* seconds until main loop checking in on changes from resolver thread */
+
 #ifdef HAVE_LIBPTHREAD
 struct n3n_resolve_ip_sock {
     char          *org_ip;            /* pointer to original ip/named address string (used read only) */
@@ -44,7 +46,9 @@ struct n3n_resolve_parameter {
 #endif
 
 int resolve_create_thread (n3n_resolve_parameter_t **param, struct peer_info *sn_list);
-bool resolve_check (n3n_resolve_parameter_t *param, bool resolution_request, time_t now);
+// Copy in the addresses from the resolver thread, when it is time to.  If
+// renewed is not NULL, it is set to true when any of them changed
+bool resolve_check (n3n_resolve_parameter_t *param, bool resolution_request, time_t now, bool *renewed);
 void resolve_cancel_thread (n3n_resolve_parameter_t *param);
 
 // Internal resolver function, will turn static once supernode.c doesnt use it
@@ -19,16 +19,24 @@
  */
 
 
+#ifdef __linux__
+#define _GNU_SOURCE             // for recvmmsg
+#endif
+
 #include <connslot/connslot.h>
 #include <errno.h>              // for errno, EAFNOSUPPORT
+#include <fcntl.h>              // for fcntl, F_SETFL, O_NONBLOCK
 #include <n3n/ethernet.h>       // for is_null_mac
 #include <n3n/initfuncs.h>      // for n3n_deinitfuncs
 #include <n3n/logging.h>        // for traceEvent
+#include <n3n/mainloop.h>       // for mainloop_timer_add, mainloop_timer_run
+#include <n3n/metrics.h>        // for n3n_metrics_register
 #include <n3n/random.h>         // for n3n_rand, n3n_rand_sqr, memrnd
 #include <n3n/resolve.h>        // for RESOLVE_LIST_*
 #include <n3n/strings.h>        // for ip_subnet_to_str, sock_to_cstr
 #include <n3n/supernode.h>      // for load_allowed_sn_community, calculate_...
 #include <stdbool.h>
+#include <stddef.h>             // for offsetof
 #include <stdint.h>             // for uint8_t, uint32_t, uint16_t, uint64_t
 #include <stdio.h>              // for sscanf, snprintf, fclose, fgets, fopen
 #include <stdlib.h>             // for free, calloc, getenv
@@ -38,22 +46,31 @@
 #include <unistd.h>
 
 #include "auth.h"               // for ascii_to_bin, calculate_dynamic_key
+#include "bitmap.h"             // for n3n_bitmap_find_down, n3n_bitmap_set
+#include "config.h"             // for HAVE_LIBPTHREAD
 #include "header_encryption.h"  // for packet_header_encrypt, packet_header_...
 #include "management.h"         // for process_mgmt
 #include "minmax.h"                  // for MIN, MAX
 #include "n2n.h"                // for sn_community, n3n_runtime_data
 #include "n2n_define.h"
-#include "n2n_regex.h"          // for re_matchp, re_compile
+#include "n2n_regex.h"          // for re_set_add, re_set_matchp
 #include "n2n_typedefs.h"
 #include "n2n_wire.h"           // for encode_buf, encode_PEER_INFO, encode_...
 #include "pearson.h"            // for pearson_hash_128, pearson_hash_32
 #include "peer_info.h"          // for purge_peer_list, clear_peer_list
+#include "pktbuf.h"             // for n3n_pktbuf_initialise
 #include "portable_endian.h"    // for be16toh, htobe16
 #include "resolve.h"            // for resolve_create_thread, resolve_cancel...
 #include "sn_selection.h"       // for sn_selection_criterion_gather_data
 #include "speck.h"              // for speck_128_encrypt, speck_context_t
+#include "tcpconn.h"            // for n3n_tcpconn_send, n3n_tcpconn_read
+#include "txqueue.h"            // for n3n_txqueue_sendto, n3n_txqueue_encrypt_...
 #include "uthash.h"             // for UT_hash_handle, HASH_ITER, HASH_DEL
 
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
 #ifdef _WIN32
 #include "win32/defs.h"
 
@@ -63,6 +80,7 @@
 #include <netinet/in.h>         // for ntohl, in_addr_t, sockaddr_in, INADDR...
 #include <netinet/tcp.h>        // for TCP_NODELAY
 #include <pwd.h>
+#include <signal.h>             // for sigset_t, pthread_sigmask
 #include <sys/select.h>         // for FD_ISSET, FD_SET, select, FD_SETSIZE
 #include <sys/socket.h>         // for recvfrom, shutdown, sockaddr_storage
 #endif
@@ -75,6 +93,31 @@
 
 #define HASH_FIND_COMMUNITY(head, name, out) HASH_FIND_STR(head, name, out)
 
+#ifdef HAVE_LIBPTHREAD
+/* A thread reading its own SO_REUSEPORT socket bound to the main UDP port */
+struct sn_worker {
+    struct n3n_runtime_data *sss;
+    pthread_t thread;
+    SOCKET sock;
+    bool running;
+};
+
+struct sn_workers {
+    // Shared by the worker threads while matching communities, held
+    // exclusively for everything that changes the supernode state
+    pthread_rwlock_t lock;
+    // A byte is written to this pipe when a worker leaves data queued on a
+    // tcp connection, so the main thread waits for it to become writable
+    int wakeup[2];
+    int count;
+    struct sn_worker worker[];
+};
+
+// Set in the worker threads, the main thread already watches its own queues
+static __thread bool sn_in_worker;
+#endif
+
+
 static ssize_t sendto_peer (struct n3n_runtime_data *sss,
                             const struct peer_info *peer,
                             const uint8_t *pktbuf,
@@ -106,6 +149,21 @@ static int sort_communities (struct n3n_runtime_data *sss,
                              time_t* p_last_sort,
                              time_t now);
 
+static void auto_ip_free (struct sn_community *comm);
+
+static void edge_del (struct sn_community *comm, struct peer_info *edge);
+
+static void members_free (struct sn_community *comm);
+
+static void auto_subnet_mark (struct n3n_runtime_data *sss,
+                              const struct sn_community *comm);
+
+static void auto_subnet_release (struct n3n_runtime_data *sss,
+                                 const struct sn_community *comm);
+static void auto_subnet_fixed_add (struct n3n_runtime_data *sss,
+                                   const n2n_ip_subnet_t *net);
+static void auto_subnet_reset (struct n3n_runtime_data *sss);
+
 /* ************************************** */
 
 
@@ -139,18 +197,16 @@ void close_tcp_connection (struct n3n_runtime_data *sss, n2n_tcp_connection_t *c
         HASH_ITER(hh, comm->edges, edge, tmp_edge) {
             if(edge->socket_fd == conn->socket_fd) {
                 // remove peer
-                HASH_DEL(comm->edges, edge);
-                peer_info_free(edge);
+                edge_del(comm, edge);
                 goto close_conn; /* break - level 2 */
             }
         }
     }
 
 close_conn:
-    // close the connection
+    // stop using the connection, it is closed and deleted later by the main
+    // thread, so the socket cannot be reused while still in the select() set
     shutdown(conn->socket_fd, SHUT_RDWR);
-    closesocket(conn->socket_fd);
-    // forget about the connection, will be deleted later
     conn->inactive = 1;
 }
 
@@ -198,6 +254,8 @@ void calculate_dynamic_keys (struct n3n_runtime_data *sss) {
 
         // calculate dynamic keys if this is a user/pw auth'ed community
         if(comm->allowed_users) {
+            // the queued packets are still to be done with the old key
+            n3n_txqueue_encrypt_headers();
             calculate_dynamic_key(comm->dynamic_key,           /* destination */
                                   sss->dynamic_key_time,       /* time - same for all */
                                   comm->community,  /* community name */
@@ -254,6 +312,78 @@ void send_re_register_super (struct n3n_runtime_data *sss) {
 }
 
 
+// Remember the community names recently refused by the allow list, so that
+// scanners repeating random names cost one hash lookup each.  As the allow
+// list only changes when it is loaded, the entries stay valid until then.
+#define SN_REJECTED_CACHE_SIZE 256      /* must be a power of two */
+
+static n2n_community_t rejected_cache[SN_REJECTED_CACHE_SIZE];
+
+static struct metrics_allow {
+    uint32_t match;             // Name matched the allowed patterns
+    uint32_t reject;            // Name checked and refused
+    uint32_t reject_cached;     // Name found in the rejected cache
+} metrics_allow;
+
+static struct n3n_metrics_items_llu32 metrics_allow_items = {
+    .name = "count",
+    .desc = "Track the allow list checks of unknown community names",
+    .name1 = "event",
+    .items = {
+        {
+            .val1 = "match",
+            .offset = offsetof(struct metrics_allow, match),
+        },
+        {
+            .val1 = "reject",
+            .offset = offsetof(struct metrics_allow, reject),
+        },
+        {
+            .val1 = "reject_cached",
+            .offset = offsetof(struct metrics_allow, reject_cached),
+        },
+        { },
+    },
+};
+
+static struct n3n_metrics_module metrics_allow_module = {
+    .name = "sn_allow",
+    .data = &metrics_allow,
+    .items_llu32 = &metrics_allow_items,
+    .type = n3n_metrics_type_llu32,
+};
+
+/** Check a community name, that is not loaded, against the allowed patterns */
+static bool community_allowed (struct n3n_runtime_data *sss, const n2n_community_t community) {
+    size_t len = strnlen(community, N2N_COMMUNITY_SIZE);
+
+    // An empty name would look just like an unused cache slot, and is
+    // never allowed anyway
+    if(!len) {
+        metrics_allow.reject++;
+        return false;
+    }
+
+    uint32_t hash = pearson_hash_32((const uint8_t *)community, len);
+    char *slot = rejected_cache[hash & (SN_REJECTED_CACHE_SIZE - 1)];
+
+    if(!strncmp(slot, community, N2N_COMMUNITY_SIZE)) {
+        metrics_allow.reject_cached++;
+        return false;
+    }
+
+    if(re_set_matchp(sss->rules, community, len)) {
+        metrics_allow.match++;
+        return true;
+    }
+
+    memset(slot, 0, N2N_COMMUNITY_SIZE);
+    memcpy(slot, community, len);
+    metrics_allow.reject++;
+    return false;
+}
+
+
 /** Load the list of allowed communities. Existing/previous ones will be removed,
  *  return 0 on success, -1 if file not found, -2 if no valid entries found
  */
@@ -280,7 +410,6 @@ int load_allowed_sn_community (struct n3n_runtime_data *sss) {
 
     uint32_t num_communities = 0;
 
-    struct sn_community_regular_expression *re, *tmp_re;
     uint32_t num_regex = 0;
     int has_net;
 
@@ -334,14 +463,18 @@ int load_allowed_sn_community (struct n3n_runtime_data *sss) {
         free(comm->header_iv_ctx_static);
         free(comm->header_encryption_ctx_dynamic);
         free(comm->header_iv_ctx_dynamic);
+        auto_ip_free(comm);
+        members_free(comm);
         free(comm);
     }
 
+    // all the community networks are gone, the configured ones included
+    auto_subnet_reset(sss);
+
     // remove all regular expressions for allowed communities
-    HASH_ITER(hh, sss->rules, re, tmp_re) {
-        HASH_DEL(sss->rules, re);
-        free(re);
-    }
+    re_set_free(sss->rules);
+    sss->rules = NULL;
+    memset(rejected_cache, 0, sizeof(rejected_cache));
 
     // prepare reading data -------------------------------
 
@@ -418,16 +551,15 @@ int load_allowed_sn_community (struct n3n_runtime_data *sss) {
         // if it contains typical characters...
         if(NULL != strpbrk(cmn_str, ".*+?[]\\")) {
             // ...it is treated as regular expression
-            re = (struct sn_community_regular_expression*)calloc(1, sizeof(struct sn_community_regular_expression));
-            if(re) {
-                re->rule = re_compile(cmn_str);
-                HASH_ADD_PTR(sss->rules, rule, re);
+            if(re_set_add(&sss->rules, cmn_str) == 0) {
                 num_regex++;
                 traceEvent(TRACE_INFO, "added regular expression for allowed communities '%s'", cmn_str);
-                free(cmn_str);
-                last_added_comm = NULL;
-                continue;
+            } else {
+                traceEvent(TRACE_WARNING, "bad regular expression for allowed communities '%s', ignoring", cmn_str);
             }
+            free(cmn_str);
+            last_added_comm = NULL;
+            continue;
         }
 
         comm = (struct sn_community*)calloc(1,sizeof(struct sn_community));
@@ -475,6 +607,8 @@ int load_allowed_sn_community (struct n3n_runtime_data *sss) {
             if(has_net) {
                 comm->auto_ip_net.net_addr = ntohl(net);
                 comm->auto_ip_net.net_bitlen = bitlen;
+                auto_subnet_fixed_add(sss, &comm->auto_ip_net);
+                auto_subnet_mark(sss, comm);
                 struct in_addr *tmp = (struct in_addr *)&net;
                 traceEvent(TRACE_INFO, "assigned sub-network %s/%u to community '%s'",
                            inet_ntoa(*tmp),
@@ -527,10 +661,9 @@ static ssize_t sendto_fd (struct n3n_runtime_data *sss,
                           size_t pktsize) {
 
     ssize_t sent = 0;
-    n2n_tcp_connection_t *conn;
 
-    sent = sendto(socket_fd, (void *)pktbuf, pktsize, 0 /* flags */,
-                  socket, socket_len);
+    // UDP datagrams can be collected and sent together
+    sent = n3n_txqueue_sendto(socket_fd, pktbuf, pktsize, NULL, socket, socket_len);
 
     if((sent <= 0) && (errno)) {
         char * c = strerror(errno);
@@ -538,13 +671,6 @@ static ssize_t sendto_fd (struct n3n_runtime_data *sss,
 #ifdef _WIN32
         traceEvent(TRACE_ERROR, "WSAGetLastError(): %u", WSAGetLastError());
 #endif
-        // if the erroneous connection is tcp, i.e. not the regular sock...
-        if((socket_fd >= 0) && (socket_fd != sss->sock)) {
-            // ...forget about the corresponding peer and the connection
-            HASH_FIND_INT(sss->tcp_connections, &socket_fd, conn);
-            close_tcp_connection(sss, conn);
-            return -1;
-        }
     } else {
         traceEvent(TRACE_DEBUG, "sendto_fd sent=%d", (signed int)sent);
     }
@@ -553,6 +679,79 @@ static ssize_t sendto_fd (struct n3n_runtime_data *sss,
 }
 
 
+/** Prepare an accepted TCP connection for the non blocking, queued writes */
+static void sn_tcp_setup (SOCKET socket_fd) {
+#ifdef _WIN32
+    u_long nonblock = 1;
+    char value = 1;
+
+    ioctlsocket(socket_fd, FIONBIO, &nonblock);
+#else
+    int value = 1;
+
+    fcntl(socket_fd, F_SETFL, O_NONBLOCK);
+#endif
+    // the writes already send as much as is available in one go
+    setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, (void *)&value, sizeof(value));
+}
+
+
+/** Send a packet on one of the TCP connections.  Whatever the socket cannot
+ *  take yet is queued, to be sent once it is writable again.
+ *
+ *    @return -1 on error otherwise number of bytes sent
+ */
+static ssize_t sendto_tcp (struct n3n_runtime_data *sss,
+                           SOCKET socket_fd,
+                           const uint8_t *pktbuf,
+                           size_t pktsize) {
+
+    n2n_tcp_connection_t *conn;
+    ssize_t sent;
+
+    HASH_FIND_INT(sss->tcp_connections, &socket_fd, conn);
+    if(!conn || conn->inactive) {
+        return -1;
+    }
+
+    if(pktsize > N2N_SN_PKTBUF_SIZE) {
+        traceEvent(TRACE_DEBUG, "packet too large for tcp connection");
+        return -1;
+    }
+
+#ifdef HAVE_LIBPTHREAD
+    bool pending = n3n_tcpconn_pending(conn->tcp);
+#endif
+    sent = n3n_tcpconn_send(conn->tcp, socket_fd, pktbuf, pktsize);
+    if(sent < 0) {
+        traceEvent(TRACE_ERROR, "send on tcp connection failed (%d) %s", errno, strerror(errno));
+#ifdef _WIN32
+        traceEvent(TRACE_ERROR, "WSAGetLastError(): %u", WSAGetLastError());
+#endif
+        // forget about the corresponding peer and the connection
+        close_tcp_connection(sss, conn);
+        return -1;
+    }
+    if(sent == 0) {
+        // The edge is not keeping up, so drop instead of queueing even more
+        traceEvent(TRACE_DEBUG, "tcp connection queue full, dropped packet");
+        return -1;
+    }
+
+#ifdef HAVE_LIBPTHREAD
+    if(sn_in_worker && !pending && n3n_tcpconn_pending(conn->tcp)) {
+        // The main thread is not yet waiting for this socket to be writable
+        uint8_t wake = 0;
+        if(write(sss->workers->wakeup[1], &wake, sizeof(wake)) < 0) {
+            // Already full of wakeups, which is just as good
+        }
+    }
+#endif
+
+    return sent;
+}
+
+
 /** Send a datagram to a network order socket of type struct sockaddr.
  *
  *    @return -1 on error otherwise number of bytes sent
@@ -564,11 +763,11 @@ static ssize_t sendto_sock (struct n3n_runtime_data *sss,
                             size_t pktsize) {
 
     ssize_t sent = 0;
-#ifdef _WIN32
-    char value = 0;
-#else
-    int value = 0;
-#endif
+
+    // if the connection is tcp, i.e. not the regular sock...
+    if((socket_fd >= 0) && (socket_fd != sss->sock)) {
+        return sendto_tcp(sss, socket_fd, pktbuf, pktsize);
+    }
 
     // TODO: do we really have to check this every time?
     //       maye try a struct containing the socket and its length
@@ -584,36 +783,8 @@ static ssize_t sendto_sock (struct n3n_runtime_data *sss,
         return -1;
     }
 
-    // if the connection is tcp, i.e. not the regular sock...
-    if((socket_fd >= 0) && (socket_fd != sss->sock)) {
-
-        setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value));
-        value = 1;
-#ifdef __linux__
-        setsockopt(socket_fd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
-#endif
-
-        // prepend packet length...
-        uint16_t pktsize16 = htobe16(pktsize);
-        sent = sendto_fd(sss, socket_fd, (const struct sockaddr *)&dest_addr, socket_len, (uint8_t*)&pktsize16, sizeof(pktsize16));
-
-        if(sent <= 0)
-            return -1;
-        // ...before sending the actual data
-    }
-
     sent = sendto_fd(sss, socket_fd, (const struct sockaddr *)&dest_addr, socket_len, pktbuf, pktsize);
 
-    // if the connection is tcp, i.e. not the regular sock...
-    if((socket_fd >= 0) && (socket_fd != sss->sock)) {
-        value = 1; /* value should still be set to 1 */
-        setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, (void *)&value, sizeof(value));
-#ifdef __linux__
-        value = 0;
-        setsockopt(socket_fd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
-#endif
-    }
-
     return sent;
 }
 
@@ -657,13 +828,136 @@ static ssize_t sendto_peer (struct n3n_runtime_data *sss,
 }
 
 
+// A community member, with the destination of its broadcasts resolved ahead
+// of time, so that the fan-out only walks this array and calls sendto()
+struct sn_member {
+    struct sockaddr_in6 addr;   // only used for members on the udp socket
+    SOCKET socket_fd;
+    n2n_mac_t mac;
+    struct peer_info *peer;     // valid until the next membership change
+};
+
+static struct metrics_members {
+    uint32_t rebuild;           // Member array was rebuilt
+    uint32_t send;              // Packet sent by the broadcast fan-out
+} metrics_members;
+
+static struct n3n_metrics_items_llu32 metrics_members_items = {
+    .name = "count",
+    .desc = "Track the community member arrays used for broadcasts",
+    .name1 = "event",
+    .items = {
+        {
+            .val1 = "rebuild",
+            .offset = offsetof(struct metrics_members, rebuild),
+        },
+        {
+            .val1 = "send",
+            .offset = offsetof(struct metrics_members, send),
+        },
+        { },
+    },
+};
+
+static struct n3n_metrics_module metrics_members_module = {
+    .name = "sn_members",
+    .data = &metrics_members,
+    .items_llu32 = &metrics_members_items,
+    .type = n3n_metrics_type_llu32,
+};
+
+/** Rebuild the member array of a community from its edges list */
+static void members_rebuild (struct n3n_runtime_data *sss, struct sn_community *comm) {
+    struct peer_info *peer, *tmp;
+    struct sn_member *member;
+    uint32_t count = HASH_COUNT(comm->edges);
+
+    if(count > comm->members_size) {
+        free(comm->members);
+        // leave some room for the next few joining edges
+        comm->members_size = count + count / 4 + 4;
+        comm->members = malloc(comm->members_size * sizeof(struct sn_member));
+        if(!comm->members) {
+            abort();
+        }
+    }
+
+    member = comm->members;
+    comm->members_tcp = false;
+    HASH_ITER(hh, comm->edges, peer, tmp) {
+        struct sockaddr_storage socket_storage;
+        struct sockaddr_storage dest_addr;
+
+        memset(&member->addr, 0, sizeof(member->addr));
+        member->socket_fd = (peer->socket_fd >= 0) ? peer->socket_fd : sss->sock;
+        memcpy(member->mac, peer->mac_addr, sizeof(n2n_mac_t));
+        member->peer = peer;
+        if(member->socket_fd != sss->sock) {
+            comm->members_tcp = true;
+        }
+
+        // this assumes we operate on a IPv6 dual stack socket, as sendto_sock()
+        // does, so every sendable address becomes a sockaddr_in6.  Any other
+        // keeps the zero family and is reported when sending to it
+        if(fill_sockaddr((struct sockaddr *)&socket_storage, sizeof(socket_storage), &peer->sock) &&
+           (prepare_sockaddr_for_send(&dest_addr, AF_INET6,
+                                      (const struct sockaddr *)&socket_storage) == sizeof(struct sockaddr_in6))) {
+            memcpy(&member->addr, &dest_addr, sizeof(struct sockaddr_in6));
+        }
+
+        member++;
+    }
+
+    comm->members_count = member - comm->members;
+    comm->members_dirty = false;
+    metrics_members.rebuild++;
+}
+
+/** Check if the member array no longer matches the edges list */
+static bool members_stale (const struct sn_community *comm) {
+    return comm->members_dirty || (comm->members_count != HASH_COUNT(comm->edges));
+}
+
+static void members_free (struct sn_community *comm) {
+    free(comm->members);
+    comm->members = NULL;
+    comm->members_count = 0;
+    comm->members_size = 0;
+}
+
+/** Send a datagram to a community member.
+ *
+ *    @return -1 on error otherwise number of bytes sent
+ */
+static ssize_t sendto_member (struct n3n_runtime_data *sss,
+                              const struct sn_member *member,
+                              const uint8_t *pktbuf,
+                              size_t pktsize) {
+
+    __atomic_add_fetch(&metrics_members.send, 1, __ATOMIC_RELAXED);
+
+    if(member->socket_fd != sss->sock) {
+        return sendto_tcp(sss, member->socket_fd, pktbuf, pktsize);
+    }
+
+    if(member->addr.sin6_family != AF_INET6) {
+        errno = EAFNOSUPPORT;
+        return -1;
+    }
+
+    return sendto_fd(sss, member->socket_fd,
+                     (const struct sockaddr *)&member->addr, sizeof(struct sockaddr_in6),
+                     pktbuf, pktsize);
+}
+
+
 /** Try and broadcast a message to all edges in the community.
  *
  *    This will send the exact same datagram to zero or more edges registered to
  *    the supernode.
  */
 static void try_broadcast (struct n3n_runtime_data * sss,
-                           const struct sn_community *comm,
+                           struct sn_community *comm,
                            const n2n_common_t * cmn,
                            const n2n_mac_t srcMac,
                            bool from_supernode,
@@ -671,7 +965,8 @@ static void try_broadcast (struct n3n_runtime_data * sss,
                            size_t pktsize,
                            time_t now) {
 
-    struct peer_info        *scan, *tmp;
+    struct sn_community     *federation = sss->federation;
+    struct sn_member        *member, *last;
     macstr_t mac_buf;
     n3n_sock_str_t sockbuf;
 
@@ -685,27 +980,32 @@ static void try_broadcast (struct n3n_runtime_data * sss,
     if(!from_supernode) {
         // If the broadcast is not from a supernode, send it to all supernodes
 
-        HASH_ITER(hh, sss->federation->edges, scan, tmp) {
+        if(members_stale(federation)) {
+            members_rebuild(sss, federation);
+        }
+
+        last = federation->members + federation->members_count;
+        for(member = federation->members; member < last; member++) {
             int data_sent_len;
 
             // only forward to active supernodes
-            if(scan->last_seen + LAST_SEEN_SN_INACTIVE > now) {
+            if(member->peer->last_seen + LAST_SEEN_SN_INACTIVE > now) {
 
-                data_sent_len = sendto_peer(sss, scan, pktbuf, pktsize);
+                data_sent_len = sendto_member(sss, member, pktbuf, pktsize);
 
                 if(data_sent_len != pktsize) {
-                    ++(sss->stats.sn_errors);
+                    __atomic_add_fetch(&sss->stats.sn_errors, 1, __ATOMIC_RELAXED);
                     traceEvent(TRACE_WARNING, "multicast %lu to supernode [%s] %s failed %s",
                                pktsize,
-                               sock_to_cstr(sockbuf, &(scan->sock)),
-                               macaddr_str(mac_buf, scan->mac_addr),
+                               sock_to_cstr(sockbuf, &(member->peer->sock)),
+                               macaddr_str(mac_buf, member->mac),
                                strerror(errno));
                 } else {
-                    ++(sss->stats.sn_broadcast);
+                    __atomic_add_fetch(&sss->stats.sn_broadcast, 1, __ATOMIC_RELAXED);
                     traceEvent(TRACE_DEBUG, "multicast %lu to supernode [%s] %s",
                                pktsize,
-                               sock_to_cstr(sockbuf, &(scan->sock)),
-                               macaddr_str(mac_buf, scan->mac_addr));
+                               sock_to_cstr(sockbuf, &(member->peer->sock)),
+                               macaddr_str(mac_buf, member->mac));
                 }
             }
         }
@@ -714,32 +1014,35 @@ static void try_broadcast (struct n3n_runtime_data * sss,
     if(comm) {
         // If we know this community, send the broadcast to all known edges
 
-        HASH_ITER(hh, comm->edges, scan, tmp) {
-            if(memcmp(srcMac, scan->mac_addr, sizeof(n2n_mac_t)) != 0) {
+        if(members_stale(comm)) {
+            members_rebuild(sss, comm);
+        }
+
+        last = comm->members + comm->members_count;
+        for(member = comm->members; member < last; member++) {
+            if(memcmp(srcMac, member->mac, sizeof(n2n_mac_t)) != 0) {
                 /* REVISIT: exclude if the destination socket is where the packet came from. */
                 int data_sent_len;
 
-                data_sent_len = sendto_peer(sss, scan, pktbuf, pktsize);
+                data_sent_len = sendto_member(sss, member, pktbuf, pktsize);
 
                 if(data_sent_len != pktsize) {
-                    ++(sss->stats.sn_errors);
+                    __atomic_add_fetch(&sss->stats.sn_errors, 1, __ATOMIC_RELAXED);
                     traceEvent(TRACE_WARNING, "multicast %lu to [%s] %s failed %s",
                                pktsize,
-                               sock_to_cstr(sockbuf, &(scan->sock)),
-                               macaddr_str(mac_buf, scan->mac_addr),
+                               sock_to_cstr(sockbuf, &(member->peer->sock)),
+                               macaddr_str(mac_buf, member->mac),
                                strerror(errno));
                 } else {
-                    ++(sss->stats.sn_broadcast);
+                    __atomic_add_fetch(&sss->stats.sn_broadcast, 1, __ATOMIC_RELAXED);
                     traceEvent(TRACE_DEBUG, "multicast %lu to [%s] %s",
                                pktsize,
-                               sock_to_cstr(sockbuf, &(scan->sock)),
-                               macaddr_str(mac_buf, scan->mac_addr));
+                               sock_to_cstr(sockbuf, &(member->peer->sock)),
+                               macaddr_str(mac_buf, member->mac));
                 }
             }
         }
     }
-
-    return;
 }
 
 
@@ -766,14 +1069,14 @@ static void try_forward (struct n3n_runtime_data * sss,
         data_sent_len = sendto_peer(sss, scan, pktbuf, pktsize);
 
         if(data_sent_len == pktsize) {
-            ++(sss->stats.sn_fwd);
+            __atomic_add_fetch(&sss->stats.sn_fwd, 1, __ATOMIC_RELAXED);
             traceEvent(TRACE_DEBUG, "unicast %lu to [%s] %s",
                        pktsize,
                        sock_to_cstr(sockbuf, &(scan->sock)),
                        macaddr_str(mac_buf, scan->mac_addr));
             return;
         } else {
-            ++(sss->stats.sn_errors);
+            __atomic_add_fetch(&sss->stats.sn_errors, 1, __ATOMIC_RELAXED);
             traceEvent(TRACE_ERROR, "unicast %lu to [%s] %s FAILED (%d: %s)",
                        pktsize,
                        sock_to_cstr(sockbuf, &(scan->sock)),
@@ -817,7 +1120,7 @@ static void try_forward (struct n3n_runtime_data * sss,
     }
 
     // Must be from a supernode then
-    sss->stats.sn_drop++;
+    __atomic_add_fetch(&sss->stats.sn_drop, 1, __ATOMIC_RELAXED);
     traceEvent(
         TRACE_DEBUG,
         "unknown mac address in packet from a supernode, dropping the packet"
@@ -854,6 +1157,7 @@ void sn_init_conf_defaults (struct n3n_runtime_data *sss, char *sessionname) {
 
     conf->is_supernode = true;
     conf->spoofing_protection = true;
+    conf->sn_workers = 1;
 
     strncpy(conf->version, VERSION, sizeof(n2n_version_t));
     conf->version[sizeof(n2n_version_t) - 1] = '\0';
@@ -959,6 +1263,9 @@ void sn_init (struct n3n_runtime_data *sss) {
         );
     }
 
+    // The transmit queue holds its datagrams in these until it sends them
+    n3n_pktbuf_initialise(N2N_PKT_BUF_SIZE, N3N_TXQUEUE_SIZE);
+
     // TODO: thread should probably be created before the above resolve!
     if(resolve_create_thread(&(sss->resolve_parameter), sss->federation->edges) == 0) {
         traceEvent(TRACE_INFO, "successfully created resolver thread");
@@ -966,17 +1273,96 @@ void sn_init (struct n3n_runtime_data *sss) {
 }
 
 
+/** Open the additional sockets for the worker threads.
+ *
+ *  This needs to be done before dropping privileges, as the kernel only
+ *  allows sockets owned by the same user to share a port.
+ */
+int sn_open_workers (struct n3n_runtime_data *sss) {
+    if(sss->conf.sn_workers <= 1) {
+        return 0;
+    }
+
+#ifdef HAVE_LIBPTHREAD
+    struct sockaddr_storage sas;
+    socklen_t sas_len = sizeof(sas);
+    int count = sss->conf.sn_workers - 1;
+
+    if(getsockname(sss->sock, (struct sockaddr *)&sas, &sas_len) != 0) {
+        traceEvent(TRACE_ERROR, "getsockname() failed: %s", strerror(errno));
+        return -1;
+    }
+
+    sss->workers = calloc(
+        1,
+        sizeof(struct sn_workers) + count * sizeof(struct sn_worker)
+    );
+    if(!sss->workers) {
+        abort();
+    }
+    pthread_rwlock_init(&sss->workers->lock, NULL);
+
+    if(pipe(sss->workers->wakeup) != 0) {
+        traceEvent(TRACE_ERROR, "failed to open worker wakeup pipe: %s", strerror(errno));
+        pthread_rwlock_destroy(&sss->workers->lock);
+        free(sss->workers);
+        sss->workers = NULL;
+        return -1;
+    }
+    fcntl(sss->workers->wakeup[0], F_SETFL, O_NONBLOCK);
+    fcntl(sss->workers->wakeup[1], F_SETFL, O_NONBLOCK);
+
+    for(int i = 0; i < count; i++) {
+        SOCKET sock = open_socket((struct sockaddr *)&sas, sas_len, 0 /* UDP */);
+        if(sock == -1) {
+            traceEvent(TRACE_ERROR, "failed to open worker socket: %s", strerror(errno));
+            break;
+        }
+        sss->workers->worker[i].sss = sss;
+        sss->workers->worker[i].sock = sock;
+        sss->workers->count++;
+    }
+
+    return sss->workers->count;
+#else
+    traceEvent(TRACE_WARNING, "supernode.workers needs pthread support, ignored");
+    return 0;
+#endif
+}
+
+
+#ifdef HAVE_LIBPTHREAD
+static void sn_close_workers (struct n3n_runtime_data *sss) {
+    if(!sss->workers) {
+        return;
+    }
+
+    for(int i = 0; i < sss->workers->count; i++) {
+        closesocket(sss->workers->worker[i].sock);
+    }
+    close(sss->workers->wakeup[0]);
+    close(sss->workers->wakeup[1]);
+    pthread_rwlock_destroy(&sss->workers->lock);
+    free(sss->workers);
+    sss->workers = NULL;
+}
+#endif
+
+
 /** Deinitialise the supernode structure and deallocate any memory owned by
  *    it. */
 void sn_term (struct n3n_runtime_data *sss) {
 
     struct sn_community *community, *tmp;
-    struct sn_community_regular_expression *re, *tmp_re;
     n2n_tcp_connection_t *conn, *tmp_conn;
     node_supernode_association_t *assoc, *tmp_assoc;
 
     resolve_cancel_thread(sss->resolve_parameter);
 
+#ifdef HAVE_LIBPTHREAD
+    sn_close_workers(sss);
+#endif
+
     if(sss->sock >= 0) {
         closesocket(sss->sock);
     }
@@ -986,6 +1372,7 @@ void sn_term (struct n3n_runtime_data *sss) {
         shutdown(conn->socket_fd, SHUT_RDWR);
         closesocket(conn->socket_fd);
         HASH_DEL(sss->tcp_connections, conn);
+        n3n_tcpconn_free(conn->tcp);
         free(conn);
     }
 
@@ -1017,16 +1404,22 @@ void sn_term (struct n3n_runtime_data *sss) {
         }
 
         HASH_DEL(sss->communities, community);
+        auto_ip_free(community);
+        members_free(community);
         free(community);
     }
 
-    HASH_ITER(hh, sss->rules, re, tmp_re) {
-        HASH_DEL(sss->rules, re);
-        if(NULL != re->rule) {
-            free(re->rule);
-        }
-        free(re);
+    if(sss->auto_subnets) {
+        n3n_bitmap_free(sss->auto_subnets);
+        free(sss->auto_subnets);
+        sss->auto_subnets = NULL;
     }
+    free(sss->auto_subnets_fixed);
+    sss->auto_subnets_fixed = NULL;
+    sss->auto_subnets_fixed_count = 0;
+
+    re_set_free(sss->rules);
+    sss->rules = NULL;
 
     free(sss->conf.bind_address);
 
@@ -1085,7 +1478,15 @@ void update_node_supernode_association (struct sn_community *comm,
     // TODO: check sock_size for overflow
     memcpy(&(assoc->sock), sender_sock, sock_size);
     assoc->sock_len = sock_size;
-    assoc->last_seen = now;
+
+    if(assoc->last_seen != now) {
+        assoc->last_seen = now;
+        if(assoc->hh.next) {
+            // Keep the list in last_seen order for the purge
+            HASH_DEL(comm->assoc, assoc);
+            HASH_ADD(hh, comm->assoc, mac, sizeof(n2n_mac_t), assoc);
+        }
+    }
     return;
 }
 
@@ -1235,6 +1636,117 @@ static int handle_remote_auth (struct n3n_runtime_data *sss, const n2n_auth_t *r
 }
 
 
+/* ************************************** */
+
+// The auto ip addresses are handed out from a per community bitmap of the
+// host ids, see bitmap.h.  It is built on first use, then edges joining
+// mark their address in it and edges leaving clear it again - unless the
+// edges_by_ip index shows that another edge still has that address.
+
+// Limit the bitmap to 2MB, larger ranges only use the start of the range
+#define AUTO_IP_MAX_HOST_BITS 24
+
+static uint32_t auto_ip_max_host (const struct sn_community *comm) {
+    uint32_t max_host = ~bitlen2mask(comm->auto_ip_net.net_bitlen);
+    return MIN(max_host, (1 << AUTO_IP_MAX_HOST_BITS) - 1);
+}
+
+/** Find the bitmap host id of an address, false if it is not in the range */
+static bool auto_ip_host_id (const struct sn_community *comm, const n2n_ip_subnet_t *dev_addr, uint32_t *host_id) {
+    uint32_t mask = bitlen2mask(comm->auto_ip_net.net_bitlen);
+    if((dev_addr->net_addr & mask) != (comm->auto_ip_net.net_addr & mask)) {
+        return false;
+    }
+
+    *host_id = dev_addr->net_addr & ~mask;
+    return *host_id <= auto_ip_max_host(comm);
+}
+
+/** Mark the address of an edge as taken, if it is in the auto ip range */
+static void auto_ip_mark (struct sn_community *comm, const n2n_ip_subnet_t *dev_addr) {
+    uint32_t host_id;
+
+    if(!comm->auto_ip_hosts) {
+        // Nothing assigned yet, the bitmap is built on first use
+        return;
+    }
+
+    if(auto_ip_host_id(comm, dev_addr, &host_id)) {
+        n3n_bitmap_set(comm->auto_ip_hosts, host_id);
+    }
+}
+
+/** Hand back the address of an edge that has left, or moved.  The edge must
+ *  already be out of the edges_by_ip index */
+static void auto_ip_release (struct sn_community *comm, const n2n_ip_subnet_t *dev_addr) {
+    uint32_t host_id;
+
+    if(!comm->auto_ip_hosts) {
+        return;
+    }
+
+    if(!auto_ip_host_id(comm, dev_addr, &host_id)) {
+        return;
+    }
+
+    // The network and broadcast addresses are never handed out
+    if((host_id == 0) || (host_id == auto_ip_max_host(comm))) {
+        return;
+    }
+
+    if(peer_info_ip_index_find(comm->edges_by_ip, dev_addr->net_addr)) {
+        // Still in use by another edge
+        return;
+    }
+
+    n3n_bitmap_clear(comm->auto_ip_hosts, host_id);
+}
+
+static void auto_ip_build (struct sn_community *comm) {
+    uint32_t max_host = auto_ip_max_host(comm);
+    struct peer_info *peer, *tmp_peer;
+
+    comm->auto_ip_hosts = malloc(sizeof(*comm->auto_ip_hosts));
+    if(!comm->auto_ip_hosts) {
+        abort();
+    }
+    n3n_bitmap_init(comm->auto_ip_hosts, max_host + 1);
+
+    // The network and broadcast addresses are never handed out
+    n3n_bitmap_set(comm->auto_ip_hosts, 0);
+    n3n_bitmap_set(comm->auto_ip_hosts, max_host);
+
+    HASH_ITER(hh, comm->edges, peer, tmp_peer) {
+        auto_ip_mark(comm, &peer->dev_addr);
+    }
+}
+
+static void auto_ip_free (struct sn_community *comm) {
+    if(!comm->auto_ip_hosts) {
+        return;
+    }
+    n3n_bitmap_free(comm->auto_ip_hosts);
+    free(comm->auto_ip_hosts);
+    comm->auto_ip_hosts = NULL;
+}
+
+/** Called by purge_peer_list() for each edge of a community it purges */
+static void auto_ip_purged (struct peer_info *edge, void *data) {
+    auto_ip_release((struct sn_community *)data, &edge->dev_addr);
+}
+
+
+/** Remove an edge from its community and free it */
+static void edge_del (struct sn_community *comm, struct peer_info *edge) {
+    n2n_ip_subnet_t dev_addr = edge->dev_addr;
+
+    HASH_DEL(comm->edges, edge);
+    peer_info_free(edge);   // which also takes it out of edges_by_ip
+    auto_ip_release(comm, &dev_addr);
+    comm->members_dirty = true;
+}
+
+
 /** Update the edge table with the details of the edge which contacted the
  *    supernode. */
 static int update_edge (struct n3n_runtime_data *sss,
@@ -1249,7 +1761,7 @@ static int update_edge (struct n3n_runtime_data *sss,
 
     macstr_t mac_buf;
     n3n_sock_str_t sockbuf;
-    struct peer_info *scan, *iter, *tmp;
+    struct peer_info *scan;
 
     traceEvent(TRACE_DEBUG, "update_edge for %s [%s]",
                macaddr_str(mac_buf, reg->edgeMac),
@@ -1259,23 +1771,30 @@ static int update_edge (struct n3n_runtime_data *sss,
 
     // if unknown, make sure it is also not known by IP address
     if(NULL == scan) {
-        HASH_ITER(hh,comm->edges,iter,tmp) {
-            // TODO:
-            // - needs ipv6 support
-            // - I suspect that this can leak TCP connections
-            // - convert to using a peer_info_*() call for manipulating the
-            //   peer info lists
-            if(iter->dev_addr.net_addr == reg->dev_addr.net_addr) {
-                scan = iter;
-                HASH_DEL(comm->edges, scan);
-                memcpy(scan->mac_addr, reg->edgeMac, sizeof(n2n_mac_t));
-                HASH_ADD_PEER(comm->edges, scan);
-                break;
-            }
+        // TODO:
+        // - needs ipv6 support
+        // - I suspect that this can leak TCP connections
+        // - convert to using a peer_info_*() call for manipulating the
+        //   peer info lists
+        scan = peer_info_ip_index_find(comm->edges_by_ip, reg->dev_addr.net_addr);
+        if(scan) {
+            HASH_DEL(comm->edges, scan);
+            memcpy(scan->mac_addr, reg->edgeMac, sizeof(n2n_mac_t));
+            HASH_ADD_PEER(comm->edges, scan);
+            comm->members_dirty = true;
         }
     }
 
-    scan = peer_info_validate(&comm->edges, scan);
+    if(scan) {
+        n2n_ip_subnet_t dev_addr = scan->dev_addr;
+
+        scan = peer_info_validate(&comm->edges, scan);
+        if(!scan) {
+            // it had timed out, so has been freed
+            auto_ip_release(comm, &dev_addr);
+            comm->members_dirty = true;
+        }
+    }
 
     if(NULL == scan) {
         /* Not known */
@@ -1304,12 +1823,15 @@ static int update_edge (struct n3n_runtime_data *sss,
                     scan->auth.scheme = n2n_auth_none;
 
                 HASH_ADD_PEER(comm->edges, scan);
+                peer_info_ip_index_set(&comm->edges_by_ip, scan);
+                auto_ip_mark(comm, &scan->dev_addr);
+                comm->members_dirty = true;
 
                 traceEvent(TRACE_INFO, "created edge  %s ==> %s",
                            macaddr_str(mac_buf, reg->edgeMac),
                            sock_to_cstr(sockbuf, sender_sock));
 
-                scan->last_seen = now;
+                peer_info_seen(&comm->edges, scan, now);
                 return update_edge_new_sn;
             }
             return update_edge_new_sn;
@@ -1321,11 +1843,17 @@ static int update_edge (struct n3n_runtime_data *sss,
         /* Known */
         if(auth_edge(&(scan->auth), &(reg->auth), answer_auth, comm) == 0) {
             if(!sock_equal(sender_sock, &(scan->sock))) {
+                n2n_ip_subnet_t old_addr = scan->dev_addr;
+
                 scan->dev_addr.net_addr = reg->dev_addr.net_addr;
                 scan->dev_addr.net_bitlen = reg->dev_addr.net_bitlen;
+                peer_info_ip_index_set(&comm->edges_by_ip, scan);
+                auto_ip_release(comm, &old_addr);
+                auto_ip_mark(comm, &scan->dev_addr);
                 memcpy((char*)scan->dev_desc, reg->dev_desc, N2N_DESC_SIZE);
                 memcpy(&(scan->sock), sender_sock, sizeof(n3n_sock_t));
                 scan->socket_fd = socket_fd;
+                comm->members_dirty = true;
                 scan->last_cookie = reg->cookie;
                 // eventually, update edge's preferred local socket from REGISTER_SUPER
                 if(cmn->flags & N2N_FLAGS_SOCKET)
@@ -1336,7 +1864,7 @@ static int update_edge (struct n3n_runtime_data *sss,
                 traceEvent(TRACE_INFO, "updated edge  %s ==> %s",
                            macaddr_str(mac_buf, reg->edgeMac),
                            sock_to_cstr(sockbuf, sender_sock));
-                scan->last_seen = now;
+                peer_info_seen(&comm->edges, scan, now);
                 return update_edge_sock_change;
             } else {
                 scan->last_cookie = reg->cookie;
@@ -1345,7 +1873,7 @@ static int update_edge (struct n3n_runtime_data *sss,
                            macaddr_str(mac_buf, reg->edgeMac),
                            sock_to_cstr(sockbuf, sender_sock));
 
-                scan->last_seen = now;
+                peer_info_seen(&comm->edges, scan, now);
                 return update_edge_no_change;
             }
         } else {
@@ -1358,78 +1886,35 @@ static int update_edge (struct n3n_runtime_data *sss,
 }
 
 
-/** checks if a certain ip address is still available, i.e. not used by any other edge of a given community */
-static int ip_addr_available (struct sn_community *comm, n2n_ip_subnet_t *ip_addr) {
-
-    int success = 1;
-    struct peer_info *peer, *tmp_peer;
-
-    // prerequisite: list of peers is sorted according to peer's tap ip address
-    HASH_ITER(hh, comm->edges, peer, tmp_peer) {
-        if(peer->dev_addr.net_addr  > ip_addr->net_addr) {
-            break;
-        }
-        if(peer->dev_addr.net_addr == ip_addr->net_addr) {
-            success = 0;
-            break;
-        }
-    }
-
-    return success;
-}
-
-
-static signed int peer_tap_ip_sort (struct peer_info *a, struct peer_info *b) {
-
-    uint32_t a_host_id = a->dev_addr.net_addr & (~bitlen2mask(a->dev_addr.net_bitlen));
-    uint32_t b_host_id = b->dev_addr.net_addr & (~bitlen2mask(b->dev_addr.net_bitlen));
-
-    return ((signed int)a_host_id - (signed int)b_host_id);
-}
-
-
 /** The IP address assigned to the edge by the auto ip address function of sn. */
 static int assign_one_ip_addr (struct sn_community *comm, n2n_desc_t dev_desc, n2n_ip_subnet_t *ip_addr) {
 
-    uint32_t tmp, success, net_id, mask, max_host, host_id = 1;
+    uint32_t tmp, net_id, max_host, host_id;
+    bool found;
     dec_ip_bit_str_t ip_bit_str = {'\0'};
 
-    mask = bitlen2mask(comm->auto_ip_net.net_bitlen);
-    net_id = comm->auto_ip_net.net_addr & mask;
-    max_host = ~mask;
+    net_id = comm->auto_ip_net.net_addr & bitlen2mask(comm->auto_ip_net.net_bitlen);
+    max_host = auto_ip_max_host(comm);
 
-    // sorting is a prerequisite for more efficient availabilitiy check
-    HASH_SORT(comm->edges, peer_tap_ip_sort);
+    if(!comm->auto_ip_hosts) {
+        auto_ip_build(comm);
+    }
 
     // first proposal derived from hash of mac address
     tmp = pearson_hash_32(dev_desc, sizeof(n2n_desc_t)) & max_host;
-    if(tmp == 0) tmp++;        /* avoid 0 host */
-    if(tmp == max_host) tmp--; /* avoid broadcast address */
-    tmp |= net_id;
-
-    // candidate
-    ip_addr->net_bitlen = comm->auto_ip_net.net_bitlen;
 
     // check for availability starting from proposal, then downwards, ...
-    for(host_id = tmp; host_id > net_id; host_id--) {
-        ip_addr->net_addr = host_id;
-        success = ip_addr_available(comm, ip_addr);
-        if(success) {
-            break;
-        }
-    }
+    found = n3n_bitmap_find_down(comm->auto_ip_hosts, tmp, &host_id);
     // ... then upwards
-    if(!success) {
-        for(host_id = tmp + 1; host_id < (net_id + max_host); host_id++) {
-            ip_addr->net_addr = host_id;
-            success = ip_addr_available(comm, ip_addr);
-            if(success) {
-                break;
-            }
-        }
+    if(!found) {
+        found = n3n_bitmap_find_up(comm->auto_ip_hosts, tmp, &host_id);
     }
 
-    if(success) {
+    if(found) {
+        // Not marked as taken until the edge registers with it, as there
+        // would be nothing to hand it back if the edge never does
+        ip_addr->net_addr = net_id | host_id;
+        ip_addr->net_bitlen = comm->auto_ip_net.net_bitlen;
         traceEvent(TRACE_INFO, "assign IP %s to tap adapter of edge", ip_subnet_to_str(ip_bit_str, ip_addr));
         return 0;
     } else {
@@ -1439,30 +1924,143 @@ static int assign_one_ip_addr (struct sn_community *comm, n2n_desc_t dev_desc, n
 }
 
 
-/** checks if a certain sub-network is still available, i.e. does not cut any other community's sub-network */
-int subnet_available (struct n3n_runtime_data *sss,
-                      struct sn_community *comm,
-                      uint32_t net_id,
-                      uint32_t mask) {
+// The community sub-networks are handed out from a supernode wide bitmap
+// of the slots between sn_min_auto_ip_net and sn_max_auto_ip_net, with a
+// slot marked as used when any community network overlaps it.  It is built
+// on first use, then kept up to date as communities come and go.
+//
+// An assigned network takes exactly one free slot, so only the configured
+// networks can share a slot with another.  They are kept in a short list of
+// their own, for when a slot is handed back.
+
+static uint32_t auto_subnet_count (const struct n3n_runtime_data *sss) {
+    uint32_t net_min = ntohl(sss->conf.sn_min_auto_ip_net.net_addr);
+    uint32_t net_max = ntohl(sss->conf.sn_max_auto_ip_net.net_addr);
+    uint32_t no_subnets;
+
+    // number of possible sub-networks
+    no_subnets   = net_max - net_min;
+    no_subnets >>= (32 - sss->conf.sn_min_auto_ip_net.net_bitlen);
+    no_subnets  += 1;
+
+    return MIN(no_subnets, (1 << AUTO_IP_MAX_HOST_BITS));
+}
+
+/** Find the slots overlapped by a network, false if there are none */
+static bool auto_subnet_slots (const struct n3n_runtime_data *sss,
+                               const n2n_ip_subnet_t *net,
+                               uint32_t *first_slot,
+                               uint32_t *last_slot) {
+    if(net->net_addr == 0) {
+        return false;
+    }
+
+    uint8_t shift = 32 - sss->conf.sn_min_auto_ip_net.net_bitlen;
+    uint64_t net_min = ntohl(sss->conf.sn_min_auto_ip_net.net_addr);
+    uint64_t net_end = net_min + ((uint64_t)sss->auto_subnets->bits << shift);
+    uint64_t first = net->net_addr;
+    uint64_t last = first + ~bitlen2mask(net->net_bitlen);
+
+    if((last < net_min) || (first >= net_end)) {
+        return false;
+    }
+
+    *first_slot = (MAX(first, net_min) - net_min) >> shift;
+    *last_slot = (MIN(last, net_end - 1) - net_min) >> shift;
+    return true;
+}
+
+/** Mark the slots overlapped by the network of a community as used */
+static void auto_subnet_mark (struct n3n_runtime_data *sss,
+                              const struct sn_community *comm) {
+    uint32_t first, last;
+
+    if(!sss->auto_subnets) {
+        // Nothing assigned yet, the bitmap is built on first use
+        return;
+    }
+    if(comm->is_federation) {
+        return;
+    }
 
-    struct sn_community *cmn, *tmpCmn;
-    int success = 1;
+    if(!auto_subnet_slots(sss, &comm->auto_ip_net, &first, &last)) {
+        return;
+    }
+    for(uint32_t slot = first; slot <= last; slot++) {
+        n3n_bitmap_set(sss->auto_subnets, slot);
+    }
+}
 
-    HASH_ITER(hh, sss->communities, cmn, tmpCmn) {
-        if(cmn == comm) {
+/** Note the network of a community from the community file */
+static void auto_subnet_fixed_add (struct n3n_runtime_data *sss,
+                                   const n2n_ip_subnet_t *net) {
+    n2n_ip_subnet_t *fixed = realloc(
+        sss->auto_subnets_fixed,
+        (sss->auto_subnets_fixed_count + 1) * sizeof(*fixed)
+    );
+    if(!fixed) {
+        abort();
+    }
+    fixed[sss->auto_subnets_fixed_count++] = *net;
+    sss->auto_subnets_fixed = fixed;
+}
+
+/** Forget all the community networks, when the communities are reloaded */
+static void auto_subnet_reset (struct n3n_runtime_data *sss) {
+    sss->auto_subnets_fixed_count = 0;
+    if(sss->auto_subnets) {
+        n3n_bitmap_reset(sss->auto_subnets);
+    }
+}
+
+/** Hand back the slot of a community with an assigned network that has
+ *  gone.  Configured networks are only ever dropped all at once, by
+ *  auto_subnet_reset() */
+static void auto_subnet_release (struct n3n_runtime_data *sss,
+                                 const struct sn_community *comm) {
+    uint32_t first, last;
+    uint32_t other_first, other_last;
+
+    if(!sss->auto_subnets) {
+        return;
+    }
+    if(comm->is_federation) {
+        return;
+    }
+
+    if(!auto_subnet_slots(sss, &comm->auto_ip_net, &first, &last)) {
+        return;
+    }
+    for(uint32_t slot = first; slot <= last; slot++) {
+        n3n_bitmap_clear(sss->auto_subnets, slot);
+    }
+
+    // A configured network can share the slot, which is then still in use
+    for(uint32_t i = 0; i < sss->auto_subnets_fixed_count; i++) {
+        if(!auto_subnet_slots(sss, &sss->auto_subnets_fixed[i], &other_first, &other_last)) {
             continue;
         }
-        if(cmn->is_federation) {
+        if((other_last < first) || (other_first > last)) {
             continue;
         }
-        if((net_id <= (cmn->auto_ip_net.net_addr + ~bitlen2mask(cmn->auto_ip_net.net_bitlen)))
-           &&(net_id + ~mask >= cmn->auto_ip_net.net_addr)) {
-            success = 0;
-            break;
+        for(uint32_t slot = MAX(first, other_first); slot <= MIN(last, other_last); slot++) {
+            n3n_bitmap_set(sss->auto_subnets, slot);
         }
     }
+}
 
-    return success;
+static void auto_subnet_build (struct n3n_runtime_data *sss) {
+    struct sn_community *comm, *tmp_comm;
+
+    sss->auto_subnets = malloc(sizeof(*sss->auto_subnets));
+    if(!sss->auto_subnets) {
+        abort();
+    }
+    n3n_bitmap_init(sss->auto_subnets, auto_subnet_count(sss));
+
+    HASH_ITER(hh, sss->communities, comm, tmp_comm) {
+        auto_subnet_mark(sss, comm);
+    }
 }
 
 
@@ -1470,48 +2068,34 @@ int subnet_available (struct n3n_runtime_data *sss,
 int assign_one_ip_subnet (struct n3n_runtime_data *sss,
                           struct sn_community *comm) {
 
-    uint32_t net_id, net_id_i, mask, net_increment;
-    uint32_t no_subnets;
-    uint8_t success;
-    in_addr_t net_min;
-    in_addr_t net_max;
+    uint32_t slot, proposal;
+    bool found;
     in_addr_t net;
 
+    // Do not let any earlier network of this community block its own
+    // assignment
+    comm->auto_ip_net.net_addr = 0;
+    comm->auto_ip_net.net_bitlen = 0;
 
-    mask = bitlen2mask(sss->conf.sn_min_auto_ip_net.net_bitlen);
-    net_min = ntohl(sss->conf.sn_min_auto_ip_net.net_addr);
-    net_max = ntohl(sss->conf.sn_max_auto_ip_net.net_addr);
-
-    // number of possible sub-networks
-    no_subnets   = net_max - net_min;
-    no_subnets >>= (32 - sss->conf.sn_min_auto_ip_net.net_bitlen);
-    no_subnets  += 1;
+    if(!sss->auto_subnets) {
+        auto_subnet_build(sss);
+    }
 
     // proposal for sub-network to choose
-    net_id    = pearson_hash_32((const uint8_t *)comm->community, N2N_COMMUNITY_SIZE) % no_subnets;
-    net_id    = net_min + (net_id << (32 - sss->conf.sn_min_auto_ip_net.net_bitlen));
-
-    // check for availability starting from net_id, then downwards, ...
-    net_increment = (~mask+1);
-    for(net_id_i = net_id; net_id_i >= net_min; net_id_i -= net_increment) {
-        success = subnet_available(sss, comm, net_id_i, mask);
-        if(success) {
-            break;
-        }
-    }
+    proposal = pearson_hash_32((const uint8_t *)comm->community, N2N_COMMUNITY_SIZE) % sss->auto_subnets->bits;
+
+    // check for availability starting from proposal, then downwards, ...
+    found = n3n_bitmap_find_down(sss->auto_subnets, proposal, &slot);
     // ... then upwards
-    if(!success) {
-        for(net_id_i = net_id + net_increment; net_id_i <= net_max; net_id_i += net_increment) {
-            success = subnet_available(sss, comm, net_id_i, mask);
-            if(success) {
-                break;
-            }
-        }
+    if(!found) {
+        found = n3n_bitmap_find_up(sss->auto_subnets, proposal, &slot);
     }
 
-    if(success) {
-        comm->auto_ip_net.net_addr = net_id_i;
+    if(found) {
+        comm->auto_ip_net.net_addr = ntohl(sss->conf.sn_min_auto_ip_net.net_addr)
+                                     + (slot << (32 - sss->conf.sn_min_auto_ip_net.net_bitlen));
         comm->auto_ip_net.net_bitlen = sss->conf.sn_min_auto_ip_net.net_bitlen;
+        n3n_bitmap_set(sss->auto_subnets, slot);
         net = htonl(comm->auto_ip_net.net_addr);
         struct in_addr *tmp = (struct in_addr *)&net;
         traceEvent(TRACE_INFO, "assigned sub-network %s/%u to community '%s'",
@@ -1520,8 +2104,6 @@ int assign_one_ip_subnet (struct n3n_runtime_data *sss,
                    comm->community);
         return 0;
     } else {
-        comm->auto_ip_net.net_addr = 0;
-        comm->auto_ip_net.net_bitlen = 0;
         traceEvent(TRACE_WARNING, "no assignable sub-network left for community '%s'",
                    comm->community);
         return -1;
@@ -1541,8 +2123,10 @@ static int re_register_and_purge_supernodes (struct n3n_runtime_data *sss, struc
 
         // purge long-time-not-seen supernodes
         if(comm) {
-            purge_expired_nodes(&(comm->edges), sss->sock, &sss->tcp_connections, p_last_re_reg_and_purge,
-                                RE_REG_AND_PURGE_FREQUENCY, LAST_SEEN_SN_INACTIVE);
+            if(purge_expired_nodes(&(comm->edges), sss->sock, &sss->tcp_connections, p_last_re_reg_and_purge,
+                                   RE_REG_AND_PURGE_FREQUENCY, LAST_SEEN_SN_INACTIVE)) {
+                comm->members_dirty = true;
+            }
         }
     }
 
@@ -1620,15 +2204,22 @@ static int purge_expired_communities (struct n3n_runtime_data *sss,
             continue;
 
         // purge the community's local peers
-        num_reg += purge_peer_list(&comm->edges, sss->sock, &sss->tcp_connections, now - REGISTRATION_TIMEOUT);
+        size_t num_purged = purge_peer_list(&comm->edges, sss->sock, &sss->tcp_connections, now - REGISTRATION_TIMEOUT,
+                                            auto_ip_purged, comm);
+        if(num_purged) {
+            comm->members_dirty = true;
+        }
+        num_reg += num_purged;
 
-        // purge the community's associated peers (connected to other supernodes)
+        // purge the community's associated peers (connected to other
+        // supernodes), which are kept in last_seen order
         HASH_ITER(hh, comm->assoc, assoc, tmp_assoc) {
-            if(comm->assoc->last_seen < (now - 3 * REGISTRATION_TIMEOUT)) {
-                HASH_DEL(comm->assoc, assoc);
-                free(assoc);
-                num_assoc++;
+            if(assoc->last_seen >= (now - 3 * REGISTRATION_TIMEOUT)) {
+                break;
             }
+            HASH_DEL(comm->assoc, assoc);
+            free(assoc);
+            num_assoc++;
         }
 
         if((comm->edges == NULL) && (comm->purgeable)) {
@@ -1646,6 +2237,9 @@ static int purge_expired_communities (struct n3n_runtime_data *sss,
                 free(assoc);
             }
             HASH_DEL(sss->communities, comm);
+            auto_subnet_release(sss, comm);
+            auto_ip_free(comm);
+            members_free(comm);
             free(comm);
         }
     }
@@ -1692,41 +2286,132 @@ static int sort_communities (struct n3n_runtime_data *sss,
 }
 
 
-/** Examine a datagram and determine what to do with it.
+/* The community a datagram was found to belong to */
+struct sn_pdu_match {
+    struct sn_community *comm;
+    uint32_t header_enc;        /* 1 == encrypted by static key, 2 == encrypted by dynamic key */
+    uint64_t stamp;
+    uint8_t hash_buf[16];       /* always size of 16 (max) despite the actual value of N2N_REG_SUP_HASH_CHECK_LEN (<= 16) */
+    uint32_t key_time;          // the dynamic key time when the header was decrypted
+    bool encrypted;             // the header did not look like plaintext
+    bool cache_hit;             // the sender cache pointed at the right community
+    uint32_t decrypts;          // full header decrypts tried
+};
+
+static struct metrics {
+    uint32_t cache_hit;         // Sender cache found the community
+    uint32_t cache_miss;        // Had to search all the communities
+    uint32_t decrypt;           // Full header decrypt attempts
+    uint32_t no_match;          // Encrypted header with no matching community
+} metrics;
+
+static struct n3n_metrics_items_llu32 metrics_items = {
+    .name = "count",
+    .desc = "Track how encrypted headers are matched to their community",
+    .name1 = "event",
+    .items = {
+        {
+            .val1 = "cache_hit",
+            .offset = offsetof(struct metrics, cache_hit),
+        },
+        {
+            .val1 = "cache_miss",
+            .offset = offsetof(struct metrics, cache_miss),
+        },
+        {
+            .val1 = "decrypt",
+            .offset = offsetof(struct metrics, decrypt),
+        },
+        {
+            .val1 = "no_match",
+            .offset = offsetof(struct metrics, no_match),
+        },
+        { },
+    },
+};
+
+static struct n3n_metrics_module metrics_module = {
+    .name = "sn_community",
+    .data = &metrics,
+    .items_llu32 = &metrics_items,
+    .type = n3n_metrics_type_llu32,
+};
+
+// Remember which community each sender last used, so that the common case
+// needs just one decrypt instead of one for every community.  Names are
+// stored instead of pointers, so purged communities simply stop matching.
+#define SN_COMMUNITY_CACHE_SIZE 1024    /* must be a power of two */
+
+struct sn_community_cache {
+    n3n_sock_t sock;
+    n2n_community_t community;
+};
+
+static struct sn_community_cache community_cache[SN_COMMUNITY_CACHE_SIZE];
+
+static struct sn_community_cache *community_cache_slot (const n3n_sock_t *sock) {
+    uint32_t hash = pearson_hash_32((const uint8_t *)sock, sizeof(*sock));
+
+    return &community_cache[hash & (SN_COMMUNITY_CACHE_SIZE - 1)];
+}
+
+
+/** Try one community's keys on an encrypted header.
  *
+ *  Only decrypting the magic bytes is enough to rule out nearly all of the
+ *  wrong communities, so the full decrypt and hash are only done on a
+ *  likely match.
  */
-static int process_pdu (struct n3n_runtime_data * sss,
-                        const struct sockaddr *sender_sock, socklen_t sock_size,
-                        const SOCKET socket_fd,
-                        uint8_t * udp_buf,
-                        size_t udp_size,
-                        time_t now
-) {
+static int try_pdu_community (struct sn_community *comm,
+                              uint8_t *udp_buf,
+                              size_t udp_size,
+                              struct sn_pdu_match *match) {
+
+    size_t static_size = MAX(0, (int)udp_size - (int)N2N_REG_SUP_HASH_CHECK_LEN);
+
+    // match with static (1) or dynamic (2) ctx?
+    // check dynamic first as it is identical to static in normal header encryption mode
+    if(packet_header_check_magic(udp_buf, udp_size, comm->header_encryption_ctx_dynamic)) {
+        match->decrypts++;
+        if(packet_header_decrypt(udp_buf, udp_size,
+                                 comm->community,
+                                 comm->header_encryption_ctx_dynamic, comm->header_iv_ctx_dynamic,
+                                 &match->stamp)) {
+            match->header_enc = 2;
+            return 1;
+        }
+    }
 
-    n2n_common_t cmn;        /* common fields in the packet header */
-    size_t rem;
-    size_t idx;
-    size_t msg_type;
-    bool from_supernode;
-    struct peer_info *sn = NULL;
-    n3n_sock_t sender;
-    n3n_sock_t          *orig_sender;
-    macstr_t mac_buf;
-    macstr_t mac_buf2;
-    n3n_sock_str_t sockbuf;
-    uint8_t hash_buf[16] = {0};             /* always size of 16 (max) despite the actual value of N2N_REG_SUP_HASH_CHECK_LEN (<= 16) */
+    if(packet_header_check_magic(udp_buf, static_size, comm->header_encryption_ctx_static)) {
+        match->decrypts++;
+        pearson_hash_128(match->hash_buf, udp_buf, static_size);
+        match->header_enc = packet_header_decrypt(udp_buf, static_size, comm->community,
+                                                  comm->header_encryption_ctx_static, comm->header_iv_ctx_static, &match->stamp);
+    }
 
-    struct sn_community *comm, *tmp;
-    uint32_t header_enc = 0;            /* 1 == encrypted by static key, 2 == encrypted by dynamic key */
-    uint64_t stamp;
-    int skip_add;
-    time_t any_time = 0;
+    return match->header_enc;
+}
 
-    fill_n3nsock(&sender, sender_sock);
-    orig_sender = &sender;
 
-    traceEvent(TRACE_DEBUG, "processing incoming UDP packet [len: %lu][sender: %s]",
-               udp_size, sock_to_cstr(sockbuf, &sender));
+/** Find the community of a datagram, decrypting its header in place if
+ *  required.
+ *
+ *  This only reads the community list, so worker threads can run it in
+ *  parallel.  Anything learnt about the community is recorded later by
+ *  update_pdu_community()
+ */
+static int match_pdu_community (struct n3n_runtime_data *sss,
+                                const struct sockaddr *sender_sock,
+                                uint8_t *udp_buf,
+                                size_t udp_size,
+                                struct sn_pdu_match *match) {
+
+    struct sn_community *comm, *tmp;
+    struct sn_community *cached = NULL;
+    n3n_sock_t sender;
+
+    memset(match, 0, sizeof(*match));
+    match->key_time = sss->dynamic_key_time;
 
     /* check if header is unencrypted. the following check is around 99.99962 percent reliable.
      * it heavily relies on the structure of packet's common part
@@ -1753,64 +2438,251 @@ static int process_pdu (struct n3n_runtime_data * sss,
                            comm->community);
                 return -1;
             }
-            if(comm->header_encryption == HEADER_ENCRYPTION_UNKNOWN) {
-                traceEvent(TRACE_INFO, "locked community '%s' to "
-                           "unencrypted headers", comm->community);
-                /* set 'no encryption' in case it is not set yet */
-                comm->header_encryption = HEADER_ENCRYPTION_NONE;
-                free(comm->header_encryption_ctx_static);
-                comm->header_encryption_ctx_static = NULL;
-                free(comm->header_encryption_ctx_dynamic);
-                comm->header_encryption_ctx_dynamic = NULL;
-            }
         }
-    } else {
-        /* most probably encrypted */
-        /* cycle through the known communities (as keys) to eventually decrypt */
-        HASH_ITER(hh, sss->communities, comm, tmp) {
-            /* skip the definitely unencrypted communities */
-            if(comm->header_encryption == HEADER_ENCRYPTION_NONE) {
-                continue;
-            }
+        match->comm = comm;
+        return 0;
+    }
 
-            // match with static (1) or dynamic (2) ctx?
-            // check dynamic first as it is identical to static in normal header encryption mode
-            if(packet_header_decrypt(udp_buf, udp_size,
-                                     comm->community,
-                                     comm->header_encryption_ctx_dynamic, comm->header_iv_ctx_dynamic,
-                                     &stamp)) {
-                header_enc = 2;
-            }
-            if(!header_enc) {
-                pearson_hash_128(hash_buf, udp_buf, MAX(0, (int)udp_size - (int)N2N_REG_SUP_HASH_CHECK_LEN));
-                header_enc = packet_header_decrypt(udp_buf, MAX(0, (int)udp_size - (int)N2N_REG_SUP_HASH_CHECK_LEN), comm->community,
-                                                   comm->header_encryption_ctx_static, comm->header_iv_ctx_static, &stamp);
+    /* most probably encrypted */
+    match->encrypted = true;
+
+    /* first try whichever community this sender used last time */
+    fill_n3nsock(&sender, sender_sock);
+    struct sn_community_cache *slot = community_cache_slot(&sender);
+    if(!memcmp(&slot->sock, &sender, sizeof(sender))) {
+        HASH_FIND_COMMUNITY(sss->communities, (char *)slot->community, cached);
+        if(cached && (cached->header_encryption != HEADER_ENCRYPTION_NONE)) {
+            if(try_pdu_community(cached, udp_buf, udp_size, match)) {
+                match->comm = cached;
+                match->cache_hit = true;
+                return 0;
             }
+        }
+    }
 
-            if(header_enc) {
-                // time stamp verification follows in the packet specific section as it requires to determine the
-                // sender from the hash list by its MAC, this all depends on packet type and packet structure
-                // (MAC is not always in the same place)
+    /* cycle through the known communities (as keys) to eventually decrypt */
+    HASH_ITER(hh, sss->communities, comm, tmp) {
+        /* skip the definitely unencrypted communities */
+        if(comm->header_encryption == HEADER_ENCRYPTION_NONE) {
+            continue;
+        }
+        /* and the one that has already been tried */
+        if(comm == cached) {
+            continue;
+        }
 
-                if(comm->header_encryption == HEADER_ENCRYPTION_UNKNOWN) {
-                    traceEvent(TRACE_INFO, "locked community '%s' to "
-                               "encrypted headers", comm->community);
-                    /* set 'encrypted' in case it is not set yet */
-                    comm->header_encryption = HEADER_ENCRYPTION_ENABLED;
-                }
-                // count the number of encrypted packets for sorting the communities from time to time
-                // for the HASH_ITER a few lines above gets faster for the more busy communities
-                (comm->number_enc_packets)++;
-                // no need to test further communities
-                break;
-            }
+        if(try_pdu_community(comm, udp_buf, udp_size, match)) {
+            // time stamp verification follows in the packet specific section as it requires to determine the
+            // sender from the hash list by its MAC, this all depends on packet type and packet structure
+            // (MAC is not always in the same place)
+            match->comm = comm;
+            // no need to test further communities
+            return 0;
         }
-        if(!header_enc) {
-            // no matching key/community
-            traceEvent(TRACE_DEBUG, "dropped a packet with seemingly encrypted header "
-                       "for which no matching community which uses encrypted headers was found");
+    }
+
+    // no matching key/community
+    traceEvent(TRACE_DEBUG, "dropped a packet with seemingly encrypted header "
+               "for which no matching community which uses encrypted headers was found");
+    return -1;
+}
+
+
+#ifdef HAVE_LIBPTHREAD
+/** Look the community up again after a match made without exclusive access,
+ *  as it could have been purged or changed since then.
+ *
+ *  The header is plaintext by now, so the community name is in place.
+ */
+static int rematch_pdu_community (struct n3n_runtime_data *sss,
+                                  uint8_t *udp_buf,
+                                  struct sn_pdu_match *match) {
+
+    HASH_FIND_COMMUNITY(sss->communities, (char *)&udp_buf[04], match->comm);
+
+    if(!match->comm) {
+        if(match->header_enc) {
+            traceEvent(TRACE_DEBUG, "dropped a packet for a community which has gone away");
             return -1;
         }
+        return 0;
+    }
+
+    if(match->header_enc) {
+        if(match->comm->header_encryption == HEADER_ENCRYPTION_NONE) {
+            return -1;
+        }
+        if((match->header_enc == 2) && match->comm->allowed_users
+           && (match->key_time != sss->dynamic_key_time)) {
+            // The dynamic keys changed since, so it would not be
+            // accepted now
+            traceEvent(TRACE_DEBUG, "dropped a packet encrypted with the previous dynamic key");
+            return -1;
+        }
+    } else {
+        if(match->comm->header_encryption == HEADER_ENCRYPTION_ENABLED) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+/** Check if a matched datagram can be handled with just the read lock held,
+ *  at the same time as the other workers.
+ *
+ *  This is the case for a PACKET forwarded to edges that are already known,
+ *  which only reads the peer and community lists.  Anything that has to
+ *  change them, the community cache or a tcp connection is left for the
+ *  write lock.
+ */
+static bool pdu_is_shared (struct n3n_runtime_data *sss,
+                           struct sn_pdu_match *match,
+                           uint8_t *udp_buf,
+                           size_t udp_size) {
+
+    n2n_common_t cmn;
+    n2n_PACKET_t pkt;
+    struct peer_info *peer;
+    size_t rem = udp_size;
+    size_t idx = 0;
+
+    if(rematch_pdu_community(sss, udp_buf, match) < 0) {
+        return false;
+    }
+
+    struct sn_community *comm = match->comm;
+    if(!comm || (comm->header_encryption == HEADER_ENCRYPTION_UNKNOWN)) {
+        return false;
+    }
+
+    // a sender that missed the cache is added to it
+    if(match->encrypted && !match->cache_hit) {
+        return false;
+    }
+
+    if((decode_common(&cmn, udp_buf, &rem, &idx) < 0) || (cmn.pc != MSG_TYPE_PACKET)) {
+        return false;
+    }
+    if(decode_PACKET(&pkt, &cmn, udp_buf, &rem, &idx) < 0) {
+        return false;
+    }
+
+    if(is_multi_broadcast(pkt.dstMac)) {
+        // the member arrays are rebuilt when they are next used
+        if(members_stale(comm) || comm->members_tcp) {
+            return false;
+        }
+        if(!(cmn.flags & N2N_FLAGS_FROM_SUPERNODE) &&
+           (members_stale(sss->federation) || sss->federation->members_tcp)) {
+            return false;
+        }
+        return true;
+    }
+
+    HASH_FIND_PEER(comm->edges, pkt.dstMac, peer);
+    return peer && ((peer->socket_fd < 0) || (peer->socket_fd == sss->sock));
+}
+#endif
+
+
+/** Lock the community to the header encryption mode seen in a datagram */
+static void update_pdu_community (struct sn_pdu_match *match) {
+    struct sn_community *comm = match->comm;
+
+    if(!comm) {
+        return;
+    }
+
+    if(!match->header_enc) {
+        if(comm->header_encryption == HEADER_ENCRYPTION_UNKNOWN) {
+            traceEvent(TRACE_INFO, "locked community '%s' to "
+                       "unencrypted headers", comm->community);
+            /* set 'no encryption' in case it is not set yet */
+            comm->header_encryption = HEADER_ENCRYPTION_NONE;
+            free(comm->header_encryption_ctx_static);
+            comm->header_encryption_ctx_static = NULL;
+            free(comm->header_encryption_ctx_dynamic);
+            comm->header_encryption_ctx_dynamic = NULL;
+        }
+        return;
+    }
+
+    if(comm->header_encryption == HEADER_ENCRYPTION_UNKNOWN) {
+        traceEvent(TRACE_INFO, "locked community '%s' to "
+                   "encrypted headers", comm->community);
+        /* set 'encrypted' in case it is not set yet */
+        comm->header_encryption = HEADER_ENCRYPTION_ENABLED;
+    }
+    // count the number of encrypted packets for sorting the communities from time to time
+    // for the HASH_ITER in match_pdu_community() gets faster for the more busy communities
+    __atomic_add_fetch(&comm->number_enc_packets, 1, __ATOMIC_RELAXED);
+}
+
+
+/** Account for the work done by match_pdu_community() */
+static void count_pdu_match (const struct sn_pdu_match *match, int matched) {
+    if(!match->encrypted) {
+        return;
+    }
+
+    __atomic_add_fetch(&metrics.decrypt, match->decrypts, __ATOMIC_RELAXED);
+    if(match->cache_hit) {
+        __atomic_add_fetch(&metrics.cache_hit, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_add_fetch(&metrics.cache_miss, 1, __ATOMIC_RELAXED);
+    }
+    if(matched < 0) {
+        __atomic_add_fetch(&metrics.no_match, 1, __ATOMIC_RELAXED);
+    }
+}
+
+
+/** Handle a datagram that match_pdu_community() has accepted.
+ *
+ */
+static int process_matched_pdu (struct n3n_runtime_data * sss,
+                                struct sn_pdu_match *match,
+                                const struct sockaddr *sender_sock, socklen_t sock_size,
+                                const SOCKET socket_fd,
+                                uint8_t * udp_buf,
+                                size_t udp_size,
+                                time_t now
+) {
+
+    n2n_common_t cmn;        /* common fields in the packet header */
+    size_t rem;
+    size_t idx;
+    size_t msg_type;
+    bool from_supernode;
+    struct peer_info *sn = NULL;
+    n3n_sock_t sender;
+    n3n_sock_t          *orig_sender;
+    macstr_t mac_buf;
+    macstr_t mac_buf2;
+    n3n_sock_str_t sockbuf;
+    uint8_t hash_buf[16];
+
+    struct sn_community *comm = match->comm;
+    uint32_t header_enc = match->header_enc;
+    uint64_t stamp = match->stamp;
+    int skip_add;
+    time_t any_time = 0;
+
+    memcpy(hash_buf, match->hash_buf, sizeof(hash_buf));
+
+    fill_n3nsock(&sender, sender_sock);
+    orig_sender = &sender;
+
+    traceEvent(TRACE_DEBUG, "processing incoming UDP packet [len: %lu][sender: %s]",
+               udp_size, sock_to_cstr(sockbuf, &sender));
+
+    update_pdu_community(match);
+
+    if(match->encrypted && !match->cache_hit) {
+        struct sn_community_cache *slot = community_cache_slot(&sender);
+        memcpy(&slot->sock, &sender, sizeof(sender));
+        memcpy(slot->community, comm->community, sizeof(slot->community));
     }
 
     /* Use decode_common() to determine the kind of packet then process it:
@@ -1882,7 +2754,8 @@ static int process_pdu (struct n3n_runtime_data * sss,
                 return -1;
             }
 
-            sss->last_sn_fwd = now;
+            // the workers can forward PACKETs at the same time
+            __atomic_store_n(&sss->last_sn_fwd, now, __ATOMIC_RELAXED);
             decode_PACKET(&pkt, &cmn, udp_buf, &rem, &idx);
 
             // already checked for valid comm
@@ -2042,11 +2915,8 @@ static int process_pdu (struct n3n_runtime_data * sss,
             uint8_t payload_buf[REG_SUPER_ACK_PAYLOAD_SPACE];
             n2n_REGISTER_SUPER_ACK_payload_t       *payload;
             size_t encx = 0;
-            struct sn_community_regular_expression *re, *tmp_re;
             struct peer_info                       *peer, *tmp_peer, *p;
-            int8_t allowed_match = -1;
             uint8_t match = 0;
-            int match_length = 0;
             n2n_ip_subnet_t ipaddr;
             int num = 0;
             int skip;
@@ -2089,15 +2959,8 @@ static int process_pdu (struct n3n_runtime_data * sss,
              */
 
             if(!comm && sss->lock_communities) {
-                HASH_ITER(hh, sss->rules, re, tmp_re) {
-                    allowed_match = re_matchp(re->rule, (const char *)cmn.community, &match_length);
-
-                    if((allowed_match != -1)
-                       && (match_length == strlen((const char *)cmn.community)) // --- only full matches allowed (remove, if also partial matches wanted)
-                       && (allowed_match == 0)) { // --- only full matches allowed (remove, if also partial matches wanted)
-                        match = 1;
-                        break;
-                    }
+                if(community_allowed(sss, cmn.community)) {
+                    match = 1;
                 }
                 if(match != 1) {
                     traceEvent(TRACE_INFO, "discarded registration with unallowed community '%s'",
@@ -2180,10 +3043,11 @@ static int process_pdu (struct n3n_runtime_data * sss,
             if(comm->is_federation) {
                 skip_add = SN_ADD;
                 p = add_sn_to_list_by_mac_or_sock(&(sss->federation->edges), &(ack.sock), reg.edgeMac, &skip_add);
-                p->last_seen = now;
+                peer_info_seen(&sss->federation->edges, p, now);
                 // communication with other supernodes happens via standard udp port
                 p->socket_fd = sss->sock;
                 if(skip_add == SN_ADD_ADDED) {
+                    sss->federation->members_dirty = true;
                     sock_to_cstr(sockbuf, &(p->sock));
                     p->hostname = strdup(sockbuf);
                 }
@@ -2343,8 +3207,7 @@ static int process_pdu (struct n3n_runtime_data * sss,
                         HASH_FIND_INT(sss->tcp_connections, &(peer->socket_fd), conn);
                         close_tcp_connection(sss, conn); /* also deletes the peer */
                     } else {
-                        HASH_DEL(comm->edges, peer);
-                        free(peer);
+                        edge_del(comm, peer);
                     }
                 }
             }
@@ -2394,8 +3257,7 @@ static int process_pdu (struct n3n_runtime_data * sss,
                         HASH_FIND_INT(sss->tcp_connections, &(peer->socket_fd), conn);
                         close_tcp_connection(sss, conn); /* also deletes the peer */
                     } else {
-                        HASH_DEL(comm->edges, peer);
-                        peer_info_free(peer);
+                        edge_del(comm, peer);
                     }
                 }
             }
@@ -2447,7 +3309,7 @@ static int process_pdu (struct n3n_runtime_data * sss,
             skip_add = SN_ADD_SKIP;
             scan = add_sn_to_list_by_mac_or_sock(&(sss->federation->edges), &sender, ack.srcMac, &skip_add);
             if(scan != NULL) {
-                scan->last_seen = now;
+                peer_info_seen(&sss->federation->edges, scan, now);
             } else {
                 traceEvent(TRACE_DEBUG, "dropped REGISTER_SUPER_ACK due to an unknown supernode");
                 return 0;
@@ -2470,7 +3332,9 @@ static int process_pdu (struct n3n_runtime_data * sss,
                     tmp->socket_fd = sss->sock;
 
                     if(skip_add == SN_ADD_ADDED) {
-                        tmp->last_seen = now - LAST_SEEN_SN_NEW;
+                        sss->federation->members_dirty = true;
+                        // backdated, so that it gets tested soon
+                        peer_info_seen(&sss->federation->edges, tmp, now - LAST_SEEN_SN_NEW);
                         sock_to_cstr(sockbuf1, &(tmp->sock));
                         tmp->hostname = strdup(sockbuf1);
                     }
@@ -2565,8 +3429,7 @@ static int process_pdu (struct n3n_runtime_data * sss,
                         HASH_FIND_INT(sss->tcp_connections, &(peer->socket_fd), conn);
                         close_tcp_connection(sss, conn); /* also deletes the peer */
                     } else {
-                        HASH_DEL(comm->edges, peer);
-                        peer_info_free(peer);
+                        edge_del(comm, peer);
                     }
                 }
             }
@@ -2579,21 +3442,11 @@ static int process_pdu (struct n3n_runtime_data * sss,
             size_t encx = 0;
             n2n_common_t cmn2;
             n2n_PEER_INFO_t pi;
-            struct sn_community_regular_expression *re, *tmp_re;
-            int8_t allowed_match = -1;
             uint8_t match = 0;
-            int match_length = 0;
 
             if(!comm && sss->lock_communities) {
-                HASH_ITER(hh, sss->rules, re, tmp_re) {
-                    allowed_match = re_matchp(re->rule, (const char *)cmn.community, &match_length);
-
-                    if((allowed_match != -1)
-                       && (match_length == strlen((const char *)cmn.community)) // --- only full matches allowed (remove, if also partial matches wanted)
-                       && (allowed_match == 0)) {                               // --- only full matches allowed (remove, if also partial matches wanted)
-                        match = 1;
-                        break;
-                    }
+                if(community_allowed(sss, cmn.community)) {
+                    match = 1;
                 }
                 if(match != 1) {
                     traceEvent(TRACE_DEBUG, "QUERY_PEER from unknown community %s", cmn.community);
@@ -2799,17 +3652,369 @@ static int process_pdu (struct n3n_runtime_data * sss,
 }
 
 
+/** Examine a datagram and determine what to do with it.
+ *
+ */
+static int process_pdu (struct n3n_runtime_data * sss,
+                        const struct sockaddr *sender_sock, socklen_t sock_size,
+                        const SOCKET socket_fd,
+                        uint8_t * udp_buf,
+                        size_t udp_size,
+                        time_t now
+) {
+    struct sn_pdu_match match;
+    int matched = match_pdu_community(sss, sender_sock, udp_buf, udp_size, &match);
+
+    count_pdu_match(&match, matched);
+    if(matched < 0) {
+        return -1;
+    }
+
+    return process_matched_pdu(
+        sss,
+        &match,
+        sender_sock,
+        sock_size,
+        socket_fd,
+        udp_buf,
+        udp_size,
+        now
+    );
+}
+
+
+#ifdef HAVE_LIBPTHREAD
+/** Read a batch of datagrams from a worker socket */
+static int sn_worker_recv (SOCKET sock,
+                           uint8_t pktbuf[][N2N_SN_PKTBUF_SIZE],
+                           struct sockaddr_storage *sas,
+                           socklen_t *ss_size,
+                           size_t *size) {
+#ifdef __linux__
+    struct mmsghdr msgs[N3N_RX_BATCH_SIZE];
+    struct iovec iov[N3N_RX_BATCH_SIZE];
+
+    memset(msgs, 0, sizeof(msgs));
+    for(int i = 0; i < N3N_RX_BATCH_SIZE; i++) {
+        iov[i].iov_base = pktbuf[i];
+        iov[i].iov_len = N2N_SN_PKTBUF_SIZE;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &sas[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(sas[i]);
+    }
+
+    int count = recvmmsg(sock, msgs, N3N_RX_BATCH_SIZE, MSG_DONTWAIT, NULL);
+    if(count < 0) {
+        if((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+            traceEvent(TRACE_ERROR, "recvmmsg() failed errno %d (%s)", errno, strerror(errno));
+        }
+        return 0;
+    }
+
+    for(int i = 0; i < count; i++) {
+        ss_size[i] = msgs[i].msg_hdr.msg_namelen;
+        size[i] = msgs[i].msg_len;
+    }
+    return count;
+#else
+    ss_size[0] = sizeof(sas[0]);
+    ssize_t bread = recvfrom(
+        sock,
+        (void *)pktbuf[0],
+        N2N_SN_PKTBUF_SIZE,
+        0 /*flags*/,
+        (struct sockaddr *)&sas[0],
+        &ss_size[0]
+    );
+    if(bread <= 0) {
+        return 0;
+    }
+    size[0] = bread;
+    return 1;
+#endif
+}
+
+
+static void *sn_worker_thread (void *arg) {
+    struct sn_worker *worker = (struct sn_worker *)arg;
+    struct n3n_runtime_data *sss = worker->sss;
+    pthread_rwlock_t *lock = &sss->workers->lock;
+
+    sn_in_worker = true;
+
+    uint8_t pktbuf[N3N_RX_BATCH_SIZE][N2N_SN_PKTBUF_SIZE];
+    struct sockaddr_storage sas[N3N_RX_BATCH_SIZE];
+    socklen_t ss_size[N3N_RX_BATCH_SIZE];
+    size_t size[N3N_RX_BATCH_SIZE];
+    struct sn_pdu_match match[N3N_RX_BATCH_SIZE];
+    int matched[N3N_RX_BATCH_SIZE];
+
+    while(*sss->keep_running) {
+        fd_set readers;
+        struct timeval wait_time;
+        int count;
+
+        FD_ZERO(&readers);
+        FD_SET(worker->sock, &readers);
+
+        // Wake up regularly to notice when we are asked to stop
+        wait_time.tv_sec = 1;
+        wait_time.tv_usec = 0;
+
+        if(select(worker->sock + 1, &readers, NULL, NULL, &wait_time) <= 0) {
+            continue;
+        }
+
+        count = sn_worker_recv(worker->sock, pktbuf, sas, ss_size, size);
+        if(count <= 0) {
+            continue;
+        }
+
+        // Trial decrypting the headers is the expensive part and only reads
+        // the community list, so all the workers can do this at once.  So
+        // can forwarding the PACKETs between known edges, the bulk of the
+        // traffic
+        pthread_rwlock_rdlock(lock);
+        time_t now = time(NULL);
+        int exclusive = 0;
+        n3n_txqueue_begin(&sss->stats.sn_errors);
+        for(int i = 0; i < count; i++) {
+            matched[i] = match_pdu_community(
+                sss,
+                (struct sockaddr *)&sas[i],
+                pktbuf[i],
+                size[i],
+                &match[i]
+            );
+            count_pdu_match(&match[i], matched[i]);
+            if(matched[i] < 0) {
+                continue;
+            }
+            if(!pdu_is_shared(sss, &match[i], pktbuf[i], size[i])) {
+                exclusive++;
+                continue;
+            }
+            // Replies go out of the main socket, which has the same address
+            process_matched_pdu(
+                sss,
+                &match[i],
+                (struct sockaddr *)&sas[i],
+                ss_size[i],
+                sss->sock,
+                pktbuf[i],
+                size[i],
+                now
+            );
+            matched[i] = -1;
+        }
+        n3n_txqueue_end();
+        pthread_rwlock_unlock(lock);
+
+        if(!exclusive) {
+            continue;
+        }
+
+        // The rest change the peer or community lists
+        pthread_rwlock_wrlock(lock);
+        now = time(NULL);
+        n3n_txqueue_begin(&sss->stats.sn_errors);
+        for(int i = 0; i < count; i++) {
+            if(matched[i] < 0) {
+                continue;
+            }
+            if(rematch_pdu_community(sss, pktbuf[i], &match[i]) < 0) {
+                continue;
+            }
+            process_matched_pdu(
+                sss,
+                &match[i],
+                (struct sockaddr *)&sas[i],
+                ss_size[i],
+                sss->sock,
+                pktbuf[i],
+                size[i],
+                now
+            );
+        }
+        n3n_txqueue_end();
+        pthread_rwlock_unlock(lock);
+    }
+
+    return NULL;
+}
+
+
+static void sn_start_workers (struct n3n_runtime_data *sss) {
+    if(!sss->workers) {
+        return;
+    }
+
+#ifndef _WIN32
+    // Leave all the signal handling to the main thread
+    sigset_t set;
+    sigset_t oldset;
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &oldset);
+#endif
+
+    // Each worker collects the datagrams it forwards in a queue of its own
+    n3n_pktbuf_initialise(N2N_PKT_BUF_SIZE, N3N_TXQUEUE_SIZE * (sss->workers->count + 1));
+
+    for(int i = 0; i < sss->workers->count; i++) {
+        struct sn_worker *worker = &sss->workers->worker[i];
+
+        if(pthread_create(&worker->thread, NULL, sn_worker_thread, worker) != 0) {
+            traceEvent(TRACE_ERROR, "failed to start worker thread %i", i);
+            continue;
+        }
+        worker->running = true;
+    }
+
+#ifndef _WIN32
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+#endif
+
+    traceEvent(TRACE_NORMAL, "started %i worker threads", sss->workers->count);
+}
+
+
+static void sn_stop_workers (struct n3n_runtime_data *sss) {
+    if(!sss->workers) {
+        return;
+    }
+
+    for(int i = 0; i < sss->workers->count; i++) {
+        struct sn_worker *worker = &sss->workers->worker[i];
+
+        if(worker->running) {
+            // Wake the worker up from its select() straight away
+            shutdown(worker->sock, SHUT_RDWR);
+            pthread_join(worker->thread, NULL);
+            worker->running = false;
+        }
+    }
+}
+#endif
+
+
+/** Take exclusive ownership of the supernode state from the workers */
+static void sn_lock_workers (struct n3n_runtime_data *sss) {
+#ifdef HAVE_LIBPTHREAD
+    if(sss->workers) {
+        pthread_rwlock_wrlock(&sss->workers->lock);
+    }
+#endif
+}
+
+
+static void sn_unlock_workers (struct n3n_runtime_data *sss) {
+#ifdef HAVE_LIBPTHREAD
+    if(sss->workers) {
+        pthread_rwlock_unlock(&sss->workers->lock);
+    }
+#endif
+}
+
+
+/* ************************************** */
+
+// The periodic duties of the supernode, each run from its own mainloop timer.
+// The timers set the pace, so the interval checks of the functions they call
+// are always passed a zero last run time
+
+static void sn_timer_re_register_and_purge (struct n3n_timer *timer, time_t now) {
+    struct n3n_runtime_data *sss = timer->data;
+    time_t last_re_reg_and_purge = 0;
+
+    re_register_and_purge_supernodes(
+        sss,
+        sss->federation,
+        &last_re_reg_and_purge,
+        now,
+        0 /* not forced */
+    );
+
+    mainloop_timer_add(timer, RE_REG_AND_PURGE_FREQUENCY * 1000);
+}
+
+static void sn_timer_purge_communities (struct n3n_timer *timer, time_t now) {
+    struct n3n_runtime_data *sss = timer->data;
+    time_t last_purge_edges = 0;
+
+    purge_expired_communities(sss, &last_purge_edges, now);
+
+    mainloop_timer_add(timer, PURGE_REGISTRATION_FREQUENCY * 1000);
+}
+
+static void sn_timer_sort_communities (struct n3n_timer *timer, time_t now) {
+    struct n3n_runtime_data *sss = timer->data;
+    time_t last_sort_communities = 0;
+
+    sort_communities(sss, &last_sort_communities, now);
+
+    mainloop_timer_add(timer, SORT_COMMUNITIES_INTERVAL * 1000);
+}
+
+static void sn_timer_resolve (struct n3n_timer *timer, time_t now) {
+    struct n3n_runtime_data *sss = timer->data;
+    bool renewed = false;
+
+    resolve_check(
+        sss->resolve_parameter,
+        false /* presumably, no special resolution requirement */,
+        now,
+        &renewed
+    );
+    if(renewed) {
+        // the broadcast destinations of the supernodes are out of date
+        sss->federation->members_dirty = true;
+    }
+
+    // resolve_check() keeps its own, longer, interval between the checks
+    // of the resolver thread results
+    mainloop_timer_add(timer, N2N_RESOLVE_CHECK_INTERVAL / 10 * 1000);
+}
+
+
 /** Long lived processing entry point. Split out from main to simply
  *  daemonisation on some platforms. */
 int run_sn_loop (struct n3n_runtime_data *sss) {
 
     uint8_t pktbuf[N2N_SN_PKTBUF_SIZE];
-    time_t last_purge_edges = 0;
-    time_t last_sort_communities = 0;
-    time_t last_re_reg_and_purge = 0;
+    struct n3n_timer timer_re_register_and_purge = {
+        .func = sn_timer_re_register_and_purge,
+        .data = sss,
+    };
+    struct n3n_timer timer_purge_communities = {
+        .func = sn_timer_purge_communities,
+        .data = sss,
+    };
+    struct n3n_timer timer_sort_communities = {
+        .func = sn_timer_sort_communities,
+        .data = sss,
+    };
+    struct n3n_timer timer_resolve = {
+        .func = sn_timer_resolve,
+        .data = sss,
+    };
 
     sss->start_time = time(NULL);
 
+    mainloop_clock_update();
+    mainloop_timer_add(&timer_re_register_and_purge, 0);
+    mainloop_timer_add(&timer_purge_communities, 0);
+    mainloop_timer_add(&timer_sort_communities, 0);
+    mainloop_timer_add(&timer_resolve, 0);
+
+    // The first wait is a full one, so the periodic work first runs once
+    // there has been some traffic or the wait has timed out
+    int timeout_ms = 10000;
+
+#ifdef HAVE_LIBPTHREAD
+    sn_start_workers(sss);
+#endif
+
     while(*sss->keep_running) {
         int rc;
         int max_sock;
@@ -2828,20 +4033,39 @@ int run_sn_loop (struct n3n_runtime_data *sss) {
         FD_SET(sss->sock, &readers);
         max_sock = sss->sock;
 
+#ifdef HAVE_LIBPTHREAD
+        if(sss->workers) {
+            FD_SET(sss->workers->wakeup[0], &readers);
+            max_sock = MAX(max_sock, sss->workers->wakeup[0]);
+        }
+#endif
+
+        // The workers can queue to the tcp connections or close them
+        sn_lock_workers(sss);
+
 #ifdef N2N_HAVE_TCP
         n3n_sock_str_t sockbuf;
         FD_SET(sss->tcp_sock, &readers);
 
         // add the tcp connections' sockets
         HASH_ITER(hh, sss->tcp_connections, conn, tmp_conn) {
+            if(conn->inactive) {
+                // already closed by the periodic work
+                continue;
+            }
             //socket descriptor
             FD_SET(conn->socket_fd, &readers);
+            if(n3n_tcpconn_pending(conn->tcp)) {
+                FD_SET(conn->socket_fd, &writers);
+            }
             if(conn->socket_fd > max_sock) {
                 max_sock = MAX(max_sock, conn->socket_fd);
             }
         }
 #endif
 
+        sn_unlock_workers(sss);
+
         slots_t *slots = sss->mgmt_slots;
         max_sock = MAX(
             max_sock,
@@ -2852,14 +4076,20 @@ int run_sn_loop (struct n3n_runtime_data *sss) {
             )
         );
 
-        wait_time.tv_sec = 10;
-        wait_time.tv_usec = 0;
+        wait_time.tv_sec = timeout_ms / 1000;
+        wait_time.tv_usec = (timeout_ms % 1000) * 1000;
 
         before = time(NULL);
 
         rc = select(max_sock + 1, &readers, &writers, NULL, &wait_time);
 
         now = time(NULL);
+        mainloop_clock_update();
+
+        sn_lock_workers(sss);
+
+        // Collect everything sent while handling this batch of ready sockets
+        n3n_txqueue_begin(&sss->stats.sn_errors);
 
         if(rc == 0) {
             if(((now - before) < wait_time.tv_sec) && (*sss->keep_running)) {
@@ -2877,6 +4107,15 @@ int run_sn_loop (struct n3n_runtime_data *sss) {
 
         if(rc > 0) {
 
+#ifdef HAVE_LIBPTHREAD
+            // a worker queued to a tcp connection, which is in the writers now
+            if(sss->workers && FD_ISSET(sss->workers->wakeup[0], &readers)) {
+                uint8_t wake[64];
+                while(read(sss->workers->wakeup[0], wake, sizeof(wake)) > 0) {
+                }
+            }
+#endif
+
             // external udp
             if(FD_ISSET(sss->sock, &readers)) {
                 struct sockaddr_storage sas;
@@ -2937,71 +4176,55 @@ int run_sn_loop (struct n3n_runtime_data *sss) {
                 if(conn->inactive)
                     continue;
 
+                if(FD_ISSET(conn->socket_fd, &writers)) {
+                    if(n3n_tcpconn_flush(conn->tcp, conn->socket_fd) < 0) {
+                        traceEvent(TRACE_INFO, "closing tcp connection to [%s]", sock_to_cstr(sockbuf, (n3n_sock_t*)&conn->sock));
+                        close_tcp_connection(sss, conn);
+                        continue;
+                    }
+                }
+
                 if(FD_ISSET(conn->socket_fd, &readers)) {
-                    struct sockaddr_storage sas;
-                    struct sockaddr *sender_sock = (struct sockaddr*)&sas;
-                    socklen_t ss_size = sizeof(sas);
-
-                    // TODO: this all looks like it could use a tcp buffer
-                    // management layer - like the connslot abstraction
-                    bread = recvfrom(
-                        conn->socket_fd,
-                        conn->buffer + conn->position,
-                        conn->expected - conn->position,
-                        0 /*flags*/,
-                        sender_sock,
-                        &ss_size
-                    );
+                    uint8_t *pkt;
+                    uint16_t pkt_size;
 
-                    if(bread <= 0) {
-                        traceEvent(TRACE_INFO, "closing tcp connection to [%s]", sock_to_cstr(sockbuf, (n3n_sock_t*)sender_sock));
-                        traceEvent(TRACE_DEBUG, "recvfrom() returns %d and sees errno %d (%s)", bread, errno, strerror(errno));
+                    bread = n3n_tcpconn_read(conn->tcp, conn->socket_fd);
+                    if(bread < 0) {
+                        traceEvent(TRACE_INFO, "closing tcp connection to [%s]", sock_to_cstr(sockbuf, (n3n_sock_t*)&conn->sock));
+                        traceEvent(TRACE_DEBUG, "recv() sees errno %d (%s)", errno, strerror(errno));
 #ifdef _WIN32
                         traceEvent(TRACE_DEBUG, "WSAGetLastError(): %u", WSAGetLastError());
 #endif
                         close_tcp_connection(sss, conn);
                         continue;
                     }
-                    conn->position += bread;
-
-                    if(conn->position == conn->expected) {
-                        if(conn->position == sizeof(uint16_t)) {
-                            // the prepended length has been read, preparing for the packet
-                            conn->expected += be16toh(*(uint16_t*)(conn->buffer));
-                            if(conn->expected > N2N_SN_PKTBUF_SIZE) {
-                                traceEvent(TRACE_INFO, "closing tcp connection to [%s]", sock_to_cstr(sockbuf, (n3n_sock_t*)sender_sock));
-                                traceEvent(TRACE_DEBUG, "too many bytes in tcp packet expected");
-                                close_tcp_connection(sss, conn);
-                                continue;
-                            }
-                        } else {
-                            // full packet read, handle it
-                            process_pdu(
-                                sss,
-                                &(conn->sock),
-                                conn->sock_len,
-                                conn->socket_fd,
-                                conn->buffer + sizeof(uint16_t),
-                                conn->position - sizeof(uint16_t),
-                                now
-                            );
 
-                            // reset, await new prepended length
-                            conn->expected = sizeof(uint16_t);
-                            conn->position = 0;
+                    // handle every full packet read, unless handling one of
+                    // them has closed the connection
+                    while(!conn->inactive) {
+                        int next = n3n_tcpconn_next(conn->tcp, &pkt, &pkt_size);
+                        if(next < 0) {
+                            traceEvent(TRACE_INFO, "closing tcp connection to [%s]", sock_to_cstr(sockbuf, (n3n_sock_t*)&conn->sock));
+                            traceEvent(TRACE_DEBUG, "too many bytes in tcp packet expected");
+                            close_tcp_connection(sss, conn);
+                            break;
+                        }
+                        if(next == 0) {
+                            break;
                         }
+                        process_pdu(
+                            sss,
+                            &(conn->sock),
+                            conn->sock_len,
+                            conn->socket_fd,
+                            pkt,
+                            pkt_size,
+                            now
+                        );
                     }
                 }
             }
 
-            // remove inactive / already closed tcp connections from list
-            HASH_ITER(hh, sss->tcp_connections, conn, tmp_conn) {
-                if(conn->inactive) {
-                    HASH_DEL(sss->tcp_connections, conn);
-                    free(conn);
-                }
-            }
-
             // accept new incoming tcp connection
             if(FD_ISSET(sss->tcp_sock, &readers)) {
                 struct sockaddr_storage sas;
@@ -3026,8 +4249,8 @@ int run_sn_loop (struct n3n_runtime_data *sss) {
                             memcpy(&(conn->sock), sender_sock, ss_size);
                             conn->sock_len = ss_size;
                             conn->inactive = 0;
-                            conn->expected = sizeof(uint16_t);
-                            conn->position = 0;
+                            conn->tcp = n3n_tcpconn_malloc();
+                            sn_tcp_setup(tmp_sock);
                             HASH_ADD_INT(sss->tcp_connections, socket_fd, conn);
                             traceEvent(
                                 TRACE_INFO,
@@ -3070,38 +4293,57 @@ int run_sn_loop (struct n3n_runtime_data *sss) {
 
         }
 
+#ifdef N2N_HAVE_TCP
+        // remove the tcp connections closed since the last time, by us or
+        // by the workers, now that their sockets are out of the select() sets
+        HASH_ITER(hh, sss->tcp_connections, conn, tmp_conn) {
+            if(conn->inactive) {
+                HASH_DEL(sss->tcp_connections, conn);
+                closesocket(conn->socket_fd);
+                n3n_tcpconn_free(conn->tcp);
+                free(conn);
+            }
+        }
+#endif
+
         // check for timed out slots
         slots_closeidle(slots);
 
+        n3n_txqueue_end();
+
         // If anything we recieved caused us to stop..
-        if(!(*sss->keep_running))
+        if(!(*sss->keep_running)) {
+            sn_unlock_workers(sss);
             break;
+        }
 
-        re_register_and_purge_supernodes(
-            sss,
-            sss->federation,
-            &last_re_reg_and_purge,
-            now,
-            0 /* not forced */
-        );
-        purge_expired_communities(
-            sss,
-            &last_purge_edges,
-            now
-        );
-        sort_communities(
-            sss,
-            &last_sort_communities,
-            now
-        );
-        resolve_check(
-            sss->resolve_parameter,
-            false /* presumably, no special resolution requirement */,
-            now
-        );
+        mainloop_timer_run(now);
+
+        sn_unlock_workers(sss);
+
+        // Wake up for the next timer
+        timeout_ms = mainloop_timer_next();
+        if(timeout_ms < 0 || timeout_ms > 10000) {
+            timeout_ms = 10000;
+        }
     } /* while */
 
+    mainloop_timer_del(&timer_re_register_and_purge);
+    mainloop_timer_del(&timer_purge_communities);
+    mainloop_timer_del(&timer_sort_communities);
+    mainloop_timer_del(&timer_resolve);
+
+#ifdef HAVE_LIBPTHREAD
+    sn_stop_workers(sss);
+#endif
+
     sn_term(sss);
 
     return 0;
 }
+
+void n3n_initfuncs_sn_utils () {
+    n3n_metrics_register(&metrics_module);
+    n3n_metrics_register(&metrics_allow_module);
+    n3n_metrics_register(&metrics_members_module);
+}
@@ -23,16 +23,41 @@
 
 
 #include "speck.h"
+#include "cpu.h"        // for n3n_cpu_kernel_select, n3n_cpu_kernel_find
 #include "portable_endian.h"  // for htole64, le64toh
 #include <stdlib.h>     // for size_t, malloc, free
+#include <string.h>     // for memcpy
 
 #if defined (SPECK_ALIGNED_CTX)
 #include <mm_malloc.h>  // for _mm_free, _mm_malloc
 #endif
 
+
+// this file is built once as the baseline which also carries the public API, and on x86_64 once more for each of
+// the variants in speck_*.c which only provide their kernels -- the best one for the CPU is picked at run time
+
+
+#if !defined (SPECK_KERNELS)
+#define SPECK_KERNELS speck_kernels_base
+#define SPECK_PUBLIC_API
+#endif
+
+
+struct speck_kernels {
+    int (*ctr) (unsigned char *out, const unsigned char *in, unsigned long long inlen,
+                const unsigned char *n, speck_context_t *ctx);
+    int (*expand_key) (speck_context_t *ctx, const unsigned char *k, int keysize);
+    void (*encrypt_lanes) (u64 *x, u64 *y, int count, speck_context_t *ctx, int numrounds);
+    void (*decrypt_lanes) (u64 *x, u64 *y, int count, speck_context_t *ctx, int numrounds);
+};
+
 #if defined (__AVX512F__)  // AVX512 support ----------------------------------------------------------------------
 
 
+#define SPECK_VARIANT_NAME "avx512"
+
+#define u512 __m512i
+
 #define LCS(x,r) (((x)<<r)|((x)>>(64-r)))
 #define RCS(x,r) (((x)>>r)|((x)<<(64-r)))
 
@@ -51,7 +76,7 @@
 
 #define LOW  _mm512_unpacklo_epi64
 #define HIGH _mm512_unpackhi_epi64
-#define LD(ip) (_mm512_load_epi64(((void *)(ip))))
+#define LD(ip) (_mm512_loadu_si512(((void *)(ip))))
 #define ST(ip,X) _mm512_storeu_si512((void *)(ip),X)
 #define STORE(out,X,Y) (ST(out,LOW(Y,X)), ST(out+64,HIGH(Y,X)))
 #define XOR_STORE(in,out,X,Y) (ST(out,XOR(LD(in),LOW(Y,X))), ST(out+64,XOR(LD(in+64),HIGH(Y,X))))
@@ -112,7 +137,7 @@
     if(numbytes == 64) {                                                                  \
         SET1(X[0], nonce[1]);                                                             \
         SET8(Y[0], nonce[0]);                                                             \
-        Encrypt_ ## keysize(X, Y, ctx->rk, 8);                                              \
+        Encrypt_ ## keysize(X, Y, ctx->rk512, 8);                                           \
         nonce[0] += (numbytes >> 4);                                                      \
         memcpy(block1024, in, 64);                                                        \
         XOR_STORE(block1024, block1024, X[0], Y[0]);                                      \
@@ -123,21 +148,21 @@
     SET1(X[0], nonce[1]); SET8(Y[0], nonce[0]);                                           \
                                                                                           \
     if(numbytes == 128)                                                                   \
-    Encrypt_ ## keysize(X, Y, ctx->rk, 8);                                              \
+    Encrypt_ ## keysize(X, Y, ctx->rk512, 8);                                           \
     else {                                                                                \
         X[1] = X[0];                                                                      \
         Y[1] = ADD(Y[0], _eight);                                                         \
         if(numbytes == 256)                                                               \
-        Encrypt_ ## keysize(X, Y, ctx->rk, 16);                                         \
+        Encrypt_ ## keysize(X, Y, ctx->rk512, 16);                                      \
         else {                                                                            \
             X[2] = X[0];                                                                  \
             Y[2] = ADD(Y[1], _eight);                                                     \
             if(numbytes == 384)                                                           \
-            Encrypt_ ## keysize(X, Y, ctx->rk, 24);                                     \
+            Encrypt_ ## keysize(X, Y, ctx->rk512, 24);                                  \
             else {                                                                        \
                 X[3] = X[0];                                                              \
                 Y[3] = ADD(Y[2], _eight);                                                 \
-                Encrypt_ ## keysize(X, Y, ctx->rk, 32);                                     \
+                Encrypt_ ## keysize(X, Y, ctx->rk512, 32);                                  \
             }                                                                             \
         }                                                                                 \
     }                                                                                     \
@@ -236,9 +261,9 @@ static int speck_expand_key (speck_context_t *ctx, const unsigned char *k, int k
 
     // 128 bit has only two keys A and B thus replacing both C and D with B then
     if(keysize == 128) {
-        EK(K[0], K[1], K[1], K[1], ctx->rk, ctx->key);
+        EK(K[0], K[1], K[1], K[1], ctx->rk512, ctx->key);
     } else {
-        EK(K[0], K[1], K[2], K[3], ctx->rk, ctx->key);
+        EK(K[0], K[1], K[2], K[3], ctx->rk512, ctx->key);
     }
 
     ctx->keysize = keysize;
@@ -250,6 +275,10 @@ static int speck_expand_key (speck_context_t *ctx, const unsigned char *k, int k
 #elif defined (__AVX2__)  // AVX2 support -------------------------------------------------------------------------
 
 
+#define SPECK_VARIANT_NAME "avx2"
+
+#define u256 __m256i
+
 #define LCS(x,r) (((x)<<r)|((x)>>(64-r)))
 #define RCS(x,r) (((x)>>r)|((x)<<(64-r)))
 
@@ -341,21 +370,21 @@ static int speck_expand_key (speck_context_t *ctx, const unsigned char *k, int k
     SET1(X[0], nonce[1]); SET4(Y[0], nonce[0]);                                           \
                                                                                           \
     if(numbytes == 64)                                                                    \
-    Encrypt_ ## keysize(X, Y, ctx->rk, 4);                                              \
+    Encrypt_ ## keysize(X, Y, ctx->rk256, 4);                                           \
     else {                                                                                \
         X[1] = X[0];                                                                      \
         Y[1] = ADD(Y[0], _four);                                                          \
         if(numbytes == 128)                                                               \
-        Encrypt_ ## keysize(X, Y, ctx->rk, 8);                                          \
+        Encrypt_ ## keysize(X, Y, ctx->rk256, 8);                                       \
         else {                                                                            \
             X[2] = X[0];                                                                  \
             Y[2] = ADD(Y[1], _four);                                                      \
             if(numbytes == 192)                                                           \
-            Encrypt_ ## keysize(X, Y, ctx->rk, 12);                                     \
+            Encrypt_ ## keysize(X, Y, ctx->rk256, 12);                                  \
             else {                                                                        \
                 X[3] = X[0];                                                              \
                 Y[3] = ADD(Y[2], _four);                                                  \
-                Encrypt_ ## keysize(X, Y, ctx->rk, 16);                                     \
+                Encrypt_ ## keysize(X, Y, ctx->rk256, 16);                                  \
             }                                                                             \
         }                                                                                 \
     }                                                                                     \
@@ -449,9 +478,9 @@ static int speck_expand_key (speck_context_t *ctx, const unsigned char *k, int k
 
     // 128 bit has only two keys A and B thus replacing both C and D with B then
     if(keysize == 128) {
-        EK(K[0], K[1], K[1], K[1], ctx->rk, ctx->key);
+        EK(K[0], K[1], K[1], K[1], ctx->rk256, ctx->key);
     } else {
-        EK(K[0], K[1], K[2], K[3], ctx->rk, ctx->key);
+        EK(K[0], K[1], K[2], K[3], ctx->rk256, ctx->key);
     }
 
     ctx->keysize = keysize;
@@ -463,6 +492,14 @@ static int speck_expand_key (speck_context_t *ctx, const unsigned char *k, int k
 #elif defined (__SSE2__) // SSE support ---------------------------------------------------------------------------
 
 
+#if defined (__SSSE3__)
+#define SPECK_VARIANT_NAME "ssse3"
+#else
+#define SPECK_VARIANT_NAME "sse2"
+#endif
+
+#define u128 __m128i
+
 #define LCS(x,r) (((x)<<r)|((x)>>(64-r)))
 #define RCS(x,r) (((x)>>r)|((x)<<(64-r)))
 
@@ -541,7 +578,7 @@ static int speck_expand_key (speck_context_t *ctx, const unsigned char *k, int k
                                                            \
     if(numbytes == 16) {                                   \
         x[0] = nonce[1]; y[0] = nonce[0]; nonce[0]++;      \
-        Encrypt_ ## keysize(x, y, ctx.key, 1);               \
+        Encrypt_ ## keysize(x, y, ctx->key, 1);              \
         ((u64 *)out)[1] = x[0]; ((u64 *)out)[0] = y[0];    \
         return 0;                                          \
     }                                                      \
@@ -549,18 +586,18 @@ static int speck_expand_key (speck_context_t *ctx, const unsigned char *k, int k
     SET1(X[0], nonce[1]); SET2(Y[0], nonce[0]);            \
                                                            \
     if(numbytes == 32)                                     \
-    Encrypt_ ## keysize(X, Y, ctx.rk, 2);                \
+    Encrypt_ ## keysize(X, Y, ctx->rk128, 2);            \
     else {                                                 \
         X[1] = X[0]; Y[1] = ADD(Y[0], _two);               \
         if(numbytes == 64)                                 \
-        Encrypt_ ## keysize(X, Y, ctx.rk, 4);            \
+        Encrypt_ ## keysize(X, Y, ctx->rk128, 4);        \
         else {                                             \
             X[2] = X[0]; Y[2] = ADD(Y[1], _two);           \
             if(numbytes == 96)                             \
-            Encrypt_ ## keysize(X, Y, ctx.rk, 6);        \
+            Encrypt_ ## keysize(X, Y, ctx->rk128, 6);    \
             else {                                         \
                 X[3] = X[0]; Y[3] = ADD(Y[2], _two);       \
-                Encrypt_ ## keysize(X, Y, ctx.rk, 8);        \
+                Encrypt_ ## keysize(X, Y, ctx->rk128, 8);    \
             }                                              \
         }                                                  \
     }                                                      \
@@ -578,10 +615,9 @@ static int speck_expand_key (speck_context_t *ctx, const unsigned char *k, int k
     return 0
 
 
-// attention: ctx is provided by value as it is faster in this case, astonishingly
-static int speck_encrypt_xor (unsigned char *out, const unsigned char *in, u64 nonce[], const speck_context_t ctx, int numbytes) {
+static int speck_encrypt_xor (unsigned char *out, const unsigned char *in, u64 nonce[], speck_context_t *ctx, int numbytes) {
 
-    if(ctx.keysize == 256) {
+    if(ctx->keysize == 256) {
         Encrypt_Dispatcher(256);
     } else {
         Encrypt_Dispatcher(128);
@@ -589,9 +625,8 @@ static int speck_encrypt_xor (unsigned char *out, const unsigned char *in, u64 n
 }
 
 
-// attention: ctx is provided by value as it is faster in this case, astonishingly
 static int internal_speck_ctr (unsigned char *out, const unsigned char *in, unsigned long long inlen,
-                               const unsigned char *n, const speck_context_t ctx) {
+                               const unsigned char *n, speck_context_t *ctx) {
 
     int i;
     u64 nonce[2];
@@ -651,9 +686,9 @@ static int speck_expand_key (speck_context_t *ctx, const unsigned char *k, int k
 
     // 128 bit has only two keys A and B thus replacing both C and D with B then
     if(keysize == 128) {
-        EK(K[0], K[1], K[1], K[1], ctx->rk, ctx->key);
+        EK(K[0], K[1], K[1], K[1], ctx->rk128, ctx->key);
     } else {
-        EK(K[0], K[1], K[2], K[3], ctx->rk, ctx->key);
+        EK(K[0], K[1], K[2], K[3], ctx->rk128, ctx->key);
     }
 
     ctx->keysize = keysize;
@@ -665,6 +700,10 @@ static int speck_expand_key (speck_context_t *ctx, const unsigned char *k, int k
 #elif defined (__ARM_NEON) && defined (SPECK_ARM_NEON)      // NEON support ---------------------------------------
 
 
+#define SPECK_VARIANT_NAME "neon"
+
+#define u128 uint64x2_t
+
 #define LCS(x,r) (((x)<<r)|((x)>>(64-r)))
 #define RCS(x,r) (((x)>>r)|((x)<<(64-r)))
 
@@ -848,6 +887,8 @@ static int speck_expand_key (speck_context_t *ctx, const unsigned char *k, int k
 #else           // plain C ----------------------------------------------------------------------------------------
 
 
+#define SPECK_VARIANT_NAME "c"
+
 #define ROR(x,r) (((x)>>(r))|((x)<<(64-(r))))
 #define ROL(x,r) (((x)<<(r))|((x)>>(64-(r))))
 #define R(x,y,k) (x=ROR(x,8), x+=y, x^=k, y=ROL(y,3), y^=x)
@@ -937,23 +978,160 @@ static int speck_expand_key (speck_context_t *ctx, const unsigned char *k, int k
 #endif          // AVX, SSE, NEON, plain C ------------------------------------------------------------------------
 
 
-// this functions wraps the call to internal_speck_ctr functions which have slightly different
-// signature -- ctx by value for SSE with SPECK_CTX_BYVAL defined in speck.h, by name otherwise
+// ----------------------------------------------------------------------------------------------------------------
+
+
+// multi-buffer -- the blocks of several independent inputs side by side in the vector lanes, one block per lane,
+// so that short inputs such as packet headers still fill the vectors; used for header encryption of packet batches
+
+
+#if defined (__AVX512F__)
+
+#define SPECK_LANES 8
+#define LANE_T u512
+#define LANE_RK(ctx) ((ctx)->rk512)
+#define LANE_LD(ip) _mm512_loadu_si512((void *)(ip))
+#define LANE_ST(ip,X) _mm512_storeu_si512((void *)(ip),X)
+#define LANE_ER(X,Y,k) (X=XOR(ADD(ROR(X,8),Y),k), Y=XOR(ROL(Y,3),X))
+#define LANE_DR(X,Y,k) (Y=XOR(Y,X), Y=ROR(Y,3), X=XOR(X,k), X=_mm512_sub_epi64(X,Y), X=ROL(X,8))
+
+#elif defined (__AVX2__)
+
+#define SPECK_LANES 4
+#define LANE_T u256
+#define LANE_RK(ctx) ((ctx)->rk256)
+#define LANE_LD(ip) LD(ip)
+#define LANE_ST(ip,X) ST(ip,X)
+#define LANE_ER(X,Y,k) (X=XOR(ADD(ROR8(X),Y),k), Y=XOR(ROL(Y,3),X))
+#define LANE_DR(X,Y,k) (Y=XOR(Y,X), Y=ROR(Y,3), X=XOR(X,k), X=_mm256_sub_epi64(X,Y), X=ROL8(X))
+
+#elif defined (__SSE2__)
+
+#define SPECK_LANES 2
+#define LANE_T u128
+#define LANE_RK(ctx) ((ctx)->rk128)
+#define LANE_LD(ip) LD(ip)
+#define LANE_ST(ip,X) ST(ip,X)
+#define LANE_ER(X,Y,k) (X=XOR(ADD(ROR8(X),Y),k), Y=XOR(ROL(Y,3),X))
+#define LANE_DR(X,Y,k) (Y=XOR(Y,X), Y=ROR(Y,3), X=XOR(X,k), X=_mm_sub_epi64(X,Y), X=ROL8(X))
+
+#endif // NEON and plain C take the scalar path below
+
+
+#define ROTL64(x,r) (((x)<<(r))|((x)>>(64-(r))))
+#define ROTR64(x,r) (((x)>>(r))|((x)<<(64-(r))))
+#define DR128(x,y,k) (y^=x, y=ROTR64(y,3), x^=k, x-=y, x=ROTL64(x,8))
+#define ER128(x,y,k) (x=(ROTR64(x,8)+y)^k, y=ROTL64(y,3)^x)
+
+
+static void speck_encrypt_lanes (u64 *x, u64 *y, int count, speck_context_t *ctx, int numrounds) {
+
+    int i = 0, r;
+
+#if defined (SPECK_LANES)
+    for(; i + SPECK_LANES <= count; i += SPECK_LANES) {
+        LANE_T X = LANE_LD(&x[i]), Y = LANE_LD(&y[i]);
+        for(r = 0; r < numrounds; r++)
+            LANE_ER(X, Y, LANE_RK(ctx)[r]);
+        LANE_ST(&x[i], X);
+        LANE_ST(&y[i], Y);
+    }
+#endif
+
+    // left over blocks
+    for(; i < count; i++)
+        for(r = 0; r < numrounds; r++)
+            ER128(x[i], y[i], ctx->key[r]);
+}
+
+
+static void speck_decrypt_lanes (u64 *x, u64 *y, int count, speck_context_t *ctx, int numrounds) {
+
+    int i = 0, r;
+
+#if defined (SPECK_LANES)
+    for(; i + SPECK_LANES <= count; i += SPECK_LANES) {
+        LANE_T X = LANE_LD(&x[i]), Y = LANE_LD(&y[i]);
+        for(r = numrounds - 1; r >= 0; r--)
+            LANE_DR(X, Y, LANE_RK(ctx)[r]);
+        LANE_ST(&x[i], X);
+        LANE_ST(&y[i], Y);
+    }
+#endif
+
+    for(; i < count; i++)
+        for(r = numrounds - 1; r >= 0; r--)
+            DR128(x[i], y[i], ctx->key[r]);
+}
+
+
+// ----------------------------------------------------------------------------------------------------------------
+
+
+const struct speck_kernels SPECK_KERNELS = {
+    .ctr = internal_speck_ctr,
+    .expand_key = speck_expand_key,
+    .encrypt_lanes = speck_encrypt_lanes,
+    .decrypt_lanes = speck_decrypt_lanes,
+};
+
+
+#if defined (SPECK_PUBLIC_API)
+
+
+// ----------------------------------------------------------------------------------------------------------------
+
+
+#if defined (N3N_CPU_DISPATCH)
+extern const struct speck_kernels speck_kernels_avx512;
+extern const struct speck_kernels speck_kernels_avx2;
+extern const struct speck_kernels speck_kernels_ssse3;
+#endif
+
+static const struct n3n_cpu_variant speck_variants[] = {
+#if defined (N3N_CPU_DISPATCH)
+    { .name = "avx512", .feature = n3n_cpu_avx512f, .kernels = &speck_kernels_avx512 },
+    { .name = "avx2", .feature = n3n_cpu_avx2, .kernels = &speck_kernels_avx2 },
+    { .name = "ssse3", .feature = n3n_cpu_ssse3, .kernels = &speck_kernels_ssse3 },
+#endif
+    { .name = SPECK_VARIANT_NAME, .feature = n3n_cpu_baseline, .kernels = &speck_kernels_base },
+};
+
+static struct n3n_cpu_kernel speck_kernel = {
+    .name = "speck",
+    .variants = speck_variants,
+    .nr_variants = sizeof(speck_variants) / sizeof(speck_variants[0]),
+};
+
+
 int speck_ctr (unsigned char *out, const unsigned char *in, unsigned long long inlen,
                const unsigned char *n, speck_context_t *ctx) {
 
-    return internal_speck_ctr(out, in, inlen, n,
-#if defined (SPECK_CTX_BYVAL)
-                              *ctx);
-#else
-                              ctx);
-#endif
+    return ctx->kernels->ctr(out, in, inlen, n, ctx);
 }
 
 
 // create context loaded with round keys ready for use, key size either 128 or 256 (bits)
 int speck_init (speck_context_t **ctx, const unsigned char *k, int keysize) {
 
+    return speck_init_variant(ctx, k, keysize, NULL);
+}
+
+
+int speck_init_variant (speck_context_t **ctx, const unsigned char *k, int keysize, const char *variant) {
+
+    const struct speck_kernels *kernels;
+
+    if(variant) {
+        kernels = n3n_cpu_kernel_find(&speck_kernel, variant);
+    } else {
+        kernels = n3n_cpu_kernel_select(&speck_kernel);
+    }
+    if(!kernels) {
+        *ctx = NULL;
+        return -1;
+    }
+
 #if defined (SPECK_ALIGNED_CTX)
     *ctx = (speck_context_t*)_mm_malloc(sizeof(speck_context_t), SPECK_ALIGNED_CTX);
 #else
@@ -963,7 +1141,15 @@ int speck_init (speck_context_t **ctx, const unsigned char *k, int keysize) {
         return -1;
     }
 
-    return speck_expand_key(*ctx, k, keysize);
+    (*ctx)->kernels = kernels;
+
+    return kernels->expand_key(*ctx, k, keysize);
+}
+
+
+int speck_variant_available (const char *variant) {
+
+    return n3n_cpu_kernel_find(&speck_kernel, variant) != NULL;
 }
 
 
@@ -990,11 +1176,6 @@ int speck_deinit (speck_context_t *ctx) {
 // for now: just plain C -- probably no need for AVX, SSE, NEON
 
 
-#define ROTL64(x,r) (((x)<<(r))|((x)>>(64-(r))))
-#define ROTR64(x,r) (((x)>>(r))|((x)<<(64-(r))))
-#define DR128(x,y,k) (y^=x, y=ROTR64(y,3), x^=k, x-=y, x=ROTL64(x,8))
-#define ER128(x,y,k) (x=(ROTR64(x,8)+y)^k, y=ROTL64(y,3)^x)
-
 int speck_128_decrypt (unsigned char *inout, speck_context_t *ctx) {
 
     u64 x, y;
@@ -1029,3 +1210,105 @@ int speck_128_encrypt (unsigned char *inout, speck_context_t *ctx) {
 
     return 0;
 }
+
+
+// most blocks handled in one go, bounded to keep the working set on the stack
+#define SPECK_MULTI_BLOCKS 64
+
+
+int speck_ctr_multi (unsigned char *out[], const unsigned char *in[], const unsigned int inlen[],
+                     const unsigned char *n[], int count, speck_context_t *ctx) {
+
+    u64 x[SPECK_MULTI_BLOCKS], y[SPECK_MULTI_BLOCKS], nonce[2], block[2];
+    int stream[SPECK_MULTI_BLOCKS];
+    unsigned int offset[SPECK_MULTI_BLOCKS];
+    int numrounds = (ctx->keysize == 256) ? 34 : 32;
+    int s = 0, blocks, b;
+    unsigned int pos = 0, len, i;
+
+    while(s < count) {
+        // collect the counter blocks of as many inputs as fit, an input can be split across two rounds
+        for(blocks = 0; (s < count) && (blocks < SPECK_MULTI_BLOCKS);) {
+            if(pos >= inlen[s]) {
+                s++;
+                pos = 0;
+                continue;
+            }
+            memcpy(nonce, n[s], sizeof(nonce));
+            x[blocks] = le64toh(nonce[1]);
+            y[blocks] = le64toh(nonce[0]) + pos / 16;
+            stream[blocks] = s;
+            offset[blocks] = pos;
+            blocks++;
+            pos += 16;
+        }
+
+        ctx->kernels->encrypt_lanes(x, y, blocks, ctx, numrounds);
+
+        for(b = 0; b < blocks; b++) {
+            const unsigned char *src = in[stream[b]] + offset[b];
+            unsigned char *dst = out[stream[b]] + offset[b];
+
+            block[0] = htole64(y[b]);
+            block[1] = htole64(x[b]);
+            len = inlen[stream[b]] - offset[b];
+            if(len > 16)
+                len = 16;
+            for(i = 0; i < len; i++)
+                dst[i] = src[i] ^ ((unsigned char *)block)[i];
+        }
+    }
+
+    return 0;
+}
+
+
+static int speck_128_multi (unsigned char *inout[], int count, speck_context_t *ctx, int encrypt) {
+
+    u64 x[SPECK_MULTI_BLOCKS], y[SPECK_MULTI_BLOCKS];
+    int done, blocks, b;
+
+    for(done = 0; done < count; done += blocks) {
+        blocks = count - done;
+        if(blocks > SPECK_MULTI_BLOCKS)
+            blocks = SPECK_MULTI_BLOCKS;
+
+        for(b = 0; b < blocks; b++) {
+            x[b] = le64toh( *(u64*)&inout[done + b][8] );
+            y[b] = le64toh( *(u64*)&inout[done + b][0] );
+        }
+
+        if(encrypt)
+            ctx->kernels->encrypt_lanes(x, y, blocks, ctx, 32);
+        else
+            ctx->kernels->decrypt_lanes(x, y, blocks, ctx, 32);
+
+        for(b = 0; b < blocks; b++) {
+            ((u64*)inout[done + b])[1] = htole64(x[b]);
+            ((u64*)inout[done + b])[0] = htole64(y[b]);
+        }
+    }
+
+    return 0;
+}
+
+
+int speck_128_decrypt_multi (unsigned char *inout[], int count, speck_context_t *ctx) {
+
+    return speck_128_multi(inout, count, ctx, 0);
+}
+
+
+int speck_128_encrypt_multi (unsigned char *inout[], int count, speck_context_t *ctx) {
+
+    return speck_128_multi(inout, count, ctx, 1);
+}
+
+
+void n3n_initfuncs_speck () {
+
+    n3n_cpu_kernel_register(&speck_kernel);
+}
+
+
+#endif // SPECK_PUBLIC_API
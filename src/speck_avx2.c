@@ -0,0 +1,9 @@
+/**
+ * Copyright (C) Hamish Coleman
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * The speck kernels built for AVX2, see speck.c
+ */
+
+#define SPECK_KERNELS speck_kernels_avx2
+#include "speck.c"
@@ -0,0 +1,9 @@
+/**
+ * Copyright (C) Hamish Coleman
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * The speck kernels built for AVX512, see speck.c
+ */
+
+#define SPECK_KERNELS speck_kernels_avx512
+#include "speck.c"
@@ -0,0 +1,354 @@
+/**
+ * Copyright (C) Hamish Coleman
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * Read the extra queues of a multi-queue TAP device on their own threads.
+ *
+ * Each thread has a private set of transops and its own random number
+ * generator for their IVs, so the compression and encryption of the frames
+ * it reads can run in parallel with the mainloop.
+ * Everything else - the policy checks, the peer lookups and the sending -
+ * still touches the shared edge state and is done while holding the edge
+ * lock, which the mainloop only releases while it is waiting for input.
+ */
+
+#include <n2n_define.h>         // for N2N_PKT_BUF_SIZE
+#include <n2n_typedefs.h>       // for n3n_runtime_data
+#include <n3n/logging.h>        // for traceEvent
+#include <n3n/metrics.h>
+#include <n3n/random.h>         // for n3n_rand_thread_init
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "config.h"             // for HAVE_LIBPTHREAD
+#include "edge_utils.h"         // for edge_encode_payload
+#include "tapqueue.h"
+#include "vnethdr.h"            // for n3n_vnet_read, n3n_vnet_segment
+
+#if defined(__linux__) && defined(HAVE_LIBPTHREAD)
+
+#include <errno.h>              // for errno
+#include <poll.h>               // for poll
+#include <pthread.h>
+#include <signal.h>             // for sigfillset, pthread_sigmask
+#include <stdlib.h>             // for calloc, free
+#include <string.h>             // for strerror
+#include <unistd.h>             // for close, read
+
+#include "n2n.h"                // for tuntap_open_queue
+
+static struct metrics {
+    uint32_t frames;        // a frame was read from an extra queue
+    uint32_t dropped;       // a frame was dropped by policy, or was empty
+    uint32_t read_error;    // a read from an extra queue failed
+} metrics;
+
+static struct n3n_metrics_items_llu32 metrics_items = {
+    .name = "count",
+    .desc = "Track the frames read by the extra TAP queue threads",
+    .name1 = "event",
+    .items = {
+        {
+            .val1 = "frames",
+            .offset = offsetof(struct metrics, frames),
+        },
+        {
+            .val1 = "dropped",
+            .offset = offsetof(struct metrics, dropped),
+        },
+        {
+            .val1 = "read_error",
+            .offset = offsetof(struct metrics, read_error),
+        },
+        { },
+    },
+};
+
+static struct n3n_metrics_module metrics_module = {
+    .name = "tapqueue",
+    .data = &metrics,
+    .items_llu32 = &metrics_items,
+    .type = n3n_metrics_type_llu32,
+};
+
+struct tapqueue {
+    struct n3n_runtime_data *eee;
+    pthread_t thread;
+    int fd;
+    struct n3n_vnet *vnet;  // when the TAP offloads are in use
+    bool running;
+    n2n_trans_op_t transop;
+    n2n_trans_op_t transop_lzo;
+    n2n_trans_op_t transop_zstd;
+};
+
+struct n3n_tapqueues {
+    pthread_mutex_t lock;
+    int count;
+    struct tapqueue queue[];
+};
+
+static void tapqueue_frame (struct tapqueue *queue, uint8_t *eth_pkt, size_t len) {
+    struct n3n_runtime_data *eee = queue->eee;
+    pthread_mutex_t *lock = &eee->tapqueues->lock;
+    uint8_t pktbuf[N2N_PKT_BUF_SIZE];
+    n2n_mac_t destMac;
+    uint16_t headerIdx;
+    bool wanted;
+
+    pthread_mutex_lock(lock);
+    metrics.frames++;
+    wanted = edge_tap_frame_wanted(eee, eth_pkt, len) &&
+             edge_tap_destination(eee, eth_pkt, destMac);
+    if(!wanted) {
+        __atomic_add_fetch(&metrics.dropped, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(lock);
+
+    if(!wanted) {
+        return;
+    }
+
+    size_t idx = edge_encode_payload(
+        eee,
+        &queue->transop,
+        &queue->transop_lzo,
+        &queue->transop_zstd,
+        eth_pkt,
+        len,
+        destMac,
+        pktbuf,
+        sizeof(pktbuf),
+        &headerIdx
+    );
+
+    pthread_mutex_lock(lock);
+    edge_send_encoded(eee, destMac, pktbuf, headerIdx, idx);
+    pthread_mutex_unlock(lock);
+}
+
+static uint8_t *tapqueue_segment (void *arg, uint8_t *seg, size_t len) {
+    tapqueue_frame(arg, seg, len);
+    return seg;
+}
+
+static void *tapqueue_thread (void *arg) {
+    struct tapqueue *queue = arg;
+    struct n3n_runtime_data *eee = queue->eee;
+    uint8_t eth_pkt[N2N_PKT_BUF_SIZE];
+    uint8_t seg[N2N_PKT_BUF_SIZE];
+
+    // The encryption runs outside of the lock, and must not share the
+    // generator state of the mainloop
+    pthread_mutex_lock(&eee->tapqueues->lock);
+    n3n_rand_thread_init();
+    pthread_mutex_unlock(&eee->tapqueues->lock);
+
+    while(*eee->keep_running) {
+        struct pollfd pfd = {
+            .fd = queue->fd,
+            .events = POLLIN,
+        };
+
+        // Wake up regularly to notice when we are being stopped
+        int ready = poll(&pfd, 1, 1000);
+        if(ready < 1) {
+            continue;
+        }
+
+        ssize_t len;
+        if(queue->vnet) {
+            len = n3n_vnet_read(queue->vnet, queue->fd, eth_pkt, sizeof(eth_pkt));
+        } else {
+            len = read(queue->fd, eth_pkt, sizeof(eth_pkt));
+        }
+        if(len == 0) {
+            // An empty frame, there is nothing to send.  errno is left over
+            // from some earlier call, so must not be looked at
+            __atomic_add_fetch(&metrics.dropped, 1, __ATOMIC_RELAXED);
+            if(pfd.revents & (POLLHUP | POLLERR | POLLNVAL)) {
+                __atomic_add_fetch(&metrics.read_error, 1, __ATOMIC_RELAXED);
+                traceEvent(TRACE_WARNING, "tap queue device has gone away");
+                break;
+            }
+            continue;
+        }
+        if(len < 0) {
+            if(errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            __atomic_add_fetch(&metrics.read_error, 1, __ATOMIC_RELAXED);
+            traceEvent(TRACE_WARNING, "tap queue read() failed (%d) %s", errno, strerror(errno));
+            break;
+        }
+
+        if(queue->vnet) {
+            int nr = n3n_vnet_segment(
+                queue->vnet,
+                eth_pkt,
+                len,
+                seg,
+                sizeof(seg),
+                tapqueue_segment,
+                queue
+            );
+            if(nr != 0) {
+                // Either already sent as segments, or to be dropped
+                continue;
+            }
+        }
+
+        tapqueue_frame(queue, eth_pkt, len);
+    }
+
+    return NULL;
+}
+
+static void tapqueue_close (struct tapqueue *queue) {
+    close(queue->fd);
+    if(queue->vnet) {
+        n3n_vnet_free(queue->vnet);
+    }
+    queue->transop.deinit(&queue->transop);
+    queue->transop_lzo.deinit(&queue->transop_lzo);
+#ifdef HAVE_LIBZSTD
+    queue->transop_zstd.deinit(&queue->transop_zstd);
+#endif
+}
+
+void n3n_tapqueue_start (struct n3n_runtime_data *eee) {
+    int extra = eee->device.queues - 1;
+    if(extra < 1) {
+        return;
+    }
+
+    struct n3n_tapqueues *tapqueues = calloc(
+        1,
+        sizeof(*tapqueues) + extra * sizeof(struct tapqueue)
+    );
+    if(!tapqueues) {
+        abort();
+    }
+    pthread_mutex_init(&tapqueues->lock, NULL);
+
+    for(int i = 0; i < extra; i++) {
+        struct tapqueue *queue = &tapqueues->queue[tapqueues->count];
+
+        queue->eee = eee;
+        queue->fd = tuntap_open_queue(&eee->device);
+        if(queue->fd < 0) {
+            break;
+        }
+
+        if(edge_init_transops(
+               &eee->conf,
+               &queue->transop,
+               &queue->transop_lzo,
+               &queue->transop_zstd)) {
+            close(queue->fd);
+            break;
+        }
+
+        if(eee->device.offload) {
+            queue->vnet = n3n_vnet_new();
+        }
+
+        tapqueues->count++;
+    }
+
+    if(!tapqueues->count) {
+        pthread_mutex_destroy(&tapqueues->lock);
+        free(tapqueues);
+        return;
+    }
+
+    eee->tapqueues = tapqueues;
+
+    // The threads must not run before the mainloop has taken the lock
+    pthread_mutex_lock(&tapqueues->lock);
+
+    // Leave all the signal handling to the main thread
+    sigset_t set;
+    sigset_t oldset;
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &oldset);
+
+    for(int i = 0; i < tapqueues->count; i++) {
+        struct tapqueue *queue = &tapqueues->queue[i];
+
+        if(pthread_create(&queue->thread, NULL, tapqueue_thread, queue) != 0) {
+            traceEvent(TRACE_ERROR, "failed to start tap queue thread %i", i);
+            continue;
+        }
+        queue->running = true;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+    traceEvent(TRACE_NORMAL, "started %i tap queue threads", tapqueues->count);
+}
+
+void n3n_tapqueue_stop (struct n3n_runtime_data *eee) {
+    struct n3n_tapqueues *tapqueues = eee->tapqueues;
+    if(!tapqueues) {
+        return;
+    }
+
+    // Let the threads finish whatever frame they are working on
+    pthread_mutex_unlock(&tapqueues->lock);
+
+    for(int i = 0; i < tapqueues->count; i++) {
+        struct tapqueue *queue = &tapqueues->queue[i];
+
+        if(queue->running) {
+            pthread_join(queue->thread, NULL);
+        }
+        tapqueue_close(queue);
+    }
+
+    pthread_mutex_destroy(&tapqueues->lock);
+    free(tapqueues);
+    eee->tapqueues = NULL;
+}
+
+void n3n_tapqueue_lock (struct n3n_runtime_data *eee) {
+    if(eee->tapqueues) {
+        pthread_mutex_lock(&eee->tapqueues->lock);
+    }
+}
+
+void n3n_tapqueue_unlock (struct n3n_runtime_data *eee) {
+    if(eee->tapqueues) {
+        pthread_mutex_unlock(&eee->tapqueues->lock);
+    }
+}
+
+void n3n_initfuncs_tapqueue () {
+    n3n_metrics_register(&metrics_module);
+}
+
+#else
+
+void n3n_tapqueue_start (struct n3n_runtime_data *eee) {
+    if(eee->conf.tuntap_queues > 1) {
+        traceEvent(
+            TRACE_WARNING,
+            "tuntap.queues needs Linux and pthread support, ignored"
+        );
+    }
+}
+
+void n3n_tapqueue_stop (struct n3n_runtime_data *eee) {
+}
+
+void n3n_tapqueue_lock (struct n3n_runtime_data *eee) {
+}
+
+void n3n_tapqueue_unlock (struct n3n_runtime_data *eee) {
+}
+
+void n3n_initfuncs_tapqueue () {
+}
+
+#endif
@@ -0,0 +1,26 @@
+/**
+ * Copyright (C) Hamish Coleman
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * Private interface to the multi-queue TAP reader threads
+ */
+
+#ifndef _TAPQUEUE_H_
+#define _TAPQUEUE_H_
+
+// Forward declare so that this header can stay small
+struct n3n_runtime_data;
+
+// Open the extra TAP queues and start one reader thread for each of them.
+// On return, the calling thread holds the edge lock
+void n3n_tapqueue_start (struct n3n_runtime_data *eee);
+
+// Release the edge lock, stop the reader threads and close their TAP queues
+void n3n_tapqueue_stop (struct n3n_runtime_data *eee);
+
+// The reader threads only touch the edge state while holding this lock, the
+// mainloop owns it at all times except while waiting for input
+void n3n_tapqueue_lock (struct n3n_runtime_data *eee);
+void n3n_tapqueue_unlock (struct n3n_runtime_data *eee);
+
+#endif
@@ -0,0 +1,312 @@
+/**
+ * Copyright (C) Hamish Coleman
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * Buffer the length prefixed v3 packets carried over a TCP connection,
+ * using non blocking reads and writes
+ */
+
+#include <errno.h>              // for errno, EAGAIN, EWOULDBLOCK
+#include <n2n_define.h>         // for N2N_PKT_BUF_SIZE
+#include <n3n/metrics.h>
+#include <stddef.h>             // for offsetof
+#include <stdlib.h>             // for calloc, malloc, realloc, free, abort
+#include <string.h>             // for memcpy, memmove
+
+#include "portable_endian.h"    // for be16toh, htobe16
+#include "tcpconn.h"
+
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <sys/socket.h>         // for recv, send
+#include <sys/uio.h>            // for writev, iovec
+#endif
+
+// The largest packet that can be carried, and the size of one framed packet
+#define TCPCONN_PKT_MAX     N2N_PKT_BUF_SIZE
+#define TCPCONN_FRAME_MAX   (TCPCONN_PKT_MAX + sizeof(uint16_t))
+
+// Enough to read several packets with each syscall
+#define TCPCONN_IN_SIZE     (8 * TCPCONN_FRAME_MAX)
+
+// When the queue reaches this, new packets are dropped instead of letting
+// a slow connection use up ever more memory
+#define TCPCONN_OUT_MAX     (64 * TCPCONN_FRAME_MAX)
+
+static struct metrics {
+    uint32_t read;          // a read syscall was made
+    uint32_t packet;        // a packet was reassembled from the input
+    uint32_t corrupt;       // a packet length was too large
+    uint32_t direct;        // a packet was sent without needing the queue
+    uint32_t queued;        // a packet was queued, at least partly
+    uint32_t flush;         // the queue was sent after a write event
+    uint32_t full;          // a packet was dropped as the queue was full
+    uint32_t error;         // a write failed on a broken connection
+} metrics;
+
+static struct n3n_metrics_items_llu32 metrics_items = {
+    .name = "count",
+    .desc = "Track the packets buffered on TCP connections",
+    .name1 = "event",
+    .items = {
+        {
+            .val1 = "read",
+            .offset = offsetof(struct metrics, read),
+        },
+        {
+            .val1 = "packet",
+            .offset = offsetof(struct metrics, packet),
+        },
+        {
+            .val1 = "corrupt",
+            .offset = offsetof(struct metrics, corrupt),
+        },
+        {
+            .val1 = "direct",
+            .offset = offsetof(struct metrics, direct),
+        },
+        {
+            .val1 = "queued",
+            .offset = offsetof(struct metrics, queued),
+        },
+        {
+            .val1 = "flush",
+            .offset = offsetof(struct metrics, flush),
+        },
+        {
+            .val1 = "full",
+            .offset = offsetof(struct metrics, full),
+        },
+        {
+            .val1 = "error",
+            .offset = offsetof(struct metrics, error),
+        },
+        { },
+    },
+};
+
+static struct n3n_metrics_module metrics_module = {
+    .name = "tcpconn",
+    .data = &metrics,
+    .items_llu32 = &metrics_items,
+    .type = n3n_metrics_type_llu32,
+};
+
+static bool tcpconn_wouldblock () {
+#ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return (errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR);
+#endif
+}
+
+struct n3n_tcpconn *n3n_tcpconn_malloc () {
+    struct n3n_tcpconn *tcp = calloc(1, sizeof(*tcp));
+    if(!tcp) {
+        abort();
+    }
+    return tcp;
+}
+
+void n3n_tcpconn_free (struct n3n_tcpconn *tcp) {
+    if(!tcp) {
+        return;
+    }
+    free(tcp->in);
+    free(tcp->out);
+    free(tcp);
+}
+
+void n3n_tcpconn_reset (struct n3n_tcpconn *tcp) {
+    tcp->in_start = 0;
+    tcp->in_end = 0;
+    tcp->out_start = 0;
+    tcp->out_end = 0;
+}
+
+bool n3n_tcpconn_pending (const struct n3n_tcpconn *tcp) {
+    return tcp->out_end != tcp->out_start;
+}
+
+ssize_t n3n_tcpconn_read (struct n3n_tcpconn *tcp, int fd) {
+    if(!tcp->in) {
+        tcp->in = malloc(TCPCONN_IN_SIZE);
+        if(!tcp->in) {
+            abort();
+        }
+    }
+
+    // Make room for at least one whole packet after what is left over
+    if(tcp->in_start == tcp->in_end) {
+        tcp->in_start = 0;
+        tcp->in_end = 0;
+    } else if((TCPCONN_IN_SIZE - tcp->in_end) < TCPCONN_FRAME_MAX) {
+        memmove(tcp->in, &tcp->in[tcp->in_start], tcp->in_end - tcp->in_start);
+        tcp->in_end -= tcp->in_start;
+        tcp->in_start = 0;
+    }
+
+    metrics.read++;
+    ssize_t rd = recv(fd, (void *)&tcp->in[tcp->in_end], TCPCONN_IN_SIZE - tcp->in_end, 0);
+    if(rd == 0) {
+        // Closed by the other end
+        return -1;
+    }
+    if(rd < 0) {
+        return tcpconn_wouldblock() ? 0 : -1;
+    }
+
+    tcp->in_end += rd;
+    return rd;
+}
+
+int n3n_tcpconn_next (struct n3n_tcpconn *tcp, uint8_t **pkt, uint16_t *size) {
+    uint32_t avail = tcp->in_end - tcp->in_start;
+    uint16_t size16;
+
+    if(avail < sizeof(size16)) {
+        return 0;
+    }
+
+    memcpy(&size16, &tcp->in[tcp->in_start], sizeof(size16));
+    size16 = be16toh(size16);
+    if(size16 > TCPCONN_PKT_MAX) {
+        metrics.corrupt++;
+        return -1;
+    }
+    if(avail < sizeof(size16) + size16) {
+        return 0;
+    }
+
+    *pkt = &tcp->in[tcp->in_start + sizeof(size16)];
+    *size = size16;
+    tcp->in_start += sizeof(size16) + size16;
+    metrics.packet++;
+    return 1;
+}
+
+// Add bytes to the end of the queue, the caller has checked the limit
+static void tcpconn_queue (struct n3n_tcpconn *tcp, const void *buf, uint32_t size) {
+    if(tcp->out_start == tcp->out_end) {
+        tcp->out_start = 0;
+        tcp->out_end = 0;
+    }
+
+    if(tcp->out_end + size > tcp->out_size) {
+        if(tcp->out_start) {
+            memmove(tcp->out, &tcp->out[tcp->out_start], tcp->out_end - tcp->out_start);
+            tcp->out_end -= tcp->out_start;
+            tcp->out_start = 0;
+        }
+        while(tcp->out_end + size > tcp->out_size) {
+            tcp->out_size = tcp->out_size ? tcp->out_size * 2 : 4 * TCPCONN_FRAME_MAX;
+        }
+        tcp->out = realloc(tcp->out, tcp->out_size);
+        if(!tcp->out) {
+            abort();
+        }
+    }
+
+    memcpy(&tcp->out[tcp->out_end], buf, size);
+    tcp->out_end += size;
+}
+
+ssize_t n3n_tcpconn_send (struct n3n_tcpconn *tcp, int fd, const void *buf, uint16_t size) {
+    uint32_t queued = tcp->out_end - tcp->out_start;
+    uint16_t size16 = htobe16(size);
+
+    if(queued + sizeof(size16) + size > TCPCONN_OUT_MAX) {
+        metrics.full++;
+        return 0;
+    }
+
+#ifdef _WIN32
+    // No writev(), so the packet always goes through the queue
+    metrics.queued++;
+    tcpconn_queue(tcp, &size16, sizeof(size16));
+    tcpconn_queue(tcp, buf, size);
+    if(n3n_tcpconn_flush(tcp, fd) < 0) {
+        return -1;
+    }
+    return size;
+#else
+    // Send the queue, the length and the packet with one syscall
+    struct iovec vecs[3];
+    int nr = 0;
+    uint32_t skip;
+    ssize_t sent;
+
+    if(queued) {
+        vecs[nr].iov_base = &tcp->out[tcp->out_start];
+        vecs[nr].iov_len = queued;
+        nr++;
+    }
+    vecs[nr].iov_base = &size16;
+    vecs[nr].iov_len = sizeof(size16);
+    nr++;
+    vecs[nr].iov_base = (void *)buf;
+    vecs[nr].iov_len = size;
+    nr++;
+
+    sent = writev(fd, vecs, nr);
+    if(sent < 0) {
+        if(!tcpconn_wouldblock()) {
+            metrics.error++;
+            return -1;
+        }
+        sent = 0;
+    }
+
+    // Whatever was sent comes off the front of the queue first
+    if(sent < queued) {
+        tcp->out_start += sent;
+        skip = 0;
+    } else {
+        tcp->out_start = tcp->out_end;
+        skip = sent - queued;
+    }
+
+    if(skip == sizeof(size16) + size) {
+        metrics.direct++;
+        return size;
+    }
+
+    // Then queue the rest of the packet
+    metrics.queued++;
+    if(skip < sizeof(size16)) {
+        tcpconn_queue(tcp, (uint8_t *)&size16 + skip, sizeof(size16) - skip);
+        skip = 0;
+    } else {
+        skip -= sizeof(size16);
+    }
+    tcpconn_queue(tcp, (const uint8_t *)buf + skip, size - skip);
+
+    return size;
+#endif
+}
+
+ssize_t n3n_tcpconn_flush (struct n3n_tcpconn *tcp, int fd) {
+    uint32_t queued = tcp->out_end - tcp->out_start;
+
+    if(!queued) {
+        return 0;
+    }
+
+    metrics.flush++;
+    ssize_t sent = send(fd, (void *)&tcp->out[tcp->out_start], queued, 0);
+    if(sent < 0) {
+        if(!tcpconn_wouldblock()) {
+            metrics.error++;
+            return -1;
+        }
+        return 0;
+    }
+
+    tcp->out_start += sent;
+    return sent;
+}
+
+void n3n_initfuncs_tcpconn () {
+    n3n_metrics_register(&metrics_module);
+}
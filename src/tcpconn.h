@@ -0,0 +1,59 @@
+/**
+ * Copyright (C) Hamish Coleman
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * Private interface to the buffering of the length prefixed v3 packets
+ * carried over a TCP connection
+ */
+
+#ifndef _TCPCONN_H
+#define _TCPCONN_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>  // for ssize_t
+
+// Each connection has an input buffer where the packets are reassembled
+// from the stream, and an output queue holding whatever the socket could
+// not take yet.  Both buffers are allocated on first use and are kept when
+// the connection is reset, so they can be reused.
+struct n3n_tcpconn {
+    uint8_t *in;            // Bytes read from the socket
+    uint32_t in_start;      // First byte not yet handed out as a packet
+    uint32_t in_end;
+    uint8_t *out;           // Bytes waiting for the socket to be writable
+    uint32_t out_start;
+    uint32_t out_end;
+    uint32_t out_size;      // Allocated size of out, grown as needed
+};
+
+struct n3n_tcpconn *n3n_tcpconn_malloc ();
+void n3n_tcpconn_free (struct n3n_tcpconn *);
+
+// Forget any buffered data, ready for a new connection
+void n3n_tcpconn_reset (struct n3n_tcpconn *);
+
+// Read what the socket has available.  Returns the number of bytes read,
+// zero if nothing was available or -1 if the connection is closed or broken
+ssize_t n3n_tcpconn_read (struct n3n_tcpconn *, int fd);
+
+// Find the next complete packet in what was read.  Returns 1 and points at
+// the packet, which is valid until the next read, or returns 0 if there is
+// no complete packet yet.  Returns -1 if the stream is corrupt
+int n3n_tcpconn_next (struct n3n_tcpconn *, uint8_t **pkt, uint16_t *size);
+
+// Send one packet, with its length prefix, after anything already queued.
+// Whatever the socket does not take is queued to be sent by a later flush.
+// Returns the packet size when sent or queued, zero if the queue is full and
+// the packet was dropped, or -1 if the connection is broken
+ssize_t n3n_tcpconn_send (struct n3n_tcpconn *, int fd, const void *buf, uint16_t size);
+
+// Send as much of the queue as the socket will take.  Returns -1 if the
+// connection is broken
+ssize_t n3n_tcpconn_flush (struct n3n_tcpconn *, int fd);
+
+// True when there is queued data, so the socket should be polled for
+// writing
+bool n3n_tcpconn_pending (const struct n3n_tcpconn *);
+
+#endif
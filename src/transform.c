@@ -82,6 +82,7 @@ const char *n3n_compression_id2str (int id) {
 // prototype any internal (non-public) initfuncs
 void n3n_initfuncs_transform_aes ();
 void n3n_initfuncs_transform_cc20 ();
+void n3n_initfuncs_transform_chachapoly ();
 void n3n_initfuncs_transform_lzo ();
 void n3n_initfuncs_transform_none ();
 void n3n_initfuncs_transform_null ();
@@ -92,6 +93,7 @@ void n3n_initfuncs_transform_zstd ();
 void n3n_initfuncs_transform () {
     n3n_initfuncs_transform_aes();
     n3n_initfuncs_transform_cc20();
+    n3n_initfuncs_transform_chachapoly();
     n3n_initfuncs_transform_lzo();
     n3n_initfuncs_transform_none();
     n3n_initfuncs_transform_null();
@@ -191,7 +191,7 @@ static int transop_decode_aes (n2n_trans_op_t *arg,
 }
 
 
-static int setup_aes_key (transop_aes_t *priv, const uint8_t *password, ssize_t password_len) {
+static int setup_aes_key (transop_aes_t *priv, const uint8_t *password, ssize_t password_len, const char *variant) {
 
     unsigned char key_mat[32];       /* maximum aes key length, equals hash length */
     unsigned char   *key;
@@ -219,7 +219,7 @@ static int setup_aes_key (transop_aes_t *priv, const uint8_t *password, ssize_t
     key = key_mat + sizeof(key_mat) - key_size;
 
     // setup the key and have corresponding context created
-    if(aes_init(key, key_size, &(priv->ctx))) {
+    if(aes_init_variant(key, key_size, &(priv->ctx), variant)) {
         traceEvent(TRACE_ERROR, "setup_aes_key %u-bit key setup unsuccessful", key_size * 8);
         return -1;
     }
@@ -251,7 +251,7 @@ int n2n_transop_aes_init (const n2n_edge_conf_t *conf, n2n_trans_op_t *ttt) {
     ttt->priv = priv;
 
     // setup the cipher and key
-    return setup_aes_key(priv, encrypt_key, encrypt_key_len);
+    return setup_aes_key(priv, encrypt_key, encrypt_key_len, NULL);
 }
 
 struct bench_ctx {
@@ -263,12 +263,12 @@ struct bench_ctx {
     ssize_t outbuf_size;
 };
 
-static void *bench_setup (void *const _ctx) {
+static void *bench_setup_variant (void *const _ctx, const char *variant) {
     struct bench_ctx *ctx = (struct bench_ctx *)_ctx;
 
     const char *key = "just_a_test_key_for_benchmarks";
     const ssize_t key_len = sizeof(key);
-    setup_aes_key(&ctx->priv, (unsigned char *)key, key_len);
+    setup_aes_key(&ctx->priv, (unsigned char *)key, key_len, variant);
 
     // Set one constant IV to use for all benchmark testing
     // chosen by a fair roll of the dice
@@ -280,6 +280,19 @@ static void *bench_setup (void *const _ctx) {
     return ctx;
 }
 
+static void *bench_setup (void *const _ctx) {
+    return bench_setup_variant(_ctx, NULL);
+}
+
+// The builds of the kernels that can be picked at run time, see aes.c
+static void *bench_setup_c (void *const _ctx) {
+    return bench_setup_variant(_ctx, "c");
+}
+
+static void *bench_setup_aesni (void *const _ctx) {
+    return bench_setup_variant(_ctx, "aesni");
+}
+
 static void bench_teardown (void *_ctx) {
     struct bench_ctx *ctx = (struct bench_ctx *)_ctx;
     aes_deinit(ctx->priv.ctx);
@@ -442,6 +455,52 @@ static struct bench_item bench_decr = {
     .data_out = test_data_32x16,
 };
 
+static struct bench_item bench_variants[] = {
+    {
+        .name = "aes_encr",
+        .variant = "c",
+        .ctx_size = sizeof(struct bench_ctx),
+        .setup = bench_setup_c,
+        .run = bench_encr_run,
+        .get_output = bench_get_output,
+        .teardown = bench_teardown,
+        .data_in = test_data_32x16,
+        .data_out = test_data_aes,
+    },
+    {
+        .name = "aes_decr",
+        .variant = "c",
+        .ctx_size = sizeof(struct bench_ctx),
+        .setup = bench_setup_c,
+        .run = bench_decr_run,
+        .get_output = bench_get_output,
+        .teardown = bench_teardown,
+        .data_in = test_data_aes,
+        .data_out = test_data_32x16,
+    },
+    {
+        .name = "aes_encr",
+        .variant = "aesni",
+        .ctx_size = sizeof(struct bench_ctx),
+        .setup = bench_setup_aesni,
+        .run = bench_encr_run,
+        .get_output = bench_get_output,
+        .teardown = bench_teardown,
+        .data_in = test_data_32x16,
+        .data_out = test_data_aes,
+    },
+    {
+        .name = "aes_decr",
+        .variant = "aesni",
+        .ctx_size = sizeof(struct bench_ctx),
+        .setup = bench_setup_aesni,
+        .run = bench_decr_run,
+        .get_output = bench_get_output,
+        .teardown = bench_teardown,
+        .data_in = test_data_aes,
+        .data_out = test_data_32x16,
+    },
+};
 
 static struct n3n_transform transform = {
     .name = "AES",
@@ -452,4 +511,11 @@ void n3n_initfuncs_transform_aes () {
     n3n_transform_register(&transform);
     n3n_benchmark_register(&bench_decr);
     n3n_benchmark_register(&bench_encr);
+
+    // Only the ones that are linked in and that this CPU can run
+    for(int i = 0; i < sizeof(bench_variants) / sizeof(bench_variants[0]); i++) {
+        if(aes_variant_available(bench_variants[i].variant)) {
+            n3n_benchmark_register(&bench_variants[i]);
+        }
+    }
 }
@@ -122,7 +122,7 @@ static int transop_decode_cc20 (n2n_trans_op_t *arg,
 
         cc20_crypt(outbuf,
                    inbuf + CC20_PREAMBLE_SIZE,
-                   in_len,
+                   len,
                    inbuf, /* iv */
                    priv->ctx);
     } else
@@ -132,14 +132,14 @@ static int transop_decode_cc20 (n2n_trans_op_t *arg,
 }
 
 
-static int setup_cc20_key (transop_cc20_t *priv, const uint8_t *password, ssize_t password_len) {
+static int setup_cc20_key (transop_cc20_t *priv, const uint8_t *password, ssize_t password_len, const char *variant) {
 
     uint8_t key_mat[CC20_KEY_BYTES];
 
     // the input key always gets hashed to make a more unpredictable and more complete use of the key space
     pearson_hash_256(key_mat, password, password_len);
 
-    if(cc20_init(key_mat, &(priv->ctx))) {
+    if(cc20_init_variant(key_mat, &(priv->ctx), variant)) {
         traceEvent(TRACE_ERROR, "setup_cc20_key setup unsuccessful");
         return -1;
     }
@@ -159,6 +159,10 @@ int n2n_transop_cc20_init (const n2n_edge_conf_t *conf, n2n_trans_op_t *ttt) {
 
     memset(ttt, 0, sizeof(*ttt));
     ttt->transform_id = N2N_TRANSFORM_ID_CHACHA20;
+    // the stream cipher reads each byte before writing it, so the payload
+    // can be encrypted where it lies, just behind the iv
+    ttt->inplace      = 1;
+    ttt->preamble     = CC20_PREAMBLE_SIZE;
 
     ttt->deinit       = transop_deinit_cc20;
     ttt->fwd          = transop_encode_cc20;
@@ -172,7 +176,7 @@ int n2n_transop_cc20_init (const n2n_edge_conf_t *conf, n2n_trans_op_t *ttt) {
     ttt->priv = priv;
 
     // setup the cipher and key
-    return setup_cc20_key(priv, encrypt_key, encrypt_key_len);
+    return setup_cc20_key(priv, encrypt_key, encrypt_key_len, NULL);
 }
 
 struct bench_ctx {
@@ -184,12 +188,12 @@ struct bench_ctx {
     ssize_t outbuf_size;
 };
 
-static void *bench_setup (void *const _ctx) {
+static void *bench_setup_variant (void *const _ctx, const char *variant) {
     struct bench_ctx *ctx = (struct bench_ctx *)_ctx;
 
     const char *key = "just_a_test_key_for_benchmarks";
     const ssize_t key_len = sizeof(key);
-    setup_cc20_key(&ctx->priv, (unsigned char *)key, key_len);
+    setup_cc20_key(&ctx->priv, (unsigned char *)key, key_len, variant);
 
     // Set one constant IV to use for all benchmark testing
     // chosen by a fair roll of the dice
@@ -201,6 +205,19 @@ static void *bench_setup (void *const _ctx) {
     return ctx;
 }
 
+static void *bench_setup (void *const _ctx) {
+    return bench_setup_variant(_ctx, NULL);
+}
+
+// The builds of the kernels that can be picked at run time, see cc20.c
+static void *bench_setup_sse2 (void *const _ctx) {
+    return bench_setup_variant(_ctx, "sse2");
+}
+
+static void *bench_setup_ssse3 (void *const _ctx) {
+    return bench_setup_variant(_ctx, "ssse3");
+}
+
 static void bench_teardown (void *_ctx) {
     struct bench_ctx *ctx = (struct bench_ctx *)_ctx;
     cc20_deinit(ctx->priv.ctx);
@@ -286,6 +303,33 @@ static struct bench_item bench_decr = {
     .data_out = test_data_32x16,
 };
 
+// Encryption and decryption are the same keystream, so only one of them is
+// repeated for each variant
+static struct bench_item bench_encr_variants[] = {
+    {
+        .name = "cc20_encr",
+        .variant = "sse2",
+        .ctx_size = sizeof(struct bench_ctx),
+        .setup = bench_setup_sse2,
+        .run = bench_encr_run,
+        .get_output = bench_get_output,
+        .teardown = bench_teardown,
+        .data_in = test_data_32x16,
+        .data_out = test_data_cc20,
+    },
+    {
+        .name = "cc20_encr",
+        .variant = "ssse3",
+        .ctx_size = sizeof(struct bench_ctx),
+        .setup = bench_setup_ssse3,
+        .run = bench_encr_run,
+        .get_output = bench_get_output,
+        .teardown = bench_teardown,
+        .data_in = test_data_32x16,
+        .data_out = test_data_cc20,
+    },
+};
+
 static struct n3n_transform transform = {
     .name = "ChaCha20",
     .id = N2N_TRANSFORM_ID_CHACHA20,
@@ -295,4 +339,11 @@ void n3n_initfuncs_transform_cc20 () {
     n3n_transform_register(&transform);
     n3n_benchmark_register(&bench_decr);
     n3n_benchmark_register(&bench_encr);
+
+    // Only the ones that are linked in and that this CPU can run
+    for(int i = 0; i < sizeof(bench_encr_variants) / sizeof(bench_encr_variants[0]); i++) {
+        if(cc20_variant_available(bench_encr_variants[i].variant)) {
+            n3n_benchmark_register(&bench_encr_variants[i]);
+        }
+    }
 }
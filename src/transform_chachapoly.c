@@ -0,0 +1,413 @@
+/**
+ * Copyright (C) Hamish Coleman
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * ChaCha20-Poly1305 payload transform.
+ *
+ * Unlike the other ciphers, this one authenticates the payload itself, so a
+ * modified or forged packet is dropped even without header encryption.  The
+ * cipher contexts are keyed once and the nonce is a counter, so the per
+ * packet cost is only the cipher work.
+ */
+
+
+#include <n3n/benchmark.h>
+#include <n3n/logging.h>     // for traceEvent
+#include <n3n/metrics.h>
+#include <n3n/random.h>      // for n3n_rand
+#include <n3n/transform.h>   // for n3n_transform_register
+#include <stddef.h>          // for offsetof
+#include <stdint.h>          // for uint8_t
+#include <stdlib.h>          // for size_t, calloc, free
+#include <string.h>          // for memset, strlen
+#include <sys/types.h>       // for u_char, ssize_t
+
+#include "chachapoly.h"      // for chachapoly_encrypt, chachapoly_decrypt
+#include "n2n.h"             // for n2n_trans_op_t
+#include "n2n_define.h"
+#include "n2n_typedefs.h"
+#include "pearson.h"         // for pearson_hash_256
+
+
+#define CHACHAPOLY_PREAMBLE_SIZE    (CHACHAPOLY_NONCE_SIZE)
+#define CHACHAPOLY_OVERHEAD         (CHACHAPOLY_NONCE_SIZE + CHACHAPOLY_TAG_SIZE)
+
+
+static struct metrics {
+    uint32_t encode;        // a payload was encrypted
+    uint32_t decode;        // a payload was authenticated and decrypted
+    uint32_t auth_fail;     // a payload was malformed or failed authentication
+} metrics;
+
+static struct n3n_metrics_items_llu32 metrics_items = {
+    .name = "count",
+    .desc = "Track the ChaCha20-Poly1305 payload transform",
+    .name1 = "event",
+    .items = {
+        {
+            .val1 = "encode",
+            .offset = offsetof(struct metrics, encode),
+        },
+        {
+            .val1 = "decode",
+            .offset = offsetof(struct metrics, decode),
+        },
+        {
+            .val1 = "auth_fail",
+            .offset = offsetof(struct metrics, auth_fail),
+        },
+        { },
+    },
+};
+
+static struct n3n_metrics_module metrics_module = {
+    .name = "chachapoly",
+    .data = &metrics,
+    .items_llu32 = &metrics_items,
+    .type = n3n_metrics_type_llu32,
+};
+
+
+typedef struct transop_chachapoly {
+    chachapoly_context_t *ctx;
+    // Every edge of a community, and every tap queue of an edge, has its
+    // own transop under the same key.  Each one picks a random salt and a
+    // random start for its counter, and then counts up.  Two of them only
+    // reuse a nonce if they pick the same salt and their counter runs
+    // overlap: for n transops sending p packets each, a chance of about
+    // n * n * p / 2^96, which is negligible for any real network.
+    //
+    // They are picked by setup_chachapoly_key(), which runs on the main
+    // thread with the edge lock held, so the shared generator is safe
+    uint32_t nonce_salt;
+    uint64_t nonce_counter;
+} transop_chachapoly_t;
+
+
+static int transop_deinit_chachapoly (n2n_trans_op_t *arg) {
+
+    transop_chachapoly_t *priv = (transop_chachapoly_t *)arg->priv;
+
+    if(priv) {
+        if(priv->ctx)
+            chachapoly_deinit(priv->ctx);
+        free(priv);
+    }
+
+    return 0;
+}
+
+
+// the ChaCha20-Poly1305 packet format consists of
+//
+//  - a 96-bit nonce
+//  - encrypted payload
+//  - a 128-bit authentication tag
+//
+//  [NNN|DDDDDDDDDDDDDDDDDDDDD|TTTT]
+//      |<---- encrypted ---->|
+//
+static int encode_one (transop_chachapoly_t *priv,
+                       uint8_t *outbuf,
+                       size_t out_len,
+                       const uint8_t *inbuf,
+                       size_t in_len) {
+
+    if(in_len > N2N_PKT_BUF_SIZE) {
+        traceEvent(TRACE_ERROR, "encode_chachapoly inbuf too big to encrypt.");
+        return -1;
+    }
+    if(in_len + CHACHAPOLY_OVERHEAD > out_len) {
+        traceEvent(TRACE_ERROR, "encode_chachapoly outbuf too small.");
+        return -1;
+    }
+
+    uint64_t counter = priv->nonce_counter++;
+    memcpy(&outbuf[0], &priv->nonce_salt, sizeof(priv->nonce_salt));
+    memcpy(&outbuf[4], &counter, sizeof(counter));
+
+    if(chachapoly_encrypt(outbuf + CHACHAPOLY_PREAMBLE_SIZE,
+                          outbuf + CHACHAPOLY_PREAMBLE_SIZE + in_len,
+                          inbuf,
+                          in_len,
+                          outbuf, /* nonce */
+                          priv->ctx)) {
+        return -1;
+    }
+
+    return in_len + CHACHAPOLY_OVERHEAD;
+}
+
+
+// see encode_one for packet format
+static int decode_one (transop_chachapoly_t *priv,
+                       uint8_t *outbuf,
+                       size_t out_len,
+                       const uint8_t *inbuf,
+                       size_t in_len) {
+
+    if(in_len < CHACHAPOLY_OVERHEAD
+       || in_len - CHACHAPOLY_OVERHEAD > N2N_PKT_BUF_SIZE
+       || in_len - CHACHAPOLY_OVERHEAD > out_len) {
+        traceEvent(TRACE_ERROR, "decode_chachapoly inbuf wrong size (%u) to decrypt.", (unsigned int)in_len);
+        return -1;
+    }
+
+    size_t len = in_len - CHACHAPOLY_OVERHEAD;
+
+    if(chachapoly_decrypt(outbuf,
+                          inbuf + CHACHAPOLY_PREAMBLE_SIZE,
+                          len,
+                          inbuf + CHACHAPOLY_PREAMBLE_SIZE + len, /* tag */
+                          inbuf, /* nonce */
+                          priv->ctx)) {
+        return -1;
+    }
+
+    return len;
+}
+
+
+static int transop_encode_chachapoly (n2n_trans_op_t *arg,
+                                      uint8_t *outbuf,
+                                      size_t out_len,
+                                      const uint8_t *inbuf,
+                                      size_t in_len,
+                                      const uint8_t *peer_mac) {
+
+    traceEvent(TRACE_DEBUG, "encode_chachapoly %lu bytes", in_len);
+
+    int len = encode_one((transop_chachapoly_t *)arg->priv, outbuf, out_len, inbuf, in_len);
+    if(len >= 0) {
+        __atomic_add_fetch(&metrics.encode, 1, __ATOMIC_RELAXED);
+    }
+    return len;
+}
+
+
+static int transop_decode_chachapoly (n2n_trans_op_t *arg,
+                                      uint8_t *outbuf,
+                                      size_t out_len,
+                                      const uint8_t *inbuf,
+                                      size_t in_len,
+                                      const uint8_t *peer_mac) {
+
+    traceEvent(TRACE_DEBUG, "decode_chachapoly %lu bytes", in_len);
+
+    int len = decode_one((transop_chachapoly_t *)arg->priv, outbuf, out_len, inbuf, in_len);
+    if(len >= 0) {
+        __atomic_add_fetch(&metrics.decode, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_add_fetch(&metrics.auth_fail, 1, __ATOMIC_RELAXED);
+    }
+    return len;
+}
+
+
+// Returns the number of payloads that were encoded
+static int transop_encode_chachapoly_batch (n2n_trans_op_t *arg,
+                                            struct n2n_trans_vec *vec,
+                                            int count) {
+
+    transop_chachapoly_t *priv = (transop_chachapoly_t *)arg->priv;
+    int done = 0;
+
+    traceEvent(TRACE_DEBUG, "encode_chachapoly_batch %i payloads", count);
+
+    for(int i = 0; i < count; i++) {
+        vec[i].result = encode_one(priv, vec[i].outbuf, vec[i].out_len, vec[i].inbuf, vec[i].in_len);
+        if(vec[i].result >= 0) {
+            done++;
+        }
+    }
+
+    __atomic_add_fetch(&metrics.encode, done, __ATOMIC_RELAXED);
+    return done;
+}
+
+
+// Returns the number of payloads that were authentic
+static int transop_decode_chachapoly_batch (n2n_trans_op_t *arg,
+                                            struct n2n_trans_vec *vec,
+                                            int count) {
+
+    transop_chachapoly_t *priv = (transop_chachapoly_t *)arg->priv;
+    int done = 0;
+
+    traceEvent(TRACE_DEBUG, "decode_chachapoly_batch %i payloads", count);
+
+    for(int i = 0; i < count; i++) {
+        vec[i].result = decode_one(priv, vec[i].outbuf, vec[i].out_len, vec[i].inbuf, vec[i].in_len);
+        if(vec[i].result >= 0) {
+            done++;
+        }
+    }
+
+    __atomic_add_fetch(&metrics.decode, done, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&metrics.auth_fail, count - done, __ATOMIC_RELAXED);
+    return done;
+}
+
+
+static int setup_chachapoly_key (transop_chachapoly_t *priv, const uint8_t *password, ssize_t password_len) {
+
+    uint8_t key_mat[CHACHAPOLY_KEY_BYTES];
+
+    // the input key always gets hashed to make a more unpredictable and more complete use of the key space
+    pearson_hash_256(key_mat, password, password_len);
+
+    if(chachapoly_init(key_mat, &(priv->ctx))) {
+        traceEvent(TRACE_ERROR, "setup_chachapoly_key setup unsuccessful");
+        return -1;
+    }
+
+    priv->nonce_salt = n3n_rand();
+    priv->nonce_counter = n3n_rand();
+
+    traceEvent(TRACE_DEBUG, "setup_chachapoly_key completed");
+
+    return 0;
+}
+
+
+// ChaCha20-Poly1305 initialization function
+int n2n_transop_chachapoly_init (const n2n_edge_conf_t *conf, n2n_trans_op_t *ttt) {
+
+    transop_chachapoly_t *priv;
+    const u_char *encrypt_key = (const u_char *)conf->encrypt_key;
+    size_t encrypt_key_len = strlen(conf->encrypt_key);
+
+    memset(ttt, 0, sizeof(*ttt));
+    ttt->transform_id = N2N_TRANSFORM_ID_CHACHAPOLY;
+    // a stream cipher as well, with the tag written after the payload
+    ttt->inplace      = 1;
+    ttt->preamble     = CHACHAPOLY_PREAMBLE_SIZE;
+
+    ttt->deinit       = transop_deinit_chachapoly;
+    ttt->fwd          = transop_encode_chachapoly;
+    ttt->rev          = transop_decode_chachapoly;
+    ttt->fwd_batch    = transop_encode_chachapoly_batch;
+    ttt->rev_batch    = transop_decode_chachapoly_batch;
+
+    priv = (transop_chachapoly_t*)calloc(1, sizeof(transop_chachapoly_t));
+    if(!priv) {
+        traceEvent(TRACE_ERROR, "cannot allocate transop_chachapoly_t memory");
+        return -1;
+    }
+    ttt->priv = priv;
+
+    // setup the cipher and key
+    return setup_chachapoly_key(priv, encrypt_key, encrypt_key_len);
+}
+
+struct bench_ctx {
+    n2n_trans_op_t op;
+    transop_chachapoly_t priv;
+    // for encryption, want to be able to test the largest expected MTU
+    uint8_t outbuf[2048 + CHACHAPOLY_OVERHEAD];
+    ssize_t outbuf_size;
+};
+
+static void *bench_setup (void *const _ctx) {
+    struct bench_ctx *ctx = (struct bench_ctx *)_ctx;
+
+    const char *key = "just_a_test_key_for_benchmarks";
+    const ssize_t key_len = strlen(key);
+    setup_chachapoly_key(&ctx->priv, (unsigned char *)key, key_len);
+
+    ctx->op.priv = &ctx->priv;
+    return ctx;
+}
+
+static void bench_teardown (void *_ctx) {
+    struct bench_ctx *ctx = (struct bench_ctx *)_ctx;
+    chachapoly_deinit(ctx->priv.ctx);
+}
+
+// Use one constant nonce for all benchmark testing
+static void bench_nonce (struct bench_ctx *ctx) {
+    ctx->priv.nonce_salt = 0;
+    ctx->priv.nonce_counter = 0;
+}
+
+static const ssize_t bench_encr_run (
+    void *_ctx,
+    const void *data_in,
+    const ssize_t data_in_size,
+    ssize_t *bytes_in
+) {
+    struct bench_ctx *ctx = (struct bench_ctx *)_ctx;
+
+    bench_nonce(ctx);
+    ctx->outbuf_size = transop_encode_chachapoly(
+        &ctx->op,
+        ctx->outbuf,
+        sizeof(ctx->outbuf),
+        data_in,
+        data_in_size,
+        NULL
+    );
+
+    *bytes_in = data_in_size;
+    return ctx->outbuf_size;
+}
+
+static const ssize_t bench_decr_run (
+    void *_ctx,
+    const void *data_in,
+    const ssize_t data_in_size,
+    ssize_t *bytes_in
+) {
+    struct bench_ctx *ctx = (struct bench_ctx *)_ctx;
+
+    ctx->outbuf_size = transop_decode_chachapoly(
+        &ctx->op,
+        ctx->outbuf,
+        sizeof(ctx->outbuf),
+        data_in,
+        data_in_size,
+        NULL
+    );
+
+    *bytes_in = data_in_size;
+    return ctx->outbuf_size;
+}
+
+static const void *const bench_get_output (void *const _ctx) {
+    struct bench_ctx *ctx = (struct bench_ctx *)_ctx;
+    return ctx->outbuf;
+}
+
+static struct bench_item bench_encr = {
+    .name = "chachapoly_encr",
+    .ctx_size = sizeof(struct bench_ctx),
+    .setup = bench_setup,
+    .run = bench_encr_run,
+    .get_output = bench_get_output,
+    .teardown = bench_teardown,
+    .data_in = test_data_32x16,
+    .data_out = test_data_chachapoly,
+};
+
+static struct bench_item bench_decr = {
+    .name = "chachapoly_decr",
+    .ctx_size = sizeof(struct bench_ctx),
+    .setup = bench_setup,
+    .run = bench_decr_run,
+    .get_output = bench_get_output,
+    .teardown = bench_teardown,
+    .data_in = test_data_chachapoly,
+    .data_out = test_data_32x16,
+};
+
+static struct n3n_transform transform = {
+    .name = "ChaCha20-Poly1305",
+    .id = N2N_TRANSFORM_ID_CHACHAPOLY,
+};
+
+void n3n_initfuncs_transform_chachapoly () {
+    n3n_transform_register(&transform);
+    n3n_metrics_register(&metrics_module);
+    n3n_benchmark_register(&bench_decr);
+    n3n_benchmark_register(&bench_encr);
+}
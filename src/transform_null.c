@@ -47,7 +47,9 @@ static int transop_encode_null (n2n_trans_op_t *arg,
 
     traceEvent(TRACE_DEBUG, "encode_null %lu", in_len);
     if(out_len >= in_len) {
-        memcpy(outbuf, inbuf, in_len);
+        if(outbuf != inbuf) {
+            memcpy(outbuf, inbuf, in_len);
+        }
         retval = in_len;
     } else {
         traceEvent(TRACE_DEBUG, "encode_null %lu too big for packet buffer", in_len);
@@ -68,7 +70,9 @@ static int transop_decode_null (n2n_trans_op_t *arg,
 
     traceEvent(TRACE_DEBUG, "decode_null %lu", in_len);
     if(out_len >= in_len) {
-        memcpy(outbuf, inbuf, in_len);
+        if(outbuf != inbuf) {
+            memcpy(outbuf, inbuf, in_len);
+        }
         retval = in_len;
     } else {
         traceEvent(TRACE_DEBUG, "decode_null %lu too big for packet buffer", in_len);
@@ -84,6 +88,7 @@ int n2n_transop_null_init (const n2n_edge_conf_t *conf, n2n_trans_op_t *ttt) {
 
     ttt->transform_id  = N2N_TRANSFORM_ID_NULL;
     ttt->no_encryption = 1;
+    ttt->inplace       = 1;
     ttt->deinit        = transop_deinit_null;
     ttt->fwd           = transop_encode_null;
     ttt->rev           = transop_decode_null;
@@ -138,7 +138,7 @@ static int transop_decode_speck (n2n_trans_op_t *arg,
 }
 
 
-static int setup_speck_key (transop_speck_t *priv, const uint8_t *key, ssize_t key_size) {
+static int setup_speck_key (transop_speck_t *priv, const uint8_t *key, ssize_t key_size, const char *variant) {
 
     uint8_t key_mat_buf[32];
 
@@ -146,7 +146,7 @@ static int setup_speck_key (transop_speck_t *priv, const uint8_t *key, ssize_t k
     pearson_hash_256(key_mat_buf, key, key_size);
 
     // expand the key material to the context (= round keys), 256 bit keysize
-    speck_init(&(priv->ctx), key_mat_buf, 256);
+    speck_init_variant(&(priv->ctx), key_mat_buf, 256, variant);
 
     traceEvent(TRACE_DEBUG, "setup_speck_key completed\n");
 
@@ -176,7 +176,7 @@ int n2n_transop_speck_init (const n2n_edge_conf_t *conf, n2n_trans_op_t *ttt) {
     ttt->priv = priv;
 
     // setup the cipher and key
-    return setup_speck_key(priv, encrypt_key, encrypt_key_len);
+    return setup_speck_key(priv, encrypt_key, encrypt_key_len, NULL);
 }
 
 struct bench_ctx {
@@ -188,12 +188,12 @@ struct bench_ctx {
     ssize_t outbuf_size;
 };
 
-static void *bench_setup (void *const _ctx) {
+static void *bench_setup_variant (void *const _ctx, const char *variant) {
     struct bench_ctx *ctx = (struct bench_ctx *)_ctx;
 
     const char *key = "just_a_test_key_for_benchmarks";
     const ssize_t key_len = sizeof(key);
-    setup_speck_key(&ctx->priv, (unsigned char *)key, key_len);
+    setup_speck_key(&ctx->priv, (unsigned char *)key, key_len, variant);
 
     // Set one constant IV to use for all benchmark testing
     // chosen by a fair roll of the dice
@@ -205,6 +205,27 @@ static void *bench_setup (void *const _ctx) {
     return ctx;
 }
 
+static void *bench_setup (void *const _ctx) {
+    return bench_setup_variant(_ctx, NULL);
+}
+
+// The builds of the kernels that can be picked at run time, see speck.c
+static void *bench_setup_sse2 (void *const _ctx) {
+    return bench_setup_variant(_ctx, "sse2");
+}
+
+static void *bench_setup_ssse3 (void *const _ctx) {
+    return bench_setup_variant(_ctx, "ssse3");
+}
+
+static void *bench_setup_avx2 (void *const _ctx) {
+    return bench_setup_variant(_ctx, "avx2");
+}
+
+static void *bench_setup_avx512 (void *const _ctx) {
+    return bench_setup_variant(_ctx, "avx512");
+}
+
 static void bench_teardown (void *_ctx) {
     struct bench_ctx *ctx = (struct bench_ctx *)_ctx;
     speck_deinit(ctx->priv.ctx);
@@ -290,6 +311,55 @@ static struct bench_item bench_decr = {
     .data_out = test_data_32x16,
 };
 
+// Encryption and decryption are the same CTR mode keystream, so only one
+// of them is repeated for each variant
+static struct bench_item bench_encr_variants[] = {
+    {
+        .name = "speck_encr",
+        .variant = "sse2",
+        .ctx_size = sizeof(struct bench_ctx),
+        .setup = bench_setup_sse2,
+        .run = bench_encr_run,
+        .get_output = bench_get_output,
+        .teardown = bench_teardown,
+        .data_in = test_data_32x16,
+        .data_out = test_data_speck,
+    },
+    {
+        .name = "speck_encr",
+        .variant = "ssse3",
+        .ctx_size = sizeof(struct bench_ctx),
+        .setup = bench_setup_ssse3,
+        .run = bench_encr_run,
+        .get_output = bench_get_output,
+        .teardown = bench_teardown,
+        .data_in = test_data_32x16,
+        .data_out = test_data_speck,
+    },
+    {
+        .name = "speck_encr",
+        .variant = "avx2",
+        .ctx_size = sizeof(struct bench_ctx),
+        .setup = bench_setup_avx2,
+        .run = bench_encr_run,
+        .get_output = bench_get_output,
+        .teardown = bench_teardown,
+        .data_in = test_data_32x16,
+        .data_out = test_data_speck,
+    },
+    {
+        .name = "speck_encr",
+        .variant = "avx512",
+        .ctx_size = sizeof(struct bench_ctx),
+        .setup = bench_setup_avx512,
+        .run = bench_encr_run,
+        .get_output = bench_get_output,
+        .teardown = bench_teardown,
+        .data_in = test_data_32x16,
+        .data_out = test_data_speck,
+    },
+};
+
 static struct n3n_transform transform = {
     .name = "Speck",
     .id = N2N_TRANSFORM_ID_SPECK,
@@ -299,4 +369,11 @@ void n3n_initfuncs_transform_speck () {
     n3n_transform_register(&transform);
     n3n_benchmark_register(&bench_decr);
     n3n_benchmark_register(&bench_encr);
+
+    // Only the ones that are linked in and that this CPU can run
+    for(int i = 0; i < sizeof(bench_encr_variants) / sizeof(bench_encr_variants[0]); i++) {
+        if(speck_variant_available(bench_encr_variants[i].variant)) {
+            n3n_benchmark_register(&bench_encr_variants[i]);
+        }
+    }
 }
@@ -26,7 +26,8 @@
 #include <sys/uio.h>                  // for iovec
 #include <errno.h>                    // for errno
 #include <fcntl.h>                    // for open, O_RDWR
-#include <linux/if_tun.h>             // for IFF_NO_PI, IFF_TAP, TUNSETIFF
+#include <linux/if_tun.h>             // for IFF_NO_PI, IFF_TAP, TUNSETIFF, IFF_MULTI...
+#include <linux/virtio_net.h>         // for virtio_net_hdr
 #include <linux/netlink.h>            // for sockaddr_nl, nlmsghdr, NETLINK_...
 #include <linux/rtnetlink.h>          // for ifinfomsg, RTMGRP_LINK
 #include <n3n/logging.h>              // for traceEvent
@@ -45,6 +46,7 @@
 #include "n2n.h"                      // for tuntap_dev, ...
 #include "n2n_typedefs.h"
 #include "n3n/ethernet.h"
+#include "vnethdr.h"                   // for n3n_vnet_read, n3n_vnet_write
 
 
 static int setup_ifname (int fd, const char *ifname,
@@ -108,6 +110,25 @@ static int setup_ifname (int fd, const char *ifname,
 }
 
 
+// Agree the virtio header size and tell the kernel which offloads we handle
+static int tuntap_set_offload (int fd) {
+
+    int hdr_size = sizeof(struct virtio_net_hdr);
+    if(ioctl(fd, TUNSETVNETHDRSZ, &hdr_size) < 0) {
+        traceEvent(TRACE_ERROR, "tuntap ioctl(TUNSETVNETHDRSZ) error: %s[%d]", strerror(errno), errno);
+        return -1;
+    }
+
+    unsigned int offload = TUN_F_CSUM|TUN_F_TSO4|TUN_F_TSO6;
+    if(ioctl(fd, TUNSETOFFLOAD, offload) < 0) {
+        traceEvent(TRACE_ERROR, "tuntap ioctl(TUNSETOFFLOAD) error: %s[%d]", strerror(errno), errno);
+        return -1;
+    }
+
+    return 0;
+}
+
+
 /** @brief  Open and configure the TAP device for packet read/write.
  *
  *  This routine creates the interface via the tuntap driver and then
@@ -151,6 +172,12 @@ int tuntap_open (tuntap_dev *device,
 
     // want a TAP device for layer 2 frames
     ifr.ifr_flags = IFF_TAP|IFF_NO_PI;
+    if(device->queues > 1) {
+        ifr.ifr_flags |= IFF_MULTI_QUEUE;
+    }
+    if(device->offload) {
+        ifr.ifr_flags |= IFF_VNET_HDR;
+    }
 
     strncpy(ifr.ifr_name, dev, IFNAMSIZ-1);
     ifr.ifr_name[IFNAMSIZ-1] = '\0';
@@ -165,6 +192,14 @@ int tuntap_open (tuntap_dev *device,
     // store the device name for later reuse
     strncpy(device->dev_name, ifr.ifr_name, MIN(IFNAMSIZ, sizeof(devstr_t)));
 
+    if(device->offload) {
+        if(tuntap_set_offload(device->fd) < 0) {
+            close(device->fd);
+            return -1;
+        }
+        device->vnet = n3n_vnet_new();
+    }
+
     if(device_mac && device_mac[0]) {
         // use the user-provided MAC
         str2mac(device->mac_addr, device_mac);
@@ -261,22 +296,90 @@ int tuntap_open (tuntap_dev *device,
 
 int tuntap_read (struct tuntap_dev *tuntap, unsigned char *buf, int len) {
 
+    if(tuntap->vnet) {
+        // Only ordinary frames can be returned through this interface
+        ssize_t size = n3n_vnet_read(tuntap->vnet, tuntap->fd, buf, len);
+        if(size > 0 && n3n_vnet_segment(tuntap->vnet, buf, size, NULL, 0, NULL, NULL) != 0) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+        return size;
+    }
+
     return read(tuntap->fd, buf, len);
 }
 
 
 int tuntap_write (struct tuntap_dev *tuntap, unsigned char *buf, int len) {
 
+    if(tuntap->vnet) {
+        return n3n_vnet_write(tuntap->vnet, tuntap->fd, buf, len);
+    }
+
     return write(tuntap->fd, buf, len);
 }
 
 
+// Write out anything that tuntap_write() is holding back
+void tuntap_flush (struct tuntap_dev *tuntap) {
+
+    if(tuntap->vnet) {
+        n3n_vnet_flush(tuntap->vnet, tuntap->fd);
+    }
+}
+
+
 void tuntap_close (struct tuntap_dev *tuntap) {
 
+    if(tuntap->vnet) {
+        n3n_vnet_flush(tuntap->vnet, tuntap->fd);
+        n3n_vnet_free(tuntap->vnet);
+        tuntap->vnet = NULL;
+    }
     close(tuntap->fd);
 }
 
 
+/*
+ * Attach one more queue to an already open multi-queue TAP device
+ *
+ * @return - negative value on error
+ *         - non-negative file-descriptor for the new queue on success
+ */
+int tuntap_open_queue (struct tuntap_dev *device) {
+
+    struct ifreq ifr;
+    int fd;
+
+    fd = open("/dev/net/tun", O_RDWR);
+    if(fd < 0) {
+        traceEvent(TRACE_ERROR, "tuntap open() error: %s[%d]", strerror(errno), errno);
+        return -1;
+    }
+
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = IFF_TAP|IFF_NO_PI|IFF_MULTI_QUEUE;
+    if(device->offload) {
+        ifr.ifr_flags |= IFF_VNET_HDR;
+    }
+    memcpy(ifr.ifr_name, device->dev_name, MIN(IFNAMSIZ, sizeof(devstr_t)));
+    ifr.ifr_name[IFNAMSIZ-1] = '\0';
+
+    if(ioctl(fd, TUNSETIFF, (void *)&ifr) < 0) {
+        traceEvent(TRACE_ERROR, "tuntap ioctl(TUNSETIFF, IFF_MULTI_QUEUE) error: %s[%d]", strerror(errno), errno);
+        close(fd);
+        return -1;
+    }
+
+    if(device->offload && tuntap_set_offload(fd) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+
 // fill out the ip_addr value from the interface, called to pick up dynamic address changes
 void tuntap_get_address (struct tuntap_dev *tuntap) {
 
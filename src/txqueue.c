@@ -0,0 +1,423 @@
+/**
+ * Copyright (C) Hamish Coleman
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * Collect the datagrams sent during one pass of a mainloop and send them
+ * with as few syscalls as possible
+ *
+ * Each thread has a queue of its own, so it needs no lock.  The edge only
+ * collects while holding the edge lock (see tapqueue.c), so the queue of the
+ * thread holding that lock is the only one that can have anything in it.
+ * The supernode workers each collect the datagrams they forward.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE             // for sendmmsg
+#endif
+
+#include <errno.h>              // for errno
+#include <stdlib.h>             // for abort
+#include <n3n/logging.h>        // for traceEvent
+#include <n3n/metrics.h>
+#include <n3n/strings.h>        // for sockaddr_to_str
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>             // for memcpy
+
+#include "header_encryption.h"  // for packet_header_encrypt, packet_header...
+#include "pktbuf.h"             // for n3n_pktbuf_alloc, n3n_pktbuf_free, n3n_...
+#include "txqueue.h"
+
+#ifndef _WIN32
+#include <sys/uio.h>            // for iovec
+#endif
+
+static struct metrics {
+    uint32_t queued;        // a datagram was added to the queue
+    uint32_t direct;        // a datagram was sent without queueing
+    uint32_t full;          // the queue was flushed early as it was full
+    uint32_t syscall;       // a sendmmsg() syscall was made
+    uint32_t error;         // a queued datagram could not be sent
+    uint32_t copied;        // a queued datagram was copied into a pktbuf
+    uint32_t batch_1;       // flushed batch sizes
+    uint32_t batch_2;
+    uint32_t batch_4;
+    uint32_t batch_8;
+    uint32_t batch_16;
+    uint32_t batch_32;
+} metrics;
+
+static struct n3n_metrics_items_llu32 metrics_items = {
+    .name = "count",
+    .desc = "Track the events in the lifecycle of the transmit queue",
+    .name1 = "event",
+    .items = {
+        {
+            .val1 = "queued",
+            .offset = offsetof(struct metrics, queued),
+        },
+        {
+            .val1 = "direct",
+            .offset = offsetof(struct metrics, direct),
+        },
+        {
+            .val1 = "full",
+            .offset = offsetof(struct metrics, full),
+        },
+        {
+            .val1 = "syscall",
+            .offset = offsetof(struct metrics, syscall),
+        },
+        {
+            .val1 = "error",
+            .offset = offsetof(struct metrics, error),
+        },
+        {
+            .val1 = "copied",
+            .offset = offsetof(struct metrics, copied),
+        },
+        { },
+    },
+};
+
+static struct n3n_metrics_items_llu32 metrics_batch_items = {
+    .name = "batch",
+    .desc = "Number of flushes by batch size (power of two bucket lower bound)",
+    .name1 = "size",
+    .items = {
+        {
+            .val1 = "1",
+            .offset = offsetof(struct metrics, batch_1),
+        },
+        {
+            .val1 = "2",
+            .offset = offsetof(struct metrics, batch_2),
+        },
+        {
+            .val1 = "4",
+            .offset = offsetof(struct metrics, batch_4),
+        },
+        {
+            .val1 = "8",
+            .offset = offsetof(struct metrics, batch_8),
+        },
+        {
+            .val1 = "16",
+            .offset = offsetof(struct metrics, batch_16),
+        },
+        {
+            .val1 = "32",
+            .offset = offsetof(struct metrics, batch_32),
+        },
+        { },
+    },
+};
+
+static struct n3n_metrics_module metrics_module_static = {
+    .name = "txqueue",
+    .data = &metrics,
+    .items_llu32 = &metrics_items,
+    .type = n3n_metrics_type_llu32,
+};
+
+static struct n3n_metrics_module metrics_module_batch = {
+    .name = "txqueue",
+    .data = &metrics,
+    .items_llu32 = &metrics_batch_items,
+    .type = n3n_metrics_type_llu32,
+};
+
+#ifdef __linux__
+
+struct txqueue_item {
+    int fd;
+    socklen_t dest_len;
+    struct sockaddr_storage dest;
+    struct iovec iov;                   // points into frame
+    struct n3n_pktbuf *frame;           // a reference held until it is sent
+    struct n3n_txqueue_header header;   // header.len is 0 once encrypted
+};
+
+static __thread struct txqueue_item queue[N3N_TXQUEUE_SIZE];
+static __thread struct mmsghdr msgs[N3N_TXQUEUE_SIZE];
+static __thread int queue_len;
+static __thread bool collecting;
+static __thread uint32_t *collect_errors;   // the caller's count of failed sends
+
+static void metrics_batch (int nr) {
+    if(nr >= 32) {
+        __atomic_add_fetch(&metrics.batch_32, 1, __ATOMIC_RELAXED);
+    } else if(nr >= 16) {
+        __atomic_add_fetch(&metrics.batch_16, 1, __ATOMIC_RELAXED);
+    } else if(nr >= 8) {
+        __atomic_add_fetch(&metrics.batch_8, 1, __ATOMIC_RELAXED);
+    } else if(nr >= 4) {
+        __atomic_add_fetch(&metrics.batch_4, 1, __ATOMIC_RELAXED);
+    } else if(nr >= 2) {
+        __atomic_add_fetch(&metrics.batch_2, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_add_fetch(&metrics.batch_1, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Send a run of queue items that all use the same fd
+static void txqueue_send_run (int first, int count) {
+    int fd = queue[first].fd;
+
+    while(count) {
+        __atomic_add_fetch(&metrics.syscall, 1, __ATOMIC_RELAXED);
+        int sent = sendmmsg(fd, &msgs[first], count, 0);
+
+        if(sent < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+
+            // The first message in the run has failed, so report and skip it
+            n3n_sock_str_t sockbuf;
+            int level = TRACE_WARNING;
+            // downgrade to TRACE_DEBUG in case of custom AF_INVALID,
+            // i.e. supernode not resolved yet
+            if(errno == EAFNOSUPPORT) {
+                level = TRACE_DEBUG;
+            }
+            traceEvent(
+                level,
+                "sendmmsg(%s) failed (%d) %s",
+                sockaddr_to_str(
+                    sockbuf,
+                    sizeof(sockbuf),
+                    (struct sockaddr *)&queue[first].dest
+                ),
+                errno,
+                strerror(errno)
+            );
+            __atomic_add_fetch(&metrics.error, 1, __ATOMIC_RELAXED);
+            if(collect_errors) {
+                // shared by all the threads sending for the same caller
+                __atomic_add_fetch(collect_errors, 1, __ATOMIC_RELAXED);
+            }
+            sent = 1;
+        }
+
+        first += sent;
+        count -= sent;
+    }
+}
+
+// Encrypt the headers still pending in the queue, with one batch for each
+// set of keys - usually there is only the one
+static void txqueue_encrypt_headers () {
+    uint8_t *packet[N3N_TXQUEUE_SIZE];
+    uint16_t header_len[N3N_TXQUEUE_SIZE];
+    uint16_t packet_len[N3N_TXQUEUE_SIZE];
+    uint64_t stamp[N3N_TXQUEUE_SIZE];
+
+    for(int first = 0; first < queue_len; first++) {
+        struct speck_context_t *ctx = queue[first].header.ctx;
+        struct speck_context_t *ctx_iv = queue[first].header.ctx_iv;
+        int count = 0;
+
+        if(!queue[first].header.len) {
+            continue;
+        }
+
+        for(int i = first; i < queue_len; i++) {
+            struct n3n_txqueue_header *header = &queue[i].header;
+
+            if(!header->len || (header->ctx != ctx) || (header->ctx_iv != ctx_iv)) {
+                continue;
+            }
+            packet[count] = queue[i].iov.iov_base;
+            header_len[count] = header->len;
+            packet_len[count] = queue[i].iov.iov_len;
+            stamp[count] = header->stamp;
+            count++;
+            header->len = 0;
+        }
+
+        packet_header_encrypt_batch(packet, header_len, packet_len, count, ctx, ctx_iv, stamp);
+    }
+}
+
+static void txqueue_flush () {
+    if(!queue_len) {
+        return;
+    }
+
+    metrics_batch(queue_len);
+    txqueue_encrypt_headers();
+
+    int first = 0;
+    while(first < queue_len) {
+        int count = 1;
+        while((first + count < queue_len) &&
+              (queue[first + count].fd == queue[first].fd)) {
+            count++;
+        }
+        txqueue_send_run(first, count);
+        first += count;
+    }
+
+    for(int i = 0; i < queue_len; i++) {
+        n3n_pktbuf_free(queue[i].frame);
+    }
+    queue_len = 0;
+}
+
+void n3n_txqueue_begin (uint32_t *errors) {
+    if(collecting) {
+        traceEvent(TRACE_ERROR, "%s called twice", __func__);
+        abort();
+    }
+    collect_errors = errors;
+    collecting = true;
+}
+
+void n3n_txqueue_encrypt_headers () {
+    txqueue_encrypt_headers();
+}
+
+void n3n_txqueue_end () {
+    txqueue_flush();
+    collecting = false;
+    collect_errors = NULL;
+}
+
+// Find the pktbuf to queue a datagram from, taking a reference to it.  The
+// caller's frame is used as it is when the datagram lies inside it,
+// otherwise the datagram is copied into one from the pool
+static struct n3n_pktbuf *txqueue_frame (const void *buf, size_t len, struct n3n_pktbuf *frame) {
+    if(frame && n3n_pktbuf_contains(frame, buf, len)) {
+        n3n_pktbuf_ref(frame);
+        return frame;
+    }
+
+    frame = n3n_pktbuf_alloc(len);
+    if(!frame && queue_len) {
+        // The queue may be holding the rest of the pool
+        __atomic_add_fetch(&metrics.full, 1, __ATOMIC_RELAXED);
+        txqueue_flush();
+        frame = n3n_pktbuf_alloc(len);
+    }
+    if(!frame) {
+        return NULL;
+    }
+
+    n3n_pktbuf_append(frame, len, (void *)buf);
+    __atomic_add_fetch(&metrics.copied, 1, __ATOMIC_RELAXED);
+    return frame;
+}
+
+// Add a datagram to the queue, or return NULL if it is to be sent directly
+static struct txqueue_item *txqueue_add (int fd, const void *buf, size_t len,
+                                         struct n3n_pktbuf *frame,
+                                         const struct sockaddr *dest, socklen_t dest_len) {
+    if(!collecting || dest_len > sizeof(queue[0].dest)) {
+        __atomic_add_fetch(&metrics.direct, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    if(queue_len == N3N_TXQUEUE_SIZE) {
+        __atomic_add_fetch(&metrics.full, 1, __ATOMIC_RELAXED);
+        txqueue_flush();
+    }
+
+    frame = txqueue_frame(buf, len, frame);
+    if(!frame) {
+        __atomic_add_fetch(&metrics.direct, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    struct txqueue_item *item = &queue[queue_len];
+    struct mmsghdr *msg = &msgs[queue_len];
+
+    item->fd = fd;
+    item->frame = frame;
+    memcpy(&item->dest, dest, dest_len);
+    item->dest_len = dest_len;
+    if(n3n_pktbuf_contains(frame, buf, len)) {
+        item->iov.iov_base = (void *)buf;
+    } else {
+        item->iov.iov_base = n3n_pktbuf_getbufptr(frame);
+    }
+    item->iov.iov_len = len;
+
+    memset(msg, 0, sizeof(*msg));
+    msg->msg_hdr.msg_name = &item->dest;
+    msg->msg_hdr.msg_namelen = item->dest_len;
+    msg->msg_hdr.msg_iov = &item->iov;
+    msg->msg_hdr.msg_iovlen = 1;
+
+    queue_len++;
+    __atomic_add_fetch(&metrics.queued, 1, __ATOMIC_RELAXED);
+    return item;
+}
+
+ssize_t n3n_txqueue_sendto (int fd, const void *buf, size_t len,
+                            struct n3n_pktbuf *frame,
+                            const struct sockaddr *dest, socklen_t dest_len) {
+    struct txqueue_item *item = txqueue_add(fd, buf, len, frame, dest, dest_len);
+    if(!item) {
+        return sendto(fd, buf, len, 0, dest, dest_len);
+    }
+
+    item->header.len = 0;
+    return len;
+}
+
+ssize_t n3n_txqueue_sendto_header (int fd, void *buf, size_t len,
+                                   const struct n3n_txqueue_header *header,
+                                   struct n3n_pktbuf *frame,
+                                   const struct sockaddr *dest, socklen_t dest_len) {
+    // The batch refuses the packets too short to encrypt, which the single
+    // packet version reports without stopping the send
+    struct txqueue_item *item = NULL;
+    if(len >= 24) {
+        item = txqueue_add(fd, buf, len, frame, dest, dest_len);
+    } else {
+        __atomic_add_fetch(&metrics.direct, 1, __ATOMIC_RELAXED);
+    }
+    if(!item) {
+        packet_header_encrypt(buf, header->len, len, header->ctx, header->ctx_iv, header->stamp);
+        return sendto(fd, buf, len, 0, dest, dest_len);
+    }
+
+    item->header = *header;
+    return len;
+}
+
+#else
+
+// Without sendmmsg() there is nothing to be gained by queueing
+void n3n_txqueue_begin (uint32_t *errors) {
+}
+
+void n3n_txqueue_end () {
+}
+
+ssize_t n3n_txqueue_sendto (int fd, const void *buf, size_t len,
+                            struct n3n_pktbuf *frame,
+                            const struct sockaddr *dest, socklen_t dest_len) {
+    __atomic_add_fetch(&metrics.direct, 1, __ATOMIC_RELAXED);
+    return sendto(fd, buf, len, 0, dest, dest_len);
+}
+
+void n3n_txqueue_encrypt_headers () {
+}
+
+ssize_t n3n_txqueue_sendto_header (int fd, void *buf, size_t len,
+                                   const struct n3n_txqueue_header *header,
+                                   struct n3n_pktbuf *frame,
+                                   const struct sockaddr *dest, socklen_t dest_len) {
+    packet_header_encrypt(buf, header->len, len, header->ctx, header->ctx_iv, header->stamp);
+    __atomic_add_fetch(&metrics.direct, 1, __ATOMIC_RELAXED);
+    return sendto(fd, buf, len, 0, dest, dest_len);
+}
+
+#endif
+
+void n3n_initfuncs_txqueue () {
+    n3n_metrics_register(&metrics_module_batch);
+    n3n_metrics_register(&metrics_module_static);
+}
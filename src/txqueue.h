@@ -0,0 +1,73 @@
+/**
+ * Copyright (C) Hamish Coleman
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * Private interface to the datagram transmit queue
+ */
+
+#ifndef _TXQUEUE_H
+#define _TXQUEUE_H
+
+#include <stddef.h>     // for size_t
+#include <stdint.h>     // for uint32_t
+#include <sys/types.h>  // for ssize_t
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>   // for socklen_t
+#else
+#include <sys/socket.h> // for sockaddr, socklen_t
+#endif
+
+// The most datagrams collected before they are sent.  Each one holds a pktbuf
+// until then, so the pool needs this many per collecting thread on top of
+// its other users
+#define N3N_TXQUEUE_SIZE 32
+
+struct n3n_pktbuf;
+
+// Every thread collects into a queue of its own.  Datagrams sent by other
+// threads are not seen by it, they are queued or sent by their own thread.
+
+// Start collecting datagrams instead of sending them immediately.  Any that
+// fail when they are finally sent are added to the errors count, if given
+void n3n_txqueue_begin (uint32_t *errors);
+
+// Send all the collected datagrams and stop collecting
+void n3n_txqueue_end ();
+
+// Send a datagram, or add it to the queue if collecting.  Queued datagrams
+// are reported as fully sent, their errors are counted by n3n_txqueue_end()
+//
+// If buf lies in frame, the queue takes a reference to the frame and sends
+// it from there, so the caller must not change it after the call.  Otherwise
+// (or with a NULL frame) it is copied into a pktbuf from the pool, or sent
+// straight away if the pool has none to spare
+ssize_t n3n_txqueue_sendto (int fd, const void *buf, size_t len,
+                            struct n3n_pktbuf *frame,
+                            const struct sockaddr *dest, socklen_t dest_len);
+
+struct speck_context_t;
+
+// The header encryption that a datagram still needs, with the arguments of
+// packet_header_encrypt()
+struct n3n_txqueue_header {
+    uint16_t len;
+    struct speck_context_t *ctx;
+    struct speck_context_t *ctx_iv;
+    uint64_t stamp;
+};
+
+// As n3n_txqueue_sendto(), for a datagram whose header is still to be
+// encrypted.  Queued headers are encrypted together when the queue is sent,
+// any other is encrypted in place in buf before sending it
+ssize_t n3n_txqueue_sendto_header (int fd, void *buf, size_t len,
+                                   const struct n3n_txqueue_header *header,
+                                   struct n3n_pktbuf *frame,
+                                   const struct sockaddr *dest, socklen_t dest_len);
+
+// Encrypt the queued headers now.  This must be done before freeing a key
+// that they might use
+void n3n_txqueue_encrypt_headers ();
+
+#endif
@@ -0,0 +1,577 @@
+/**
+ * Copyright (C) Hamish Coleman
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * TAP offload helpers.
+ *
+ * With IFF_VNET_HDR, the kernel can hand us TCP "super frames" of up to 64k
+ * (GSO) and frames with only a partial checksum, and can accept the same from
+ * us.  Since every n3n PDU is separately encrypted and has to fit the path
+ * MTU, the super frames read from the TAP are split here into ordinary
+ * frames, but that is done in one pass with the headers already parsed, and
+ * the resulting PDUs leave in one sendmmsg() batch.  In the other direction,
+ * consecutive TCP segments received from a peer are merged back into one
+ * super frame, so the local stack sees far fewer packets.
+ */
+
+#include <errno.h>              // for errno, EIO
+#include <n3n/logging.h>        // for traceEvent
+#include <n3n/metrics.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>             // for calloc, free
+#include <string.h>             // for memcpy, memcmp
+
+#include "vnethdr.h"
+
+static struct metrics {
+    uint32_t gso_read;      // a GSO frame was read from the TAP
+    uint32_t segment;       // a frame was built from a GSO frame
+    uint32_t csum;          // a partial checksum was completed
+    uint32_t drop;          // a frame read could not be handled
+    uint32_t coalesce;      // a received segment was merged into another
+    uint32_t gso_write;     // a GSO frame was written to the TAP
+} metrics;
+
+static struct n3n_metrics_items_llu32 metrics_items = {
+    .name = "count",
+    .desc = "Track the TAP offload segmenting and coalescing",
+    .name1 = "event",
+    .items = {
+        {
+            .val1 = "gso_read",
+            .offset = offsetof(struct metrics, gso_read),
+        },
+        {
+            .val1 = "segment",
+            .offset = offsetof(struct metrics, segment),
+        },
+        {
+            .val1 = "csum",
+            .offset = offsetof(struct metrics, csum),
+        },
+        {
+            .val1 = "drop",
+            .offset = offsetof(struct metrics, drop),
+        },
+        {
+            .val1 = "coalesce",
+            .offset = offsetof(struct metrics, coalesce),
+        },
+        {
+            .val1 = "gso_write",
+            .offset = offsetof(struct metrics, gso_write),
+        },
+        { },
+    },
+};
+
+static struct n3n_metrics_module metrics_module = {
+    .name = "vnethdr",
+    .data = &metrics,
+    .items_llu32 = &metrics_items,
+    .type = n3n_metrics_type_llu32,
+};
+
+void n3n_initfuncs_vnethdr () {
+    n3n_metrics_register(&metrics_module);
+}
+
+#ifdef __linux__
+
+#include <linux/if_ether.h>     // for ETH_HLEN, ETH_P_IP, ETH_P_IPV6
+#include <linux/virtio_net.h>   // for virtio_net_hdr
+#include <netinet/in.h>         // for IPPROTO_TCP
+#include <sys/uio.h>            // for readv, writev
+
+#define TCP_FIN         0x01
+#define TCP_PSH         0x08
+#define TCP_ACK         0x10
+#define TCP_CWR         0x80
+
+// Where the headers of a TCP frame are
+struct tcp_frame {
+    bool v6;
+    uint16_t l4;            // offset of the TCP header
+    uint16_t hlen;          // length of all the headers
+    uint16_t payload;       // length of the TCP payload
+};
+
+struct n3n_vnet {
+    struct virtio_net_hdr rx_hdr;
+    size_t rx_size;         // size of the callers buffer at the last read
+    uint8_t rx_overflow[N3N_VNET_FRAME_MAX];
+
+    struct tcp_frame gro;
+    size_t gro_len;         // zero when nothing is being coalesced
+    uint32_t gro_next_seq;
+    uint16_t gro_mss;
+    int gro_count;
+    uint8_t gro_buf[N3N_VNET_FRAME_MAX];
+};
+
+static inline uint16_t get_be16 (const uint8_t *p) {
+    return (p[0] << 8) | p[1];
+}
+
+static inline uint32_t get_be32 (const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static inline void put_be16 (uint8_t *p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static inline void put_be32 (uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+// Ones complement sum of big endian 16bit words
+static uint32_t csum_add (uint32_t sum, const uint8_t *p, size_t len) {
+    while(len > 1) {
+        sum += get_be16(p);
+        p += 2;
+        len -= 2;
+    }
+    if(len) {
+        sum += p[0] << 8;
+    }
+    return sum;
+}
+
+static uint16_t csum_fold (uint32_t sum) {
+    while(sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return sum;
+}
+
+// Sum of the TCP pseudo header, for a TCP header and payload of tcp_len
+static uint32_t csum_pseudo (const uint8_t *frame, bool v6, size_t tcp_len) {
+    uint32_t sum;
+
+    if(v6) {
+        sum = csum_add(0, &frame[ETH_HLEN + 8], 32);
+    } else {
+        sum = csum_add(0, &frame[ETH_HLEN + 12], 8);
+    }
+    sum += IPPROTO_TCP;
+    sum += tcp_len >> 16;
+    sum += tcp_len & 0xffff;
+    return sum;
+}
+
+// Find the headers of a plain (no VLAN, no IPv6 extension headers) TCP frame
+static bool tcp_frame_parse (const uint8_t *frame, size_t len, struct tcp_frame *tcp) {
+    size_t l4;
+
+    if(len < ETH_HLEN + 40) {
+        return false;
+    }
+
+    switch(get_be16(&frame[12])) {
+        case ETH_P_IP: {
+            const uint8_t *ip = &frame[ETH_HLEN];
+            if((ip[0] >> 4) != 4 || ip[9] != IPPROTO_TCP) {
+                return false;
+            }
+            if(get_be16(&ip[6]) & 0x3fff) {
+                // fragmented
+                return false;
+            }
+            if(get_be16(&ip[2]) != len - ETH_HLEN) {
+                // ethernet padding or truncated
+                return false;
+            }
+            tcp->v6 = false;
+            l4 = ETH_HLEN + (ip[0] & 0x0f) * 4;
+            break;
+        }
+        case ETH_P_IPV6: {
+            const uint8_t *ip = &frame[ETH_HLEN];
+            if(ip[6] != IPPROTO_TCP) {
+                return false;
+            }
+            if(get_be16(&ip[4]) != len - ETH_HLEN - 40) {
+                return false;
+            }
+            tcp->v6 = true;
+            l4 = ETH_HLEN + 40;
+            break;
+        }
+        default:
+            return false;
+    }
+
+    if(l4 + 20 > len) {
+        return false;
+    }
+    size_t hlen = l4 + (frame[l4 + 12] >> 4) * 4;
+    if(hlen > len || hlen < l4 + 20) {
+        return false;
+    }
+
+    tcp->l4 = l4;
+    tcp->hlen = hlen;
+    tcp->payload = len - hlen;
+    return true;
+}
+
+struct n3n_vnet *n3n_vnet_new () {
+    struct n3n_vnet *vnet = calloc(1, sizeof(*vnet));
+    if(!vnet) {
+        abort();
+    }
+    return vnet;
+}
+
+void n3n_vnet_free (struct n3n_vnet *vnet) {
+    free(vnet);
+}
+
+ssize_t n3n_vnet_read (struct n3n_vnet *vnet, int fd, uint8_t *buf, size_t size) {
+    struct iovec iov[3] = {
+        { .iov_base = &vnet->rx_hdr, .iov_len = sizeof(vnet->rx_hdr) },
+        { .iov_base = buf, .iov_len = size },
+        { .iov_base = vnet->rx_overflow, .iov_len = sizeof(vnet->rx_overflow) },
+    };
+
+    ssize_t len = readv(fd, iov, 3);
+    if(len < 0) {
+        return -1;
+    }
+    if(len < (ssize_t)sizeof(vnet->rx_hdr)) {
+        // A frame without its header, so that the caller sees an error
+        // instead of whatever errno was left from before
+        errno = EIO;
+        return -1;
+    }
+    vnet->rx_size = size;
+    return len - sizeof(vnet->rx_hdr);
+}
+
+// Copy part of the last frame read, which may continue into the overflow
+static void frame_copy (struct n3n_vnet *vnet, const uint8_t *buf, uint8_t *dst, size_t pos, size_t len) {
+    if(pos < vnet->rx_size) {
+        size_t n = vnet->rx_size - pos;
+        if(n > len) {
+            n = len;
+        }
+        memcpy(dst, &buf[pos], n);
+        dst += n;
+        pos += n;
+        len -= n;
+    }
+    if(len) {
+        memcpy(dst, &vnet->rx_overflow[pos - vnet->rx_size], len);
+    }
+}
+
+static int segment_tcp (struct n3n_vnet *vnet,
+                        uint8_t *buf,
+                        size_t len,
+                        uint8_t *seg,
+                        size_t seg_size,
+                        n3n_vnet_emit_f *emit,
+                        void *ctx) {
+
+    size_t mss = vnet->rx_hdr.gso_size;
+    size_t l4;
+    size_t hlen;
+    bool v6;
+
+    // The IP length fields of a GSO frame are not reliable, so the headers
+    // are found without checking them against the frame length
+    switch(get_be16(&buf[12])) {
+        case ETH_P_IP:
+            if(buf[ETH_HLEN + 9] != IPPROTO_TCP) {
+                return -1;
+            }
+            v6 = false;
+            l4 = ETH_HLEN + (buf[ETH_HLEN] & 0x0f) * 4;
+            break;
+        case ETH_P_IPV6:
+            if(buf[ETH_HLEN + 6] != IPPROTO_TCP) {
+                return -1;
+            }
+            v6 = true;
+            l4 = ETH_HLEN + 40;
+            break;
+        default:
+            return -1;
+    }
+    hlen = l4 + (buf[l4 + 12] >> 4) * 4;
+
+    if(!mss || hlen > vnet->rx_size || hlen >= len || hlen + mss > seg_size) {
+        return -1;
+    }
+
+    size_t total = len - hlen;
+    uint16_t ip_id = get_be16(&buf[ETH_HLEN + 4]);
+    uint32_t seq = get_be32(&buf[l4 + 4]);
+    uint8_t flags = buf[l4 + 13];
+    int nr = 0;
+
+    for(size_t off = 0; off < total; off += mss, nr++) {
+        size_t n = total - off;
+        if(n > mss) {
+            n = mss;
+        }
+        size_t tcp_len = hlen - l4 + n;
+
+        memcpy(seg, buf, hlen);
+        frame_copy(vnet, buf, &seg[hlen], hlen + off, n);
+
+        if(v6) {
+            put_be16(&seg[ETH_HLEN + 4], tcp_len);
+        } else {
+            uint8_t *ip = &seg[ETH_HLEN];
+            put_be16(&ip[2], l4 - ETH_HLEN + tcp_len);
+            put_be16(&ip[4], ip_id + nr);
+            put_be16(&ip[10], 0);
+            put_be16(&ip[10], ~csum_fold(csum_add(0, ip, l4 - ETH_HLEN)));
+        }
+
+        uint8_t *th = &seg[l4];
+        uint8_t seg_flags = flags;
+        if(off + n < total) {
+            seg_flags &= ~(TCP_FIN | TCP_PSH);
+        }
+        if(nr) {
+            seg_flags &= ~TCP_CWR;
+        }
+        put_be32(&th[4], seq + off);
+        th[13] = seg_flags;
+        put_be16(&th[16], 0);
+        put_be16(&th[16], ~csum_fold(csum_add(csum_pseudo(seg, v6, tcp_len), th, tcp_len)));
+
+        metrics.segment++;
+        seg = emit(ctx, seg, hlen + n);
+    }
+
+    return nr;
+}
+
+int n3n_vnet_segment (struct n3n_vnet *vnet,
+                      uint8_t *buf,
+                      size_t len,
+                      uint8_t *seg,
+                      size_t seg_size,
+                      n3n_vnet_emit_f *emit,
+                      void *ctx) {
+
+    struct virtio_net_hdr *hdr = &vnet->rx_hdr;
+
+    if(len < ETH_HLEN) {
+        metrics.drop++;
+        return -1;
+    }
+
+    switch(hdr->gso_type & ~VIRTIO_NET_HDR_GSO_ECN) {
+        case VIRTIO_NET_HDR_GSO_NONE:
+            break;
+
+        case VIRTIO_NET_HDR_GSO_TCPV4:
+        case VIRTIO_NET_HDR_GSO_TCPV6: {
+            metrics.gso_read++;
+            int nr = segment_tcp(vnet, buf, len, seg, seg_size, emit, ctx);
+            if(nr < 0) {
+                metrics.drop++;
+            }
+            return nr;
+        }
+
+        default:
+            // We never offered UFO or USO, so should never see them
+            metrics.drop++;
+            return -1;
+    }
+
+    if(len > vnet->rx_size) {
+        // A single frame that did not fit the buffer
+        metrics.drop++;
+        return -1;
+    }
+
+    if(hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+        size_t start = hdr->csum_start;
+        size_t offset = hdr->csum_offset;
+
+        if(start + offset + 2 > len) {
+            metrics.drop++;
+            return -1;
+        }
+
+        // The checksum field already holds the pseudo header sum
+        uint16_t csum = ~csum_fold(csum_add(0, &buf[start], len - start));
+        if(offset == 6 && !csum) {
+            // UDP uses zero to mean "no checksum"
+            csum = 0xffff;
+        }
+        put_be16(&buf[start + offset], csum);
+        metrics.csum++;
+    }
+
+    return 0;
+}
+
+static ssize_t write_frame (int fd, struct virtio_net_hdr *hdr, const uint8_t *buf, size_t len) {
+    struct iovec iov[2] = {
+        { .iov_base = hdr, .iov_len = sizeof(*hdr) },
+        { .iov_base = (void *)buf, .iov_len = len },
+    };
+
+    ssize_t written = writev(fd, iov, 2);
+    if(written < (ssize_t)sizeof(*hdr)) {
+        return written;
+    }
+    return written - sizeof(*hdr);
+}
+
+void n3n_vnet_flush (struct n3n_vnet *vnet, int fd) {
+    struct virtio_net_hdr hdr;
+
+    if(!vnet->gro_len) {
+        return;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+
+    if(vnet->gro_count > 1) {
+        uint8_t *frame = vnet->gro_buf;
+        struct tcp_frame *tcp = &vnet->gro;
+        size_t tcp_len = vnet->gro_len - tcp->l4;
+
+        if(tcp->v6) {
+            put_be16(&frame[ETH_HLEN + 4], tcp_len);
+        } else {
+            uint8_t *ip = &frame[ETH_HLEN];
+            put_be16(&ip[2], vnet->gro_len - ETH_HLEN);
+            put_be16(&ip[10], 0);
+            put_be16(&ip[10], ~csum_fold(csum_add(0, ip, tcp->l4 - ETH_HLEN)));
+        }
+
+        // Leave the checksum for the kernel to finish, as it would for a
+        // locally generated GSO frame
+        put_be16(&frame[tcp->l4 + 16], csum_fold(csum_pseudo(frame, tcp->v6, tcp_len)));
+
+        hdr.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        hdr.gso_type = tcp->v6 ? VIRTIO_NET_HDR_GSO_TCPV6 : VIRTIO_NET_HDR_GSO_TCPV4;
+        hdr.hdr_len = tcp->hlen;
+        hdr.gso_size = vnet->gro_mss;
+        hdr.csum_start = tcp->l4;
+        hdr.csum_offset = 16;
+        metrics.gso_write++;
+    }
+
+    ssize_t written = write_frame(fd, &hdr, vnet->gro_buf, vnet->gro_len);
+    if(written < 0) {
+        traceEvent(TRACE_WARNING, "tuntap write of coalesced frame failed");
+    }
+    vnet->gro_len = 0;
+}
+
+// Can the frame be appended to the one being coalesced
+static bool gro_match (struct n3n_vnet *vnet, const uint8_t *frame, const struct tcp_frame *tcp) {
+    const uint8_t *pending = vnet->gro_buf;
+    size_t l4 = tcp->l4;
+
+    if(!vnet->gro_len || tcp->v6 != vnet->gro.v6) {
+        return false;
+    }
+    if(l4 != vnet->gro.l4 || tcp->hlen != vnet->gro.hlen) {
+        return false;
+    }
+    if(tcp->payload > vnet->gro_mss) {
+        return false;
+    }
+    if(vnet->gro_len + tcp->payload > ETH_HLEN + 65535) {
+        return false;
+    }
+
+    // Ethernet header
+    if(memcmp(frame, pending, ETH_HLEN)) {
+        return false;
+    }
+
+    // IP headers, skipping the length, id and checksum fields
+    if(tcp->v6) {
+        if(memcmp(&frame[ETH_HLEN], &pending[ETH_HLEN], 4) ||
+           memcmp(&frame[ETH_HLEN + 6], &pending[ETH_HLEN + 6], 34)) {
+            return false;
+        }
+    } else {
+        if(memcmp(&frame[ETH_HLEN], &pending[ETH_HLEN], 2) ||
+           memcmp(&frame[ETH_HLEN + 6], &pending[ETH_HLEN + 6], 4) ||
+           memcmp(&frame[ETH_HLEN + 12], &pending[ETH_HLEN + 12], l4 - ETH_HLEN - 12)) {
+            return false;
+        }
+    }
+
+    // TCP header: same ports, ack, window and options, following on
+    if(get_be32(&frame[l4 + 4]) != vnet->gro_next_seq) {
+        return false;
+    }
+    if(memcmp(&frame[l4], &pending[l4], 4) ||
+       memcmp(&frame[l4 + 8], &pending[l4 + 8], 5) ||
+       memcmp(&frame[l4 + 14], &pending[l4 + 14], 2) ||
+       memcmp(&frame[l4 + 20], &pending[l4 + 20], tcp->hlen - l4 - 20)) {
+        return false;
+    }
+
+    return true;
+}
+
+ssize_t n3n_vnet_write (struct n3n_vnet *vnet, int fd, const uint8_t *buf, size_t len) {
+    struct virtio_net_hdr hdr;
+    struct tcp_frame tcp;
+    bool coalesce = false;
+
+    if(len <= N3N_VNET_FRAME_MAX && tcp_frame_parse(buf, len, &tcp) && tcp.payload) {
+        uint8_t flags = buf[tcp.l4 + 13];
+        size_t tcp_len = len - tcp.l4;
+
+        // Only plain data segments, and only if the checksum is good, since
+        // the kernel will not check the checksum of a GSO frame again
+        coalesce = (flags & ~TCP_PSH) == TCP_ACK &&
+                   csum_fold(csum_add(csum_pseudo(buf, tcp.v6, tcp_len), &buf[tcp.l4], tcp_len)) == 0xffff;
+    }
+
+    if(coalesce && gro_match(vnet, buf, &tcp)) {
+        memcpy(&vnet->gro_buf[vnet->gro_len], &buf[tcp.hlen], tcp.payload);
+        vnet->gro_len += tcp.payload;
+        vnet->gro_next_seq += tcp.payload;
+        vnet->gro_count++;
+        vnet->gro_buf[tcp.l4 + 13] |= buf[tcp.l4 + 13];
+        metrics.coalesce++;
+
+        if(tcp.payload < vnet->gro_mss || (buf[tcp.l4 + 13] & TCP_PSH)) {
+            // The end of a burst
+            n3n_vnet_flush(vnet, fd);
+        }
+        return len;
+    }
+
+    n3n_vnet_flush(vnet, fd);
+
+    if(coalesce && !(buf[tcp.l4 + 13] & TCP_PSH)) {
+        // Start coalescing a new run
+        memcpy(vnet->gro_buf, buf, len);
+        vnet->gro = tcp;
+        vnet->gro_len = len;
+        vnet->gro_mss = tcp.payload;
+        vnet->gro_next_seq = get_be32(&buf[tcp.l4 + 4]) + tcp.payload;
+        vnet->gro_count = 1;
+        return len;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    return write_frame(fd, &hdr, buf, len);
+}
+
+#endif
@@ -0,0 +1,58 @@
+/**
+ * Copyright (C) Hamish Coleman
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * Private interface to the TAP offload (IFF_VNET_HDR) helpers
+ */
+
+#ifndef _VNETHDR_H_
+#define _VNETHDR_H_
+
+#include <stddef.h>     // for size_t
+#include <stdint.h>
+#include <sys/types.h>  // for ssize_t
+
+// Large enough for a 64k GSO frame with its ethernet header
+#define N3N_VNET_FRAME_MAX (65536 + 32)
+
+// Opaque per TAP fd state: the virtio header of the last frame read, space
+// for the part of a large frame that does not fit the callers buffer and the
+// frame being coalesced for writing
+struct n3n_vnet;
+
+struct n3n_vnet *n3n_vnet_new ();
+void n3n_vnet_free (struct n3n_vnet *vnet);
+
+// Read one frame from a TAP fd opened with IFF_VNET_HDR.  The frame is read
+// into buf, continuing into the vnet overflow space if it is larger than
+// size.  Returns the length of the frame or -1 on error
+ssize_t n3n_vnet_read (struct n3n_vnet *vnet, int fd, uint8_t *buf, size_t size);
+
+// Hand one segment to the caller, returning where the next one is to be
+// built.  That may be frame again, or any other buffer of at least the same
+// seg_size
+typedef uint8_t *n3n_vnet_emit_f (void *ctx, uint8_t *frame, size_t len);
+
+// Prepare the frame from the last n3n_vnet_read() for sending to a peer.
+//
+// If it is an ordinary frame, any partial checksum is completed in place and
+// zero is returned: the caller sends buf as it is.  If it is a GSO frame, it
+// is split into MTU sized frames, the first built in seg and each handed to
+// emit, and the number of frames is returned.  Returns -1 if the frame
+// cannot be handled and should be dropped
+int n3n_vnet_segment (struct n3n_vnet *vnet,
+                      uint8_t *buf,
+                      size_t len,
+                      uint8_t *seg,
+                      size_t seg_size,
+                      n3n_vnet_emit_f *emit,
+                      void *ctx);
+
+// Write a frame to a TAP fd opened with IFF_VNET_HDR.  Consecutive TCP
+// segments of one flow are held back and written as a single GSO frame
+ssize_t n3n_vnet_write (struct n3n_vnet *vnet, int fd, const uint8_t *buf, size_t len);
+
+// Write out any frame still being coalesced
+void n3n_vnet_flush (struct n3n_vnet *vnet, int fd);
+
+#endif
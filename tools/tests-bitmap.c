@@ -0,0 +1,163 @@
+/*
+ * Copyright (C) Hamish Coleman
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+
+#include <stdbool.h>  // for bool
+#include <stdint.h>   // for uint32_t
+#include <stdio.h>    // for printf, fprintf, stdout, stderr
+#include "../src/bitmap.h"  // for n3n_bitmap_init, n3n_bitmap_find_down, n3n_bi...
+
+
+static void show_down (struct n3n_bitmap *bitmap, uint32_t start) {
+    uint32_t found;
+
+    if(n3n_bitmap_find_down(bitmap, start, &found)) {
+        printf("find_down(%u) = %u\n", start, found);
+    } else {
+        printf("find_down(%u) = none\n", start);
+    }
+}
+
+static void show_up (struct n3n_bitmap *bitmap, uint32_t start) {
+    uint32_t found;
+
+    if(n3n_bitmap_find_up(bitmap, start, &found)) {
+        printf("find_up(%u) = %u\n", start, found);
+    } else {
+        printf("find_up(%u) = none\n", start);
+    }
+}
+
+static void set_range (struct n3n_bitmap *bitmap, uint32_t first, uint32_t last) {
+    for(uint32_t bit = first; bit <= last; bit++) {
+        n3n_bitmap_set(bitmap, bit);
+    }
+}
+
+// The end of the range is not a multiple of the word size
+void test_range_end (void) {
+    char *test_name = "range_end";
+    struct n3n_bitmap bitmap;
+
+    n3n_bitmap_init(&bitmap, 100);
+    printf("%s: bits = %u\n", test_name, bitmap.bits);
+
+    show_down(&bitmap, 0);
+    show_up(&bitmap, 98);
+    show_up(&bitmap, 99);
+
+    n3n_bitmap_set(&bitmap, 99);
+    printf("%s: set 99\n", test_name);
+    show_up(&bitmap, 98);
+
+    n3n_bitmap_set(&bitmap, 0);
+    printf("%s: set 0\n", test_name);
+    show_down(&bitmap, 0);
+
+    n3n_bitmap_free(&bitmap);
+
+    fprintf(stderr, "%s: tested\n", test_name);
+    printf("\n");
+}
+
+// A used run that spans the boundary between two words
+void test_word_boundary (void) {
+    char *test_name = "word_boundary";
+    struct n3n_bitmap bitmap;
+
+    n3n_bitmap_init(&bitmap, 256);
+    set_range(&bitmap, 60, 70);
+    printf("%s: set 60..70\n", test_name);
+
+    show_down(&bitmap, 70);
+    show_down(&bitmap, 64);
+    show_down(&bitmap, 63);
+    show_up(&bitmap, 60);
+    show_up(&bitmap, 63);
+    show_up(&bitmap, 59);
+
+    set_range(&bitmap, 0, 59);
+    printf("%s: set 0..59\n", test_name);
+    show_down(&bitmap, 127);
+    show_down(&bitmap, 70);
+
+    n3n_bitmap_clear(&bitmap, 64);
+    printf("%s: clear 64\n", test_name);
+    show_down(&bitmap, 70);
+    show_up(&bitmap, 0);
+
+    n3n_bitmap_free(&bitmap);
+
+    fprintf(stderr, "%s: tested\n", test_name);
+    printf("\n");
+}
+
+// Whole groups of full words, which the searches skip using the second
+// level of the bitmap
+void test_level_boundary (void) {
+    char *test_name = "level_boundary";
+    struct n3n_bitmap bitmap;
+
+    n3n_bitmap_init(&bitmap, 3 * 4096 + 10);
+    printf("%s: bits = %u\n", test_name, bitmap.bits);
+
+    set_range(&bitmap, 0, 2 * 4096 - 1);
+    printf("%s: set 0..8191\n", test_name);
+    show_down(&bitmap, 8191);
+    show_down(&bitmap, 8192);
+    show_up(&bitmap, 0);
+    show_up(&bitmap, 4095);
+
+    n3n_bitmap_clear(&bitmap, 4000);
+    printf("%s: clear 4000\n", test_name);
+    show_down(&bitmap, 8191);
+    show_up(&bitmap, 0);
+    show_up(&bitmap, 4000);
+
+    n3n_bitmap_set(&bitmap, 4000);
+    n3n_bitmap_clear(&bitmap, 4096);
+    printf("%s: set 4000, clear 4096\n", test_name);
+    show_down(&bitmap, 8191);
+    show_down(&bitmap, 4095);
+    show_up(&bitmap, 0);
+
+    set_range(&bitmap, 4096, 3 * 4096 + 9);
+    printf("%s: set 4096..12297\n", test_name);
+    show_down(&bitmap, 3 * 4096 + 9);
+    show_up(&bitmap, 0);
+
+    n3n_bitmap_reset(&bitmap);
+    printf("%s: reset\n", test_name);
+    show_down(&bitmap, 3 * 4096 + 9);
+    show_up(&bitmap, 3 * 4096 + 8);
+
+    n3n_bitmap_free(&bitmap);
+
+    fprintf(stderr, "%s: tested\n", test_name);
+    printf("\n");
+}
+
+int main (int argc, char * argv[]) {
+
+    test_range_end();
+    test_word_boundary();
+    test_level_boundary();
+
+    return 0;
+}
@@ -0,0 +1,316 @@
+/*
+ * Copyright (C) Hamish Coleman
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+
+#include <n3n/network_traffic_filter.h>  // for process_traffic_filter_rule_str
+#include <stdint.h>     // for uint8_t, uint16_t
+#include <stdio.h>      // for printf, fprintf, stderr
+#include <stdlib.h>     // for calloc, free
+#include <string.h>     // for memcpy, memset
+#include "n2n.h"        // for network_traffic_filter_t
+#include "uthash.h"     // for HASH_ADD, HASH_ITER, HASH_DEL
+
+#ifdef _WIN32
+#include "win32/defs.h"
+#else
+#include <arpa/inet.h>  // for inet_ntop, inet_pton
+#endif
+
+
+static const char *rule_strs[] = {
+    "192.168.1.0/24:[10,20],10.0.0.1,TCP+,UDP-",
+    "10.0.0.0/8,192.168.0.0/16:53,ICMP-",
+    "[2001:db8::]/32:80,[fd00::1]/128:[1000,2000],TCP-,ICMP+",
+    "[2001:db8::]/32,[fd00::]/16:53,UDP-,TCP-",
+    "[2001:db8::]/32,[fd00::2],UDP-",
+    "192.168.1.0/288,10.0.0.1,TCP-",
+    "192.168.1.0/33,10.0.0.1,TCP-",
+    "192.168.1.0/0000024,10.0.0.1,TCP-",
+    "192.168.1.0/,10.0.0.1,TCP-",
+    "10.0.0.0/8,192.168.0.0/300,UDP-",
+    "[2001:db8::]/129,[fd00::1],UDP-",
+    "[2001:db8::]/32,10.0.0.1,UDP-",
+    "[2001:db8::,[fd00::1],UDP-",
+};
+
+static void print_rule (const filter_rule_t *rule) {
+    char src_net[INET6_ADDRSTRLEN];
+    char dst_net[INET6_ADDRSTRLEN];
+
+    if(rule->key.bool_ipv6) {
+        inet_ntop(AF_INET6, rule->key.src_net6, src_net, sizeof(src_net));
+        inet_ntop(AF_INET6, rule->key.dst_net6, dst_net, sizeof(dst_net));
+    } else {
+        inet_ntop(AF_INET, &rule->key.src_net_cidr, src_net, sizeof(src_net));
+        inet_ntop(AF_INET, &rule->key.dst_net_cidr, dst_net, sizeof(dst_net));
+    }
+
+    printf("  src %s/%u ports %u-%u\n",
+           src_net,
+           rule->key.src_net_bit_len,
+           rule->key.src_port_range.start_port,
+           rule->key.src_port_range.end_port
+    );
+    printf("  dst %s/%u ports %u-%u\n",
+           dst_net,
+           rule->key.dst_net_bit_len,
+           rule->key.dst_port_range.start_port,
+           rule->key.dst_port_range.end_port
+    );
+    printf("  tcp %s, udp %s, icmp %s\n",
+           !rule->key.bool_tcp_configured ? "any" : rule->bool_accept_tcp ? "accept" : "drop",
+           !rule->key.bool_udp_configured ? "any" : rule->bool_accept_udp ? "accept" : "drop",
+           !rule->key.bool_icmp_configured ? "any" : rule->bool_accept_icmp ? "accept" : "drop"
+    );
+}
+
+void test_rule_parse (filter_rule_t **rules) {
+    char *test_name = "rule_parse";
+
+    for(int i = 0; i < sizeof(rule_strs) / sizeof(rule_strs[0]); i++) {
+        filter_rule_t *rule = calloc(1, sizeof(filter_rule_t));
+
+        if(!process_traffic_filter_rule_str(rule_strs[i], rule)) {
+            printf("%s: %s rejected\n", test_name, rule_strs[i]);
+            free(rule);
+            continue;
+        }
+
+        printf("%s: %s\n", test_name, rule_strs[i]);
+        print_rule(rule);
+        HASH_ADD(hh, *rules, key, sizeof(filter_rule_key_t), rule);
+    }
+
+    fprintf(stderr, "%s: tested\n", test_name);
+    printf("\n");
+}
+
+/* *************************************************** */
+
+// The packets are built up one header at a time
+struct packet {
+    uint8_t data[256];
+    int size;
+};
+
+static void add_bytes (struct packet *pkt, const void *bytes, int size) {
+    memcpy(&pkt->data[pkt->size], bytes, size);
+    pkt->size += size;
+}
+
+static void add_u16 (struct packet *pkt, uint16_t value) {
+    uint8_t bytes[2] = { value >> 8, value & 0xff };
+    add_bytes(pkt, bytes, sizeof(bytes));
+}
+
+// The ethernet header, with a tag for each of the given VLAN ethertypes
+static void add_ether (struct packet *pkt, const uint16_t *tags, int nr_tags, uint16_t type) {
+    static const uint8_t macs[12] = {
+        0x02, 0, 0, 0, 0, 0x01,
+        0x02, 0, 0, 0, 0, 0x02,
+    };
+
+    add_bytes(pkt, macs, sizeof(macs));
+    for(int i = 0; i < nr_tags; i++) {
+        add_u16(pkt, tags[i]);
+        add_u16(pkt, 100 + i);  // the VLAN id
+    }
+    add_u16(pkt, type);
+}
+
+static void add_ipv4 (struct packet *pkt, const char *src, const char *dst, uint8_t proto) {
+    uint8_t hdr[20] = { 0x45 };
+
+    hdr[8] = 64;    // ttl
+    hdr[9] = proto;
+    inet_pton(AF_INET, src, &hdr[12]);
+    inet_pton(AF_INET, dst, &hdr[16]);
+    add_bytes(pkt, hdr, sizeof(hdr));
+}
+
+static void add_ipv6 (struct packet *pkt, const char *src, const char *dst, uint8_t next_header) {
+    uint8_t hdr[40] = { 0x60 };
+
+    hdr[6] = next_header;
+    hdr[7] = 64;    // hop limit
+    inet_pton(AF_INET6, src, &hdr[8]);
+    inet_pton(AF_INET6, dst, &hdr[24]);
+    add_bytes(pkt, hdr, sizeof(hdr));
+}
+
+// An options header (hop-by-hop or destination) of 8 bytes, just padding
+static void add_ipv6_options (struct packet *pkt, uint8_t next_header) {
+    uint8_t hdr[8] = { next_header, 0, 1, 4 };
+    add_bytes(pkt, hdr, sizeof(hdr));
+}
+
+static void add_ipv6_fragment (struct packet *pkt, uint8_t next_header, uint16_t offset) {
+    uint8_t hdr[8] = { next_header };
+
+    hdr[2] = (offset << 3) >> 8;
+    hdr[3] = ((offset << 3) & 0xf8) | 1;    // more fragments
+    add_bytes(pkt, hdr, sizeof(hdr));
+}
+
+static void add_ports (struct packet *pkt, uint16_t src_port, uint16_t dst_port) {
+    add_u16(pkt, src_port);
+    add_u16(pkt, dst_port);
+    add_u16(pkt, 8);    // the UDP length, or the TCP sequence number
+    add_u16(pkt, 0);
+}
+
+static void check_packet (network_traffic_filter_t *filter, const char *name, struct packet *pkt) {
+    n2n_verdict verdict = filter->filter_packet_from_tap(filter, NULL, pkt->data, pkt->size);
+
+    printf("packet_filter: %s: %s\n", name, (verdict == N2N_ACCEPT) ? "accept" : "drop");
+}
+
+void test_packet_filter (filter_rule_t *rules) {
+    char *test_name = "packet_filter";
+    network_traffic_filter_t *filter = create_network_traffic_filter();
+    const uint16_t vlan[] = { 0x8100 };
+    const uint16_t qinq[] = { 0x88a8, 0x8100 };
+    struct packet pkt;
+
+    network_traffic_filter_add_rule(filter, rules);
+
+    memset(&pkt, 0, sizeof(pkt));
+    add_ether(&pkt, NULL, 0, 0x86dd);
+    add_ipv6(&pkt, "2001:db8::10", "fd00::20", 17);
+    add_ports(&pkt, 40000, 53);
+    check_packet(filter, "ipv6 udp 53", &pkt);
+
+    memset(&pkt, 0, sizeof(pkt));
+    add_ether(&pkt, NULL, 0, 0x86dd);
+    add_ipv6(&pkt, "2001:db8::10", "fd00::20", 17);
+    add_ports(&pkt, 40000, 54);
+    check_packet(filter, "ipv6 udp 54", &pkt);
+
+    memset(&pkt, 0, sizeof(pkt));
+    add_ether(&pkt, NULL, 0, 0x86dd);
+    add_ipv6(&pkt, "2001:db9::10", "fd00::20", 17);
+    add_ports(&pkt, 40000, 53);
+    check_packet(filter, "ipv6 udp 53 from another net", &pkt);
+
+    memset(&pkt, 0, sizeof(pkt));
+    add_ether(&pkt, NULL, 0, 0x86dd);
+    add_ipv6(&pkt, "2001:db8::10", "fd00::20", 0);
+    add_ipv6_options(&pkt, 60);
+    add_ipv6_options(&pkt, 17);
+    add_ports(&pkt, 40000, 53);
+    check_packet(filter, "ipv6 hop-by-hop, dest options, udp 53", &pkt);
+
+    memset(&pkt, 0, sizeof(pkt));
+    add_ether(&pkt, NULL, 0, 0x86dd);
+    add_ipv6(&pkt, "2001:db8::10", "fd00::20", 0);
+    add_ipv6_options(&pkt, 6);
+    add_ports(&pkt, 40000, 53);
+    check_packet(filter, "ipv6 hop-by-hop, tcp 53", &pkt);
+
+    memset(&pkt, 0, sizeof(pkt));
+    add_ether(&pkt, NULL, 0, 0x86dd);
+    add_ipv6(&pkt, "2001:db8::10", "fd00::20", 44);
+    add_ipv6_fragment(&pkt, 17, 0);
+    add_ports(&pkt, 40000, 53);
+    check_packet(filter, "ipv6 first fragment, udp 53", &pkt);
+
+    // later fragments have no ports, so only match rules for all ports
+    memset(&pkt, 0, sizeof(pkt));
+    add_ether(&pkt, NULL, 0, 0x86dd);
+    add_ipv6(&pkt, "2001:db8::10", "fd00::20", 44);
+    add_ipv6_fragment(&pkt, 17, 185);
+    add_ports(&pkt, 40000, 53);
+    check_packet(filter, "ipv6 later fragment, udp", &pkt);
+
+    memset(&pkt, 0, sizeof(pkt));
+    add_ether(&pkt, NULL, 0, 0x86dd);
+    add_ipv6(&pkt, "2001:db8::10", "fd00::2", 44);
+    add_ipv6_fragment(&pkt, 17, 185);
+    add_ports(&pkt, 40000, 53);
+    check_packet(filter, "ipv6 later fragment, udp to all ports", &pkt);
+
+    // the options header claims to be longer than the packet
+    memset(&pkt, 0, sizeof(pkt));
+    add_ether(&pkt, NULL, 0, 0x86dd);
+    add_ipv6(&pkt, "2001:db8::10", "fd00::20", 0);
+    add_ipv6_options(&pkt, 17);
+    pkt.data[pkt.size - 7] = 2;
+    add_ports(&pkt, 40000, 53);
+    check_packet(filter, "ipv6 truncated options", &pkt);
+
+    memset(&pkt, 0, sizeof(pkt));
+    add_ether(&pkt, vlan, 1, 0x86dd);
+    add_ipv6(&pkt, "2001:db8::10", "fd00::20", 17);
+    add_ports(&pkt, 40000, 53);
+    check_packet(filter, "vlan ipv6 udp 53", &pkt);
+
+    memset(&pkt, 0, sizeof(pkt));
+    add_ether(&pkt, qinq, 2, 0x86dd);
+    add_ipv6(&pkt, "2001:db8::10", "fd00::20", 17);
+    add_ports(&pkt, 40000, 53);
+    check_packet(filter, "qinq ipv6 udp 53", &pkt);
+
+    memset(&pkt, 0, sizeof(pkt));
+    add_ether(&pkt, NULL, 0, 0x0800);
+    add_ipv4(&pkt, "10.1.2.3", "192.168.5.6", 1);
+    check_packet(filter, "ipv4 icmp", &pkt);
+
+    memset(&pkt, 0, sizeof(pkt));
+    add_ether(&pkt, vlan, 1, 0x0800);
+    add_ipv4(&pkt, "10.1.2.3", "192.168.5.6", 1);
+    check_packet(filter, "vlan ipv4 icmp", &pkt);
+
+    memset(&pkt, 0, sizeof(pkt));
+    add_ether(&pkt, qinq, 2, 0x0800);
+    add_ipv4(&pkt, "192.168.1.7", "10.0.0.1", 17);
+    add_ports(&pkt, 15, 53);
+    check_packet(filter, "qinq ipv4 udp", &pkt);
+
+    memset(&pkt, 0, sizeof(pkt));
+    add_ether(&pkt, qinq, 2, 0x0800);
+    add_ipv4(&pkt, "192.168.1.7", "10.0.0.1", 6);
+    add_ports(&pkt, 15, 53);
+    check_packet(filter, "qinq ipv4 tcp", &pkt);
+
+    // cut off inside the second tag
+    memset(&pkt, 0, sizeof(pkt));
+    add_ether(&pkt, qinq, 2, 0x0800);
+    pkt.size = 16;
+    check_packet(filter, "truncated qinq", &pkt);
+
+    destroy_network_traffic_filter(filter);
+
+    fprintf(stderr, "%s: tested\n", test_name);
+    printf("\n");
+}
+
+int main (int argc, char * argv[]) {
+    filter_rule_t *rules = NULL;
+    filter_rule_t *rule, *tmp_rule;
+
+    test_rule_parse(&rules);
+    test_packet_filter(rules);
+
+    HASH_ITER(hh, rules, rule, tmp_rule) {
+        HASH_DEL(rules, rule);
+        free(rule);
+    }
+
+    return 0;
+}
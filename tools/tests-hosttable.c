@@ -0,0 +1,217 @@
+/*
+ * Copyright (C) Hamish Coleman
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+
+#include <connslot/strbuf.h>    // for sb_malloc, strbuf_t
+#include <n3n/initfuncs.h>      // for n3n_initfuncs
+#include <n3n/metrics.h>        // for n3n_metrics_render
+#include <stdint.h>             // for uint32_t
+#include <stdio.h>              // for printf, fprintf, snprintf, stderr
+#include <stdlib.h>             // for free, strtoul
+#include <string.h>             // for memcpy, strlen, strstr
+#include "../src/hosttable.h"   // for n3n_hosttable_malloc, n3n_hosttable_seen, ...
+
+
+static const n2n_mac_t edge1 = { 0x02, 0x00, 0x00, 0x00, 0xee, 0x01 };
+static const n2n_mac_t edge2 = { 0x02, 0x00, 0x00, 0x00, 0xee, 0x02 };
+
+static int errors;
+
+static void host_mac (n2n_mac_t mac, int nr) {
+    static const n2n_mac_t base = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x00 };
+
+    memcpy(mac, base, sizeof(n2n_mac_t));
+    mac[5] = nr;
+}
+
+static void seen (struct n3n_hosttable *table, int nr, const n2n_mac_t edge, time_t now) {
+    n2n_mac_t mac;
+
+    host_mac(mac, nr);
+    n3n_hosttable_seen(table, mac, edge, now);
+}
+
+static struct host_info *find (struct n3n_hosttable *table, int nr) {
+    n2n_mac_t mac;
+
+    host_mac(mac, nr);
+    return n3n_hosttable_find(table, mac);
+}
+
+// Find one of the hosttable values in the metrics output
+static uint32_t metric (const char *event) {
+    strbuf_t *buf = sb_malloc(4096, 65536);
+    char name[64];
+    uint32_t val = 0;
+
+    snprintf(name, sizeof(name), "event=\"%s\"} ", event);
+
+    n3n_metrics_render(&buf);
+    char *p = strstr(buf->str, "n3n_hosttable_count");
+    if(p) {
+        p = strstr(p, name);
+    }
+    if(p) {
+        val = strtoul(p + strlen(name), NULL, 10);
+    }
+    free(buf);
+    return val;
+}
+
+// Show the hosts from the oldest to the newest seen
+static void show (const char *test_name, struct n3n_hosttable *table) {
+    printf("%s: count=%u hosts=", test_name, table->count);
+    for(struct host_info *host = table->oldest; host; host = host->next) {
+        printf(" %u@%u", host->mac_addr[5], (unsigned)host->last_seen);
+    }
+    printf("\n");
+}
+
+static void check (const char *test_name, const char *what, uint32_t got, uint32_t want) {
+    printf("%s: %s=%u\n", test_name, what, got);
+    if(got != want) {
+        fprintf(stderr, "%s: %s is %u, expected %u\n", test_name, what, got, want);
+        errors++;
+    }
+}
+
+// A new host is added, and seeing it again only updates it
+static void test_insert_update (void) {
+    char *test_name = "insert_update";
+    struct n3n_hosttable *table = n3n_hosttable_malloc(4);
+    uint32_t insert = metric("insert");
+
+    check(test_name, "size", metric("size"), 4);
+
+    seen(table, 1, edge1, 100);
+    show(test_name, table);
+    check(test_name, "edge", find(table, 1)->edge_addr[5], edge1[5]);
+
+    // The host moved to another edge
+    seen(table, 1, edge2, 101);
+    show(test_name, table);
+    check(test_name, "edge", find(table, 1)->edge_addr[5], edge2[5]);
+
+    check(test_name, "insert", metric("insert") - insert, 1);
+    check(test_name, "used", metric("used"), 1);
+    check(test_name, "unknown found", find(table, 2) != NULL, 0);
+
+    n3n_hosttable_free(table);
+
+    fprintf(stderr, "%s: tested\n", test_name);
+    printf("\n");
+}
+
+// A full table forgets the least recently seen host
+static void test_evict (void) {
+    char *test_name = "evict";
+    struct n3n_hosttable *table = n3n_hosttable_malloc(4);
+    uint32_t evict = metric("evict");
+
+    for(int nr = 1; nr <= 4; nr++) {
+        seen(table, nr, edge1, 100 + nr);
+    }
+    show(test_name, table);
+
+    // Seen again, so no longer the oldest
+    seen(table, 1, edge1, 105);
+    // Seen again within the same second, which keeps its place
+    seen(table, 4, edge2, 104);
+    show(test_name, table);
+
+    seen(table, 5, edge1, 106);
+    show(test_name, table);
+
+    check(test_name, "evict", metric("evict") - evict, 1);
+    check(test_name, "used", metric("used"), 4);
+    check(test_name, "evicted found", find(table, 2) != NULL, 0);
+    check(test_name, "refreshed found", find(table, 1) != NULL, 1);
+
+    seen(table, 6, edge1, 107);
+    show(test_name, table);
+    check(test_name, "evict", metric("evict") - evict, 2);
+
+    n3n_hosttable_free(table);
+
+    fprintf(stderr, "%s: tested\n", test_name);
+    printf("\n");
+}
+
+// Hosts not seen for a while are purged, the rest are kept
+static void test_expire (void) {
+    char *test_name = "expire";
+    struct n3n_hosttable *table = n3n_hosttable_malloc(8);
+    uint32_t expire = metric("expire");
+
+    for(int nr = 1; nr <= 5; nr++) {
+        seen(table, nr, edge1, 100 + nr);
+    }
+    seen(table, 2, edge1, 110);
+    show(test_name, table);
+
+    check(test_name, "purged", n3n_hosttable_purge(table, 104), 2);
+    show(test_name, table);
+    check(test_name, "expire", metric("expire") - expire, 2);
+    check(test_name, "used", metric("used"), 3);
+
+    check(test_name, "purged", n3n_hosttable_purge(table, 104), 0);
+
+    // The freed entries are used again
+    for(int nr = 6; nr <= 10; nr++) {
+        seen(table, nr, edge2, 110 + nr);
+    }
+    show(test_name, table);
+    check(test_name, "used", metric("used"), 8);
+
+    check(test_name, "purged", n3n_hosttable_purge(table, 200), 8);
+    show(test_name, table);
+    check(test_name, "used", metric("used"), 0);
+
+    n3n_hosttable_free(table);
+
+    fprintf(stderr, "%s: tested\n", test_name);
+    printf("\n");
+}
+
+// A table that can hold nothing never holds anything
+static void test_empty (void) {
+    char *test_name = "empty";
+    struct n3n_hosttable *table = n3n_hosttable_malloc(0);
+
+    seen(table, 1, edge1, 100);
+    show(test_name, table);
+    check(test_name, "found", find(table, 1) != NULL, 0);
+
+    n3n_hosttable_free(table);
+
+    fprintf(stderr, "%s: tested\n", test_name);
+    printf("\n");
+}
+
+int main (int argc, char * argv[]) {
+
+    n3n_initfuncs();
+
+    test_insert_update();
+    test_evict();
+    test_expire();
+    test_empty();
+
+    return errors;
+}
@@ -0,0 +1,163 @@
+/*
+ * Copyright (C) Hamish Coleman
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+
+#include <stdbool.h>  // for bool
+#include <stdio.h>    // for printf, fprintf, stderr
+#include <string.h>   // for strlen
+#include "n2n.h"        // for re_set_t
+#include "n2n_regex.h"  // for re_set_add, re_set_matchp, re_match, re_set_...
+
+
+// Patterns as they might appear in a community file
+static const char *rules[] = {
+    "net[0-9]+",
+    "home.*",
+    "a?b+c*",
+    "[a-z]+_[0-9]",
+    "\\d\\d\\d",
+    "x.y",
+    "office\\s?lan",
+    "[^xyz]+end",
+    "z*",
+};
+
+static const char *names[] = {
+    "",
+    "net",
+    "net1",
+    "net42x",
+    "home",
+    "homelab",
+    "bc",
+    "abbbcc",
+    "ac",
+    "abc_1",
+    "abc_12",
+    "123",
+    "1234",
+    "xzy",
+    "x.y",
+    "office lan",
+    "officelan",
+    "office  lan",
+    "qend",
+    "xend",
+    "end",
+};
+
+#define NR_RULES (sizeof(rules) / sizeof(rules[0]))
+#define NR_NAMES (sizeof(names) / sizeof(names[0]))
+
+static int errors;
+
+// The check the supernode did before the rules were combined into a set:
+// only a match of the whole name counts
+static bool single_match (const char *rule, const char *name) {
+    int match_length = 0;
+    int match = re_match(rule, name, &match_length);
+
+    return (match == 0) && (match_length == strlen(name));
+}
+
+// Every rule on its own, as a set of one
+static void test_each_rule (void) {
+    char *test_name = "each_rule";
+
+    for(int r = 0; r < NR_RULES; r++) {
+        re_set_t set = NULL;
+        int matched = 0;
+
+        re_set_add(&set, rules[r]);
+
+        for(int n = 0; n < NR_NAMES; n++) {
+            bool want = single_match(rules[r], names[n]);
+            bool got = re_set_matchp(set, names[n], strlen(names[n]));
+
+            if(got != want) {
+                fprintf(stderr, "%s: '%s' on '%s' gave %i, expected %i\n",
+                        test_name, rules[r], names[n], got, want);
+                errors++;
+            }
+            matched += want;
+        }
+        printf("%s: '%s' matches %i of %i names\n", test_name, rules[r], matched, (int)NR_NAMES);
+
+        re_set_free(set);
+    }
+
+    fprintf(stderr, "%s: tested\n", test_name);
+    printf("\n");
+}
+
+// All the rules at once, against any of them matching on its own
+static void test_all_rules (void) {
+    char *test_name = "all_rules";
+    re_set_t set = NULL;
+
+    for(int r = 0; r < NR_RULES; r++) {
+        re_set_add(&set, rules[r]);
+    }
+
+    for(int n = 0; n < NR_NAMES; n++) {
+        bool want = false;
+        for(int r = 0; r < NR_RULES; r++) {
+            want |= single_match(rules[r], names[n]);
+        }
+        bool got = re_set_matchp(set, names[n], strlen(names[n]));
+
+        if(got != want) {
+            fprintf(stderr, "%s: '%s' gave %i, expected %i\n", test_name, names[n], got, want);
+            errors++;
+        }
+        printf("%s: '%s' %s\n", test_name, names[n], want ? "allowed" : "rejected");
+    }
+
+    re_set_free(set);
+
+    fprintf(stderr, "%s: tested\n", test_name);
+    printf("\n");
+}
+
+// Only the first len chars of a name count, as a community name need not
+// be terminated
+static void test_len (void) {
+    char *test_name = "len";
+    re_set_t set = NULL;
+
+    re_set_add(&set, "net[0-9]+");
+
+    printf("%s: 'net12x' len 5 = %i\n", test_name, re_set_matchp(set, "net12x", 5));
+    printf("%s: 'net12x' len 6 = %i\n", test_name, re_set_matchp(set, "net12x", 6));
+    printf("%s: 'net12' len 3 = %i\n", test_name, re_set_matchp(set, "net12", 3));
+
+    re_set_free(set);
+
+    fprintf(stderr, "%s: tested\n", test_name);
+    printf("\n");
+}
+
+int main (int argc, char * argv[]) {
+
+    test_each_rule();
+    test_all_rules();
+    test_len();
+
+    return errors;
+}
@@ -0,0 +1,378 @@
+/*
+ * Copyright (C) Hamish Coleman
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+
+#include <connslot/strbuf.h>    // for sb_malloc, strbuf_t
+#include <n2n_define.h>         // for N2N_PKT_BUF_SIZE
+#include <n3n/initfuncs.h>      // for n3n_initfuncs
+#include <n3n/metrics.h>        // for n3n_metrics_render
+#include <stdint.h>             // for uint8_t, uint16_t, uint32_t
+#include <stdio.h>              // for printf, fprintf, snprintf, stderr
+#include <stdlib.h>             // for exit, free, strtoul
+#include <string.h>             // for memcmp, strlen, strstr
+#include "../src/tcpconn.h"     // for n3n_tcpconn_read, n3n_tcpconn_next, ...
+
+#ifndef _WIN32
+#include <fcntl.h>              // for fcntl, F_SETFL, O_NONBLOCK
+#include <sys/socket.h>         // for socketpair, send, setsockopt
+#include <unistd.h>             // for close
+#endif
+
+#define FRAME_MAX (N2N_PKT_BUF_SIZE + 2)
+
+static int errors;
+
+// Build a length prefixed frame, with contents that tell the frames apart
+static size_t frame (uint8_t *buf, int nr, uint16_t size) {
+    buf[0] = size >> 8;
+    buf[1] = size;
+    for(int i = 0; i < size; i++) {
+        buf[2 + i] = nr + i * 3;
+    }
+    return 2 + size;
+}
+
+// Find one of the tcpconn values in the metrics output
+static uint32_t metric (const char *event) {
+    strbuf_t *buf = sb_malloc(4096, 65536);
+    char name[64];
+    uint32_t val = 0;
+
+    snprintf(name, sizeof(name), "event=\"%s\"} ", event);
+
+    n3n_metrics_render(&buf);
+    char *p = strstr(buf->str, "n3n_tcpconn_count");
+    if(p) {
+        p = strstr(p, name);
+    }
+    if(p) {
+        val = strtoul(p + strlen(name), NULL, 10);
+    }
+    free(buf);
+    return val;
+}
+
+static void check (const char *test_name, const char *what, int got, int want) {
+    if(got != want) {
+        fprintf(stderr, "%s: %s is %i, expected %i\n", test_name, what, got, want);
+        errors++;
+    }
+}
+
+#ifndef _WIN32
+// Both ends are non blocking, so a read with nothing waiting returns 0
+static void connect_pair (int fds[2]) {
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        fprintf(stderr, "could not create a socketpair\n");
+        exit(1);
+    }
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+}
+
+// Check a reassembled packet is the one frame() built
+static void check_pkt (const char *test_name, uint8_t *pkt, uint16_t size, int nr, uint16_t want) {
+    uint8_t buf[FRAME_MAX];
+
+    frame(buf, nr, want);
+    if((size != want) || memcmp(pkt, &buf[2], size)) {
+        fprintf(stderr, "%s: packet %i differs\n", test_name, nr);
+        errors++;
+    }
+}
+
+// Read whatever is waiting and check the packets in it, counting them in nr
+static void receive (const char *test_name, struct n3n_tcpconn *rx, int fd, int *nr, uint16_t size) {
+    uint8_t *pkt;
+    uint16_t pkt_size;
+
+    while(n3n_tcpconn_read(rx, fd) > 0) {
+        while(n3n_tcpconn_next(rx, &pkt, &pkt_size) == 1) {
+            check_pkt(test_name, pkt, pkt_size, *nr, size);
+            (*nr)++;
+        }
+    }
+}
+#endif
+
+// One packet arriving a few bytes at a time, including a split length
+static void test_split_read (void) {
+    char *test_name = "split_read";
+    static const int pieces[] = { 1, 1, 700, 700, 648 };
+    uint8_t buf[FRAME_MAX];
+    size_t len = frame(buf, 1, N2N_PKT_BUF_SIZE);
+
+    printf("%s: len=%u pieces=", test_name, (unsigned)len);
+    for(int i = 0; i < sizeof(pieces) / sizeof(pieces[0]); i++) {
+        printf(" %i", pieces[i]);
+    }
+    printf("\n");
+
+#ifndef _WIN32
+    struct n3n_tcpconn *rx = n3n_tcpconn_malloc();
+    uint8_t *pkt;
+    uint16_t pkt_size;
+    size_t off = 0;
+    int fds[2];
+
+    connect_pair(fds);
+    for(int i = 0; i < sizeof(pieces) / sizeof(pieces[0]); i++) {
+        check(test_name, "next before", n3n_tcpconn_next(rx, &pkt, &pkt_size), 0);
+        if(send(fds[0], &buf[off], pieces[i], 0) != pieces[i]) {
+            fprintf(stderr, "%s: could not send piece %i\n", test_name, i);
+            errors++;
+        }
+        off += pieces[i];
+        check(test_name, "read", n3n_tcpconn_read(rx, fds[1]), pieces[i]);
+    }
+    check(test_name, "sent", off, len);
+
+    check(test_name, "next", n3n_tcpconn_next(rx, &pkt, &pkt_size), 1);
+    check_pkt(test_name, pkt, pkt_size, 1, N2N_PKT_BUF_SIZE);
+    check(test_name, "next after", n3n_tcpconn_next(rx, &pkt, &pkt_size), 0);
+    check(test_name, "read empty", n3n_tcpconn_read(rx, fds[1]), 0);
+
+    // The other end going away is seen as an error
+    close(fds[0]);
+    check(test_name, "read closed", n3n_tcpconn_read(rx, fds[1]), -1);
+    close(fds[1]);
+    n3n_tcpconn_free(rx);
+#endif
+
+    fprintf(stderr, "%s: tested\n", test_name);
+    printf("\n");
+}
+
+// Many packets read at once, more than fit the input buffer, so the reads
+// end part way through a packet and what is left is moved to the front
+static void test_multi_frame (void) {
+    char *test_name = "multi_frame";
+    static uint8_t stream[32 * FRAME_MAX];
+    size_t len = 0;
+    int count = 0;
+
+    // Sizes that do not line up with the input buffer, including empty
+    while(len + 2 + (count * 1001) % N2N_PKT_BUF_SIZE <= sizeof(stream)) {
+        len += frame(&stream[len], count, (count * 1001) % N2N_PKT_BUF_SIZE);
+        count++;
+    }
+    printf("%s: frames=%i len=%u\n", test_name, count, (unsigned)len);
+
+#ifndef _WIN32
+    struct n3n_tcpconn *rx = n3n_tcpconn_malloc();
+    uint8_t *pkt;
+    uint16_t pkt_size;
+    size_t off = 0;
+    int nr = 0;
+    int fds[2];
+
+    connect_pair(fds);
+    while(nr < count) {
+        if(off < len) {
+            ssize_t sent = send(fds[0], &stream[off], len - off, 0);
+            if(sent > 0) {
+                off += sent;
+            }
+        }
+        if(n3n_tcpconn_read(rx, fds[1]) < 0) {
+            fprintf(stderr, "%s: read failed\n", test_name);
+            errors++;
+            break;
+        }
+        while(n3n_tcpconn_next(rx, &pkt, &pkt_size) == 1) {
+            check_pkt(test_name, pkt, pkt_size, nr, (nr * 1001) % N2N_PKT_BUF_SIZE);
+            nr++;
+        }
+    }
+    check(test_name, "packets", nr, count);
+
+    close(fds[0]);
+    close(fds[1]);
+    n3n_tcpconn_free(rx);
+#endif
+
+    fprintf(stderr, "%s: tested\n", test_name);
+    printf("\n");
+}
+
+// A length larger than any packet means the stream cannot be trusted
+static void test_oversize (void) {
+    char *test_name = "oversize";
+
+    printf("%s: length=%u\n", test_name, (N2N_PKT_BUF_SIZE + 1));
+
+#ifndef _WIN32
+    uint8_t buf[4] = { (N2N_PKT_BUF_SIZE + 1) >> 8, (N2N_PKT_BUF_SIZE + 1) & 0xff, 0, 0 };
+    struct n3n_tcpconn *rx = n3n_tcpconn_malloc();
+    uint32_t corrupt = metric("corrupt");
+    uint8_t *pkt;
+    uint16_t pkt_size;
+    int fds[2];
+
+    connect_pair(fds);
+    send(fds[0], buf, sizeof(buf), 0);
+    check(test_name, "read", n3n_tcpconn_read(rx, fds[1]), sizeof(buf));
+    check(test_name, "next", n3n_tcpconn_next(rx, &pkt, &pkt_size), -1);
+    check(test_name, "corrupt", metric("corrupt") - corrupt, 1);
+
+    close(fds[0]);
+    close(fds[1]);
+    n3n_tcpconn_free(rx);
+#endif
+
+    fprintf(stderr, "%s: tested\n", test_name);
+    printf("\n");
+}
+
+// Once the socket is full, the rest of a packet is queued and sent with
+// the next send or flush, without losing or reordering anything
+static void test_partial_write (void) {
+    char *test_name = "partial_write";
+    uint16_t size = 1000;
+
+    printf("%s: size=%u\n", test_name, size);
+
+#ifndef _WIN32
+    struct n3n_tcpconn *tx = n3n_tcpconn_malloc();
+    struct n3n_tcpconn *rx = n3n_tcpconn_malloc();
+    uint32_t queued = metric("queued");
+    uint8_t buf[FRAME_MAX];
+    int sndbuf = 4096;
+    int sent = 0;
+    int nr = 0;
+    int fds[2];
+
+    connect_pair(fds);
+    setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, (void *)&sndbuf, sizeof(sndbuf));
+
+    // Stop once a packet went only partly or not at all
+    while(!n3n_tcpconn_pending(tx) && (sent < 1000)) {
+        frame(buf, sent, size);
+        check(test_name, "send", n3n_tcpconn_send(tx, fds[0], &buf[2], size), size);
+        sent++;
+    }
+    check(test_name, "pending", n3n_tcpconn_pending(tx), 1);
+    check(test_name, "queued", metric("queued") - queued, 1);
+
+    // A few more go behind the queue, still in order
+    for(int i = 0; i < 3; i++) {
+        frame(buf, sent, size);
+        check(test_name, "send queued", n3n_tcpconn_send(tx, fds[0], &buf[2], size), size);
+        sent++;
+    }
+
+    while(n3n_tcpconn_pending(tx)) {
+        receive(test_name, rx, fds[1], &nr, size);
+        if(n3n_tcpconn_flush(tx, fds[0]) < 0) {
+            fprintf(stderr, "%s: flush failed\n", test_name);
+            errors++;
+            break;
+        }
+    }
+    receive(test_name, rx, fds[1], &nr, size);
+    check(test_name, "packets", nr, sent);
+
+    close(fds[0]);
+    close(fds[1]);
+    n3n_tcpconn_free(tx);
+    n3n_tcpconn_free(rx);
+#endif
+
+    fprintf(stderr, "%s: tested\n", test_name);
+    printf("\n");
+}
+
+// A connection that is not read from fills its queue, and then packets are
+// dropped instead of queued, until it is drained again
+static void test_full (void) {
+    char *test_name = "full";
+    uint16_t size = N2N_PKT_BUF_SIZE;
+
+    printf("%s: size=%u\n", test_name, size);
+
+#ifndef _WIN32
+    struct n3n_tcpconn *tx = n3n_tcpconn_malloc();
+    struct n3n_tcpconn *rx = n3n_tcpconn_malloc();
+    uint32_t full = metric("full");
+    uint8_t buf[FRAME_MAX];
+    ssize_t rc = 0;
+    int sent = 0;
+    int nr = 0;
+    int fds[2];
+
+    connect_pair(fds);
+
+    // Far more than both the socket and the queue can hold
+    for(int i = 0; i < 10000; i++) {
+        frame(buf, sent, size);
+        rc = n3n_tcpconn_send(tx, fds[0], &buf[2], size);
+        if(rc != size) {
+            break;
+        }
+        sent++;
+    }
+    check(test_name, "send when full", rc, 0);
+    check(test_name, "full", metric("full") - full, 1);
+    check(test_name, "pending", n3n_tcpconn_pending(tx), 1);
+
+    // Dropped again, the queue does not grow
+    uint32_t out_end = tx->out_end - tx->out_start;
+    check(test_name, "send again", n3n_tcpconn_send(tx, fds[0], &buf[2], size), 0);
+    check(test_name, "queue", tx->out_end - tx->out_start, out_end);
+
+    // Only the packets that were accepted arrive
+    while(n3n_tcpconn_pending(tx)) {
+        receive(test_name, rx, fds[1], &nr, size);
+        if(n3n_tcpconn_flush(tx, fds[0]) < 0) {
+            fprintf(stderr, "%s: flush failed\n", test_name);
+            errors++;
+            break;
+        }
+    }
+    receive(test_name, rx, fds[1], &nr, size);
+    check(test_name, "packets", nr, sent);
+
+    // And there is room once more
+    frame(buf, sent, size);
+    check(test_name, "send drained", n3n_tcpconn_send(tx, fds[0], &buf[2], size), size);
+    receive(test_name, rx, fds[1], &nr, size);
+    check(test_name, "packets drained", nr, sent + 1);
+
+    close(fds[0]);
+    close(fds[1]);
+    n3n_tcpconn_free(tx);
+    n3n_tcpconn_free(rx);
+#endif
+
+    fprintf(stderr, "%s: tested\n", test_name);
+    printf("\n");
+}
+
+int main (int argc, char * argv[]) {
+
+    n3n_initfuncs();
+
+    test_split_read();
+    test_multi_frame();
+    test_oversize();
+    test_partial_write();
+    test_full();
+
+    return errors;
+}
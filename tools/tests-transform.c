@@ -60,6 +60,8 @@ uint8_t PKT_CONTENT[]={
 /* Prototypes */
 static ssize_t do_encode_packet ( uint8_t * pktbuf, size_t bufsize, const n2n_community_t c );
 static void run_transop_benchmark (const char *op_name, n2n_trans_op_t *op_fn, n2n_edge_conf_t *conf, uint8_t *pktbuf);
+static void run_transop_tamper (const char *op_name, n2n_trans_op_t *op_fn);
+static void run_transop_batch (const char *op_name, n2n_trans_op_t *op_fn);
 
 
 int main (int argc, char * argv[]) {
@@ -69,6 +71,7 @@ int main (int argc, char * argv[]) {
     n2n_trans_op_t transop_aes;
     n2n_trans_op_t transop_cc20;
     n2n_trans_op_t transop_speck;
+    n2n_trans_op_t transop_chachapoly;
     n2n_trans_op_t transop_lzo;
 #ifdef HAVE_LIBZSTD
     n2n_trans_op_t transop_zstd;
@@ -100,6 +103,9 @@ int main (int argc, char * argv[]) {
     n2n_transop_aes_init(&conf, &transop_aes);
     n2n_transop_cc20_init(&conf, &transop_cc20);
     n2n_transop_speck_init(&conf, &transop_speck);
+    // the nonce starting point is drawn when the key is set up
+    n3n_srand_stable_default();
+    n2n_transop_chachapoly_init(&conf, &transop_chachapoly);
     n2n_transop_lzo_init(&conf, &transop_lzo);
 #ifdef HAVE_LIBZSTD
     n2n_transop_zstd_init(&conf, &transop_zstd);
@@ -112,6 +118,9 @@ int main (int argc, char * argv[]) {
     run_transop_benchmark("aes", &transop_aes, &conf, pktbuf);
     run_transop_benchmark("cc20", &transop_cc20, &conf, pktbuf);
     run_transop_benchmark("speck", &transop_speck, &conf, pktbuf);
+    run_transop_benchmark("chachapoly", &transop_chachapoly, &conf, pktbuf);
+    run_transop_tamper("chachapoly", &transop_chachapoly);
+    run_transop_batch("chachapoly", &transop_chachapoly);
     run_transop_benchmark("lzo", &transop_lzo, &conf, pktbuf);
 #ifdef HAVE_LIBZSTD
     run_transop_benchmark("zstd", &transop_zstd, &conf, pktbuf);
@@ -134,6 +143,7 @@ int main (int argc, char * argv[]) {
     transop_aes.deinit(&transop_aes);
     transop_cc20.deinit(&transop_cc20);
     transop_speck.deinit(&transop_speck);
+    transop_chachapoly.deinit(&transop_chachapoly);
     transop_lzo.deinit(&transop_lzo);
 #ifdef HAVE_LIBZSTD
     transop_zstd.deinit(&transop_zstd);
@@ -183,6 +193,38 @@ static void run_transop_benchmark (const char *op_name, n2n_trans_op_t *op_fn, n
     printf("\n");
 }
 
+// --- authentication test ----------------------------------------------------------------
+
+static void run_transop_tamper (const char *op_name, n2n_trans_op_t *op_fn) {
+    n2n_mac_t mac_buf;
+    uint8_t encbuf[N2N_PKT_BUF_SIZE];
+    uint8_t decodebuf[N2N_PKT_BUF_SIZE];
+    int nw;
+
+    memset(mac_buf, 0, sizeof(mac_buf));
+
+    nw = op_fn->fwd(op_fn,
+                    encbuf, sizeof(encbuf),
+                    PKT_CONTENT, sizeof(PKT_CONTENT), mac_buf);
+
+    // the untouched payload must still decode ...
+    if(op_fn->rev(op_fn, decodebuf, sizeof(decodebuf), encbuf, nw, mac_buf) != sizeof(PKT_CONTENT)) {
+        fprintf(stderr, "%s: authentic payload rejected\n", op_name);
+        exit(1);
+    }
+
+    // ... but one flipped bit in the tag at its end must not
+    encbuf[nw - 1] ^= 0x01;
+    if(op_fn->rev(op_fn, decodebuf, sizeof(decodebuf), encbuf, nw, mac_buf) >= 0) {
+        fprintf(stderr, "%s: tampered payload accepted\n", op_name);
+        exit(1);
+    }
+
+    printf("%s: tampered tag rejected\n", op_name);
+    fprintf(stderr, "%s: tamper tested\n", op_name);
+    printf("\n");
+}
+
 
 static ssize_t do_encode_packet ( uint8_t * pktbuf, size_t bufsize, const n2n_community_t c )
 {
@@ -212,3 +254,51 @@ static ssize_t do_encode_packet ( uint8_t * pktbuf, size_t bufsize, const n2n_co
 
     return idx;
 }
+
+#define BATCH 3
+
+static void run_transop_batch (const char *op_name, n2n_trans_op_t *op_fn) {
+    uint8_t encbuf[BATCH][N2N_PKT_BUF_SIZE];
+    uint8_t decodebuf[BATCH][N2N_PKT_BUF_SIZE];
+    struct n2n_trans_vec vec[BATCH];
+    int done;
+
+    // Encode a batch, each payload a little shorter than the previous one
+    for(int i = 0; i < BATCH; i++) {
+        vec[i].outbuf = encbuf[i];
+        vec[i].out_len = sizeof(encbuf[i]);
+        vec[i].inbuf = PKT_CONTENT;
+        vec[i].in_len = sizeof(PKT_CONTENT) - i;
+    }
+    done = op_fn->fwd_batch(op_fn, vec, BATCH);
+    printf("%s: batch encoded %i of %i\n", op_name, done, BATCH);
+
+    // Decode it again, with the tag of the middle one tampered with
+    for(int i = 0; i < BATCH; i++) {
+        vec[i].inbuf = encbuf[i];
+        vec[i].in_len = vec[i].result;
+        vec[i].outbuf = decodebuf[i];
+        vec[i].out_len = sizeof(decodebuf[i]);
+    }
+    encbuf[1][vec[1].in_len - 1] ^= 0x01;
+    done = op_fn->rev_batch(op_fn, vec, BATCH);
+    printf("%s: batch decoded %i of %i\n", op_name, done, BATCH);
+
+    for(int i = 0; i < BATCH; i++) {
+        if(i == 1) {
+            if(vec[i].result >= 0) {
+                fprintf(stderr, "%s: tampered payload %i accepted in a batch\n", op_name, i);
+                exit(1);
+            }
+            continue;
+        }
+        if((vec[i].result != sizeof(PKT_CONTENT) - i) ||
+           memcmp(decodebuf[i], PKT_CONTENT, vec[i].result)) {
+            fprintf(stderr, "%s: payload %i of a batch did not round trip\n", op_name, i);
+            exit(1);
+        }
+    }
+
+    fprintf(stderr, "%s: batch tested\n", op_name);
+    printf("\n");
+}
@@ -0,0 +1,287 @@
+/*
+ * Copyright (C) Hamish Coleman
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+
+#include <connslot/strbuf.h>    // for sb_malloc, strbuf_t
+#include <n3n/initfuncs.h>      // for n3n_initfuncs
+#include <n3n/metrics.h>        // for n3n_metrics_render
+#include <stdint.h>             // for uint32_t
+#include <stdio.h>              // for printf, fprintf, stdout, stderr
+#include <stdlib.h>             // for strtoul
+#include <string.h>             // for memset, strcmp, strlen, strstr
+#include "config.h"             // for HAVE_LIBPTHREAD
+#include "../src/pktbuf.h"      // for n3n_pktbuf_alloc, n3n_pktbuf_free, n3n_...
+#include "../src/txqueue.h"     // for n3n_txqueue_begin, n3n_txqueue_end, n3n_...
+
+#ifdef _WIN32
+#include "win32/defs.h"
+#else
+#include <netinet/in.h>         // for sockaddr_in, sockaddr_in6, htonl, htons
+#include <sys/select.h>         // for select, FD_SET, FD_ZERO
+#include <sys/socket.h>         // for socket, bind, recv, getsockname
+#include <unistd.h>             // for close
+#define closesocket(a) close(a)
+#endif
+
+#if defined(__linux__) && defined(HAVE_LIBPTHREAD)
+#include <pthread.h>            // for pthread_create, pthread_join
+#endif
+
+
+static int errors;
+
+static int open_udp (struct sockaddr_in *addr) {
+    socklen_t len = sizeof(*addr);
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(fd, (struct sockaddr *)addr, sizeof(*addr));
+    getsockname(fd, (struct sockaddr *)addr, &len);
+    return fd;
+}
+
+// Print everything waiting on a socket, in the order it arrived
+static void show_received (const char *name, int fd) {
+    char buf[64];
+    struct timeval tv;
+    fd_set readers;
+
+    while(1) {
+        tv.tv_sec = 1;
+        tv.tv_usec = 0;
+        FD_ZERO(&readers);
+        FD_SET(fd, &readers);
+        if(select(fd + 1, &readers, NULL, NULL, &tv) != 1) {
+            break;
+        }
+        int len = recv(fd, buf, sizeof(buf) - 1, 0);
+        if(len <= 0) {
+            break;
+        }
+        buf[len] = 0;
+        printf("%s: received '%s'\n", name, buf);
+
+        // Only wait for the first one, the rest are already there
+        tv.tv_sec = 0;
+    }
+}
+
+static void send_str (int fd, const char *str, const struct sockaddr_in *dest, int *failed) {
+    if(n3n_txqueue_sendto(fd, str, strlen(str), NULL, (struct sockaddr *)dest, sizeof(*dest)) < 0) {
+        (*failed)++;
+    }
+}
+
+// Find one of the values in the metrics output
+static uint32_t metric (const char *name) {
+    strbuf_t *buf = sb_malloc(4096, 65536);
+    uint32_t val = 0;
+
+    n3n_metrics_render(&buf);
+    char *p = strstr(buf->str, name);
+    if(p) {
+        val = strtoul(p + strlen(name), NULL, 10);
+    }
+    free(buf);
+    return val;
+}
+
+// Check something that is only true where the queue is built
+static void check_linux (const char *test_name, const char *what, uint32_t got, uint32_t want) {
+#if defined(__linux__)
+    if(got != want) {
+        fprintf(stderr, "%s: %s is %u, expected %u\n", test_name, what, got, want);
+        errors++;
+    }
+#endif
+}
+
+// Datagrams for two sockets, interleaved, go out in runs per socket
+void test_runs (void) {
+    char *test_name = "runs";
+    struct sockaddr_in addr_tx1, addr_tx2, addr_rx1, addr_rx2;
+    int tx1 = open_udp(&addr_tx1);
+    int tx2 = open_udp(&addr_tx2);
+    int rx1 = open_udp(&addr_rx1);
+    int rx2 = open_udp(&addr_rx2);
+    uint32_t sn_errors = 0;
+    int failed = 0;
+
+    uint32_t syscalls = metric("event=\"syscall\"} ");
+
+    n3n_txqueue_begin(&sn_errors);
+    send_str(tx1, "one", &addr_rx1, &failed);
+    send_str(tx1, "two", &addr_rx1, &failed);
+    send_str(tx2, "three", &addr_rx2, &failed);
+    send_str(tx2, "four", &addr_rx1, &failed);
+    send_str(tx1, "five", &addr_rx2, &failed);
+    n3n_txqueue_end();
+
+    // tx1, tx2, tx1
+    check_linux(test_name, "syscalls", metric("event=\"syscall\"} ") - syscalls, 3);
+
+    printf("%s: failed %u\n", test_name, sn_errors + failed);
+    show_received("rx1", rx1);
+    show_received("rx2", rx2);
+
+    closesocket(tx1);
+    closesocket(tx2);
+    closesocket(rx1);
+    closesocket(rx2);
+
+    fprintf(stderr, "%s: tested\n", test_name);
+    printf("\n");
+}
+
+// A send that fails is counted once, and does not stop the rest of the run
+void test_errors (void) {
+    char *test_name = "errors";
+    struct sockaddr_in addr_tx, addr_rx;
+    struct sockaddr_in6 bad;
+    int tx = open_udp(&addr_tx);
+    int rx = open_udp(&addr_rx);
+    uint32_t sn_errors = 0;
+    int failed = 0;
+
+    // An IPv6 destination cannot be reached from an IPv4 socket
+    memset(&bad, 0, sizeof(bad));
+    bad.sin6_family = AF_INET6;
+    bad.sin6_port = addr_rx.sin_port;
+
+    n3n_txqueue_begin(&sn_errors);
+    send_str(tx, "one", &addr_rx, &failed);
+    if(n3n_txqueue_sendto(tx, "bad", 3, NULL, (struct sockaddr *)&bad, sizeof(bad)) < 0) {
+        failed++;
+    }
+    send_str(tx, "two", &addr_rx, &failed);
+    if(n3n_txqueue_sendto(tx, "bad", 3, NULL, (struct sockaddr *)&bad, sizeof(bad)) < 0) {
+        failed++;
+    }
+    n3n_txqueue_end();
+
+    // Queued failures are counted, direct ones returned
+    printf("%s: failed %u\n", test_name, sn_errors + failed);
+    check_linux(test_name, "counted errors", sn_errors, 2);
+    show_received("rx", rx);
+
+    closesocket(tx);
+    closesocket(rx);
+
+    fprintf(stderr, "%s: tested\n", test_name);
+    printf("\n");
+}
+
+// A datagram sent from a pktbuf is not copied, and the queue keeps the
+// pktbuf until it is sent
+void test_frame (void) {
+    char *test_name = "frame";
+    struct sockaddr_in addr_tx, addr_rx;
+    int tx = open_udp(&addr_tx);
+    int rx = open_udp(&addr_rx);
+    uint32_t sn_errors = 0;
+
+    uint32_t copied = metric("event=\"copied\"} ");
+
+    n3n_txqueue_begin(&sn_errors);
+
+    struct n3n_pktbuf *frame = n3n_pktbuf_alloc(64);
+    n3n_pktbuf_append(frame, 5, "first");
+    n3n_txqueue_sendto(tx, n3n_pktbuf_getbufptr(frame), 5, frame,
+                       (struct sockaddr *)&addr_rx, sizeof(addr_rx));
+    n3n_pktbuf_free(frame);
+
+    // If the queue did not hold on to it, this would get the same buffer
+    struct n3n_pktbuf *other = n3n_pktbuf_alloc(64);
+    n3n_pktbuf_append(other, 6, "second");
+    n3n_txqueue_sendto(tx, n3n_pktbuf_getbufptr(other), 6, other,
+                       (struct sockaddr *)&addr_rx, sizeof(addr_rx));
+    n3n_pktbuf_free(other);
+
+    // Not in a pktbuf, so this one is copied
+    n3n_txqueue_sendto(tx, "third", 5, NULL, (struct sockaddr *)&addr_rx, sizeof(addr_rx));
+
+    n3n_txqueue_end();
+
+    check_linux(test_name, "copies", metric("event=\"copied\"} ") - copied, 1);
+    check_linux(test_name, "buffers in use", metric("n3n_pktbuf_in_use "), 0);
+    show_received("rx", rx);
+
+    closesocket(tx);
+    closesocket(rx);
+
+    fprintf(stderr, "%s: tested\n", test_name);
+    printf("\n");
+}
+
+#if defined(__linux__) && defined(HAVE_LIBPTHREAD)
+static struct sockaddr_in thread_dest;
+
+static void *other_thread (void *arg) {
+    int *fd = arg;
+
+    n3n_txqueue_sendto(*fd, "two", 3, NULL, (struct sockaddr *)&thread_dest, sizeof(thread_dest));
+    return NULL;
+}
+
+// Another thread sending while one is collecting does not use its queue
+void test_threads (void) {
+    char *test_name = "threads";
+    struct sockaddr_in addr_tx;
+    pthread_t thread;
+    char buf[16];
+    int tx = open_udp(&addr_tx);
+    int rx = open_udp(&thread_dest);
+
+    n3n_txqueue_begin(NULL);
+    send_str(tx, "one", &thread_dest, &errors);
+    pthread_create(&thread, NULL, other_thread, &tx);
+    pthread_join(thread, NULL);
+    n3n_txqueue_end();
+
+    // The other thread was not collecting, so it sent straight away
+    int len = recv(rx, buf, sizeof(buf) - 1, 0);
+    buf[len > 0 ? len : 0] = 0;
+    if(strcmp(buf, "two")) {
+        fprintf(stderr, "%s: received '%s' first, expected 'two'\n", test_name, buf);
+        errors++;
+    }
+
+    closesocket(tx);
+    closesocket(rx);
+
+    fprintf(stderr, "%s: tested\n", test_name);
+}
+#endif
+
+int main (int argc, char * argv[]) {
+
+    n3n_initfuncs();
+    n3n_pktbuf_initialise(2048, 4);
+
+    test_runs();
+    test_errors();
+    test_frame();
+#if defined(__linux__) && defined(HAVE_LIBPTHREAD)
+    test_threads();
+#endif
+
+    return errors;
+}
@@ -0,0 +1,308 @@
+/*
+ * Copyright (C) Hamish Coleman
+ * SPDX-License-Identifier: GPL-3.0-only
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ */
+
+
+#include <stdbool.h>            // for bool
+#include <stdint.h>             // for uint8_t, uint16_t, uint32_t
+#include <stdio.h>              // for printf, fprintf, stderr
+#include <string.h>             // for memcpy, memcmp, memset
+
+#ifdef __linux__
+#include <linux/virtio_net.h>   // for virtio_net_hdr, VIRTIO_NET_HDR_...
+#include <sys/socket.h>         // for socketpair, AF_UNIX, SOCK_DGRAM
+#include <sys/uio.h>            // for iovec, writev
+#include <unistd.h>             // for close
+#include "../src/vnethdr.h"     // for n3n_vnet_read, n3n_vnet_segment, n3n_...
+#endif
+
+#define ETH_HLEN 14
+#define IP4_HLEN 20
+#define IP6_HLEN 40
+#define TCP_HLEN 20
+
+#define TCP_PSH 0x08
+#define TCP_ACK 0x10
+#define TCP_CWR 0x80
+
+#define MSS 1000
+#define PAYLOAD 2500
+#define FIRST_SEQ 0xfffffc00    // wraps around during the test
+#define FIRST_ID 0xfffe         // as does this
+
+static int errors;
+
+static uint8_t payload[PAYLOAD];
+
+static void put16 (uint8_t *p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static void put32 (uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static uint16_t get16 (const uint8_t *p) {
+    return (p[0] << 8) | p[1];
+}
+
+// The internet checksum, as in RFC1071
+static uint32_t sum16 (uint32_t sum, const uint8_t *p, size_t len) {
+    for(size_t i = 0; i < len; i += 2) {
+        sum += (p[i] << 8) | ((i + 1 < len) ? p[i + 1] : 0);
+    }
+    return sum;
+}
+
+static uint16_t fold (uint32_t sum) {
+    while(sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return sum;
+}
+
+static size_t l4_offset (bool v6) {
+    return ETH_HLEN + (v6 ? IP6_HLEN : IP4_HLEN);
+}
+
+// The checksum over the TCP pseudo header, not yet inverted
+static uint16_t pseudo_sum (const uint8_t *frame, bool v6, size_t tcp_len) {
+    uint32_t sum;
+
+    if(v6) {
+        sum = sum16(0, &frame[ETH_HLEN + 8], 32);
+    } else {
+        sum = sum16(0, &frame[ETH_HLEN + 12], 8);
+    }
+    return fold(sum + 6 + tcp_len);
+}
+
+// Build a complete TCP frame with correct checksums, as a segment would be
+// sent on the wire
+static size_t build_frame (uint8_t *frame, bool v6, uint32_t seq, uint16_t ip_id,
+                           uint8_t flags, const uint8_t *data, size_t len) {
+    size_t l4 = l4_offset(v6);
+    size_t tcp_len = TCP_HLEN + len;
+    uint8_t *ip = &frame[ETH_HLEN];
+    uint8_t *th = &frame[l4];
+
+    memset(frame, 0, l4 + TCP_HLEN);
+    memcpy(frame, "\x02\x00\x00\x00\x00\x01\x02\x00\x00\x00\x00\x02", 12);
+
+    if(v6) {
+        put16(&frame[12], 0x86dd);
+        ip[0] = 0x60;
+        put16(&ip[4], tcp_len);
+        ip[6] = 6;
+        ip[7] = 64;
+        ip[8] = 0xfd;
+        ip[23] = 1;
+        ip[24] = 0xfd;
+        ip[39] = 2;
+    } else {
+        put16(&frame[12], 0x0800);
+        ip[0] = 0x45;
+        put16(&ip[2], IP4_HLEN + tcp_len);
+        put16(&ip[4], ip_id);
+        put16(&ip[6], 0x4000);
+        ip[8] = 64;
+        ip[9] = 6;
+        memcpy(&ip[12], "\x0a\x00\x00\x01\x0a\x00\x00\x02", 8);
+        put16(&ip[10], ~fold(sum16(0, ip, IP4_HLEN)));
+    }
+
+    put16(&th[0], 1234);
+    put16(&th[2], 80);
+    put32(&th[4], seq);
+    put32(&th[8], 1);
+    th[12] = (TCP_HLEN / 4) << 4;
+    th[13] = flags;
+    put16(&th[14], 512);
+    memcpy(&th[TCP_HLEN], data, len);
+    put16(&th[16], ~fold(sum16(pseudo_sum(frame, v6, tcp_len), th, tcp_len)));
+
+    return l4 + tcp_len;
+}
+
+#ifdef __linux__
+// Hand a frame to the vnet as if the kernel had passed it up with this header
+static void vnet_receive (struct n3n_vnet *vnet, struct virtio_net_hdr *hdr,
+                          uint8_t *frame, size_t len, uint8_t *buf, size_t size) {
+    int fds[2];
+    struct iovec iov[2] = {
+        { .iov_base = hdr, .iov_len = sizeof(*hdr) },
+        { .iov_base = frame, .iov_len = len },
+    };
+
+    socketpair(AF_UNIX, SOCK_DGRAM, 0, fds);
+    if(writev(fds[0], iov, 2) < 0 ||
+       n3n_vnet_read(vnet, fds[1], buf, size) != (ssize_t)len) {
+        fprintf(stderr, "could not pass the frame through the vnet\n");
+        errors++;
+    }
+    close(fds[0]);
+    close(fds[1]);
+}
+
+struct segments {
+    const char *test_name;
+    uint8_t (*want)[ETH_HLEN + IP6_HLEN + TCP_HLEN + MSS];
+    size_t *want_len;
+    int nr;
+};
+
+static uint8_t *check_segment (void *ctx, uint8_t *frame, size_t len) {
+    struct segments *segs = ctx;
+    int nr = segs->nr++;
+
+    if(len != segs->want_len[nr] || memcmp(frame, segs->want[nr], len)) {
+        fprintf(stderr, "%s: segment %i differs from the reference\n", segs->test_name, nr);
+        errors++;
+    }
+    return frame;
+}
+#endif
+
+// Split a GSO frame and compare every segment with one built from scratch
+static void test_segment (bool v6) {
+    char *test_name = v6 ? "segment_v6" : "segment_v4";
+    uint8_t want[3][ETH_HLEN + IP6_HLEN + TCP_HLEN + MSS];
+    size_t want_len[3];
+    int want_nr = 0;
+
+    for(size_t off = 0; off < PAYLOAD; off += MSS, want_nr++) {
+        size_t n = (PAYLOAD - off > MSS) ? MSS : PAYLOAD - off;
+        size_t l4 = l4_offset(v6);
+        uint8_t flags = TCP_ACK;
+
+        // PSH stays on the last segment and CWR on the first
+        if(off + n == PAYLOAD) {
+            flags |= TCP_PSH;
+        }
+        if(!off) {
+            flags |= TCP_CWR;
+        }
+        want_len[want_nr] = build_frame(want[want_nr], v6, FIRST_SEQ + off,
+                                        FIRST_ID + want_nr, flags, &payload[off], n);
+
+        printf("%s: segment %i len=%u", test_name, want_nr, (unsigned)want_len[want_nr]);
+        if(!v6) {
+            printf(" ip_csum=0x%04x", get16(&want[want_nr][ETH_HLEN + 10]));
+        }
+        printf(" tcp_csum=0x%04x\n", get16(&want[want_nr][l4 + 16]));
+    }
+
+#ifdef __linux__
+    static uint8_t gso[ETH_HLEN + IP6_HLEN + TCP_HLEN + PAYLOAD];
+    uint8_t buf[2048];
+    uint8_t seg[2048];
+    struct virtio_net_hdr hdr;
+    struct segments segs = {
+        .test_name = test_name,
+        .want = want,
+        .want_len = want_len,
+    };
+    size_t l4 = l4_offset(v6);
+    size_t len = build_frame(gso, v6, FIRST_SEQ, FIRST_ID,
+                             TCP_ACK | TCP_PSH | TCP_CWR, payload, PAYLOAD);
+
+    // The checksum is left for the segmenting to fill in
+    put16(&gso[l4 + 16], pseudo_sum(gso, v6, len - l4));
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    hdr.gso_type = v6 ? VIRTIO_NET_HDR_GSO_TCPV6 : VIRTIO_NET_HDR_GSO_TCPV4;
+    hdr.hdr_len = l4 + TCP_HLEN;
+    hdr.gso_size = MSS;
+    hdr.csum_start = l4;
+    hdr.csum_offset = 16;
+
+    // The frame is larger than buf, so continues into the vnet overflow
+    struct n3n_vnet *vnet = n3n_vnet_new();
+    vnet_receive(vnet, &hdr, gso, len, buf, sizeof(buf));
+
+    int nr = n3n_vnet_segment(vnet, buf, len, seg, sizeof(seg), check_segment, &segs);
+    if(nr != want_nr || segs.nr != want_nr) {
+        fprintf(stderr, "%s: got %i segments, expected %i\n", test_name, nr, want_nr);
+        errors++;
+    }
+    n3n_vnet_free(vnet);
+#endif
+
+    fprintf(stderr, "%s: tested\n", test_name);
+    printf("\n");
+}
+
+// Complete the partial checksum of an ordinary frame
+static void test_csum (bool v6) {
+    char *test_name = v6 ? "csum_v6" : "csum_v4";
+    uint8_t want[ETH_HLEN + IP6_HLEN + TCP_HLEN + MSS];
+    size_t l4 = l4_offset(v6);
+    size_t len = build_frame(want, v6, FIRST_SEQ, FIRST_ID, TCP_ACK, payload, MSS);
+
+    printf("%s: len=%u tcp_csum=0x%04x\n", test_name, (unsigned)len, get16(&want[l4 + 16]));
+
+#ifdef __linux__
+    uint8_t frame[sizeof(want)];
+    uint8_t buf[2048];
+    struct virtio_net_hdr hdr;
+
+    memcpy(frame, want, len);
+    put16(&frame[l4 + 16], pseudo_sum(frame, v6, len - l4));
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    hdr.gso_type = VIRTIO_NET_HDR_GSO_NONE;
+    hdr.csum_start = l4;
+    hdr.csum_offset = 16;
+
+    struct n3n_vnet *vnet = n3n_vnet_new();
+    vnet_receive(vnet, &hdr, frame, len, buf, sizeof(buf));
+
+    if(n3n_vnet_segment(vnet, buf, len, NULL, 0, NULL, NULL) != 0) {
+        fprintf(stderr, "%s: the frame was not passed through\n", test_name);
+        errors++;
+    } else if(memcmp(buf, want, len)) {
+        fprintf(stderr, "%s: tcp_csum=0x%04x differs from the reference\n",
+                test_name, get16(&buf[l4 + 16]));
+        errors++;
+    }
+    n3n_vnet_free(vnet);
+#endif
+
+    fprintf(stderr, "%s: tested\n", test_name);
+    printf("\n");
+}
+
+int main (int argc, char * argv[]) {
+
+    for(int i = 0; i < PAYLOAD; i++) {
+        payload[i] = i * 7;
+    }
+
+    test_segment(false);
+    test_segment(true);
+    test_csum(false);
+    test_csum(true);
+
+    return errors;
+}